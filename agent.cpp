@@ -0,0 +1,491 @@
+#include "agent.h"
+#include "blocking_queue.h"
+#include "file_header.h"
+#include "follow.h"
+#include "fileio.h"
+#include "log.h"
+#include "pipeline.h"
+#include "secure_pool.h"
+#include "sparse.h"
+#include "xts.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define AGENT_MAGIC 0x46434147u      // "FCAG"
+#define AGENT_VERSION 1
+#define AGENT_CACHE_SLOTS 64         // число ключей, одновременно хранимых агентом
+#define AGENT_MAX_PASSWORD 4096      // максимальная длина пароля в запросе
+#define AGENT_MAX_MESSAGE 1024       // максимальная длина текста ошибки в ответе
+#define AGENT_WORKERS 8              // потоков, обслуживающих клиентов
+#define AGENT_MAX_PENDING 64         // принятых соединений в очереди к потокам
+
+/**
+ * @brief Заголовок запроса клиента к агенту.
+ *
+ * За заголовком следует пароль длиной passwordLen байт. Дескрипторы входного
+ * и выходного файлов передаются в том же сообщении через SCM_RIGHTS.
+ */
+struct AgentRequest {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t op;
+    uint8_t reserved;
+    uint32_t passwordLen;
+};
+
+/**
+ * @brief Заголовок ответа агента; за ним следует текст ошибки длиной messageLen.
+ */
+struct AgentReply {
+    uint32_t magic;
+    int32_t status;
+    uint32_t messageLen;
+};
+
+/**
+ * @brief Ячейка кэша ключей.
+ */
+struct KeySlot {
+    unsigned char id[32];               ///< HMAC пароля на секрете агента
+    unsigned char key[AES_KEY_LENGTH];  ///< производный ключ
+    time_t expires;                     ///< момент удаления ключа
+    time_t lastUse;                     ///< для вытеснения самого старого
+    int used;
+};
+
+/**
+ * @brief Кэш производных ключей в заблокированной памяти.
+ *
+ * Ячейки размещаются в отдельном отображении, закреплённом mlock() и исключённом
+ * из дампов памяти. Ключ ищется по HMAC пароля на случайном секрете агента,
+ * поэтому сам пароль в кэше не хранится. По истечении TTL ячейка затирается.
+ */
+class SecureKeyCache {
+public:
+    explicit SecureKeyCache(int ttl) : ttl_(ttl), slots_(nullptr), size_(sizeof(KeySlot) * AGENT_CACHE_SLOTS) {
+        void *mem = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            throw CryptoError(std::string("Cannot allocate key cache: ") + strerror(errno));
+        }
+        if (mlock(mem, size_) != 0) {
+            LOG(LOG_LEVEL_WARN, "cannot lock key cache in memory: " << strerror(errno));
+        }
+#ifdef MADV_DONTDUMP
+        madvise(mem, size_, MADV_DONTDUMP);
+#endif
+        slots_ = static_cast<KeySlot *>(mem);
+        if (!RAND_bytes(secret_, sizeof(secret_))) {
+            handleErrors();
+        }
+    }
+    ~SecureKeyCache() {
+        OPENSSL_cleanse(slots_, size_);
+        OPENSSL_cleanse(secret_, sizeof(secret_));
+        munlock(slots_, size_);
+        munmap(slots_, size_);
+    }
+
+    /**
+     * @brief Возвращает ключ для пароля, выполняя PBKDF2 только при промахе кэша.
+     */
+    void lookup(const std::string &password, unsigned char *key) {
+        unsigned char id[32];
+        unsigned int idLen = sizeof(id);
+        if (!HMAC(EVP_sha256(), secret_, sizeof(secret_), (const unsigned char *)password.data(), password.size(), id, &idLen)) {
+            handleErrors();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            expireLocked();
+            for (int i = 0; i < AGENT_CACHE_SLOTS; i++) {
+                if (slots_[i].used && CRYPTO_memcmp(slots_[i].id, id, sizeof(id)) == 0) {
+                    slots_[i].lastUse = time(nullptr);
+                    memcpy(key, slots_[i].key, AES_KEY_LENGTH);
+                    return;
+                }
+            }
+        }
+
+        // PBKDF2 выполняется вне блокировки, чтобы не задерживать другие запросы
+        generateKeyFromPassword(password, key);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        KeySlot *victim = &slots_[0];
+        for (int i = 0; i < AGENT_CACHE_SLOTS; i++) {
+            if (!slots_[i].used) {
+                victim = &slots_[i];
+                break;
+            }
+            if (slots_[i].lastUse < victim->lastUse) victim = &slots_[i];
+        }
+        OPENSSL_cleanse(victim, sizeof(KeySlot));
+        memcpy(victim->id, id, sizeof(id));
+        memcpy(victim->key, key, AES_KEY_LENGTH);
+        victim->lastUse = time(nullptr);
+        victim->expires = victim->lastUse + ttl_;
+        victim->used = 1;
+    }
+
+    /**
+     * @brief Затирает ключи с истёкшим TTL.
+     */
+    void expire() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        expireLocked();
+    }
+
+private:
+    void expireLocked() {
+        time_t now = time(nullptr);
+        for (int i = 0; i < AGENT_CACHE_SLOTS; i++) {
+            if (slots_[i].used && slots_[i].expires <= now) {
+                OPENSSL_cleanse(&slots_[i], sizeof(KeySlot));
+            }
+        }
+    }
+
+    int ttl_;
+    KeySlot *slots_;
+    size_t size_;
+    unsigned char secret_[32];
+    std::mutex mutex_;
+
+    SecureKeyCache(const SecureKeyCache &);
+    SecureKeyCache &operator=(const SecureKeyCache &);
+};
+
+static volatile sig_atomic_t agentStop = 0;
+
+static void agentSignalHandler(int) {
+    agentStop = 1;
+}
+/**
+ * @brief Заполняет адрес Unix-сокета.
+ */
+static socklen_t makeAddress(const std::string &path, sockaddr_un &addr) {
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw CryptoError("Socket path is too long: " + path);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return sizeof(addr);
+}
+/**
+ * @brief Отправляет ответ клиенту агента.
+ */
+static void sendReply(int fd, int status, const std::string &message) {
+    AgentReply reply;
+    reply.magic = AGENT_MAGIC;
+    reply.status = status;
+    reply.messageLen = message.size() < AGENT_MAX_MESSAGE ? message.size() : AGENT_MAX_MESSAGE;
+    writeAll(fd, (const unsigned char *)&reply, sizeof(reply));
+    writeAll(fd, (const unsigned char *)message.data(), reply.messageLen);
+}
+/**
+ * @brief Обрабатывает одно соединение клиента агента.
+ *
+ * @param[in] client Дескриптор принятого соединения.
+ * @param[in] cache Кэш ключей агента.
+ *
+ * Проверяет, что клиент запущен тем же пользователем, принимает запрос вместе
+ * с дескрипторами файлов, выполняет операцию и отправляет код результата.
+ * Соединение закрывает вызывающий.
+ */
+static void serveClient(int client, SecureKeyCache *cache) {
+    int fds[2] = {-1, -1};
+    std::string password;
+    try {
+        ucred cred;
+        socklen_t credLen = sizeof(cred);
+        if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) != 0 || cred.uid != getuid()) {
+            throw CryptoError("Permission denied");
+        }
+
+        AgentRequest request;
+        char control[CMSG_SPACE(sizeof(fds))];
+        iovec iov;
+        iov.iov_base = &request;
+        iov.iov_len = sizeof(request);
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t n;
+        do {
+            n = recvmsg(client, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+        } while (n < 0 && errno == EINTR);
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+                cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+                memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+            }
+        }
+        if (n != (ssize_t)sizeof(request) || request.magic != AGENT_MAGIC || request.version != AGENT_VERSION) {
+            throw CryptoError("Malformed agent request");
+        }
+        if (fds[0] < 0 || fds[1] < 0) {
+            throw CryptoError("Agent request carries no file descriptors");
+        }
+        if (request.passwordLen == 0 || request.passwordLen > AGENT_MAX_PASSWORD) {
+            throw CryptoError("Invalid password length");
+        }
+
+        password.resize(request.passwordLen);
+        if (readFull(client, (unsigned char *)&password[0], password.size()) != password.size()) {
+            throw CryptoError("Truncated agent request");
+        }
+
+        SecureBuffer key = keyPool().acquire(), fileKey = keyPool().acquire();
+        cache->lookup(password, key.data());
+        if (request.op == OP_ENCRYPT) {
+            unsigned char iv[AES_BLOCK_SIZE];
+            if (!RAND_bytes(iv, AES_BLOCK_SIZE)) handleErrors();
+            writeFileHeader(fds[1], key.data(), iv, PipelineOptions(), false, fileKey.data());
+            encryptPipeline(fds[0], fds[1], fileKey.data(), iv, PipelineOptions());
+        } else if (request.op == OP_DECRYPT) {
+            FileHeader header;
+            readFileHeader(fds[0], key.data(), &header, fileKey.data());
+            if (header.flags() & FILE_HEADER_FLAG_STRIPED) {
+                throw CryptoError("Striped files are decrypted with --stripe");
+            } else if (header.flags() & FILE_HEADER_FLAG_XTS) {
+                decryptXts(fds[0], fds[1], fileKey.data(), header, PipelineOptions());
+            } else if (header.flags() & FILE_HEADER_FLAG_SEGMENTED) {
+                decryptSegments(fds[0], fds[1], fileKey.data(), PipelineOptions(), header.prefix);
+            } else if (header.flags() & FILE_HEADER_FLAG_SPARSE) {
+                decryptSparse(fds[0], fds[1], fileKey.data(), PipelineOptions(), header.prefix);
+            } else {
+                decryptPipeline(fds[0], fds[1], fileKey.data(), PipelineOptions(), header.prefix);
+            }
+        } else {
+            throw CryptoError("Unknown operation");
+        }
+        sendReply(client, 0, "");
+    } catch (const std::exception &e) {
+        try {
+            sendReply(client, 1, e.what());
+        } catch (const std::exception &) {
+            // клиент уже отключился
+        }
+    }
+    if (!password.empty()) OPENSSL_cleanse(&password[0], password.size());
+    if (fds[0] >= 0) close(fds[0]);
+    if (fds[1] >= 0) close(fds[1]);
+}
+/**
+ * @brief Запускает агент ключей.
+ *
+ * @param[in] options Параметры агента.
+ * @return int Код завершения процесса.
+ *
+ * Агент слушает Unix-сокет (права 0600), хранит производные ключи в заблокированной
+ * памяти не дольше TTL и обслуживает каждый запрос в отдельном потоке. Без флага
+ * foreground процесс уходит в фон после того, как сокет готов принимать соединения.
+ */
+int runAgent(const AgentOptions &options) {
+    sockaddr_un addr;
+    socklen_t addrLen = makeAddress(options.socketPath, addr);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0) {
+        throw CryptoError(std::string("Cannot create socket: ") + strerror(errno));
+    }
+    unlink(options.socketPath.c_str());
+    mode_t oldMask = umask(0077);
+    int rc = bind(listener, (sockaddr *)&addr, addrLen);
+    umask(oldMask);
+    if (rc != 0 || listen(listener, SOMAXCONN) != 0) {
+        int err = errno;
+        close(listener);
+        throw CryptoError("Cannot listen on " + options.socketPath + ": " + strerror(err));
+    }
+
+    if (!options.foreground) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            throw CryptoError(std::string("fork failed: ") + strerror(errno));
+        }
+        if (pid > 0) {
+            std::cout << "Agent listening on " << options.socketPath << " (pid " << pid << ")" << std::endl;
+            _exit(0);
+        }
+        setsid();
+        int devnull = open("/dev/null", O_RDWR);
+        if (devnull >= 0) {
+            dup2(devnull, STDIN_FILENO);
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+            if (devnull > STDERR_FILENO) close(devnull);
+        }
+    } else {
+        std::cout << "Agent listening on " << options.socketPath << std::endl;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, agentSignalHandler);
+    signal(SIGTERM, agentSignalHandler);
+
+    // Клиентов обслуживает ограниченный набор потоков; до выхода из функции
+    // все они завершаются, поэтому кэш ключей переживает каждого из них
+    SecureKeyCache cache(options.ttlSeconds);
+    BlockingQueue<int> clients(AGENT_MAX_PENDING);
+    std::mutex activeMutex;
+    std::set<int> active;
+    auto worker = [&]() {
+        int client;
+        while (clients.pop(client)) {
+            if (!agentStop) {
+                {
+                    std::lock_guard<std::mutex> lock(activeMutex);
+                    active.insert(client);
+                }
+                serveClient(client, &cache);
+                std::lock_guard<std::mutex> lock(activeMutex);
+                active.erase(client);
+            }
+            close(client);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int i = 0; i < AGENT_WORKERS; i++) workers.push_back(std::thread(worker));
+
+    while (!agentStop) {
+        pollfd pfd;
+        pfd.fd = listener;
+        pfd.events = POLLIN;
+        // Периодическое пробуждение затирает просроченные ключи даже без запросов
+        int ready = poll(&pfd, 1, 1000);
+        cache.expire();
+        if (ready <= 0) continue;
+
+        int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) continue;
+        if (!clients.tryPush(int(client))) {
+            try {
+                sendReply(client, 1, "Agent is busy");
+            } catch (const std::exception &) {
+                // клиент уже отключился
+            }
+            close(client);
+        }
+    }
+
+    // Ждущие в очереди соединения закрываются без обработки, у
+    // обслуживаемых сокет закрывается на чтение и запись, чтобы
+    // прервать ожидание запроса
+    clients.close();
+    {
+        std::lock_guard<std::mutex> lock(activeMutex);
+        for (std::set<int>::iterator it = active.begin(); it != active.end(); ++it) shutdown(*it, SHUT_RDWR);
+    }
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+
+    close(listener);
+    unlink(options.socketPath.c_str());
+    return 0;
+}
+/**
+ * @brief Выполняет операцию через агент ключей.
+ *
+ * @param[in] socketPath Путь к сокету агента.
+ * @param[in] op Шифрование или расшифрование.
+ * @param[in] password Пароль пользователя.
+ * @param[in] inFd Открытый входной файл.
+ * @param[in] outFd Открытый выходной файл.
+ * @return bool false, если агент недоступен и операцию нужно выполнить локально.
+ *
+ * При ошибке, о которой сообщил агент, выбрасывает CryptoError.
+ */
+bool agentProcess(const std::string &socketPath, CryptoOp op, const std::string &password, int inFd, int outFd) {
+    if (password.empty() || password.size() > AGENT_MAX_PASSWORD) {
+        return false;
+    }
+    sockaddr_un addr;
+    socklen_t addrLen = makeAddress(socketPath, addr);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return false;
+    if (connect(sock, (sockaddr *)&addr, addrLen) != 0) {
+        close(sock);
+        return false;
+    }
+
+    AgentRequest request;
+    memset(&request, 0, sizeof(request));
+    request.magic = AGENT_MAGIC;
+    request.version = AGENT_VERSION;
+    request.op = op;
+    request.passwordLen = password.size();
+
+    int fds[2] = {inFd, outFd};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    iovec iov;
+    iov.iov_base = &request;
+    iov.iov_len = sizeof(request);
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    AgentReply reply;
+    std::string message;
+    try {
+        ssize_t n;
+        do {
+            n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        } while (n < 0 && errno == EINTR);
+        if (n != (ssize_t)sizeof(request)) {
+            throw CryptoError(std::string("Cannot send request to agent: ") + strerror(errno));
+        }
+        writeAll(sock, (const unsigned char *)password.data(), password.size());
+
+        if (readFull(sock, (unsigned char *)&reply, sizeof(reply)) != sizeof(reply) || reply.magic != AGENT_MAGIC ||
+            reply.messageLen > AGENT_MAX_MESSAGE) {
+            throw CryptoError("Malformed reply from agent");
+        }
+        message.resize(reply.messageLen);
+        if (reply.messageLen > 0 && readFull(sock, (unsigned char *)&message[0], message.size()) != message.size()) {
+            throw CryptoError("Malformed reply from agent");
+        }
+    } catch (...) {
+        close(sock);
+        throw;
+    }
+    close(sock);
+
+    if (reply.status != 0) {
+        throw CryptoError("Agent: " + message);
+    }
+    return true;
+}
@@ -0,0 +1,25 @@
+#ifndef FILE_CRYPTO_AGENT_H
+#define FILE_CRYPTO_AGENT_H
+
+#include "crypto.h"
+
+#include <string>
+
+#define AGENT_DEFAULT_TTL 600            // время жизни ключа в кэше агента, секунд
+#define AGENT_SOCKET_ENV "FILE_CRYPTO_AGENT"  // переменная окружения с путём к сокету агента
+
+/**
+ * @brief Параметры запуска агента ключей.
+ */
+struct AgentOptions {
+    std::string socketPath;  ///< путь к Unix-сокету
+    int ttlSeconds;          ///< время жизни производного ключа в кэше
+    bool foreground;         ///< не уходить в фон после запуска
+
+    AgentOptions() : ttlSeconds(AGENT_DEFAULT_TTL), foreground(false) {}
+};
+
+int runAgent(const AgentOptions &options);
+bool agentProcess(const std::string &socketPath, CryptoOp op, const std::string &password, int inFd, int outFd);
+
+#endif // FILE_CRYPTO_AGENT_H
@@ -0,0 +1,358 @@
+#include "crypto.h"
+#include "encrypted_file.h"
+#include "file_header.h"
+#include "fileio.h"
+#include "multibuffer.h"
+#include "pipeline.h"
+
+#include <benchmark/benchmark.h>
+#include <openssl/rand.h>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define BENCH_MIN_SIZE 16                 // наименьший размер данных
+#define BENCH_MAX_SIZE (1u << 30)         // наибольший размер данных
+#define BENCH_SIZE_STEP 16                // множитель между размерами
+#define BENCH_CPU_CACHE_EVICT (64u << 20) // больше кэша последнего уровня
+#define BENCH_BATCH_FILES 256             // сообщений в пакете для пакетного шифрования
+#define BENCH_IMAGE_SIZE (16u << 20)      // образ XTS для измерения произвольного чтения
+
+/**
+ * @brief Каталог для файлов измерений: $FILE_CRYPTO_BENCH_DIR или /tmp.
+ */
+static std::string benchDir() {
+    const char *dir = getenv("FILE_CRYPTO_BENCH_DIR");
+    return dir && *dir ? dir : "/tmp";
+}
+/**
+ * @brief Вытесняет данные из кэшей процессора, записывая большой буфер.
+ */
+static void evictCpuCaches() {
+    static std::vector<unsigned char> scratch(BENCH_CPU_CACHE_EVICT);
+    for (size_t i = 0; i < scratch.size(); i += 64) scratch[i]++;
+    benchmark::DoNotOptimize(scratch.data());
+    benchmark::ClobberMemory();
+}
+/**
+ * @brief Вытесняет файл из страничного кэша (после записи его на диск).
+ */
+static void dropPageCache(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+/**
+ * @brief Вытесняет данные, которые пригодились бы следующей итерации.
+ */
+static void makeCold(const std::string &path = std::string()) {
+    if (!path.empty()) dropPageCache(path);
+    evictCpuCaches();
+}
+
+static std::vector<unsigned char> randomData(size_t size) {
+    std::vector<unsigned char> data(size);
+    RAND_bytes(data.data(), data.size());
+    return data;
+}
+
+static void writeRandomFile(const std::string &path, size_t size) {
+    writeFile(path, randomData(size));
+}
+static const unsigned char BENCH_KEY[AES_KEY_LENGTH] = {1, 2, 3, 4, 5, 6, 7, 8};
+
+static void benchKeyDerivation(benchmark::State &state, bool cold) {
+    unsigned char key[AES_KEY_LENGTH];
+    for (auto _ : state) {
+        if (cold) {
+            state.PauseTiming();
+            makeCold();
+            state.ResumeTiming();
+        }
+        generateKeyFromPassword("benchmark password", key);
+        benchmark::DoNotOptimize(key);
+    }
+}
+
+static void benchEncryptBuffer(benchmark::State &state, bool cold) {
+    std::vector<unsigned char> plain = randomData(state.range(0));
+    unsigned char key[AES_KEY_LENGTH], iv[AES_BLOCK_SIZE];
+    memcpy(key, BENCH_KEY, sizeof(key));
+    RAND_bytes(iv, sizeof(iv));
+    for (auto _ : state) {
+        if (cold) {
+            state.PauseTiming();
+            makeCold();
+            state.ResumeTiming();
+        }
+        std::vector<unsigned char> cipher = encryptDataWithIV(plain, key, iv);
+        benchmark::DoNotOptimize(cipher.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+
+static void benchDecryptBuffer(benchmark::State &state, bool cold) {
+    unsigned char key[AES_KEY_LENGTH], iv[AES_BLOCK_SIZE];
+    memcpy(key, BENCH_KEY, sizeof(key));
+    RAND_bytes(iv, sizeof(iv));
+    std::vector<unsigned char> cipher = encryptDataWithIV(randomData(state.range(0)), key, iv);
+    for (auto _ : state) {
+        if (cold) {
+            state.PauseTiming();
+            makeCold();
+            state.ResumeTiming();
+        }
+        std::vector<unsigned char> plain = decryptDataWithIV(cipher, key);
+        benchmark::DoNotOptimize(plain.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+
+static void benchReadFile(benchmark::State &state, bool cold) {
+    std::string path = benchDir() + "/file_crypto_bench.read";
+    writeRandomFile(path, state.range(0));
+    readFile(path);
+    for (auto _ : state) {
+        if (cold) {
+            state.PauseTiming();
+            makeCold(path);
+            state.ResumeTiming();
+        }
+        std::vector<unsigned char> data = readFile(path);
+        benchmark::DoNotOptimize(data.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+    unlink(path.c_str());
+}
+/**
+ * @brief writeFile(): в «холодном» варианте файл каждый раз создаётся заново
+ * и вытесняется из кэша, в «тёплом» перезаписывается файл, уже находящийся в кэше.
+ */
+static void benchWriteFile(benchmark::State &state, bool cold) {
+    std::string path = benchDir() + "/file_crypto_bench.write";
+    std::vector<unsigned char> data = randomData(state.range(0));
+    writeFile(path, data);
+    for (auto _ : state) {
+        if (cold) {
+            state.PauseTiming();
+            makeCold(path);
+            unlink(path.c_str());
+            state.ResumeTiming();
+        }
+        writeFile(path, data);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+    unlink(path.c_str());
+}
+/**
+ * @brief Файловый конвейер шифрования или расшифрования (основной путь file_crypto).
+ */
+static void benchPipeline(benchmark::State &state, CryptoOp op, bool cold) {
+    std::string plainPath = benchDir() + "/file_crypto_bench.plain";
+    std::string cipherPath = benchDir() + "/file_crypto_bench.enc";
+    std::string outPath = benchDir() + "/file_crypto_bench.out";
+    writeRandomFile(plainPath, state.range(0));
+    {
+        ScopedFd in(openInputFile(plainPath));
+        ScopedFd out(open(cipherPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+        encryptPipeline(in.get(), out.get(), BENCH_KEY, nullptr, PipelineOptions());
+    }
+    const std::string &inPath = op == OP_ENCRYPT ? plainPath : cipherPath;
+    for (auto _ : state) {
+        if (cold) {
+            state.PauseTiming();
+            makeCold(inPath);
+            state.ResumeTiming();
+        }
+        ScopedFd in(openInputFile(inPath));
+        ScopedFd out(open(outPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+        if (out.get() < 0) {
+            state.SkipWithError("Cannot open output file");
+            break;
+        }
+        if (op == OP_ENCRYPT) {
+            encryptPipeline(in.get(), out.get(), BENCH_KEY, nullptr, PipelineOptions());
+        } else {
+            decryptPipeline(in.get(), out.get(), BENCH_KEY, PipelineOptions());
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+    unlink(plainPath.c_str());
+    unlink(cipherPath.c_str());
+    unlink(outPath.c_str());
+}
+/**
+ * @brief Мелкие чтения образа XTS по случайным смещениям: напрямую
+ *        (каждое чтение расшифровывает сектора) или через EncryptedFile с
+ *        кэшем порций. Размер чтения — range(0).
+ */
+static void benchImageRead(benchmark::State &state, bool cached) {
+    std::string plainPath = benchDir() + "/file_crypto_bench.plain";
+    std::string imagePath = benchDir() + "/file_crypto_bench.xts";
+    writeRandomFile(plainPath, BENCH_IMAGE_SIZE);
+    {
+        ScopedFd in(openInputFile(plainPath));
+        ScopedFd out(open(imagePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+        unsigned char iv[AES_BLOCK_SIZE];
+        RAND_bytes(iv, AES_BLOCK_SIZE);
+        unsigned char fileKey[AES_KEY_LENGTH];
+        std::vector<unsigned char> info = xtsLayoutInfo(XTS_DEFAULT_SECTOR, FILE_HEADER_SIZE);
+        writeFileHeader(out.get(), BENCH_KEY, iv, PipelineOptions(), false, fileKey, FILE_HEADER_FLAG_XTS, info.data(),
+                        info.size());
+        encryptXts(in.get(), out.get(), fileKey, iv, XTS_DEFAULT_SECTOR, PipelineOptions());
+    }
+    std::vector<unsigned char> buf(state.range(0));
+    uint64_t span = BENCH_IMAGE_SIZE - buf.size();
+    uint64_t seed = 1;
+    if (cached) {
+        EncryptedFile file(imagePath, BENCH_KEY, false);
+        for (auto _ : state) {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            file.pread(buf.data(), buf.size(), (seed >> 16) % span);
+            benchmark::DoNotOptimize(buf.data());
+        }
+    } else {
+        XtsImage image(imagePath, BENCH_KEY, false);
+        for (auto _ : state) {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            image.pread(buf.data(), buf.size(), (seed >> 16) % span);
+            benchmark::DoNotOptimize(buf.data());
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * buf.size());
+    unlink(plainPath.c_str());
+    unlink(imagePath.c_str());
+}
+/**
+ * @brief Пакет мелких сообщений размером от 1 до range(0) КиБ.
+ */
+static std::vector<std::vector<unsigned char> > smallFiles(benchmark::State &state, size_t *total) {
+    std::vector<std::vector<unsigned char> > files(BENCH_BATCH_FILES);
+    *total = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        files[i] = randomData(1024 + (i * 7919) % (state.range(0) * 1024 - 1023));
+        *total += files[i].size();
+    }
+    return files;
+}
+/**
+ * @brief Мелкие сообщения по одному через BufferCipher.
+ */
+static void benchSmallSerial(benchmark::State &state, bool cold) {
+    size_t total;
+    std::vector<std::vector<unsigned char> > files = smallFiles(state, &total);
+    BufferCipher cipher(BENCH_KEY);
+    for (auto _ : state) {
+        if (cold) {
+            state.PauseTiming();
+            makeCold();
+            state.ResumeTiming();
+        }
+        for (size_t i = 0; i < files.size(); i++) {
+            std::vector<unsigned char> out = cipher.encrypt(files[i].data(), files[i].size());
+            benchmark::DoNotOptimize(out.data());
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * total);
+}
+/**
+ * @brief Те же сообщения одним пакетом через MultiBufferCipher.
+ */
+static void benchSmallMultiBuffer(benchmark::State &state, bool cold) {
+    size_t total;
+    std::vector<std::vector<unsigned char> > files = smallFiles(state, &total);
+    std::vector<std::vector<unsigned char> > outs(files.size());
+    std::vector<CbcJob> jobs(files.size());
+    for (size_t i = 0; i < files.size(); i++) {
+        outs[i].resize(MultiBufferCipher::encryptedSize(files[i].size()));
+        RAND_bytes(outs[i].data(), AES_BLOCK_SIZE);
+        jobs[i].data = files[i].data();
+        jobs[i].len = files[i].size();
+        jobs[i].out = outs[i].data();
+    }
+    MultiBufferCipher cipher(BENCH_KEY);
+    for (auto _ : state) {
+        if (cold) {
+            state.PauseTiming();
+            makeCold();
+            state.ResumeTiming();
+        }
+        cipher.encrypt(jobs.data(), jobs.size());
+        benchmark::DoNotOptimize(outs.data());
+    }
+    state.SetBytesProcessed(state.iterations() * total);
+}
+/**
+ * @brief Регистрирует вариант измерения для всех размеров данных.
+ */
+template <typename Function>
+static void registerSized(const std::string &name, Function function) {
+    benchmark::RegisterBenchmark(name.c_str(), function)
+        ->RangeMultiplier(BENCH_SIZE_STEP)
+        ->Range(BENCH_MIN_SIZE, BENCH_MAX_SIZE)
+        ->Unit(benchmark::kMicrosecond)
+        ->UseRealTime();
+}
+/**
+ * @brief Микробенчмарки file_crypto.
+ *
+ * Каждая функция измеряется в «тёплом» варианте (данные в кэшах после
+ * предыдущей итерации) и «холодном» (перед итерацией кэш процессора
+ * вытесняется, а файлы — из страничного кэша). По умолчанию результат
+ * печатается в JSON, чтобы сравнивать сборки между коммитами; обычные
+ * параметры Google Benchmark (--benchmark_filter, --benchmark_out и т. д.)
+ * поддерживаются.
+ */
+int main(int argc, char *argv[]) {
+    initCrypto();
+    const char *variants[] = {"warm", "cold"};
+    for (int i = 0; i < 2; i++) {
+        bool cold = i == 1;
+        std::string suffix = std::string("/") + variants[i];
+        benchmark::RegisterBenchmark(("generateKeyFromPassword" + suffix).c_str(),
+                                     [cold](benchmark::State &state) { benchKeyDerivation(state, cold); })
+            ->Unit(benchmark::kMicrosecond);
+        registerSized("encryptDataWithIV" + suffix, [cold](benchmark::State &state) { benchEncryptBuffer(state, cold); });
+        registerSized("decryptDataWithIV" + suffix, [cold](benchmark::State &state) { benchDecryptBuffer(state, cold); });
+        registerSized("readFile" + suffix, [cold](benchmark::State &state) { benchReadFile(state, cold); });
+        registerSized("writeFile" + suffix, [cold](benchmark::State &state) { benchWriteFile(state, cold); });
+        registerSized("encryptPipeline" + suffix,
+                      [cold](benchmark::State &state) { benchPipeline(state, OP_ENCRYPT, cold); });
+        registerSized("decryptPipeline" + suffix,
+                      [cold](benchmark::State &state) { benchPipeline(state, OP_DECRYPT, cold); });
+        // Пакеты мелких файлов: аргумент — наибольший размер в КиБ
+        benchmark::RegisterBenchmark(("smallFilesSerial" + suffix).c_str(),
+                                     [cold](benchmark::State &state) { benchSmallSerial(state, cold); })
+            ->Arg(1)->Arg(4)->Unit(benchmark::kMicrosecond);
+        benchmark::RegisterBenchmark(("smallFilesMultiBuffer" + suffix).c_str(),
+                                     [cold](benchmark::State &state) { benchSmallMultiBuffer(state, cold); })
+            ->Arg(1)->Arg(4)->Unit(benchmark::kMicrosecond);
+    }
+    // Произвольные мелкие чтения зашифрованного образа: без кэша и с кэшем порций
+    benchmark::RegisterBenchmark("xtsImageRead", [](benchmark::State &state) { benchImageRead(state, false); })
+        ->Arg(512)->Arg(4096)->Unit(benchmark::kMicrosecond);
+    benchmark::RegisterBenchmark("encryptedFileRead", [](benchmark::State &state) { benchImageRead(state, true); })
+        ->Arg(512)->Arg(4096)->Unit(benchmark::kMicrosecond);
+
+    // JSON по умолчанию, если формат не задан явно
+    std::vector<char *> args(argv, argv + argc);
+    bool hasFormat = false;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--benchmark_format", 18) == 0) hasFormat = true;
+    }
+    static char jsonFormat[] = "--benchmark_format=json";
+    if (!hasFormat) args.push_back(jsonFormat);
+    int count = args.size();
+    args.push_back(nullptr);
+
+    benchmark::Initialize(&count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(count, args.data())) return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
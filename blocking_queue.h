@@ -0,0 +1,80 @@
+#ifndef FILE_CRYPTO_BLOCKING_QUEUE_H
+#define FILE_CRYPTO_BLOCKING_QUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief Ограниченная очередь между потоками конвейера.
+ *
+ * push() ждёт, пока в очереди есть место, tryPush() в полной очереди сразу
+ * возвращает false, pop() — пока появится элемент;
+ * popBatch() забирает сразу все готовые элементы, но не больше maxCount.
+ * После close() ожидающие потоки просыпаются: push() возвращает false сразу,
+ * pop() — когда очередь опустеет. Так ошибка в одном потоке останавливает весь
+ * конвейер без отдельных флагов.
+ */
+template <typename T>
+class BlockingQueue {
+public:
+    explicit BlockingQueue(size_t capacity = (size_t)-1) : capacity_(capacity), closed_(false) {}
+
+    bool push(T &&item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (items_.size() >= capacity_ && !closed_) notFull_.wait(lock);
+        if (closed_) return false;
+        items_.push_back(std::move(item));
+        notEmpty_.notify_one();
+        return true;
+    }
+
+    bool tryPush(T &&item) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_ || items_.size() >= capacity_) return false;
+        items_.push_back(std::move(item));
+        notEmpty_.notify_one();
+        return true;
+    }
+
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (items_.empty() && !closed_) notEmpty_.wait(lock);
+        if (items_.empty()) return false;
+        item = std::move(items_.front());
+        items_.pop_front();
+        notFull_.notify_one();
+        return true;
+    }
+
+    bool popBatch(std::vector<T> &batch, size_t maxCount) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (items_.empty() && !closed_) notEmpty_.wait(lock);
+        if (items_.empty()) return false;
+        while (!items_.empty() && batch.size() < maxCount) {
+            batch.push_back(std::move(items_.front()));
+            items_.pop_front();
+        }
+        notFull_.notify_all();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        notEmpty_.notify_all();
+        notFull_.notify_all();
+    }
+
+private:
+    size_t capacity_;
+    bool closed_;
+    std::deque<T> items_;
+    std::mutex mutex_;
+    std::condition_variable notEmpty_;
+    std::condition_variable notFull_;
+};
+
+#endif // FILE_CRYPTO_BLOCKING_QUEUE_H
@@ -0,0 +1,244 @@
+#include "crypto.h"
+#include "fileio.h"
+#include "log.h"
+
+#include <openssl/conf.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * @brief Обрабатывает ошибки OpenSSL.
+ *
+ * Выбрасывает CryptoError с текстом первой ошибки из очереди OpenSSL. Вся
+ * очередь ошибок выводится в журнал на уровне отладки и очищается.
+ */
+void handleErrors() {
+    unsigned long code = ERR_peek_error();
+    char text[256] = "OpenSSL error";
+    if (code != 0) {
+        ERR_error_string_n(code, text, sizeof(text));
+    }
+    if (logEnabled(LOG_LEVEL_DEBUG)) {
+        ERR_print_errors_cb([](const char *line, size_t len, void *) {
+            // Строки OpenSSL заканчиваются переводом строки, его добавит журнал
+            LOG(LOG_LEVEL_DEBUG, std::string(line, len && line[len - 1] == '\n' ? len - 1 : len));
+            return 1;
+        }, nullptr);
+    }
+    ERR_clear_error();
+    throw CryptoError(text);
+}
+/**
+ * @brief Инициализирует OpenSSL с наименьшими затратами на запуск.
+ *
+ * Вызывается в начале main() до любых других функций OpenSSL. Файл
+ * openssl.cnf не читается (программе не нужны ни его провайдеры, ни
+ * движки), очистка при выходе не регистрируется: ключи затираются самой
+ * программой, а остальное освободит ядро. Заодно один раз запрашивается
+ * реализация AES-256-CBC у провайдера, чтобы каждое EVP_*Init_ex() не
+ * искало её заново.
+ */
+void initCrypto() {
+    uint64_t flags = OPENSSL_INIT_NO_LOAD_CONFIG;
+#ifdef OPENSSL_INIT_NO_ATEXIT
+    flags |= OPENSSL_INIT_NO_ATEXIT;
+#endif
+    // При ошибке OpenSSL инициализируется сам при первом обращении
+    OPENSSL_init_crypto(flags, nullptr);
+    aes256Cbc();
+}
+/**
+ * @brief Реализация AES-256-CBC, полученная от провайдера один раз.
+ */
+const EVP_CIPHER *aes256Cbc() {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    static const EVP_CIPHER *cipher = [] {
+        const EVP_CIPHER *fetched = EVP_CIPHER_fetch(nullptr, "AES-256-CBC", nullptr);
+        return fetched ? fetched : EVP_aes_256_cbc();
+    }();
+    return cipher;
+#else
+    return EVP_aes_256_cbc();
+#endif
+}
+/**
+ * @brief Владеющая обёртка над EVP_CIPHER_CTX.
+ *
+ * Освобождает контекст при выходе из области видимости, в том числе по исключению.
+ */
+struct CipherCtx {
+    EVP_CIPHER_CTX *ctx;
+    CipherCtx() : ctx(EVP_CIPHER_CTX_new()) {
+        if (!ctx) handleErrors();
+    }
+    ~CipherCtx() { EVP_CIPHER_CTX_free(ctx); }
+private:
+    CipherCtx(const CipherCtx &);
+    CipherCtx &operator=(const CipherCtx &);
+};
+/**
+ * @brief Генерация ключа из пароля с использованием PBKDF2.
+ *
+ * @param[in] password Пароль, из которого будет генерироваться ключ.
+ * @param[out] key Массив байтов для сохранения сгенерированного ключа.
+ *
+ * Функция использует алгоритм PBKDF2 с хэш-функцией SHA-1 для генерации ключа длиной AES_KEY_LENGTH байт.
+ */
+void generateKeyFromPassword(const std::string &password, unsigned char *key) {
+    const unsigned char *salt = (unsigned char *)"12345678"; // Соль для PBKDF2
+    if (PKCS5_PBKDF2_HMAC_SHA1(password.c_str(), password.size(), salt, 8, 10000, AES_KEY_LENGTH, key) != 1) {
+        handleErrors();
+    }
+}
+/**
+ * @brief Шифрование данных с использованием AES-256 CBC и записью IV в начало файла.
+ *
+ * @param[in] plaintext Вектор байтов, содержащий исходные данные (plaintext).
+ * @param[in] key Массив байтов, содержащий ключ для шифрования.
+ * @param[in] iv Массив байтов, содержащий вектор инициализации (IV).
+ * @return std::vector<unsigned char> Вектор байтов, содержащий зашифрованные данные с добавленным в начало IV.
+ *
+ * Функция шифрует данные с использованием AES-256 в режиме CBC, добавляет IV в начало зашифрованного текста
+ * и возвращает результат.
+ */
+std::vector<unsigned char> encryptDataWithIV(const std::vector<unsigned char> &plaintext, unsigned char *key, unsigned char *iv) {
+    CipherCtx cipher;
+    EVP_CIPHER_CTX *ctx = cipher.ctx;
+
+    if (1 != EVP_EncryptInit_ex(ctx, aes256Cbc(), nullptr, key, iv)) {
+        handleErrors();
+    }
+
+    std::vector<unsigned char> ciphertext(plaintext.size() + AES_BLOCK_SIZE);
+    int len;
+    int ciphertext_len = 0;
+
+    if (1 != EVP_EncryptUpdate(ctx, ciphertext.data(), &len, plaintext.data(), plaintext.size())) {
+        handleErrors();
+    }
+    ciphertext_len = len;
+
+    if (1 != EVP_EncryptFinal_ex(ctx, ciphertext.data() + len, &len)) {
+        handleErrors();
+    }
+    ciphertext_len += len;
+
+    ciphertext.resize(ciphertext_len);
+
+    // Добавляем IV в начало шифрованных данных
+    std::vector<unsigned char> result(AES_BLOCK_SIZE + ciphertext.size());
+    std::copy(iv, iv + AES_BLOCK_SIZE, result.begin());
+    std::copy(ciphertext.begin(), ciphertext.end(), result.begin() + AES_BLOCK_SIZE);
+
+    return result;
+}
+/**
+ * @brief Расшифрование данных с использованием AES-256 CBC и извлечением IV из начала файла.
+ *
+ * @param[in] ciphertext Вектор байтов, содержащий зашифрованные данные с IV в начале.
+ * @param[in] key Массив байтов, содержащий ключ для расшифрования.
+ * @return std::vector<unsigned char> Вектор байтов, содержащий расшифрованные данные (plaintext).
+ *
+ * Функция извлекает IV из первых AES_BLOCK_SIZE байт зашифрованного текста, а затем использует его для
+ * расшифрования оставшейся части данных.
+ */
+std::vector<unsigned char> decryptDataWithIV(const std::vector<unsigned char> &ciphertext, unsigned char *key) {
+    if (ciphertext.size() < AES_BLOCK_SIZE) {
+        throw CryptoError("Input is too short to contain an IV");
+    }
+    unsigned char iv[AES_BLOCK_SIZE];
+    std::copy(ciphertext.begin(), ciphertext.begin() + AES_BLOCK_SIZE, iv);
+
+    LOG(LOG_LEVEL_DEBUG, "Extracted IV: " << hexBytes(iv, AES_BLOCK_SIZE));
+
+    CipherCtx cipher;
+    EVP_CIPHER_CTX *ctx = cipher.ctx;
+
+    if (1 != EVP_DecryptInit_ex(ctx, aes256Cbc(), nullptr, key, iv)) {
+        handleErrors();
+    }
+
+    std::vector<unsigned char> plaintext(ciphertext.size() - AES_BLOCK_SIZE);
+    int len;
+    int plaintext_len = 0;
+
+    if (1 != EVP_DecryptUpdate(ctx, plaintext.data(), &len, ciphertext.data() + AES_BLOCK_SIZE, ciphertext.size() - AES_BLOCK_SIZE)) {
+        handleErrors();
+    }
+    plaintext_len = len;
+
+    if (1 != EVP_DecryptFinal_ex(ctx, plaintext.data() + len, &len)) {
+        handleErrors();
+    }
+    plaintext_len += len;
+
+    plaintext.resize(plaintext_len);
+
+    return plaintext;
+}
+/**
+ * @brief Создаёт контексты шифрования и расшифрования для ключа.
+ *
+ * @param[in] key Ключ AES-256.
+ */
+BufferCipher::BufferCipher(const unsigned char *key) : enc_(EVP_CIPHER_CTX_new()), dec_(EVP_CIPHER_CTX_new()) {
+    if (!enc_ || !dec_ ||
+        1 != EVP_EncryptInit_ex(enc_, aes256Cbc(), nullptr, key, nullptr) ||
+        1 != EVP_DecryptInit_ex(dec_, aes256Cbc(), nullptr, key, nullptr)) {
+        EVP_CIPHER_CTX_free(enc_);
+        EVP_CIPHER_CTX_free(dec_);
+        handleErrors();
+    }
+}
+
+BufferCipher::~BufferCipher() {
+    EVP_CIPHER_CTX_free(enc_);
+    EVP_CIPHER_CTX_free(dec_);
+}
+/**
+ * @brief Шифрует буфер со случайным IV.
+ *
+ * @param[in] data Исходные данные.
+ * @param[in] len Длина данных.
+ * @return std::vector<unsigned char> IV, за которым следует шифртекст.
+ */
+std::vector<unsigned char> BufferCipher::encrypt(const unsigned char *data, size_t len) {
+    std::vector<unsigned char> result(AES_BLOCK_SIZE + len + AES_BLOCK_SIZE);
+    if (!RAND_bytes(result.data(), AES_BLOCK_SIZE)) {
+        handleErrors();
+    }
+    int outLen, finalLen;
+    if (1 != EVP_EncryptInit_ex(enc_, nullptr, nullptr, nullptr, result.data()) ||
+        1 != EVP_EncryptUpdate(enc_, result.data() + AES_BLOCK_SIZE, &outLen, data, len) ||
+        1 != EVP_EncryptFinal_ex(enc_, result.data() + AES_BLOCK_SIZE + outLen, &finalLen)) {
+        handleErrors();
+    }
+    result.resize(AES_BLOCK_SIZE + outLen + finalLen);
+    return result;
+}
+/**
+ * @brief Расшифровывает буфер, начинающийся с IV.
+ *
+ * @param[in] data Зашифрованные данные с IV в начале.
+ * @param[in] len Длина данных.
+ * @return std::vector<unsigned char> Расшифрованные данные.
+ */
+std::vector<unsigned char> BufferCipher::decrypt(const unsigned char *data, size_t len) {
+    if (len < AES_BLOCK_SIZE) {
+        throw CryptoError("Input is too short to contain an IV");
+    }
+    std::vector<unsigned char> result(len);
+    int outLen, finalLen;
+    if (1 != EVP_DecryptInit_ex(dec_, nullptr, nullptr, nullptr, data) ||
+        1 != EVP_DecryptUpdate(dec_, result.data(), &outLen, data + AES_BLOCK_SIZE, len - AES_BLOCK_SIZE) ||
+        1 != EVP_DecryptFinal_ex(dec_, result.data() + outLen, &finalLen)) {
+        handleErrors();
+    }
+    result.resize(outLen + finalLen);
+    return result;
+}
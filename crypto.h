@@ -0,0 +1,62 @@
+#ifndef FILE_CRYPTO_CRYPTO_H
+#define FILE_CRYPTO_CRYPTO_H
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#define AES_KEY_LENGTH 32  // для AES-256
+#define AES_BLOCK_SIZE 16  // размер блока AES
+
+/**
+ * @brief Исключение, сигнализирующее об ошибке шифрования или ввода-вывода.
+ *
+ * Используется вместо аварийного завершения, чтобы долгоживущие режимы
+ * (агент ключей) могли отклонить один запрос и продолжить работу.
+ */
+class CryptoError : public std::runtime_error {
+public:
+    explicit CryptoError(const std::string &what) : std::runtime_error(what) {}
+};
+
+/**
+ * @brief Направление операции над данными.
+ */
+enum CryptoOp {
+    OP_ENCRYPT = 1,  ///< шифрование
+    OP_DECRYPT = 2   ///< расшифрование
+};
+
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
+typedef struct evp_cipher_st EVP_CIPHER;
+
+/**
+ * @brief Шифратор коротких буферов с многократно используемыми контекстами.
+ *
+ * Формат результата совпадает с encryptDataWithIV(). Расписание ключа
+ * вычисляется один раз в конструкторе, а для каждого буфера меняется только IV,
+ * поэтому объект выгодно держать в каждом рабочем потоке сервиса.
+ */
+class BufferCipher {
+public:
+    explicit BufferCipher(const unsigned char *key);
+    ~BufferCipher();
+    std::vector<unsigned char> encrypt(const unsigned char *data, size_t len);
+    std::vector<unsigned char> decrypt(const unsigned char *data, size_t len);
+
+private:
+    EVP_CIPHER_CTX *enc_;
+    EVP_CIPHER_CTX *dec_;
+
+    BufferCipher(const BufferCipher &);
+    BufferCipher &operator=(const BufferCipher &);
+};
+
+void initCrypto();
+const EVP_CIPHER *aes256Cbc();
+void handleErrors();
+void generateKeyFromPassword(const std::string &password, unsigned char *key);
+std::vector<unsigned char> encryptDataWithIV(const std::vector<unsigned char> &plaintext, unsigned char *key, unsigned char *iv);
+std::vector<unsigned char> decryptDataWithIV(const std::vector<unsigned char> &ciphertext, unsigned char *key);
+
+#endif // FILE_CRYPTO_CRYPTO_H
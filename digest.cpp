@@ -0,0 +1,44 @@
+#include "digest.h"
+#include "crypto.h"
+
+#include <openssl/evp.h>
+
+StreamDigest::StreamDigest() : ctx_(EVP_MD_CTX_new()) {
+    if (!ctx_ || 1 != EVP_DigestInit_ex(ctx_, EVP_sha256(), nullptr)) {
+        EVP_MD_CTX_free(ctx_);
+        handleErrors();
+    }
+}
+
+StreamDigest::~StreamDigest() {
+    EVP_MD_CTX_free(ctx_);
+}
+
+void StreamDigest::update(const unsigned char *data, size_t len) {
+    if (1 != EVP_DigestUpdate(ctx_, data, len)) {
+        handleErrors();
+    }
+}
+/**
+ * @brief Завершает вычисление и возвращает сумму в шестнадцатеричном виде.
+ */
+std::string StreamDigest::hex() {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    if (1 != EVP_DigestFinal_ex(ctx_, digest, &len)) {
+        handleErrors();
+    }
+    static const char digits[] = "0123456789abcdef";
+    std::string result;
+    for (unsigned int i = 0; i < len; i++) {
+        result += digits[digest[i] >> 4];
+        result += digits[digest[i] & 15];
+    }
+    return result;
+}
+/**
+ * @brief Строка в формате sha256sum, пригодная для sha256sum -c.
+ */
+std::string digestLine(const std::string &hex, const std::string &fileName) {
+    return hex + "  " + fileName + "\n";
+}
@@ -0,0 +1,41 @@
+#ifndef FILE_CRYPTO_DIGEST_H
+#define FILE_CRYPTO_DIGEST_H
+
+#include <cstddef>
+#include <string>
+
+typedef struct evp_md_ctx_st EVP_MD_CTX;
+
+/**
+ * @brief Какие контрольные суммы вычислять при обработке файла.
+ */
+enum DigestTarget {
+    DIGEST_NONE = 0,
+    DIGEST_PLAIN = 1,   ///< открытого текста
+    DIGEST_CIPHER = 2,  ///< зашифрованного файла целиком, включая IV
+    DIGEST_BOTH = 3
+};
+
+/**
+ * @brief Потоковое вычисление SHA-256.
+ *
+ * Реализация OpenSSL сама выбирает инструкции SHA-NI или AVX2, если они есть.
+ */
+class StreamDigest {
+public:
+    StreamDigest();
+    ~StreamDigest();
+
+    void update(const unsigned char *data, size_t len);
+    std::string hex();
+
+private:
+    EVP_MD_CTX *ctx_;
+
+    StreamDigest(const StreamDigest &);
+    StreamDigest &operator=(const StreamDigest &);
+};
+
+std::string digestLine(const std::string &hex, const std::string &fileName);
+
+#endif // FILE_CRYPTO_DIGEST_H
@@ -0,0 +1,309 @@
+#include "encrypted_file.h"
+#include "crypto.h"
+#include "log.h"
+#include "memory_budget.h"
+
+#include <openssl/crypto.h>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <utility>
+#include <sys/stat.h>
+
+/**
+ * @brief Создаёт кэш объёмом не больше capacity байт открытого текста.
+ *
+ * Объём ограничен и свободной частью бюджета памяти. Память под порции
+ * выделяется по мере заполнения, а не сразу.
+ */
+BlockCache::BlockCache(size_t capacity)
+    : shardCapacity_(0), pool_(BLOCK_CACHE_CHUNK, secureHugePages()), hits_(0), misses_(0) {
+    size_t available = memoryBudget().available();
+    if (capacity > available) capacity = available;
+    shardCapacity_ = capacity / BLOCK_CACHE_CHUNK / BLOCK_CACHE_SHARDS;
+    if (shardCapacity_ == 0) shardCapacity_ = 1;
+}
+/**
+ * @brief Буфер для новой порции.
+ *
+ * Если бюджет памяти не позволяет расширить пул, забирается и затирается
+ * буфер последней в LRU порции из первой непустой части; ошибка — только
+ * при пустом кэше.
+ */
+SecureBuffer BlockCache::acquire() {
+    try {
+        return pool_.acquire();
+    } catch (const CryptoError &) {
+        for (size_t i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+            Shard &shard = shards_[i];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            if (shard.lru.empty()) continue;
+            SecureBuffer data = std::move(shard.lru.back().data);
+            shard.index.erase(shard.lru.back().key);
+            shard.lru.pop_back();
+            OPENSSL_cleanse(data.data(), BLOCK_CACHE_CHUNK);
+            return data;
+        }
+        throw;
+    }
+}
+/**
+ * @brief Копирует часть порции из кэша.
+ *
+ * @param[in] file Идентификатор файла.
+ * @param[in] chunk Номер порции.
+ * @param[in] offset Смещение внутри порции.
+ * @param[out] buf Куда копировать.
+ * @param[in] len Сколько байт; offset + len не больше длины порции.
+ * @param[in] count Учитывать ли обращение в hits() и misses().
+ * @return bool Порция была в кэше.
+ */
+bool BlockCache::lookup(uint64_t file, uint64_t chunk, size_t offset, unsigned char *buf, size_t len, bool count) {
+    Key key = {file, chunk};
+    Shard &shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+        if (count) misses_++;
+        return false;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    memcpy(buf, it->second->data.data() + offset, len);
+    if (count) hits_++;
+    return true;
+}
+/**
+ * @brief Кладёт порцию в кэш, вытесняя давно не использованную.
+ *
+ * @param[in] data Буфер из acquire() с открытым текстом порции; переходит
+ *            кэшу, вытесненный буфер затирается и возвращается в пул.
+ * @param[in] len Длина порции.
+ */
+void BlockCache::insert(uint64_t file, uint64_t chunk, SecureBuffer &&data, size_t len) {
+    Key key = {file, chunk};
+    Shard &shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+        it->second->data = std::move(data);
+        it->second->length = len;
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        return;
+    }
+    if (shard.lru.size() >= shardCapacity_) {
+        shard.index.erase(shard.lru.back().key);
+        shard.lru.pop_back();
+    }
+    Entry entry;
+    entry.key = key;
+    entry.data = std::move(data);
+    entry.length = len;
+    shard.lru.push_front(std::move(entry));
+    shard.index[key] = shard.lru.begin();
+}
+
+bool BlockCache::contains(uint64_t file, uint64_t chunk) {
+    Key key = {file, chunk};
+    Shard &shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.index.count(key) != 0;
+}
+
+void BlockCache::erase(uint64_t file, uint64_t chunk) {
+    Key key = {file, chunk};
+    Shard &shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) return;
+    shard.lru.erase(it->second);
+    shard.index.erase(it);
+}
+/**
+ * @brief Убирает из кэша все порции файла (при его закрытии).
+ */
+void BlockCache::eraseFile(uint64_t file) {
+    for (size_t i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        Shard &shard = shards_[i];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (auto it = shard.lru.begin(); it != shard.lru.end();) {
+            if (it->key.file == file) {
+                shard.index.erase(it->key);
+                it = shard.lru.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+/**
+ * @brief Общий кэш расшифрованных порций для всех EncryptedFile процесса.
+ */
+BlockCache &blockCache() {
+    static BlockCache cache(BLOCK_CACHE_DEFAULT_SIZE);
+    return cache;
+}
+
+/**
+ * @brief Состояние, общее для всех открытий одного файла.
+ */
+struct EncryptedFile::Shared {
+    std::pair<dev_t, ino_t> inode;
+    BlockCache *cache;
+    uint64_t id;       ///< ключ файла в кэше
+    std::mutex mutex;  ///< чтение образа со вставкой в кэш и запись с очисткой кэша
+};
+
+typedef std::map<std::pair<dev_t, ino_t>, std::weak_ptr<EncryptedFile::Shared> > SharedRegistry;
+static std::mutex registryMutex;
+/**
+ * @brief Открытые файлы процесса по устройству и inode.
+ */
+static SharedRegistry &sharedRegistry() {
+    static SharedRegistry registry;
+    return registry;
+}
+
+/**
+ * @brief Открывает образ XTS и запускает поток упреждающего чтения.
+ *
+ * @param[in] path Путь к образу.
+ * @param[in] key Ключ AES-256 (главный для образа с ключом файла).
+ * @param[in] writable Открыть для записи.
+ * @param[in] cache Кэш порций, обычно общий blockCache().
+ */
+EncryptedFile::EncryptedFile(const std::string &path, const unsigned char *key, bool writable, BlockCache &cache)
+    : image_(path, key, writable), cache_(cache), nextOffset_(0), window_(0), aheadEnd_(0), stopping_(false) {
+    struct stat st;
+    if (fstat(image_.fd(), &st) != 0) throw CryptoError("Cannot stat " + path + ": " + strerror(errno));
+    std::pair<dev_t, ino_t> inode(st.st_dev, st.st_ino);
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        std::weak_ptr<Shared> &slot = sharedRegistry()[inode];
+        shared_ = slot.lock();
+        if (shared_ && shared_->cache != &cache) throw CryptoError(path + " is already open with another block cache");
+        if (!shared_) {
+            static uint64_t nextId = 1;
+            shared_ = std::make_shared<Shared>();
+            shared_->inode = inode;
+            shared_->cache = &cache;
+            shared_->id = nextId++;
+            slot = shared_;
+        }
+    }
+    prefetchThread_ = std::thread(&EncryptedFile::prefetchLoop, this);
+}
+/**
+ * @brief Останавливает упреждающее чтение; последнее открытие файла
+ *        убирает его порции из кэша.
+ */
+EncryptedFile::~EncryptedFile() {
+    stopping_ = true;
+    prefetch_.close();
+    prefetchThread_.join();
+    std::lock_guard<std::mutex> lock(registryMutex);
+    if (shared_.use_count() == 1) {
+        cache_.eraseFile(shared_->id);
+        sharedRegistry().erase(shared_->inode);
+    }
+    shared_.reset();
+}
+/**
+ * @brief Длина порции: последняя может быть короче.
+ */
+size_t EncryptedFile::chunkLength(uint64_t chunk) const {
+    uint64_t start = chunk * BLOCK_CACHE_CHUNK;
+    return size() - start < BLOCK_CACHE_CHUNK ? (size_t)(size() - start) : BLOCK_CACHE_CHUNK;
+}
+/**
+ * @brief Расшифровывает порцию в кэш и, если задан buf, копирует её часть.
+ *
+ * Чтение образа и вставка выполняются под общей блокировкой файла, поэтому порция,
+ * расшифрованная до pwrite(), не попадает в кэш после него. Если порцию
+ * тем временем уже загрузил другой поток, образ не читается.
+ */
+void EncryptedFile::load(uint64_t chunk, size_t offset, unsigned char *buf, size_t len) {
+    std::lock_guard<std::mutex> lock(shared_->mutex);
+    if (buf ? cache_.lookup(shared_->id, chunk, offset, buf, len, false) : cache_.contains(shared_->id, chunk)) return;
+    SecureBuffer data = cache_.acquire();
+    size_t length = chunkLength(chunk);
+    image_.pread(data.data(), length, chunk * BLOCK_CACHE_CHUNK);
+    if (buf) memcpy(buf, data.data() + offset, len);
+    cache_.insert(shared_->id, chunk, std::move(data), length);
+}
+/**
+ * @brief Заказывает фоновую расшифровку порций после последовательного чтения.
+ */
+void EncryptedFile::scheduleReadAhead(uint64_t offset, size_t len) {
+    std::lock_guard<std::mutex> lock(sequenceMutex_);
+    bool sequential = offset == nextOffset_;
+    nextOffset_ = offset + len;
+    if (!sequential) {
+        window_ = 0;
+        aheadEnd_ = 0;
+        return;
+    }
+    window_ = window_ == 0 ? 1 : window_ * 2 < ENCRYPTED_FILE_MAX_READ_AHEAD ? window_ * 2 : ENCRYPTED_FILE_MAX_READ_AHEAD;
+    uint64_t first = (offset + len - 1) / BLOCK_CACHE_CHUNK + 1;
+    uint64_t end = first + window_ < chunkCount() ? first + window_ : chunkCount();
+    if (first < aheadEnd_) first = aheadEnd_;
+    for (uint64_t chunk = first; chunk < end; chunk++) prefetch_.push(uint64_t(chunk));
+    if (end > aheadEnd_) aheadEnd_ = end;
+}
+/**
+ * @brief Поток упреждающего чтения.
+ *
+ * Ошибки не пробрасываются: то же чтение повторит и сообщит pread().
+ */
+void EncryptedFile::prefetchLoop() {
+    uint64_t chunk;
+    while (!stopping_ && prefetch_.pop(chunk)) {
+        if (cache_.contains(shared_->id, chunk)) continue;
+        try {
+            load(chunk, 0, nullptr, 0);
+        } catch (const std::exception &e) {
+            LOG(LOG_LEVEL_DEBUG, "Read-ahead of chunk " << chunk << " failed: " << e.what());
+        }
+    }
+}
+/**
+ * @brief Читает открытый текст со смещения offset.
+ *
+ * @return size_t Прочитано байт; меньше len только у конца файла.
+ */
+size_t EncryptedFile::pread(unsigned char *buf, size_t len, uint64_t offset) {
+    if (offset >= size()) return 0;
+    if (len > size() - offset) len = (size_t)(size() - offset);
+    if (len == 0) return 0;
+    scheduleReadAhead(offset, len);
+    size_t done = 0;
+    while (done < len) {
+        uint64_t pos = offset + done;
+        uint64_t chunk = pos / BLOCK_CACHE_CHUNK;
+        size_t inChunk = (size_t)(pos % BLOCK_CACHE_CHUNK);
+        size_t n = chunkLength(chunk) - inChunk < len - done ? chunkLength(chunk) - inChunk : len - done;
+        if (!cache_.lookup(shared_->id, chunk, inChunk, buf + done, n)) load(chunk, inChunk, buf + done, n);
+        done += n;
+    }
+    return len;
+}
+/**
+ * @brief Переписывает открытый текст со смещения offset.
+ *
+ * Запись не может выходить за конец файла. Затронутые порции убираются
+ * из кэша и при следующем чтении расшифровываются заново.
+ */
+void EncryptedFile::pwrite(const unsigned char *buf, size_t len, uint64_t offset) {
+    std::lock_guard<std::mutex> lock(shared_->mutex);
+    image_.pwrite(buf, len, offset);
+    if (len == 0) return;
+    for (uint64_t chunk = offset / BLOCK_CACHE_CHUNK; chunk <= (offset + len - 1) / BLOCK_CACHE_CHUNK; chunk++) {
+        cache_.erase(shared_->id, chunk);
+    }
+}
+/**
+ * @brief Сбрасывает записанные данные на диск.
+ */
+void EncryptedFile::sync() {
+    std::lock_guard<std::mutex> lock(shared_->mutex);
+    image_.sync();
+}
@@ -0,0 +1,146 @@
+#ifndef FILE_CRYPTO_ENCRYPTED_FILE_H
+#define FILE_CRYPTO_ENCRYPTED_FILE_H
+
+#include "blocking_queue.h"
+#include "secure_pool.h"
+#include "xts.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#define BLOCK_CACHE_CHUNK (64u << 10)          // открытого текста в элементе кэша; кратен любому сектору XTS
+#define BLOCK_CACHE_SHARDS 16                  // независимых частей кэша со своими блокировками
+#define BLOCK_CACHE_DEFAULT_SIZE (64u << 20)   // объём общего кэша по умолчанию
+#define ENCRYPTED_FILE_MAX_READ_AHEAD 16       // наибольшее окно упреждающего чтения, в элементах
+
+/**
+ * @brief Кэш расшифрованных порций файлов, общий для потоков и файлов.
+ *
+ * Порция — BLOCK_CACHE_CHUNK байт открытого текста файла, последняя может
+ * быть короче. Кэш разбит на BLOCK_CACHE_SHARDS частей по хешу ключа
+ * (файл, номер порции); у каждой части своя блокировка и свой список LRU,
+ * поэтому потоки, читающие разные порции, почти не мешают друг другу.
+ * Объём ограничен: при вставке в заполненную часть вытесняется давно не
+ * использованная порция. Открытый текст хранится в буферах SecurePool
+ * (закреплённая память, затирается при вытеснении) и учитывается в
+ * memoryBudget(): объём кэша не больше свободной части бюджета при его
+ * создании, а если бюджета всё же не хватает на новую порцию, acquire()
+ * забирает буфер давно не использованной. Буфер для новой порции
+ * передаётся кэшу в insert() без копирования.
+ */
+class BlockCache {
+public:
+    explicit BlockCache(size_t capacity);
+
+    SecureBuffer acquire();
+    bool lookup(uint64_t file, uint64_t chunk, size_t offset, unsigned char *buf, size_t len, bool count = true);
+    void insert(uint64_t file, uint64_t chunk, SecureBuffer &&data, size_t len);
+    bool contains(uint64_t file, uint64_t chunk);
+    void erase(uint64_t file, uint64_t chunk);
+    void eraseFile(uint64_t file);
+
+    size_t capacity() const { return shardCapacity_ * BLOCK_CACHE_SHARDS * BLOCK_CACHE_CHUNK; }
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+
+private:
+    struct Key {
+        uint64_t file;
+        uint64_t chunk;
+        bool operator==(const Key &other) const { return file == other.file && chunk == other.chunk; }
+    };
+    struct KeyHash {
+        size_t operator()(const Key &key) const {
+            return std::hash<uint64_t>()(key.file * 0x9e3779b97f4a7c15ull ^ key.chunk);
+        }
+    };
+    struct Entry {
+        Key key;
+        SecureBuffer data;
+        size_t length;
+    };
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> lru;  ///< в начале — последняя использованная порция
+        std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+    };
+
+    Shard &shardFor(const Key &key) { return shards_[KeyHash()(key) % BLOCK_CACHE_SHARDS]; }
+
+    size_t shardCapacity_;  ///< порций в одной части
+    SecurePool pool_;
+    Shard shards_[BLOCK_CACHE_SHARDS];
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+
+    BlockCache(const BlockCache &);
+    BlockCache &operator=(const BlockCache &);
+};
+
+BlockCache &blockCache();
+
+/**
+ * @brief Зашифрованный образ XTS, читаемый и изменяемый как обычный файл.
+ *
+ * pread() отдаёт открытый текст из общего кэша BlockCache; промах
+ * расшифровывает порцию целиком и кладёт её в кэш, поэтому повторные
+ * мелкие чтения не запускают AES. Если чтения идут подряд, фоновый поток
+ * заранее расшифровывает следующие порции; окно растёт вдвое с каждым
+ * последовательным чтением до ENCRYPTED_FILE_MAX_READ_AHEAD и
+ * сбрасывается при переходе в другое место файла.
+ *
+ * pwrite() сразу шифрует и пишет затронутые сектора (XtsImage::pwrite) и
+ * убирает их порции из кэша; размер файла не меняется. Методы можно
+ * вызывать из нескольких потоков: попадания в кэш не блокируют друг
+ * друга, обращения к самому образу выполняются по одному.
+ *
+ * Порции в кэше принадлежат файлу (устройство и inode), а не открытию:
+ * все EncryptedFile одного файла в процессе делят порции и блокировку
+ * образа, поэтому запись через одно открытие сразу видна остальным.
+ * Открыть один файл с разными кэшами нельзя. Изменения образа в обход
+ * EncryptedFile (другим процессом или --patch) кэш не замечает.
+ */
+class EncryptedFile {
+public:
+    EncryptedFile(const std::string &path, const unsigned char *key, bool writable, BlockCache &cache = blockCache());
+    ~EncryptedFile();
+
+    uint64_t size() const { return image_.size(); }
+    size_t pread(unsigned char *buf, size_t len, uint64_t offset);
+    void pwrite(const unsigned char *buf, size_t len, uint64_t offset);
+    void sync();
+
+    struct Shared;  ///< общее для открытий одного файла; определено в encrypted_file.cpp
+
+private:
+    uint64_t chunkCount() const { return (size() + BLOCK_CACHE_CHUNK - 1) / BLOCK_CACHE_CHUNK; }
+    size_t chunkLength(uint64_t chunk) const;
+    void load(uint64_t chunk, size_t offset, unsigned char *buf, size_t len);
+    void scheduleReadAhead(uint64_t offset, size_t len);
+    void prefetchLoop();
+
+    XtsImage image_;
+    BlockCache &cache_;
+    std::shared_ptr<Shared> shared_;  ///< общее для открытий файла: ключ в кэше и блокировка образа
+
+    std::mutex sequenceMutex_;
+    uint64_t nextOffset_;         ///< конец предыдущего чтения
+    size_t window_;               ///< текущее окно упреждения, в порциях
+    uint64_t aheadEnd_;           ///< порции до этой уже заказаны
+    std::atomic<bool> stopping_;
+    BlockingQueue<uint64_t> prefetch_;
+    std::thread prefetchThread_;
+
+    EncryptedFile(const EncryptedFile &);
+    EncryptedFile &operator=(const EncryptedFile &);
+};
+
+#endif // FILE_CRYPTO_ENCRYPTED_FILE_H
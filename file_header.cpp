@@ -0,0 +1,297 @@
+#include "file_header.h"
+#include "fileio.h"
+#include "secure_pool.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define FILE_KCV_LABEL "file_crypto key check"  // разделение доменов HMAC
+#define FILE_HEADER_FIXED 8                     // magic, версия, флаги и длина
+
+/**
+ * @brief Вычисляет контрольное значение ключа.
+ *
+ * @param[in] header Первые FILE_HEADER_FIXED байт заголовка.
+ * @param[in] key Ключ AES-256.
+ * @param[in] iv Вектор инициализации файла.
+ * @param[out] kcv Буфер на FILE_KCV_SIZE байт.
+ */
+void keyCheckValue(const unsigned char *header, const unsigned char *key, const unsigned char *iv, unsigned char *kcv) {
+    unsigned char message[sizeof(FILE_KCV_LABEL) - 1 + FILE_HEADER_FIXED + AES_BLOCK_SIZE];
+    memcpy(message, FILE_KCV_LABEL, sizeof(FILE_KCV_LABEL) - 1);
+    memcpy(message + sizeof(FILE_KCV_LABEL) - 1, header, FILE_HEADER_FIXED);
+    memcpy(message + sizeof(FILE_KCV_LABEL) - 1 + FILE_HEADER_FIXED, iv, AES_BLOCK_SIZE);
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int macLen = 0;
+    if (!HMAC(EVP_sha256(), key, AES_KEY_LENGTH, message, sizeof(message), mac, &macLen)) {
+        handleErrors();
+    }
+    memcpy(kcv, mac, FILE_KCV_SIZE);
+    OPENSSL_cleanse(mac, sizeof(mac));
+}
+/**
+ * @brief Заполняет первые FILE_HEADER_FIXED байт заголовка и обнуляет остальные.
+ */
+static void beginHeader(unsigned char *header, unsigned char flags, size_t size) {
+    memset(header, 0, size);
+    memcpy(header, FILE_HEADER_MAGIC, FILE_HEADER_MAGIC_SIZE);
+    header[4] = FILE_HEADER_VERSION;
+    header[FILE_HEADER_FLAGS_OFFSET] = flags;
+    header[6] = size & 0xff;
+    header[7] = size >> 8;
+}
+/**
+ * @brief Заполняет слот: оборачивает ключ содержимого ключом получателя.
+ */
+static void fillSlot(unsigned char *slot, const Recipient &recipient, const unsigned char *contentKey) {
+    memset(slot, 0, FILE_SLOT_SIZE);
+    slot[0] = (unsigned char)recipient.kind;
+    if (!RAND_bytes(slot + 8, SLOT_SALT_SIZE)) handleErrors();
+    unsigned char wrapKey[AES_KEY_LENGTH];
+    deriveSlotKey(recipient.key.data(), slot + 8, wrapKey, slot + 24);
+    wrapContentKey(wrapKey, contentKey, slot + 32);
+    OPENSSL_cleanse(wrapKey, sizeof(wrapKey));
+}
+/**
+ * @brief Ищет слот, открываемый ключом.
+ *
+ * @param[in] slots Область слотов заголовка.
+ * @param[in] key Ключ получателя.
+ * @param[out] contentKey Развёрнутый ключ содержимого; nullptr — только найти слот.
+ * @return int Номер слота или -1.
+ *
+ * Чужие слоты отсеиваются по контрольному значению за один вызов HKDF,
+ * разворачивается только совпавший.
+ */
+static int findSlot(const unsigned char *slots, const unsigned char *key, unsigned char *contentKey) {
+    for (int i = 0; i < FILE_SLOT_COUNT; i++) {
+        const unsigned char *slot = slots + i * FILE_SLOT_SIZE;
+        if (slot[0] == 0) continue;
+        unsigned char wrapKey[AES_KEY_LENGTH], check[SLOT_CHECK_SIZE];
+        deriveSlotKey(key, slot + 8, wrapKey, check);
+        bool match = CRYPTO_memcmp(check, slot + 24, SLOT_CHECK_SIZE) == 0 &&
+                     (!contentKey || unwrapContentKey(wrapKey, slot + 32, contentKey));
+        OPENSSL_cleanse(wrapKey, sizeof(wrapKey));
+        if (match) return i;
+    }
+    return -1;
+}
+/**
+ * @brief Пишет заголовок версии FILE_HEADER_VERSION перед IV и шифртекстом.
+ *
+ * @param[in] outFd Дескриптор результата.
+ * @param[in] key Ключ AES-256 (при perFileKey — главный).
+ * @param[in] iv IV, который будет записан следом.
+ * @param[in] options Обработчик onOutput получает байты заголовка.
+ * @param[in] perFileKey Вывести ключ файла из key со случайной солью.
+ * @param[out] fileKey Ключ, которым шифруются данные (AES_KEY_LENGTH байт).
+ * @param[in] layout Флаг устройства данных после IV (FILE_HEADER_FLAG_SEGMENTED,
+ *            FILE_HEADER_FLAG_SPARSE, FILE_HEADER_FLAG_STRIPED, FILE_HEADER_FLAG_XTS) или 0.
+ * @param[in] layoutInfo Данные устройства, дописываемые в конец заголовка
+ *            (карта полос, параметры образа), или nullptr.
+ * @param[in] layoutInfoSize Длина layoutInfo.
+ */
+void writeFileHeader(int outFd, const unsigned char *key, const unsigned char *iv, const PipelineOptions &options,
+                     bool perFileKey, unsigned char *fileKey, unsigned char layout, const unsigned char *layoutInfo,
+                     size_t layoutInfoSize) {
+    unsigned char header[FILE_HEADER_MAX];
+    size_t base = perFileKey ? FILE_HEADER_HKDF_SIZE : FILE_HEADER_SIZE;
+    size_t size = base + layoutInfoSize;
+    if (size > sizeof(header)) throw CryptoError("File header layout data is too large");
+    beginHeader(header, (perFileKey ? FILE_HEADER_FLAG_HKDF : 0) | layout, size);
+    if (layoutInfoSize) memcpy(header + base, layoutInfo, layoutInfoSize);
+    if (perFileKey) {
+        if (!RAND_bytes(header + FILE_HEADER_SIZE, FILE_KEY_SALT_SIZE)) handleErrors();
+        deriveFileKey(key, header + FILE_HEADER_SIZE, fileKey);
+    } else {
+        memcpy(fileKey, key, AES_KEY_LENGTH);
+    }
+    keyCheckValue(header, fileKey, iv, header + FILE_HEADER_FIXED);
+    writeAll(outFd, header, size);
+    if (options.onOutput) options.onOutput(header, size);
+}
+/**
+ * @brief Пишет заголовок со слотами получателей.
+ *
+ * @param[in] outFd Дескриптор результата.
+ * @param[in] recipients Получатели, не больше FILE_SLOT_COUNT.
+ * @param[in] iv IV, который будет записан следом.
+ * @param[in] options Обработчик onOutput получает байты заголовка.
+ * @param[out] fileKey Случайный ключ содержимого (AES_KEY_LENGTH байт).
+ * @param[in] layout Флаг устройства данных после IV или 0.
+ */
+void writeFileHeader(int outFd, const std::vector<Recipient> &recipients, const unsigned char *iv,
+                     const PipelineOptions &options, unsigned char *fileKey, unsigned char layout) {
+    if (recipients.empty() || recipients.size() > FILE_SLOT_COUNT) {
+        throw CryptoError("A file can have from 1 to " + std::to_string(FILE_SLOT_COUNT) + " recipients");
+    }
+    unsigned char header[FILE_HEADER_SLOTS_SIZE];
+    beginHeader(header, FILE_HEADER_FLAG_SLOTS | layout, sizeof(header));
+    if (!RAND_bytes(fileKey, AES_KEY_LENGTH)) handleErrors();
+    for (size_t i = 0; i < recipients.size(); i++) {
+        fillSlot(header + FILE_HEADER_SIZE + i * FILE_SLOT_SIZE, recipients[i], fileKey);
+    }
+    keyCheckValue(header, fileKey, iv, header + FILE_HEADER_FIXED);
+    writeAll(outFd, header, sizeof(header));
+    if (options.onOutput) options.onOutput(header, sizeof(header));
+}
+/**
+ * @brief Читает заголовок и проверяет ключ до расшифрования.
+ *
+ * @param[in] inFd Дескриптор зашифрованного файла.
+ * @param[in] key Ключ AES-256 (главный, если файл зашифрован ключом, выведенным HKDF;
+ *                ключ получателя, если в файле слоты).
+ * @param[out] header Заголовок; size == 0 для файла старого формата.
+ * @param[out] fileKey Ключ, которым расшифровываются данные (AES_KEY_LENGTH байт).
+ *
+ * После вызова позиция inFd указывает на IV. Если вход — канал, в
+ * который нельзя вернуть прочитанное, уже прочитанные байты потока
+ * (IV или начало файла старого формата) возвращаются в header->prefix.
+ * При неверном ключе выбрасывается CryptoError; прочитаны к этому
+ * моменту только заголовок и IV.
+ */
+void readFileHeader(int inFd, const unsigned char *key, FileHeader *header, unsigned char *fileKey) {
+    memcpy(fileKey, key, AES_KEY_LENGTH);
+    header->size = 0;
+    header->prefix.clear();
+    off_t start = lseek(inFd, 0, SEEK_CUR);
+    bool seekable = start >= 0;
+
+    unsigned char *bytes = header->bytes;
+    size_t n = readFull(inFd, bytes, FILE_HEADER_FIXED);
+    if (n < FILE_HEADER_FIXED || memcmp(bytes, FILE_HEADER_MAGIC, FILE_HEADER_MAGIC_SIZE) != 0) {
+        // Старый формат: IV сразу в начале файла
+        if (seekable) {
+            lseek(inFd, start, SEEK_SET);
+        } else {
+            header->prefix.assign(bytes, bytes + n);
+        }
+        return;
+    }
+    if (bytes[4] != FILE_HEADER_VERSION) {
+        throw CryptoError("Unsupported file format version " + std::to_string(bytes[4]));
+    }
+    if (bytes[FILE_HEADER_FLAGS_OFFSET] & ~(FILE_HEADER_FLAG_HKDF | FILE_HEADER_FLAG_SLOTS | FILE_HEADER_FLAG_SEGMENTED |
+                     FILE_HEADER_FLAG_SPARSE | FILE_HEADER_FLAG_STRIPED | FILE_HEADER_FLAG_XTS)) {
+        throw CryptoError("Unsupported file header flags");
+    }
+    size_t size = bytes[6] | (bytes[7] << 8);
+    bool perFileKey = (bytes[FILE_HEADER_FLAGS_OFFSET] & FILE_HEADER_FLAG_HKDF) != 0;
+    bool slots = (bytes[FILE_HEADER_FLAGS_OFFSET] & FILE_HEADER_FLAG_SLOTS) != 0;
+    size_t minSize = slots ? FILE_HEADER_SLOTS_SIZE : perFileKey ? FILE_HEADER_HKDF_SIZE : FILE_HEADER_SIZE;
+    // Флаги устройства данных после IV взаимоисключающие; полосы — без слотов
+    unsigned char layout = bytes[FILE_HEADER_FLAGS_OFFSET] & (FILE_HEADER_FLAG_SEGMENTED | FILE_HEADER_FLAG_SPARSE | FILE_HEADER_FLAG_STRIPED |
+                                       FILE_HEADER_FLAG_XTS);
+    bool layouts = (layout & (layout - 1)) != 0 || (slots && (layout & FILE_HEADER_FLAG_STRIPED));
+    if (layout & FILE_HEADER_FLAG_STRIPED) minSize += FILE_STRIPE_INFO_SIZE;
+    if (layout & FILE_HEADER_FLAG_XTS) minSize += FILE_XTS_INFO_SIZE;
+    if ((perFileKey && slots) || layouts || size < minSize || size > FILE_HEADER_MAX) {
+        throw CryptoError("Corrupt file header");
+    }
+    if (readFull(inFd, bytes + FILE_HEADER_FIXED, size - FILE_HEADER_FIXED) != size - FILE_HEADER_FIXED) {
+        throw CryptoError("Truncated file header");
+    }
+    header->size = size;
+
+    unsigned char iv[AES_BLOCK_SIZE];
+    if (readFull(inFd, iv, AES_BLOCK_SIZE) != AES_BLOCK_SIZE) {
+        throw CryptoError("Input is too short to contain an IV");
+    }
+    if (seekable) {
+        lseek(inFd, start + (off_t)size, SEEK_SET);
+    } else {
+        header->prefix.assign(iv, iv + AES_BLOCK_SIZE);
+    }
+    if (perFileKey) deriveFileKey(key, bytes + FILE_HEADER_SIZE, fileKey);
+    if (slots && findSlot(bytes + FILE_HEADER_SIZE, key, fileKey) < 0) {
+        throw CryptoError("Wrong password or key");
+    }
+    unsigned char kcv[FILE_KCV_SIZE];
+    keyCheckValue(bytes, fileKey, iv, kcv);
+    if (CRYPTO_memcmp(kcv, bytes + FILE_HEADER_FIXED, FILE_KCV_SIZE) != 0) {
+        throw CryptoError("Wrong password or key");
+    }
+}
+/**
+ * @brief Открывает файл со слотами для изменения списка получателей.
+ *
+ * @param[in] path Зашифрованный файл.
+ * @param[in] key Ключ одного из текущих получателей.
+ * @param[out] header Заголовок файла.
+ * @param[out] contentKey Ключ содержимого (AES_KEY_LENGTH байт).
+ * @return int Дескриптор, открытый на чтение и запись.
+ */
+static int openSlottedFile(const std::string &path, const unsigned char *key, FileHeader *header,
+                           unsigned char *contentKey) {
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) throw CryptoError("Cannot open " + path + ": " + strerror(errno));
+    ScopedFd guard(fd);
+    readFileHeader(fd, key, header, contentKey);
+    if (!(header->flags() & FILE_HEADER_FLAG_SLOTS)) {
+        throw CryptoError(path + " has no key slots; encrypt it with --recipient");
+    }
+    return guard.release();
+}
+/**
+ * @brief Записывает один слот на место и сбрасывает его на диск.
+ */
+static void writeSlot(int fd, const FileHeader &header, int index) {
+    size_t offset = FILE_HEADER_SIZE + index * FILE_SLOT_SIZE;
+    if (pwrite(fd, header.bytes + offset, FILE_SLOT_SIZE, offset) != FILE_SLOT_SIZE || fdatasync(fd) != 0) {
+        throw CryptoError(std::string("Cannot update key slot: ") + strerror(errno));
+    }
+}
+/**
+ * @brief Добавляет получателя в свободный слот файла.
+ *
+ * @param[in] path Зашифрованный файл со слотами.
+ * @param[in] key Ключ одного из текущих получателей.
+ * @param[in] recipient Новый получатель.
+ *
+ * Данные не перешифровываются: переписывается только свободный слот.
+ */
+void addFileRecipient(const std::string &path, const unsigned char *key, const Recipient &recipient) {
+    FileHeader header;
+    SecureBuffer contentKey = keyPool().acquire();
+    ScopedFd fd(openSlottedFile(path, key, &header, contentKey.data()));
+    unsigned char *slots = header.bytes + FILE_HEADER_SIZE;
+    if (findSlot(slots, recipient.key.data(), nullptr) >= 0) throw CryptoError("Recipient is already present");
+    int index = 0;
+    while (index < FILE_SLOT_COUNT && slots[index * FILE_SLOT_SIZE] != 0) index++;
+    if (index == FILE_SLOT_COUNT) {
+        throw CryptoError("All " + std::to_string(FILE_SLOT_COUNT) + " key slots are in use");
+    }
+    fillSlot(slots + index * FILE_SLOT_SIZE, recipient, contentKey.data());
+    writeSlot(fd.get(), header, index);
+}
+/**
+ * @brief Удаляет получателя из файла.
+ *
+ * @param[in] path Зашифрованный файл со слотами.
+ * @param[in] key Ключ одного из текущих получателей.
+ * @param[in] recipientKey Ключ удаляемого получателя.
+ *
+ * Слот затирается нулями. Ключ содержимого не меняется, поэтому получатель,
+ * уже расшифровавший файл, мог его сохранить; чтобы отозвать доступ
+ * полностью, файл нужно зашифровать заново.
+ */
+void removeFileRecipient(const std::string &path, const unsigned char *key, const unsigned char *recipientKey) {
+    FileHeader header;
+    SecureBuffer contentKey = keyPool().acquire();
+    ScopedFd fd(openSlottedFile(path, key, &header, contentKey.data()));
+    unsigned char *slots = header.bytes + FILE_HEADER_SIZE;
+    int index = findSlot(slots, recipientKey, nullptr);
+    if (index < 0) throw CryptoError("Recipient is not present");
+    int used = 0;
+    for (int i = 0; i < FILE_SLOT_COUNT; i++) used += slots[i * FILE_SLOT_SIZE] != 0;
+    if (used == 1) throw CryptoError("Cannot remove the last recipient");
+    memset(slots + index * FILE_SLOT_SIZE, 0, FILE_SLOT_SIZE);
+    writeSlot(fd.get(), header, index);
+}
@@ -0,0 +1,101 @@
+#ifndef FILE_CRYPTO_FILE_HEADER_H
+#define FILE_CRYPTO_FILE_HEADER_H
+
+#include "crypto.h"
+#include "keys.h"
+#include "pipeline.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define FILE_HEADER_MAGIC "FCRY"    // первые байты файла с заголовком
+#define FILE_HEADER_MAGIC_SIZE 4
+#define FILE_HEADER_VERSION 1
+#define FILE_HEADER_SIZE 32         // заголовок версии 1
+#define FILE_HEADER_FLAGS_OFFSET 5  // смещение байта флагов
+#define FILE_HEADER_HKDF_SIZE (FILE_HEADER_SIZE + FILE_KEY_SALT_SIZE)  // с солью ключа файла
+#define FILE_HEADER_MAX 4096        // наибольшая длина заголовка будущих версий
+#define FILE_KCV_SIZE 16            // байт контрольного значения ключа
+#define FILE_HEADER_FLAG_HKDF 0x01  // ключ файла выведен HKDF из главного ключа и соли
+#define FILE_HEADER_FLAG_SLOTS 0x02 // ключ содержимого обёрнут для каждого получателя
+#define FILE_HEADER_FLAG_SEGMENTED 0x04  // после IV — независимые сегменты (follow.h)
+#define FILE_HEADER_FLAG_SPARSE 0x08     // после IV — карта участков и данные только участков (sparse.h)
+#define FILE_HEADER_FLAG_STRIPED 0x10    // файл — одна полоса из нескольких (stripe.h)
+#define FILE_HEADER_FLAG_XTS 0x20        // после IV — образ из секторов XTS-AES-256 (xts.h)
+#define FILE_SLOT_COUNT 8           // слотов в заголовке; число постоянно, чтобы менять получателей на месте
+#define FILE_SLOT_SIZE 80           // байт на слот
+#define FILE_HEADER_SLOTS_SIZE (FILE_HEADER_SIZE + FILE_SLOT_COUNT * FILE_SLOT_SIZE)  // со слотами
+#define FILE_STRIPE_INFO_SIZE 32    // карта полос в конце заголовка с FILE_HEADER_FLAG_STRIPED
+#define FILE_XTS_INFO_SIZE 16       // параметры образа в конце заголовка с FILE_HEADER_FLAG_XTS
+
+/**
+ * @brief Заголовок зашифрованного файла.
+ *
+ * Формат (целые — little-endian):
+ *   0  magic "FCRY"
+ *   4  версия формата (1)
+ *   5  флаги (FILE_HEADER_FLAG_*)
+ *   6  длина заголовка (uint16, 32, 64 или 672; с картой полос — на 32 больше;
+ *      у образа XTS дополнена до XTS_DATA_OFFSET вместе с IV)
+ *   8  контрольное значение ключа (16 байт)
+ *   24 резерв (нули)
+ *   32 с FILE_HEADER_FLAG_HKDF: соль ключа файла (32 байта);
+ *      с FILE_HEADER_FLAG_SLOTS: FILE_SLOT_COUNT слотов по FILE_SLOT_SIZE байт
+ *   затем с FILE_HEADER_FLAG_STRIPED: карта полос (FILE_STRIPE_INFO_SIZE байт, см. stripe.h);
+ *   с FILE_HEADER_FLAG_XTS: нули и параметры образа (FILE_XTS_INFO_SIZE байт, см. xts.h)
+ * Затем, как и в файлах без заголовка, IV и шифртекст AES-256 CBC.
+ *
+ * С флагом FILE_HEADER_FLAG_HKDF данные шифруются не заданным ключом, а
+ * выведенным из него deriveFileKey() с солью из заголовка: так при
+ * шифровании многих файлов одним главным ключом у каждого файла свой ключ.
+ *
+ * С флагом FILE_HEADER_FLAG_SLOTS данные шифруются случайным ключом
+ * содержимого, обёрнутым (AES key wrap) отдельно для каждого получателя.
+ * Слот:
+ *   0  вид ключа получателя (RecipientKind; 0 — слот свободен)
+ *   1  резерв (нули)
+ *   8  соль ключа обёртки (SLOT_SALT_SIZE байт)
+ *   24 контрольное значение ключа слота (SLOT_CHECK_SIZE байт)
+ *   32 обёрнутый ключ содержимого (WRAPPED_KEY_SIZE байт)
+ *   72 резерв (нули)
+ * Данные шифруются один раз при любом числе получателей, а добавление и
+ * удаление получателя переписывает только его слот.
+ *
+ * Флаг FILE_HEADER_FLAG_SEGMENTED меняет только то, что следует за IV:
+ * вместо одного шифртекста — последовательность сегментов (см. follow.h).
+ * Флаг FILE_HEADER_FLAG_SPARSE тоже: за IV следуют зашифрованная карта
+ * участков с данными и шифртекст только этих участков (см. sparse.h).
+ * С флагом FILE_HEADER_FLAG_STRIPED за IV следуют независимо
+ * зашифрованные единицы чередования этой полосы (см. stripe.h), а с
+ * FILE_HEADER_FLAG_XTS — сектора образа, каждый из которых читается и
+ * переписывается отдельно (см. xts.h).
+ *
+ * Контрольное значение — первые FILE_KCV_SIZE байт HMAC-SHA256 с ключом
+ * шифрования от первых восьми байт заголовка и IV. Оно позволяет отличить
+ * неверный ключ, прочитав только заголовок и IV, и связывает файл с ключом:
+ * ключ, прошедший проверку, не даст мусора на выходе.
+ */
+struct FileHeader {
+    unsigned char bytes[FILE_HEADER_MAX];  ///< заголовок как в файле
+    size_t size;                           ///< длина заголовка; 0 — файл старого формата без заголовка
+    std::vector<unsigned char> prefix;     ///< прочитанное из канала сверх заголовка: начало потока IV || шифртекст
+
+    FileHeader() : size(0) {}
+
+    /// Флаги FILE_HEADER_FLAG_*; у файла без заголовка флагов нет
+    unsigned char flags() const { return size ? bytes[FILE_HEADER_FLAGS_OFFSET] : 0; }
+};
+
+void keyCheckValue(const unsigned char *header, const unsigned char *key, const unsigned char *iv, unsigned char *kcv);
+void writeFileHeader(int outFd, const unsigned char *key, const unsigned char *iv, const PipelineOptions &options,
+                     bool perFileKey, unsigned char *fileKey, unsigned char layout = 0,
+                     const unsigned char *layoutInfo = nullptr, size_t layoutInfoSize = 0);
+void writeFileHeader(int outFd, const std::vector<Recipient> &recipients, const unsigned char *iv,
+                     const PipelineOptions &options, unsigned char *fileKey, unsigned char layout = 0);
+void readFileHeader(int inFd, const unsigned char *key, FileHeader *header, unsigned char *fileKey);
+void addFileRecipient(const std::string &path, const unsigned char *key, const Recipient &recipient);
+void removeFileRecipient(const std::string &path, const unsigned char *key, const unsigned char *recipientKey);
+
+#endif // FILE_CRYPTO_FILE_HEADER_H
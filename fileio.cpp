@@ -0,0 +1,182 @@
+#include "fileio.h"
+#include "crypto.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @brief Чтение содержимого файла в вектор байтов.
+ * 
+ * @param[in] filename Имя файла для чтения.
+ * @return std::vector<unsigned char> Вектор байтов, содержащий данные файла.
+ * 
+ * Функция открывает файл в бинарном режиме и считывает его содержимое в вектор байтов.
+ */
+std::vector<unsigned char> readFile(const std::string &filename) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        throw CryptoError("Cannot open file: " + filename);
+    }
+    return std::vector<unsigned char>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+/**
+ * @brief Запись данных в файл.
+ * 
+ * @param[in] filename Имя файла для записи.
+ * @param[in] data Вектор байтов, содержащий данные для записи.
+ * 
+ * Функция открывает файл в бинарном режиме и записывает данные из вектора байтов в файл.
+ */
+void writeFile(const std::string &filename, const std::vector<unsigned char> &data) {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        throw CryptoError("Cannot open file: " + filename);
+    }
+    file.write((char*)data.data(), data.size());
+}
+/**
+ * @brief Чтение из дескриптора до заполнения буфера или конца файла.
+ * 
+ * @param[in] fd Дескриптор для чтения.
+ * @param[out] buf Буфер для данных.
+ * @param[in] len Требуемое количество байт.
+ * @return size_t Количество прочитанных байт; меньше len только в конце файла.
+ */
+size_t readFull(int fd, unsigned char *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, buf + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw CryptoError(std::string("Read failed: ") + strerror(errno));
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+/**
+ * @brief Запись всего буфера в дескриптор.
+ * 
+ * @param[in] fd Дескриптор для записи.
+ * @param[in] buf Данные для записи.
+ * @param[in] len Количество байт.
+ * 
+ * Повторяет write() при частичной записи и прерывании сигналом.
+ */
+void writeAll(int fd, const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw CryptoError(std::string("Write failed: ") + strerror(errno));
+        }
+        buf += n;
+        len -= n;
+    }
+}
+/**
+ * @brief Чтение len байт со смещения offset, не меняя позицию дескриптора.
+ *
+ * @return size_t Количество прочитанных байт; меньше len только в конце файла.
+ */
+size_t preadFull(int fd, unsigned char *buf, size_t len, uint64_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, offset + done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw CryptoError(std::string("Read failed: ") + strerror(errno));
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+/**
+ * @brief Запись всего буфера по смещению offset, не меняя позицию дескриптора.
+ */
+void pwriteAll(int fd, const unsigned char *buf, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw CryptoError(std::string("Write failed: ") + strerror(errno));
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+}
+
+void ScopedFd::reset(int fd) {
+    if (fd_ >= 0) close(fd_);
+    fd_ = fd;
+}
+/**
+ * @brief Открывает входной файл для чтения.
+ * 
+ * @param[in] filename Имя файла.
+ * @return int Дескриптор файла.
+ */
+int openInputFile(const std::string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw CryptoError("Cannot open file: " + filename);
+    }
+    return fd;
+}
+/**
+ * @brief Включает или выключает O_DIRECT для открытого файла.
+ * 
+ * @param[in] fd Дескриптор файла.
+ * @param[in] enable true — включить, false — выключить.
+ * @return bool false, если файл не обычный или файловая система не поддерживает O_DIRECT.
+ * 
+ * Для каналов флаг O_DIRECT меняет семантику (пакетный режим), поэтому он
+ * ставится только на обычные файлы.
+ */
+bool setDirectIo(int fd, bool enable) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) return false;
+    flags = enable ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+    return fcntl(fd, F_SETFL, flags) == 0;
+}
+/**
+ * @brief Разбирает размер с необязательным суффиксом K, M или G (степени 1024).
+ * 
+ * @param[in] text Строка вида "512M".
+ * @param[out] value Размер в байтах.
+ * @return bool false, если строка не является размером.
+ */
+bool parseSize(const char *text, size_t *value) {
+    // strtoull() принимает знак минус и превращает "-1" в огромное число
+    const char *start = text;
+    while (isspace((unsigned char)*start)) start++;
+    if (*start == '-') return false;
+    char *end;
+    errno = 0;
+    unsigned long long number = strtoull(text, &end, 10);
+    if (end == text || errno != 0) return false;
+    unsigned shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+        default: break;
+    }
+    if (*end == 'i' || *end == 'B') end++;
+    if (*end == 'B') end++;
+    if (*end != '\0' || (shift && number > (~0ULL >> shift))) return false;
+    *value = (size_t)(number << shift);
+    return true;
+}
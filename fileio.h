@@ -0,0 +1,41 @@
+#ifndef FILE_CRYPTO_FILEIO_H
+#define FILE_CRYPTO_FILEIO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Владеющая обёртка над файловым дескриптором.
+ */
+class ScopedFd {
+public:
+    explicit ScopedFd(int fd = -1) : fd_(fd) {}
+    ~ScopedFd() { reset(); }
+    int get() const { return fd_; }
+    int release() {
+        int fd = fd_;
+        fd_ = -1;
+        return fd;
+    }
+    void reset(int fd = -1);
+
+private:
+    int fd_;
+
+    ScopedFd(const ScopedFd &);
+    ScopedFd &operator=(const ScopedFd &);
+};
+
+int openInputFile(const std::string &filename);
+bool setDirectIo(int fd, bool enable);
+std::vector<unsigned char> readFile(const std::string &filename);
+void writeFile(const std::string &filename, const std::vector<unsigned char> &data);
+size_t readFull(int fd, unsigned char *buf, size_t len);
+void writeAll(int fd, const unsigned char *buf, size_t len);
+size_t preadFull(int fd, unsigned char *buf, size_t len, uint64_t offset);
+void pwriteAll(int fd, const unsigned char *buf, size_t len, uint64_t offset);
+bool parseSize(const char *text, size_t *value);
+
+#endif // FILE_CRYPTO_FILEIO_H
@@ -0,0 +1,330 @@
+#include "follow.h"
+#include "crypto.h"
+#include "file_header.h"
+#include "fileio.h"
+#include "log.h"
+#include "output_file.h"
+#include "secure_pool.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FOLLOW_FRAME_SIZE (4 + AES_BLOCK_SIZE)  // длина и IV перед шифртекстом сегмента
+#define FOLLOW_CHECKPOINT_FORMAT "file_crypto follow 1 %llu %llu %llu %llu\n"
+
+static int followWakeFd = -1;
+static volatile sig_atomic_t followStop = 0;
+
+static void followSignalHandler(int) {
+    followStop = 1;
+    uint64_t one = 1;
+    if (followWakeFd >= 0 && write(followWakeFd, &one, sizeof(one)) < 0) {
+        // очередь eventfd переполнена — цикл и так проснётся
+    }
+}
+
+typedef std::unique_ptr<EVP_CIPHER_CTX, void (*)(EVP_CIPHER_CTX *)> CipherCtxPtr;
+typedef std::chrono::steady_clock FollowClock;
+
+/**
+ * @brief Сохранённое состояние: докуда вход зашифрован и где кончается результат.
+ */
+struct FollowCheckpoint {
+    unsigned long long dev;           ///< устройство входного файла
+    unsigned long long ino;           ///< inode входного файла
+    unsigned long long inputOffset;   ///< зашифровано байт входа
+    unsigned long long outputOffset;  ///< длина результата из целых сегментов
+};
+
+static bool loadCheckpoint(const std::string &path, FollowCheckpoint *checkpoint) {
+    if (access(path.c_str(), F_OK) != 0) return false;
+    std::vector<unsigned char> data = readFile(path);
+    std::string text(data.begin(), data.end());
+    if (sscanf(text.c_str(), FOLLOW_CHECKPOINT_FORMAT, &checkpoint->dev, &checkpoint->ino, &checkpoint->inputOffset,
+               &checkpoint->outputOffset) != 4) {
+        throw CryptoError("Corrupt checkpoint " + path);
+    }
+    return true;
+}
+/**
+ * @brief Атомарно заменяет файл состояния и сбрасывает его на диск.
+ */
+static void saveCheckpoint(const std::string &path, const FollowCheckpoint &checkpoint) {
+    char text[128];
+    int len = snprintf(text, sizeof(text), FOLLOW_CHECKPOINT_FORMAT, checkpoint.dev, checkpoint.ino,
+                       checkpoint.inputOffset, checkpoint.outputOffset);
+    OutputOptions options;
+    options.fsync = FSYNC_ALWAYS;
+    DurabilityGroup group(options);
+    AtomicOutputFile file(path, group);
+    writeAll(file.fd(), (const unsigned char *)text, len);
+    file.commit();
+}
+
+/**
+ * @brief Шифрует данные, дописываемые в файл, сегментами.
+ *
+ * Новые данные ждутся через inotify, поэтому без записи во вход процесс
+ * не просыпается, а каждый байт входа читается и шифруется один раз.
+ * После каждого сегмента результат сбрасывается на диск, затем
+ * обновляется файл состояния.
+ */
+class Follower {
+public:
+    Follower(const std::string &inputFile, const std::string &outputFile, const unsigned char *key, bool perFileKey,
+             const FollowOptions &options)
+        : inputFile_(inputFile), outputFile_(outputFile), key_(key), perFileKey_(perFileKey), options_(options),
+          ctx_(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free), pool_(options.segmentSize, secureHugePages()), pending_(0) {
+        if (!ctx_) handleErrors();
+        checkpointPath_ = options.checkpoint.empty() ? outputFile + FOLLOW_CHECKPOINT_SUFFIX : options.checkpoint;
+    }
+
+    int run();
+
+private:
+    void open();
+    void emit();
+
+    std::string inputFile_;
+    std::string outputFile_;
+    std::string checkpointPath_;
+    const unsigned char *key_;
+    bool perFileKey_;
+    const FollowOptions &options_;
+    ScopedFd in_;
+    ScopedFd out_;
+    SecureBuffer fileKey_;
+    CipherCtxPtr ctx_;
+    FollowCheckpoint checkpoint_;
+    SecurePool pool_;                    ///< один буфер на сегмент, резервируется в run()
+    SecureBuffer plain_;                 ///< накопленный открытый текст сегмента
+    std::vector<unsigned char> cipher_;  ///< кадр и шифртекст сегмента
+    size_t pending_;                     ///< байт в plain_
+    FollowClock::time_point first_;      ///< когда появился первый байт сегмента
+
+    Follower(const Follower &);
+    Follower &operator=(const Follower &);
+};
+/**
+ * @brief Открывает вход и результат: продолжает по файлу состояния или начинает заново.
+ */
+void Follower::open() {
+    in_.reset(openInputFile(inputFile_));
+    struct stat st;
+    if (fstat(in_.get(), &st) != 0) throw CryptoError("Cannot stat " + inputFile_ + ": " + strerror(errno));
+    fileKey_ = keyPool().acquire();
+
+    if (loadCheckpoint(checkpointPath_, &checkpoint_)) {
+        if (checkpoint_.dev != (unsigned long long)st.st_dev || checkpoint_.ino != (unsigned long long)st.st_ino) {
+            throw CryptoError(inputFile_ + " is not the file recorded in " + checkpointPath_);
+        }
+        if ((unsigned long long)st.st_size < checkpoint_.inputOffset) {
+            throw CryptoError(inputFile_ + " is shorter than the encrypted part; it was truncated");
+        }
+        int fd = ::open(outputFile_.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd < 0) throw CryptoError("Cannot open " + outputFile_ + ": " + strerror(errno));
+        out_.reset(fd);
+        FileHeader header;
+        readFileHeader(fd, key_, &header, fileKey_.data());
+        if (!(header.flags() & FILE_HEADER_FLAG_SEGMENTED)) {
+            throw CryptoError(outputFile_ + " is not a segmented file");
+        }
+        // Сегмент, записанный после последнего сохранения состояния, шифруется заново
+        if (ftruncate(fd, checkpoint_.outputOffset) != 0 || lseek(fd, 0, SEEK_END) < 0 ||
+            lseek(in_.get(), checkpoint_.inputOffset, SEEK_SET) < 0) {
+            throw CryptoError("Cannot resume " + outputFile_ + ": " + strerror(errno));
+        }
+        LOG(LOG_LEVEL_INFO, "Resuming " << inputFile_ << " at offset " << checkpoint_.inputOffset);
+        return;
+    }
+
+    int fd = ::open(outputFile_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) throw CryptoError("Cannot create " + outputFile_ + ": " + strerror(errno));
+    out_.reset(fd);
+    unsigned char iv[AES_BLOCK_SIZE];
+    if (!RAND_bytes(iv, AES_BLOCK_SIZE)) handleErrors();
+    writeFileHeader(fd, key_, iv, PipelineOptions(), perFileKey_, fileKey_.data(), FILE_HEADER_FLAG_SEGMENTED);
+    writeAll(fd, iv, AES_BLOCK_SIZE);
+    if (fdatasync(fd) != 0) throw CryptoError("Cannot sync " + outputFile_ + ": " + strerror(errno));
+    checkpoint_.dev = st.st_dev;
+    checkpoint_.ino = st.st_ino;
+    checkpoint_.inputOffset = 0;
+    checkpoint_.outputOffset = lseek(fd, 0, SEEK_CUR);
+    saveCheckpoint(checkpointPath_, checkpoint_);
+}
+/**
+ * @brief Шифрует накопленные данные отдельным сегментом и сохраняет состояние.
+ */
+void Follower::emit() {
+    unsigned char *frame = cipher_.data();
+    if (!RAND_bytes(frame + 4, AES_BLOCK_SIZE)) handleErrors();
+    int len = 0, finalLen = 0;
+    bool ok = EVP_EncryptInit_ex(ctx_.get(), aes256Cbc(), nullptr, fileKey_.data(), frame + 4) == 1 &&
+              EVP_EncryptUpdate(ctx_.get(), frame + FOLLOW_FRAME_SIZE, &len, plain_.data(), (int)pending_) == 1 &&
+              EVP_EncryptFinal_ex(ctx_.get(), frame + FOLLOW_FRAME_SIZE + len, &finalLen) == 1;
+    OPENSSL_cleanse(plain_.data(), pending_);
+    if (!ok) handleErrors();
+    uint32_t n = len + finalLen;
+    for (int i = 0; i < 4; i++) frame[i] = (n >> (8 * i)) & 0xff;
+    writeAll(out_.get(), frame, FOLLOW_FRAME_SIZE + n);
+    if (fdatasync(out_.get()) != 0) throw CryptoError("Cannot sync " + outputFile_ + ": " + strerror(errno));
+
+    checkpoint_.inputOffset += pending_;
+    checkpoint_.outputOffset += FOLLOW_FRAME_SIZE + n;
+    saveCheckpoint(checkpointPath_, checkpoint_);
+    LOG(LOG_LEVEL_DEBUG, "Segment of " << pending_ << " bytes, input offset " << checkpoint_.inputOffset);
+    pending_ = 0;
+}
+/**
+ * @brief Цикл слежения: до SIGINT или SIGTERM, после которых дописывается последний сегмент.
+ */
+int Follower::run() {
+    open();
+    // Открытый текст сегмента в закреплённой памяти, учтённой в бюджете
+    pool_.reserve(1);
+    plain_ = pool_.acquire();
+    cipher_.resize(FOLLOW_FRAME_SIZE + options_.segmentSize + AES_BLOCK_SIZE);
+
+    ScopedFd notify(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+    ScopedFd wake(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    if (wake.get() < 0) throw CryptoError(std::string("Cannot create event loop: ") + strerror(errno));
+    // Без inotify (например, на сетевой ФС) вход проверяется раз в interval
+    bool watching = notify.get() >= 0 && inotify_add_watch(notify.get(), inputFile_.c_str(), IN_MODIFY) >= 0;
+    if (!watching) LOG(LOG_LEVEL_WARN, "inotify is not available for " << inputFile_ << ", polling");
+
+    followWakeFd = wake.get();
+    signal(SIGINT, followSignalHandler);
+    signal(SIGTERM, followSignalHandler);
+
+    int intervalMs = (int)(options_.interval * 1000);
+    for (;;) {
+        for (;;) {
+            ssize_t n = read(in_.get(), plain_.data() + pending_, options_.segmentSize - pending_);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) throw CryptoError("Cannot read " + inputFile_ + ": " + strerror(errno));
+            if (n == 0) break;
+            if (pending_ == 0) first_ = FollowClock::now();
+            pending_ += n;
+            if (pending_ == options_.segmentSize) emit();
+        }
+        int waitMs = watching ? -1 : intervalMs;
+        if (pending_) {
+            int elapsed = (int)std::chrono::duration_cast<std::chrono::milliseconds>(FollowClock::now() - first_).count();
+            if (followStop || elapsed >= intervalMs) {
+                emit();
+            } else {
+                waitMs = intervalMs - elapsed;
+            }
+        }
+        if (followStop) break;
+
+        struct stat st;
+        if (fstat(in_.get(), &st) == 0 && (unsigned long long)st.st_size < checkpoint_.inputOffset + pending_) {
+            throw CryptoError(inputFile_ + " was truncated while being followed");
+        }
+        pollfd fds[2];
+        fds[0].fd = wake.get();
+        fds[0].events = POLLIN;
+        fds[1].fd = notify.get();
+        fds[1].events = POLLIN;
+        if (poll(fds, watching ? 2 : 1, waitMs) < 0 && errno != EINTR) {
+            throw CryptoError(std::string("poll failed: ") + strerror(errno));
+        }
+        char events[4096];
+        while (watching && read(notify.get(), events, sizeof(events)) > 0) {}
+    }
+    followWakeFd = -1;
+    LOG(LOG_LEVEL_INFO, "Encrypted " << checkpoint_.inputOffset << " bytes of " << inputFile_);
+    return 0;
+}
+/**
+ * @brief Шифрует файл и затем дописываемые в него данные, пока не получен сигнал.
+ *
+ * @param[in] inputFile Растущий файл (например, журнал приложения).
+ * @param[in] outputFile Результат сегментированного формата.
+ * @param[in] key Ключ AES-256 (главный, если perFileKey).
+ * @param[in] perFileKey Шифровать ключом файла, выведенным HKDF.
+ * @param[in] options Параметры сегментов.
+ * @return int Код завершения процесса.
+ *
+ * Если есть файл состояния, работа продолжается с сохранённого смещения
+ * без повторного шифрования; иначе результат создаётся заново.
+ */
+int runFollow(const std::string &inputFile, const std::string &outputFile, const unsigned char *key, bool perFileKey,
+              const FollowOptions &options) {
+    Follower follower(inputFile, outputFile, key, perFileKey, options);
+    return follower.run();
+}
+/**
+ * @brief Расшифровывает сегменты, следующие за IV файла.
+ *
+ * @param[in] inFd Дескриптор, указывающий на IV (после readFileHeader()).
+ * @param[in] outFd Дескриптор для открытого текста.
+ * @param[in] key Ключ файла.
+ * @param[in] options Используются только onInput и onOutput.
+ * @param[in] prefix Уже прочитанное из канала начало потока.
+ *
+ * Неполный последний сегмент — файл ещё дописывается или запись
+ * прервалась — пропускается с предупреждением.
+ */
+void decryptSegments(int inFd, int outFd, const unsigned char *key, const PipelineOptions &options,
+                     const std::vector<unsigned char> &prefix) {
+    if (prefix.size() > AES_BLOCK_SIZE) throw CryptoError("Corrupt segmented file");
+    unsigned char iv[AES_BLOCK_SIZE];
+    memcpy(iv, prefix.data(), prefix.size());
+    size_t rest = AES_BLOCK_SIZE - prefix.size();
+    if (readFull(inFd, iv + prefix.size(), rest) != rest) throw CryptoError("Input is too short to contain an IV");
+    if (options.onInput) options.onInput(iv, AES_BLOCK_SIZE);
+
+    CipherCtxPtr ctx(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
+    if (!ctx) handleErrors();
+    std::vector<unsigned char> cipher, plain;
+    unsigned char frame[FOLLOW_FRAME_SIZE];
+    for (;;) {
+        size_t got = readFull(inFd, frame, FOLLOW_FRAME_SIZE);
+        if (got == 0) break;
+        uint32_t n = frame[0] | frame[1] << 8 | frame[2] << 16 | (uint32_t)frame[3] << 24;
+        bool complete = got == FOLLOW_FRAME_SIZE;
+        if (complete && (n == 0 || n % AES_BLOCK_SIZE != 0 || n > FOLLOW_MAX_SEGMENT)) {
+            throw CryptoError("Corrupt segment length");
+        }
+        if (complete) {
+            cipher.resize(n);
+            complete = readFull(inFd, cipher.data(), n) == n;
+        }
+        if (!complete) {
+            LOG(LOG_LEVEL_WARN, "Ignoring incomplete final segment");
+            break;
+        }
+        if (options.onInput) {
+            options.onInput(frame, FOLLOW_FRAME_SIZE);
+            options.onInput(cipher.data(), n);
+        }
+        plain.resize(n);
+        int len = 0, finalLen = 0;
+        bool ok = EVP_DecryptInit_ex(ctx.get(), aes256Cbc(), nullptr, key, frame + 4) == 1 &&
+                  EVP_DecryptUpdate(ctx.get(), plain.data(), &len, cipher.data(), n) == 1 &&
+                  EVP_DecryptFinal_ex(ctx.get(), plain.data() + len, &finalLen) == 1;
+        if (!ok) {
+            OPENSSL_cleanse(plain.data(), plain.size());
+            handleErrors();
+        }
+        writeAll(outFd, plain.data(), len + finalLen);
+        if (options.onOutput) options.onOutput(plain.data(), len + finalLen);
+        OPENSSL_cleanse(plain.data(), len + finalLen);
+    }
+}
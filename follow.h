@@ -0,0 +1,39 @@
+#ifndef FILE_CRYPTO_FOLLOW_H
+#define FILE_CRYPTO_FOLLOW_H
+
+#include "pipeline.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#define FOLLOW_DEFAULT_SEGMENT (1u << 20)   // открытого текста в сегменте, после которого он записывается
+#define FOLLOW_DEFAULT_INTERVAL 1.0         // секунд, после которых записывается неполный сегмент
+#define FOLLOW_MAX_SEGMENT (64u << 20)      // наибольший шифртекст сегмента
+#define FOLLOW_CHECKPOINT_SUFFIX ".ckpt"    // файл состояния рядом с результатом
+
+/**
+ * @brief Параметры режима слежения за растущим файлом.
+ *
+ * Формат результата: заголовок с флагом FILE_HEADER_FLAG_SEGMENTED, IV
+ * файла (нужен только для контрольного значения ключа), затем сегменты:
+ *   0  длина шифртекста n (uint32, little-endian, кратна AES_BLOCK_SIZE)
+ *   4  IV сегмента
+ *   20 шифртекст AES-256 CBC с дополнением, n байт
+ * Каждый сегмент расшифровывается независимо, поэтому файл можно читать,
+ * пока он дописывается: неполный последний сегмент пропускается.
+ */
+struct FollowOptions {
+    size_t segmentSize;      ///< открытого текста в сегменте
+    double interval;         ///< наибольшая задержка записи новых данных, секунд
+    std::string checkpoint;  ///< файл состояния; пусто — результат + FOLLOW_CHECKPOINT_SUFFIX
+
+    FollowOptions() : segmentSize(FOLLOW_DEFAULT_SEGMENT), interval(FOLLOW_DEFAULT_INTERVAL) {}
+};
+
+int runFollow(const std::string &inputFile, const std::string &outputFile, const unsigned char *key, bool perFileKey,
+              const FollowOptions &options);
+void decryptSegments(int inFd, int outFd, const unsigned char *key, const PipelineOptions &options,
+                     const std::vector<unsigned char> &prefix);
+
+#endif // FILE_CRYPTO_FOLLOW_H
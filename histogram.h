@@ -0,0 +1,100 @@
+#ifndef FILE_CRYPTO_HISTOGRAM_H
+#define FILE_CRYPTO_HISTOGRAM_H
+
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+#define HISTOGRAM_SUB_BUCKETS 8    // делений на каждую степень двойки
+#define HISTOGRAM_BUCKETS 512
+
+/**
+ * @brief Гистограмма задержек в микросекундах.
+ *
+ * Значения группируются по степеням двойки, каждая из которых делится на
+ * HISTOGRAM_SUB_BUCKETS равных частей, поэтому ошибка перцентилей не превышает
+ * 12.5% при фиксированном объёме памяти. Запись выполняется за O(1) без выделений;
+ * объект не потокобезопасен, для сбора из нескольких потоков используется merge().
+ */
+class LatencyHistogram {
+public:
+    LatencyHistogram() { reset(); }
+
+    void reset() {
+        memset(buckets_, 0, sizeof(buckets_));
+        count_ = 0;
+        sum_ = 0;
+        max_ = 0;
+    }
+
+    void record(uint64_t value) {
+        buckets_[bucketOf(value)]++;
+        count_++;
+        sum_ += value;
+        if (value > max_) max_ = value;
+    }
+
+    void merge(const LatencyHistogram &other) {
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) buckets_[i] += other.buckets_[i];
+        count_ += other.count_;
+        sum_ += other.sum_;
+        if (other.max_ > max_) max_ = other.max_;
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t max() const { return max_; }
+    double mean() const { return count_ ? (double)sum_ / count_ : 0.0; }
+
+    /**
+     * @brief Верхняя граница корзины, в которую попадает перцентиль p (0..100).
+     */
+    uint64_t percentile(double p) const {
+        if (count_ == 0) return 0;
+        uint64_t rank = (uint64_t)(p / 100.0 * count_);
+        if (rank >= count_) rank = count_ - 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            seen += buckets_[i];
+            if (seen > rank) {
+                uint64_t upper = upperBound(i);
+                return upper < max_ ? upper : max_;
+            }
+        }
+        return max_;
+    }
+
+    /**
+     * @brief Однострочная сводка: число значений, среднее и перцентили в мкс.
+     */
+    std::string format() const {
+        std::ostringstream out;
+        out << "count=" << count_ << " mean=" << (uint64_t)mean() << "us p50=" << percentile(50)
+            << "us p90=" << percentile(90) << "us p99=" << percentile(99) << "us p99.9=" << percentile(99.9)
+            << "us max=" << max_ << "us";
+        return out.str();
+    }
+
+private:
+    static int bucketOf(uint64_t value) {
+        if (value < HISTOGRAM_SUB_BUCKETS) return (int)value;
+        int msb = 63 - __builtin_clzll(value);
+        int sub = (int)((value >> (msb - 3)) & (HISTOGRAM_SUB_BUCKETS - 1));
+        return (msb - 2) * HISTOGRAM_SUB_BUCKETS + sub;
+    }
+
+    static uint64_t upperBound(int bucket) {
+        if (bucket < HISTOGRAM_SUB_BUCKETS) return bucket;
+        int msb = bucket / HISTOGRAM_SUB_BUCKETS + 2;
+        uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+        uint64_t base = (uint64_t)(HISTOGRAM_SUB_BUCKETS + sub) << (msb - 3);
+        return base + ((uint64_t)1 << (msb - 3)) - 1;
+    }
+
+    uint64_t buckets_[HISTOGRAM_BUCKETS];
+    uint64_t count_;
+    uint64_t sum_;
+    uint64_t max_;
+};
+
+#endif // FILE_CRYPTO_HISTOGRAM_H
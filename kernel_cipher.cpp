@@ -0,0 +1,295 @@
+#include "kernel_cipher.h"
+#include "fileio.h"
+#include "secure_pool.h"
+#include "throttle.h"
+
+#include <openssl/crypto.h>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/if_alg.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef SOL_ALG
+#define SOL_ALG 279
+#endif
+
+/**
+ * @brief Операция шифра AF_ALG с каналом для передачи данных через splice().
+ *
+ * Ключ передаётся ядру один раз; данные из входного файла попадают в сокет
+ * операции через канал, минуя пользовательское пространство. Ядро продолжает
+ * цепочку CBC между порциями, пока при отправке указан MSG_MORE.
+ */
+class KernelCipher {
+public:
+    explicit KernelCipher(const unsigned char *key);
+    ~KernelCipher();
+
+    void start(CryptoOp op, const unsigned char *iv);
+    void spliceIn(int inFd, size_t len);
+    void send(const unsigned char *data, size_t len, bool more);
+    void receive(unsigned char *data, size_t len);
+
+private:
+    int tfm_;
+    int op_;
+    int pipe_[2];
+
+    KernelCipher(const KernelCipher &);
+    KernelCipher &operator=(const KernelCipher &);
+};
+/**
+ * @brief Открывает сокет алгоритма KERNEL_CIPHER_NAME.
+ *
+ * @return int Дескриптор или -1, если AF_ALG или алгоритм недоступны.
+ */
+static int openAlgorithm() {
+    int fd = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    sockaddr_alg address;
+    memset(&address, 0, sizeof(address));
+    address.salg_family = AF_ALG;
+    strcpy((char *)address.salg_type, "skcipher");
+    strcpy((char *)address.salg_name, KERNEL_CIPHER_NAME);
+    if (bind(fd, (sockaddr *)&address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+KernelCipher::KernelCipher(const unsigned char *key) : tfm_(openAlgorithm()), op_(-1) {
+    pipe_[0] = pipe_[1] = -1;
+    if (tfm_ < 0) {
+        throw CryptoError(std::string("AF_ALG " KERNEL_CIPHER_NAME " is not available: ") + strerror(errno));
+    }
+    if (setsockopt(tfm_, SOL_ALG, ALG_SET_KEY, key, AES_KEY_LENGTH) != 0 ||
+        (op_ = accept4(tfm_, nullptr, nullptr, SOCK_CLOEXEC)) < 0 || pipe2(pipe_, O_CLOEXEC) != 0) {
+        int err = errno;
+        if (op_ >= 0) close(op_);
+        close(tfm_);
+        throw CryptoError(std::string("AF_ALG setup failed: ") + strerror(err));
+    }
+}
+
+KernelCipher::~KernelCipher() {
+    close(pipe_[0]);
+    close(pipe_[1]);
+    close(op_);
+    close(tfm_);
+}
+/**
+ * @brief Задаёт направление и IV; данные последуют с MSG_MORE.
+ */
+void KernelCipher::start(CryptoOp op, const unsigned char *iv) {
+    char control[CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(af_alg_iv) + AES_BLOCK_SIZE)];
+    memset(control, 0, sizeof(control));
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_ALG;
+    cmsg->cmsg_type = ALG_SET_OP;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+    uint32_t type = op == OP_ENCRYPT ? ALG_OP_ENCRYPT : ALG_OP_DECRYPT;
+    memcpy(CMSG_DATA(cmsg), &type, sizeof(type));
+
+    cmsg = CMSG_NXTHDR(&message, cmsg);
+    cmsg->cmsg_level = SOL_ALG;
+    cmsg->cmsg_type = ALG_SET_IV;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(af_alg_iv) + AES_BLOCK_SIZE);
+    af_alg_iv *algIv = (af_alg_iv *)CMSG_DATA(cmsg);
+    algIv->ivlen = AES_BLOCK_SIZE;
+    memcpy(algIv->iv, iv, AES_BLOCK_SIZE);
+
+    if (sendmsg(op_, &message, MSG_MORE) < 0) {
+        throw CryptoError(std::string("AF_ALG sendmsg failed: ") + strerror(errno));
+    }
+}
+/**
+ * @brief Передаёт len байт из файла в шифр через канал, без копирования в процесс.
+ */
+void KernelCipher::spliceIn(int inFd, size_t len) {
+    while (len > 0) {
+        ssize_t n = splice(inFd, nullptr, pipe_[1], nullptr, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw CryptoError(std::string("splice failed: ") + strerror(errno));
+        }
+        if (n == 0) throw CryptoError("Unexpected end of input");
+        for (ssize_t left = n; left > 0;) {
+            ssize_t m = splice(pipe_[0], nullptr, op_, nullptr, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m < 0) {
+                if (errno == EINTR) continue;
+                throw CryptoError(std::string("splice to AF_ALG failed: ") + strerror(errno));
+            }
+            left -= m;
+        }
+        len -= n;
+    }
+}
+/**
+ * @brief Отправляет данные из памяти; без more операция завершается.
+ */
+void KernelCipher::send(const unsigned char *data, size_t len, bool more) {
+    for (;;) {
+        ssize_t n = ::send(op_, data, len, more ? MSG_MORE : 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw CryptoError(std::string("AF_ALG send failed: ") + strerror(errno));
+        }
+        data += n;
+        len -= n;
+        if (len == 0) break;
+    }
+}
+/**
+ * @brief Читает ровно len байт результата.
+ */
+void KernelCipher::receive(unsigned char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(op_, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw CryptoError(std::string("AF_ALG read failed: ") + strerror(errno));
+        }
+        if (n == 0) throw CryptoError("AF_ALG returned no data");
+        data += n;
+        len -= n;
+    }
+}
+/**
+ * @brief Проверяет, можно ли использовать AF_ALG с KERNEL_CIPHER_NAME.
+ *
+ * Результат проверки запоминается.
+ */
+bool kernelCipherAvailable() {
+    static const bool available = [] {
+        int fd = openAlgorithm();
+        if (fd < 0) return false;
+        close(fd);
+        return true;
+    }();
+    return available;
+}
+/**
+ * @brief Размер непрочитанной части обычного файла.
+ *
+ * @return bool false, если вход не обычный файл: тогда конец данных заранее
+ *         неизвестен, а его нужно знать, чтобы дополнить последний блок.
+ */
+static bool remainingSize(int fd, uint64_t *size) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos < 0 || pos > st.st_size) return false;
+    *size = st.st_size - pos;
+    return true;
+}
+/**
+ * @brief Пропускает целые блоки через шифр порциями и пишет результат.
+ */
+static void cipherBody(KernelCipher &cipher, int inFd, int outFd, uint64_t len, SecureBuffer &buf,
+                       const PipelineOptions &options) {
+    while (len > 0) {
+        size_t n = len < KERNEL_CIPHER_CHUNK ? (size_t)len : KERNEL_CIPHER_CHUNK;
+        ioThrottle().account(n, 2);
+        cipher.spliceIn(inFd, n);
+        cipher.receive(buf.data(), n);
+        writeAll(outFd, buf.data(), n);
+        if (options.onOutput) options.onOutput(buf.data(), n);
+        len -= n;
+    }
+}
+/**
+ * @brief Шифрует файл средствами ядра в формате encryptPipeline().
+ *
+ * @param[in] inFd Дескриптор входного файла.
+ * @param[in] outFd Дескриптор для результата.
+ * @param[in] key Ключ AES-256.
+ * @param[in] iv Вектор инициализации.
+ * @param[in] options Используется только обработчик onOutput.
+ * @return bool false, если вход не обычный файл, AF_ALG недоступен или
+ *         задан onInput (открытый текст в процесс не попадает); тогда
+ *         ничего не записано и нужно использовать конвейер EVP.
+ *
+ * Целые блоки попадают в ядро через splice(); в процесс читается только
+ * последний неполный блок, к которому добавляется дополнение PKCS7.
+ */
+bool kernelEncryptFile(int inFd, int outFd, const unsigned char *key, const unsigned char *iv, const PipelineOptions &options) {
+    uint64_t size;
+    if (options.onInput || !kernelCipherAvailable() || !remainingSize(inFd, &size)) return false;
+
+    KernelCipher cipher(key);
+    SecurePool pool(KERNEL_CIPHER_CHUNK, secureHugePages());
+    pool.reserve(1);
+    SecureBuffer buf = pool.acquire();
+
+    writeAll(outFd, iv, AES_BLOCK_SIZE);
+    if (options.onOutput) options.onOutput(iv, AES_BLOCK_SIZE);
+    cipher.start(OP_ENCRYPT, iv);
+    uint64_t body = size / AES_BLOCK_SIZE * AES_BLOCK_SIZE;
+    cipherBody(cipher, inFd, outFd, body, buf, options);
+
+    // Последний блок: остаток данных и дополнение PKCS7
+    unsigned char *last = buf.data();
+    size_t tail = size - body;
+    if (readFull(inFd, last, tail) != tail) throw CryptoError("Unexpected end of input");
+    memset(last + tail, AES_BLOCK_SIZE - tail, AES_BLOCK_SIZE - tail);
+    cipher.send(last, AES_BLOCK_SIZE, false);
+    cipher.receive(last, AES_BLOCK_SIZE);
+    writeAll(outFd, last, AES_BLOCK_SIZE);
+    if (options.onOutput) options.onOutput(last, AES_BLOCK_SIZE);
+    return true;
+}
+/**
+ * @brief Расшифровывает файл средствами ядра.
+ *
+ * @param[in] inFd Дескриптор входного файла, начинающегося с IV.
+ * @param[in] outFd Дескриптор для результата.
+ * @param[in] key Ключ AES-256.
+ * @param[in] options Используется только обработчик onOutput.
+ * @return bool false, если вход не обычный файл, AF_ALG недоступен или задан onInput.
+ *
+ * Последний блок расшифровывается отдельно, чтобы проверить и отбросить
+ * дополнение.
+ */
+bool kernelDecryptFile(int inFd, int outFd, const unsigned char *key, const PipelineOptions &options) {
+    uint64_t size;
+    if (options.onInput || !kernelCipherAvailable() || !remainingSize(inFd, &size)) return false;
+    if (size < 2 * AES_BLOCK_SIZE || size % AES_BLOCK_SIZE != 0) {
+        throw CryptoError("Invalid ciphertext length");
+    }
+
+    KernelCipher cipher(key);
+    SecurePool pool(KERNEL_CIPHER_CHUNK, secureHugePages());
+    pool.reserve(1);
+    SecureBuffer buf = pool.acquire();
+
+    unsigned char iv[AES_BLOCK_SIZE];
+    readFull(inFd, iv, AES_BLOCK_SIZE);
+    cipher.start(OP_DECRYPT, iv);
+    cipherBody(cipher, inFd, outFd, size - 2 * AES_BLOCK_SIZE, buf, options);
+
+    unsigned char *last = buf.data();
+    if (readFull(inFd, last, AES_BLOCK_SIZE) != AES_BLOCK_SIZE) throw CryptoError("Unexpected end of input");
+    cipher.send(last, AES_BLOCK_SIZE, false);
+    cipher.receive(last, AES_BLOCK_SIZE);
+
+    // Проверка дополнения PKCS7 без ветвлений по его содержимому
+    unsigned pad = last[AES_BLOCK_SIZE - 1];
+    unsigned bad = (pad == 0) | (pad > AES_BLOCK_SIZE);
+    for (unsigned i = 0; i < AES_BLOCK_SIZE; i++) {
+        unsigned inPad = i >= AES_BLOCK_SIZE - pad;
+        bad |= inPad & (last[i] != pad);
+    }
+    if (bad) throw CryptoError("Decryption failed: bad padding");
+    writeAll(outFd, last, AES_BLOCK_SIZE - pad);
+    if (options.onOutput) options.onOutput(last, AES_BLOCK_SIZE - pad);
+    return true;
+}
@@ -0,0 +1,21 @@
+#ifndef FILE_CRYPTO_KERNEL_CIPHER_H
+#define FILE_CRYPTO_KERNEL_CIPHER_H
+
+#include "pipeline.h"
+
+#define KERNEL_CIPHER_NAME "cbc(aes)"       // алгоритм AF_ALG, совместимый с форматом файла
+#define KERNEL_CIPHER_CHUNK (64u << 10)     // порция; не больше буфера сокета AF_ALG по умолчанию
+
+/**
+ * @brief Реализация шифра для файлового режима.
+ */
+enum CryptoBackend {
+    BACKEND_EVP,     ///< OpenSSL EVP в пользовательском пространстве
+    BACKEND_KERNEL   ///< криптоподсистема ядра через AF_ALG
+};
+
+bool kernelCipherAvailable();
+bool kernelEncryptFile(int inFd, int outFd, const unsigned char *key, const unsigned char *iv, const PipelineOptions &options);
+bool kernelDecryptFile(int inFd, int outFd, const unsigned char *key, const PipelineOptions &options);
+
+#endif // FILE_CRYPTO_KERNEL_CIPHER_H
@@ -0,0 +1,202 @@
+#include "keys.h"
+#include "fileio.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define FILE_KEY_INFO "file_crypto file key"  // контекст HKDF
+#define SLOT_KEY_INFO "file_crypto slot key"  // контекст HKDF ключа слота
+#define XTS_KEY_INFO "file_crypto xts key"    // контекст HKDF ключа образа XTS
+
+static int hexDigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+/**
+ * @brief Разбирает ключ AES-256 из RAW_KEY_HEX_LENGTH шестнадцатеричных цифр.
+ *
+ * @param[in] text Текст ключа; пробельные символы в конце допускаются.
+ * @param[in] len Длина текста.
+ * @param[out] key Буфер на AES_KEY_LENGTH байт.
+ * @return bool false, если текст не является ключом нужной длины.
+ */
+bool parseHexKey(const char *text, size_t len, unsigned char *key) {
+    while (len > 0 && isspace((unsigned char)text[len - 1])) len--;
+    if (len != RAW_KEY_HEX_LENGTH) return false;
+    for (size_t i = 0; i < AES_KEY_LENGTH; i++) {
+        int high = hexDigit(text[2 * i]), low = hexDigit(text[2 * i + 1]);
+        if (high < 0 || low < 0) {
+            OPENSSL_cleanse(key, AES_KEY_LENGTH);
+            return false;
+        }
+        key[i] = (unsigned char)(high << 4 | low);
+    }
+    return true;
+}
+/**
+ * @brief Читает ключ из дескриптора до конца данных.
+ *
+ * @param[in] fd Дескриптор файла или канала с ключом.
+ * @param[in] source Название источника для сообщений об ошибках.
+ * @param[out] key Буфер на AES_KEY_LENGTH байт.
+ *
+ * Принимаются ровно AES_KEY_LENGTH двоичных байт или ключ в
+ * шестнадцатеричном виде (как у -k), например вывод
+ * "openssl rand -hex 32".
+ */
+void readRawKey(int fd, const std::string &source, unsigned char *key) {
+    unsigned char data[RAW_KEY_MAX_INPUT + 1];
+    size_t len = readFull(fd, data, sizeof(data));
+    bool ok = false;
+    if (len == AES_KEY_LENGTH) {
+        memcpy(key, data, AES_KEY_LENGTH);
+        ok = true;
+    } else if (len <= RAW_KEY_MAX_INPUT) {
+        ok = parseHexKey((const char *)data, len, key);
+    }
+    OPENSSL_cleanse(data, sizeof(data));
+    if (!ok) {
+        throw CryptoError("Invalid key in " + source + ": expected 32 raw bytes or 64 hex digits");
+    }
+}
+/**
+ * @brief Читает ключ из файла (см. readRawKey()).
+ */
+void readRawKeyFile(const std::string &path, unsigned char *key) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw CryptoError("Cannot open key file " + path + ": " + strerror(errno));
+    ScopedFd guard(fd);
+    readRawKey(fd, path, key);
+}
+/**
+ * @brief HKDF-SHA256 с контекстом info.
+ */
+static void hkdf(const unsigned char *master, const unsigned char *salt, size_t saltLen, const char *info,
+                 unsigned char *out, size_t outLen) {
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+    size_t len = outLen;
+    bool ok = ctx && EVP_PKEY_derive_init(ctx) == 1 && EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) == 1 &&
+              EVP_PKEY_CTX_set1_hkdf_salt(ctx, salt, saltLen) == 1 &&
+              EVP_PKEY_CTX_set1_hkdf_key(ctx, master, AES_KEY_LENGTH) == 1 &&
+              EVP_PKEY_CTX_add1_hkdf_info(ctx, (const unsigned char *)info, strlen(info)) == 1 &&
+              EVP_PKEY_derive(ctx, out, &len) == 1 && len == outLen;
+    EVP_PKEY_CTX_free(ctx);
+    if (!ok) handleErrors();
+}
+/**
+ * @brief Выводит ключ отдельного файла из главного ключа (HKDF-SHA256).
+ *
+ * @param[in] master Главный ключ AES_KEY_LENGTH байт.
+ * @param[in] salt Случайная соль файла FILE_KEY_SALT_SIZE байт из заголовка.
+ * @param[out] key Ключ файла AES_KEY_LENGTH байт.
+ *
+ * Главный ключ уже случаен, поэтому растяжение не нужно: HKDF стоит
+ * микросекунды, но каждый файл шифруется своим ключом.
+ */
+void deriveFileKey(const unsigned char *master, const unsigned char *salt, unsigned char *key) {
+    hkdf(master, salt, FILE_KEY_SALT_SIZE, FILE_KEY_INFO, key, AES_KEY_LENGTH);
+}
+/**
+ * @brief Выводит пару ключей XTS-AES-256 образа из ключа файла.
+ *
+ * @param[in] fileKey Ключ файла AES_KEY_LENGTH байт.
+ * @param[in] iv IV файла из заголовка (соль HKDF).
+ * @param[out] xtsKey XTS_KEY_LENGTH байт: ключ данных, затем ключ твика.
+ *
+ * Половины выводятся одним вызовом HKDF и поэтому различны, как того
+ * требует XTS.
+ */
+void deriveXtsKey(const unsigned char *fileKey, const unsigned char *iv, unsigned char *xtsKey) {
+    hkdf(fileKey, iv, AES_BLOCK_SIZE, XTS_KEY_INFO, xtsKey, XTS_KEY_LENGTH);
+}
+/**
+ * @brief Выводит ключ обёртки слота и его контрольное значение.
+ *
+ * @param[in] recipientKey Ключ получателя AES_KEY_LENGTH байт.
+ * @param[in] salt Соль слота SLOT_SALT_SIZE байт.
+ * @param[out] wrapKey Ключ обёртки AES_KEY_LENGTH байт.
+ * @param[out] check Контрольное значение SLOT_CHECK_SIZE байт.
+ *
+ * Оба значения — части одного вывода HKDF, поэтому проверка слота стоит
+ * один вызов HKDF, а контрольное значение ничего не говорит о ключе обёртки.
+ */
+void deriveSlotKey(const unsigned char *recipientKey, const unsigned char *salt, unsigned char *wrapKey,
+                   unsigned char *check) {
+    unsigned char out[AES_KEY_LENGTH + SLOT_CHECK_SIZE];
+    hkdf(recipientKey, salt, SLOT_SALT_SIZE, SLOT_KEY_INFO, out, sizeof(out));
+    memcpy(wrapKey, out, AES_KEY_LENGTH);
+    memcpy(check, out + AES_KEY_LENGTH, SLOT_CHECK_SIZE);
+    OPENSSL_cleanse(out, sizeof(out));
+}
+/**
+ * @brief AES key wrap (RFC 3394) ключа содержимого.
+ */
+static bool keyWrap(bool wrap, const unsigned char *wrapKey, const unsigned char *in, size_t inLen,
+                    unsigned char *out) {
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) handleErrors();
+    EVP_CIPHER_CTX_set_flags(ctx, EVP_CIPHER_CTX_FLAG_WRAP_ALLOW);
+    int len = 0, final = 0;
+    bool ok = EVP_CipherInit_ex(ctx, EVP_aes_256_wrap(), nullptr, wrapKey, nullptr, wrap ? 1 : 0) == 1 &&
+              EVP_CipherUpdate(ctx, out, &len, in, inLen) == 1 && EVP_CipherFinal_ex(ctx, out + len, &final) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    return ok;
+}
+/**
+ * @brief Оборачивает ключ содержимого ключом слота.
+ *
+ * @param[in] wrapKey Ключ обёртки из deriveSlotKey().
+ * @param[in] key Ключ содержимого AES_KEY_LENGTH байт.
+ * @param[out] wrapped Буфер на WRAPPED_KEY_SIZE байт.
+ */
+void wrapContentKey(const unsigned char *wrapKey, const unsigned char *key, unsigned char *wrapped) {
+    if (!keyWrap(true, wrapKey, key, AES_KEY_LENGTH, wrapped)) handleErrors();
+}
+/**
+ * @brief Разворачивает ключ содержимого.
+ *
+ * @return bool false, если проверка целостности обёртки не прошла.
+ */
+bool unwrapContentKey(const unsigned char *wrapKey, const unsigned char *wrapped, unsigned char *key) {
+    // Запас на блок: EVP проверяет длину выхода по длине входа
+    unsigned char out[WRAPPED_KEY_SIZE];
+    bool ok = keyWrap(false, wrapKey, wrapped, WRAPPED_KEY_SIZE, out);
+    if (ok) memcpy(key, out, AES_KEY_LENGTH);
+    OPENSSL_cleanse(out, sizeof(out));
+    return ok;
+}
+/**
+ * @brief Разбирает получателя из аргумента --recipient.
+ *
+ * @param[in] spec "pass:<пароль>", "hex:<ключ>" или "keyfile:<путь>".
+ * @param[out] recipient Получатель с ключом из пула ключей.
+ */
+void parseRecipient(const std::string &spec, Recipient *recipient) {
+    size_t colon = spec.find(':');
+    std::string kind = spec.substr(0, colon == std::string::npos ? 0 : colon);
+    std::string value = colon == std::string::npos ? std::string() : spec.substr(colon + 1);
+    recipient->key = keyPool().acquire();
+    if (kind == "pass" && !value.empty()) {
+        recipient->kind = RECIPIENT_PASSWORD;
+        generateKeyFromPassword(value, recipient->key.data());
+    } else if (kind == "hex") {
+        recipient->kind = RECIPIENT_RAW_KEY;
+        if (!parseHexKey(value.data(), value.size(), recipient->key.data())) {
+            throw CryptoError("Invalid recipient key: expected 64 hex digits");
+        }
+    } else if (kind == "keyfile" && !value.empty()) {
+        recipient->kind = RECIPIENT_RAW_KEY;
+        readRawKeyFile(value, recipient->key.data());
+    } else {
+        throw CryptoError("Invalid recipient: expected pass:<password>, hex:<key> or keyfile:<path>");
+    }
+    if (!value.empty()) OPENSSL_cleanse(&value[0], value.size());
+}
@@ -0,0 +1,46 @@
+#ifndef FILE_CRYPTO_KEYS_H
+#define FILE_CRYPTO_KEYS_H
+
+#include "crypto.h"
+#include "secure_pool.h"
+
+#include <cstddef>
+#include <string>
+
+#define RAW_KEY_HEX_LENGTH (2 * AES_KEY_LENGTH)  // ключ в шестнадцатеричном виде
+#define RAW_KEY_MAX_INPUT 256                    // наибольший размер файла ключа
+#define FILE_KEY_SALT_SIZE 32                    // соль HKDF в заголовке файла
+#define SLOT_SALT_SIZE 16                        // соль ключа обёртки слота
+#define SLOT_CHECK_SIZE 8                        // контрольное значение ключа слота
+#define WRAPPED_KEY_SIZE (AES_KEY_LENGTH + 8)    // ключ после AES key wrap (RFC 3394)
+#define XTS_KEY_LENGTH (2 * AES_KEY_LENGTH)      // ключи данных и твика XTS-AES-256
+
+/**
+ * @brief Вид ключа получателя.
+ */
+enum RecipientKind {
+    RECIPIENT_PASSWORD = 1,  ///< ключ выведен из пароля PBKDF2
+    RECIPIENT_RAW_KEY = 2    ///< готовый ключ (-k, -K, --key-fd)
+};
+/**
+ * @brief Получатель файла: тот, кто сможет его расшифровать.
+ */
+struct Recipient {
+    RecipientKind kind;  ///< откуда взят ключ
+    SecureBuffer key;    ///< ключ получателя AES_KEY_LENGTH байт
+
+    Recipient() : kind(RECIPIENT_PASSWORD) {}
+};
+
+bool parseHexKey(const char *text, size_t len, unsigned char *key);
+void readRawKey(int fd, const std::string &source, unsigned char *key);
+void readRawKeyFile(const std::string &path, unsigned char *key);
+void deriveFileKey(const unsigned char *master, const unsigned char *salt, unsigned char *key);
+void deriveSlotKey(const unsigned char *recipientKey, const unsigned char *salt, unsigned char *wrapKey,
+                   unsigned char *check);
+void wrapContentKey(const unsigned char *wrapKey, const unsigned char *key, unsigned char *wrapped);
+void deriveXtsKey(const unsigned char *fileKey, const unsigned char *iv, unsigned char *xtsKey);
+bool unwrapContentKey(const unsigned char *wrapKey, const unsigned char *wrapped, unsigned char *key);
+void parseRecipient(const std::string &spec, Recipient *recipient);
+
+#endif // FILE_CRYPTO_KEYS_H
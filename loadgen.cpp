@@ -0,0 +1,248 @@
+#include "crypto.h"
+#include "fileio.h"
+#include "histogram.h"
+#include "server.h"
+
+#include <openssl/rand.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock LoadClock;
+
+/**
+ * @brief Параметры нагрузочного теста.
+ */
+struct LoadOptions {
+    std::string endpoint;
+    int connections;
+    long requests;   ///< запросов на одно соединение
+    size_t size;     ///< размер полезной нагрузки
+    int depth;       ///< запросов «в полёте» на соединение
+    bool decrypt;    ///< нагружать расшифрованием вместо шифрования
+};
+
+/**
+ * @brief Результаты одного соединения.
+ */
+struct LoadResult {
+    LatencyHistogram latency;
+    long completed;
+    long errors;
+    long mismatches;
+    std::string error;
+
+    LoadResult() : completed(0), errors(0), mismatches(0) {}
+};
+/**
+ * @brief Отправляет кадр и читает ответ на него (без конвейера).
+ */
+static std::vector<unsigned char> roundTrip(int fd, uint8_t op, const std::vector<unsigned char> &payload, uint8_t *status) {
+    ServeFrameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SERVE_MAGIC;
+    header.op = op;
+    header.length = payload.size();
+    writeAll(fd, (const unsigned char *)&header, sizeof(header));
+    writeAll(fd, payload.data(), payload.size());
+    if (readFull(fd, (unsigned char *)&header, sizeof(header)) != sizeof(header) || header.magic != SERVE_MAGIC) {
+        throw CryptoError("Malformed response");
+    }
+    std::vector<unsigned char> body(header.length);
+    if (readFull(fd, body.data(), body.size()) != body.size()) {
+        throw CryptoError("Truncated response");
+    }
+    *status = header.status;
+    return body;
+}
+/**
+ * @brief Нагрузка через одно соединение.
+ *
+ * Отправитель держит не более depth запросов без ответа; приёмник в
+ * отдельном потоке читает ответы, измеряет задержку по id запроса и,
+ * при расшифровании, сверяет результат с исходными данными.
+ */
+static void runConnection(const LoadOptions &options, const std::vector<unsigned char> &plain,
+                          const std::vector<unsigned char> &payload, LoadResult *result) {
+    int fd;
+    try {
+        fd = openEndpoint(options.endpoint, false);
+    } catch (const std::exception &e) {
+        result->error = e.what();
+        return;
+    }
+
+    std::mutex mutex;
+    std::condition_variable slot;
+    std::map<uint32_t, LoadClock::time_point> pending;
+    bool failed = false;
+
+    std::thread receiver([&]() {
+        try {
+            std::vector<unsigned char> body;
+            for (long i = 0; i < options.requests; i++) {
+                ServeFrameHeader header;
+                if (readFull(fd, (unsigned char *)&header, sizeof(header)) != sizeof(header) || header.magic != SERVE_MAGIC) {
+                    throw CryptoError("Malformed response");
+                }
+                body.resize(header.length);
+                if (readFull(fd, body.data(), body.size()) != body.size()) {
+                    throw CryptoError("Truncated response");
+                }
+                LoadClock::time_point now = LoadClock::now();
+                std::lock_guard<std::mutex> lock(mutex);
+                std::map<uint32_t, LoadClock::time_point>::iterator it = pending.find(header.id);
+                if (it != pending.end()) {
+                    result->latency.record(std::chrono::duration_cast<std::chrono::microseconds>(now - it->second).count());
+                    pending.erase(it);
+                }
+                if (header.status != 0) {
+                    result->errors++;
+                } else if (options.decrypt && body != plain) {
+                    result->mismatches++;
+                }
+                result->completed++;
+                slot.notify_one();
+            }
+        } catch (const std::exception &e) {
+            std::lock_guard<std::mutex> lock(mutex);
+            result->error = e.what();
+            failed = true;
+            slot.notify_one();
+        }
+    });
+
+    ServeFrameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SERVE_MAGIC;
+    header.op = options.decrypt ? SERVE_DECRYPT : SERVE_ENCRYPT;
+    header.length = payload.size();
+    std::vector<unsigned char> frame(sizeof(header) + payload.size());
+    try {
+        for (long i = 0; i < options.requests; i++) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while ((int)pending.size() >= options.depth && !failed) slot.wait(lock);
+                if (failed) break;
+                header.id = (uint32_t)i;
+                pending[header.id] = LoadClock::now();
+            }
+            memcpy(frame.data(), &header, sizeof(header));
+            memcpy(frame.data() + sizeof(header), payload.data(), payload.size());
+            writeAll(fd, frame.data(), frame.size());
+        }
+    } catch (const std::exception &e) {
+        std::lock_guard<std::mutex> lock(mutex);
+        result->error = e.what();
+        shutdown(fd, SHUT_RDWR);
+    }
+    receiver.join();
+    close(fd);
+}
+
+static void printUsage(const char *program) {
+    std::cout << "Usage: " << program << " --connect <endpoint> [-c connections] [-n requests] [-s size] [-q depth] [--decrypt]"
+              << std::endl;
+}
+/**
+ * @brief Нагрузочный генератор для режима --serve.
+ *
+ * Открывает несколько соединений, отправляет запросы фиксированного размера
+ * с заданной глубиной конвейера и печатает пропускную способность, перцентили
+ * задержки на стороне клиента и статистику самого сервиса.
+ */
+int main(int argc, char *argv[]) {
+    initCrypto();
+    static const option longOptions[] = {
+        {"connect", required_argument, nullptr, 'a'},
+        {"decrypt", no_argument, nullptr, 'D'},
+        {nullptr, 0, nullptr, 0}
+    };
+    LoadOptions options;
+    options.connections = 4;
+    options.requests = 10000;
+    options.size = 4096;
+    options.depth = 16;
+    options.decrypt = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "a:c:n:s:q:D", longOptions, nullptr)) != -1) {
+        switch (opt) {
+            case 'a': options.endpoint = optarg; break;
+            case 'c': options.connections = atoi(optarg); break;
+            case 'n': options.requests = atol(optarg); break;
+            case 's': options.size = strtoul(optarg, nullptr, 10); break;
+            case 'q': options.depth = atoi(optarg); break;
+            case 'D': options.decrypt = true; break;
+            default:
+                printUsage(argv[0]);
+                return 1;
+        }
+    }
+    if (options.endpoint.empty() || options.connections <= 0 || options.requests <= 0 || options.depth <= 0) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    std::vector<unsigned char> plain(options.size);
+    RAND_bytes(plain.data(), plain.size());
+    std::vector<unsigned char> payload = plain;
+
+    try {
+        if (options.decrypt) {
+            // Шифртекст для расшифрования получаем от самого сервиса
+            int fd = openEndpoint(options.endpoint, false);
+            uint8_t status;
+            payload = roundTrip(fd, SERVE_ENCRYPT, plain, &status);
+            close(fd);
+            if (status != 0) throw CryptoError("Encrypt request failed: " + std::string(payload.begin(), payload.end()));
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    std::vector<LoadResult> results(options.connections);
+    std::vector<std::thread> threads;
+    LoadClock::time_point start = LoadClock::now();
+    for (int i = 0; i < options.connections; i++) {
+        threads.push_back(std::thread(runConnection, std::cref(options), std::cref(plain), std::cref(payload), &results[i]));
+    }
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+    double seconds = std::chrono::duration<double>(LoadClock::now() - start).count();
+
+    LatencyHistogram total;
+    long completed = 0, errors = 0, mismatches = 0;
+    for (size_t i = 0; i < results.size(); i++) {
+        total.merge(results[i].latency);
+        completed += results[i].completed;
+        errors += results[i].errors;
+        mismatches += results[i].mismatches;
+        if (!results[i].error.empty()) std::cerr << "connection " << i << ": " << results[i].error << std::endl;
+    }
+
+    std::cout << "requests=" << completed << " errors=" << errors << " mismatches=" << mismatches << " seconds=" << seconds
+              << " req/s=" << (long)(completed / seconds)
+              << " MiB/s=" << (completed * (double)options.size / seconds / (1 << 20)) << std::endl;
+    std::cout << "client latency " << total.format() << std::endl;
+
+    try {
+        int fd = openEndpoint(options.endpoint, false);
+        uint8_t status;
+        std::vector<unsigned char> stats = roundTrip(fd, SERVE_STATS, std::vector<unsigned char>(), &status);
+        close(fd);
+        std::cout << "server " << std::string(stats.begin(), stats.end());
+    } catch (const std::exception &e) {
+        std::cerr << "Cannot fetch server stats: " << e.what() << std::endl;
+    }
+    return errors == 0 && mismatches == 0 && completed == options.connections * options.requests ? 0 : 1;
+}
@@ -0,0 +1,179 @@
+#include "log.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <pthread.h>
+#include <unistd.h>
+
+std::atomic<int> logThreshold(LOG_LEVEL_WARN);
+
+/**
+ * @brief Ячейка кольцевого буфера сообщений.
+ *
+ * seq — номер позиции, для которой ячейка свободна (seq == pos) или
+ * заполнена (seq == pos + 1); так писатели и читатель обходятся без блокировок.
+ */
+struct LogSlot {
+    std::atomic<size_t> seq;
+    LogLevel level;
+    size_t len;
+    char text[LOG_LINE_MAX];
+};
+
+/**
+ * @brief Общий буфер сообщений всех потоков.
+ *
+ * Писатель занимает ячейку одним compare_exchange и никогда не ждёт: если
+ * буфер полон, сообщение отбрасывается и учитывается в счётчике потерь.
+ * Фоновый поток раз в LOG_FLUSH_INTERVAL_MS забирает накопленные сообщения
+ * и выводит их в stderr одним write(). Поток запускается при первом
+ * сообщении, поэтому без вывода журнала он не создаётся вовсе.
+ */
+class LogSink {
+public:
+    LogSink() : head_(0), tail_(0), dropped_(0), running_(false) {
+        for (size_t i = 0; i < LOG_RING_SLOTS; i++) slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    void push(LogLevel level, const std::string &message);
+    void drain();
+    void forked();
+    std::mutex &drainMutex() { return drainMutex_; }
+
+private:
+    void start();
+    void flusher();
+
+    LogSlot slots_[LOG_RING_SLOTS];
+    std::atomic<size_t> head_;     ///< следующая позиция для писателей
+    size_t tail_;                  ///< следующая позиция для чтения; под drainMutex_
+    std::atomic<uint64_t> dropped_;
+    std::atomic<bool> running_;
+    std::mutex drainMutex_;        ///< только между читателями: фоновым потоком и logFlush()
+};
+
+static std::atomic<bool> logSinkCreated(false);
+
+/**
+ * @brief Буфер живёт до конца процесса: фоновый поток не останавливается,
+ * а остаток сообщений выводит обработчик atexit().
+ */
+static LogSink &logSink() {
+    static LogSink *sink = [] {
+        LogSink *created = new LogSink();
+        logSinkCreated.store(true, std::memory_order_release);
+        // fork() в момент сброса оставил бы мьютекс занятым в дочернем процессе
+        pthread_atfork([] { logSink().drainMutex().lock(); }, [] { logSink().drainMutex().unlock(); },
+                       [] {
+                           logSink().drainMutex().unlock();
+                           logSink().forked();
+                       });
+        atexit(logFlush);
+        return created;
+    }();
+    return *sink;
+}
+
+void LogSink::push(LogLevel level, const std::string &message) {
+    if (!running_.load(std::memory_order_acquire)) start();
+    size_t pos = head_.load(std::memory_order_relaxed);
+    LogSlot *slot;
+    for (;;) {
+        slot = &slots_[pos & (LOG_RING_SLOTS - 1)];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = head_.load(std::memory_order_relaxed);
+        }
+    }
+    slot->level = level;
+    slot->len = message.size() < LOG_LINE_MAX ? message.size() : LOG_LINE_MAX;
+    memcpy(slot->text, message.data(), slot->len);
+    slot->seq.store(pos + 1, std::memory_order_release);
+}
+/**
+ * @brief Выводит все готовые сообщения одним вызовом write().
+ */
+void LogSink::drain() {
+    static const char *prefixes[] = {"Error: ", "Warning: ", "", "Debug: "};
+    std::lock_guard<std::mutex> lock(drainMutex_);
+    std::string out;
+    for (;;) {
+        LogSlot &slot = slots_[tail_ & (LOG_RING_SLOTS - 1)];
+        if (slot.seq.load(std::memory_order_acquire) != tail_ + 1) break;
+        out += prefixes[slot.level];
+        out.append(slot.text, slot.len);
+        out += '\n';
+        slot.seq.store(tail_ + LOG_RING_SLOTS, std::memory_order_release);
+        tail_++;
+    }
+    uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+    if (dropped) out += "Warning: " + std::to_string(dropped) + " log messages dropped\n";
+    const char *data = out.data();
+    size_t len = out.size();
+    while (len > 0) {
+        ssize_t n = write(STDERR_FILENO, data, len);
+        if (n <= 0) break;
+        data += n;
+        len -= n;
+    }
+}
+/**
+ * @brief В дочернем процессе фонового потока нет; он запустится заново при следующем сообщении.
+ */
+void LogSink::forked() {
+    running_.store(false, std::memory_order_relaxed);
+}
+
+void LogSink::start() {
+    bool expected = false;
+    if (!running_.compare_exchange_strong(expected, true, std::memory_order_acq_rel)) return;
+    std::thread(&LogSink::flusher, this).detach();
+}
+
+void LogSink::flusher() {
+    for (;;) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+        drain();
+    }
+}
+/**
+ * @brief Задаёт порог: выводятся сообщения с уровнем не выше level.
+ */
+void setLogLevel(LogLevel level) {
+    logThreshold.store(level, std::memory_order_relaxed);
+}
+/**
+ * @brief Ставит сообщение в буфер; не ждёт ни вывода, ни других потоков.
+ */
+void logWrite(LogLevel level, const std::string &message) {
+    logSink().push(level, message);
+}
+/**
+ * @brief Сразу выводит накопленные сообщения (перед выходом или сообщением об ошибке).
+ */
+void logFlush() {
+    if (logSinkCreated.load(std::memory_order_acquire)) logSink().drain();
+}
+/**
+ * @brief Байты в шестнадцатеричном виде через пробел.
+ */
+std::string hexBytes(const unsigned char *data, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    std::string text;
+    for (size_t i = 0; i < len; i++) {
+        if (i) text += ' ';
+        text += digits[data[i] >> 4];
+        text += digits[data[i] & 0xf];
+    }
+    return text;
+}
@@ -0,0 +1,49 @@
+#ifndef FILE_CRYPTO_LOG_H
+#define FILE_CRYPTO_LOG_H
+
+#include <atomic>
+#include <cstddef>
+#include <sstream>
+#include <string>
+
+#define LOG_RING_SLOTS 1024        // сообщений в буфере до сброса (степень двойки)
+#define LOG_LINE_MAX 512           // наибольшая длина сообщения, остаток отбрасывается
+#define LOG_FLUSH_INTERVAL_MS 100  // период сброса буфера фоновым потоком
+
+/**
+ * @brief Уровень важности сообщения.
+ */
+enum LogLevel {
+    LOG_LEVEL_ERROR = 0,
+    LOG_LEVEL_WARN = 1,   ///< порог по умолчанию
+    LOG_LEVEL_INFO = 2,   ///< -v
+    LOG_LEVEL_DEBUG = 3   ///< -vv
+};
+
+extern std::atomic<int> logThreshold;
+
+/**
+ * @brief Будет ли выведено сообщение уровня level; проверка без блокировок.
+ */
+inline bool logEnabled(LogLevel level) { return level <= logThreshold.load(std::memory_order_relaxed); }
+
+void setLogLevel(LogLevel level);
+void logWrite(LogLevel level, const std::string &message);
+void logFlush();
+std::string hexBytes(const unsigned char *data, size_t len);
+
+/**
+ * @brief Пишет сообщение, если уровень включён; иначе выражение не вычисляется.
+ *
+ * Пример: LOG(LOG_LEVEL_DEBUG, "chunk " << seq << " done");
+ */
+#define LOG(level, message)                              \
+    do {                                                 \
+        if (logEnabled(level)) {                         \
+            std::ostringstream logStream_;               \
+            logStream_ << message;                       \
+            logWrite(level, logStream_.str());           \
+        }                                                \
+    } while (0)
+
+#endif // FILE_CRYPTO_LOG_H
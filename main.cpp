@@ -1,190 +1,463 @@
-#include <openssl/conf.h>
-#include <openssl/evp.h>
-#include <openssl/err.h>
+#include "agent.h"
+#include "crypto.h"
+#include "digest.h"
+#include "file_header.h"
+#include "follow.h"
+#include "fileio.h"
+#include "kernel_cipher.h"
+#include "keys.h"
+#include "log.h"
+#include "memory_budget.h"
+#include "output_file.h"
+#include "pipeline.h"
+#include "progress.h"
+#include "secure_pool.h"
+#include "server.h"
+#include "sparse.h"
+#include "stripe.h"
+#include "throttle.h"
+#include "volume.h"
+#include "xts.h"
+#include "watch.h"
+
+#include <openssl/crypto.h>
 #include <openssl/rand.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
-#include <fstream>
-#include <vector>
-#include <unistd.h>  // для getopt()
-
-#define AES_KEY_LENGTH 32  // для AES-256
-#define AES_BLOCK_SIZE 16  // размер блока AES
+#include <memory>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <getopt.h>  // для getopt_long()
+#include <unistd.h>
 
 /**
- * @brief Обрабатывает ошибки OpenSSL и завершает программу.
+ * @brief Выводит сообщение об использовании программы.
+ * 
+ * @param[in] program Имя программы (argv[0]).
  * 
- * Выводит сообщения об ошибках, используя библиотеку OpenSSL, и завершает выполнение программы.
+ * Функция выводит инструкции по использованию программы, включая доступные опции.
  */
-void handleErrors() {
-    ERR_print_errors_fp(stderr);
-    abort();
+void printUsage(const char *program) {
+    std::cout << "Usage: " << program << " [-e | -d] -i <inputfile> -o <outputfile>"
+              << " (-p <password> | -k <hexkey> | -K <keyfile> | --key-fd <n>) [-v[v]] [--agent-socket <path>]"
+              << " [--recipient pass:<password>|hex:<key>|keyfile:<path>]..."
+              << " [--sparse | --volume-size <size>] [--hugepages] [--max-memory <size>] [--workers <n>]" << std::endl;
+    std::cout << "       [--stripe <dir>,<dir>,... [--stripe-unit <size>]]" << std::endl;
+    std::cout << "       [--fsync none|batch|always] [--fsync-batch <files>] [--write-behind <size>]" << std::endl;
+    std::cout << "       [--cache normal|dontneed|direct] [--backend evp|kernel]" << std::endl;
+    std::cout << "       [--digest plain|cipher|both] [--digest-file <file>] [--numa]" << std::endl;
+    std::cout << "       [--progress[=bar|lines]] [--progress-interval <seconds>]" << std::endl;
+    std::cout << "       [--rate <size>/s] [--iops <n>] [--throttle-control <path>] [--max-workers <n>]" << std::endl;
+    std::cout << "       [--nice <n>] [--ioprio idle|be[:0-7]|rt[:0-7]]" << std::endl;
+    std::cout << "       " << program << " -i <file> (-p | -k | -K | --key-fd) (--add-recipient | --remove-recipient)"
+              << " pass:<password>|hex:<key>|keyfile:<path>" << std::endl;
+    std::cout << "       " << program << " -e --xts [--sector-size <size>] -i <image> -o <outputfile> ..." << std::endl;
+    std::cout << "       " << program << " --patch <xtsimage> --patch-offset <n> -i <datafile>"
+              << " (-p <password> | -k | -K | --key-fd)" << std::endl;
+    std::cout << "       " << program << " --agent --agent-socket <path> [--ttl <seconds>] [--foreground]" << std::endl;
+    std::cout << "       " << program << " -e --follow -i <growingfile> -o <outputfile> (-p <password> | -k | -K | --key-fd)"
+              << " [--segment-size <size>] [--flush-interval <seconds>]" << std::endl;
+    std::cout << "       " << program << " --watch <spooldir> -o <outputdir> (-p <password> | -k | -K | --key-fd)"
+              << " [--workers <n>] [--batch <n>] [--fsync batch|always]" << std::endl;
+    std::cout << "       " << program << " --serve <unix:path | tcp:127.0.0.1:port> (-p <password> | -k | -K | --key-fd)"
+              << " [--workers <n>]"
+              << " [--queue-depth <n>] [--batch <n>]" << std::endl;
 }
 /**
- * @brief Генерация ключа из пароля с использованием PBKDF2.
- * 
- * @param[in] password Пароль, из которого будет генерироваться ключ.
- * @param[out] key Массив байтов для сохранения сгенерированного ключа.
- * 
- * Функция использует алгоритм PBKDF2 с хэш-функцией SHA-1 для генерации ключа длиной AES_KEY_LENGTH байт.
+ * @brief Ожидаемый размер результата для предварительного выделения места.
+ *
+ * Считается от текущей позиции входа: при расшифровании заголовок к этому
+ * моменту уже прочитан. При шифровании к результату добавляется заголовок
+ * длиной headerSize.
  */
-void generateKeyFromPassword(const std::string &password, unsigned char *key) {
-    const unsigned char *salt = (unsigned char *)"12345678"; // Соль для PBKDF2
-    if (PKCS5_PBKDF2_HMAC_SHA1(password.c_str(), password.size(), salt, 8, 10000, AES_KEY_LENGTH, key) != 1) {
-        handleErrors();
-    }
+static uint64_t expectedOutputSize(CryptoOp op, int inFd, size_t headerSize = FILE_HEADER_SIZE) {
+    struct stat st;
+    if (fstat(inFd, &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+    off_t pos = lseek(inFd, 0, SEEK_CUR);
+    if (pos < 0 || pos > st.st_size) return 0;
+    uint64_t size = st.st_size - pos;
+    if (op == OP_ENCRYPT) return headerSize + AES_BLOCK_SIZE + (size / AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE;
+    return size > 2 * AES_BLOCK_SIZE ? size - AES_BLOCK_SIZE : 0;
 }
 /**
- * @brief Чтение содержимого файла в вектор байтов.
- * 
- * @param[in] filename Имя файла для чтения.
- * @return std::vector<unsigned char> Вектор байтов, содержащий данные файла.
- * 
- * Функция открывает файл в бинарном режиме и считывает его содержимое в вектор байтов.
+ * @brief Параметры обработки файла.
+ */
+struct LocalOptions {
+    PipelineOptions pipeline;  ///< параметры конвейера шифрования
+    CryptoBackend backend;     ///< BACKEND_KERNEL — для обычных файлов при доступном AF_ALG
+    int digest;                ///< сочетание DigestTarget
+    std::string digestFile;    ///< файл контрольных сумм; пусто — <результат>.sha256
+    ProgressMode progress;     ///< вывод хода выполнения
+    double progressInterval;   ///< секунд между строками хода выполнения
+    bool perFileKey;           ///< шифровать ключом файла, выведенным HKDF из заданного
+    std::vector<Recipient> recipients;  ///< получатели; непустой список — заголовок со слотами
+    bool sparse;               ///< шифровать только участки с данными (sparse.h)
+    size_t volumeSize;         ///< при шифровании — разбить на тома не больше этого размера (volume.h)
+    std::vector<std::string> stripeDirs;  ///< каталоги полос; непустой список — чередование (stripe.h)
+    size_t stripeUnit;         ///< открытого текста в единице чередования
+    size_t xtsSector;          ///< при шифровании — образ XTS с таким сектором (xts.h); 0 — CBC
+
+    LocalOptions() : backend(BACKEND_EVP), digest(DIGEST_NONE), progress(PROGRESS_OFF),
+                     progressInterval(PROGRESS_DEFAULT_INTERVAL), perFileKey(false), sparse(false), volumeSize(0),
+                     stripeUnit(STRIPE_DEFAULT_UNIT), xtsSector(0) {}
+};
+/**
+ * @brief Источник готового ключа вместо пароля.
  */
-std::vector<unsigned char> readFile(const std::string &filename) {
-    std::ifstream file(filename, std::ios::binary);
-    if (!file.is_open()) {
-        std::cerr << "Cannot open file: " << filename << std::endl;
-        exit(1);
+struct RawKeySource {
+    std::string hex;   ///< -k: ключ в шестнадцатеричном виде
+    std::string file;  ///< -K: файл с ключом
+    int fd;            ///< --key-fd: дескриптор с ключом; -1 — не задан
+
+    RawKeySource() : fd(-1) {}
+    ~RawKeySource() {
+        if (!hex.empty()) OPENSSL_cleanse(&hex[0], hex.size());
     }
-    return std::vector<unsigned char>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-}
+    int count() const { return !hex.empty() + !file.empty() + (fd >= 0); }
+};
 /**
- * @brief Запись данных в файл.
- * 
- * @param[in] filename Имя файла для записи.
- * @param[in] data Вектор байтов, содержащий данные для записи.
- * 
- * Функция открывает файл в бинарном режиме и записывает данные из вектора байтов в файл.
+ * @brief Получает ключ AES-256 из пароля (PBKDF2) или из заданного источника.
+ *
+ * Готовый ключ уже случаен и в PBKDF2 не нуждается, поэтому загружается как есть.
  */
-void writeFile(const std::string &filename, const std::vector<unsigned char> &data) {
-    std::ofstream file(filename, std::ios::binary);
-    if (!file.is_open()) {
-        std::cerr << "Cannot open file: " << filename << std::endl;
-        exit(1);
+static void loadKey(const std::string &password, const RawKeySource &raw, unsigned char *key) {
+    if (!raw.hex.empty()) {
+        if (!parseHexKey(raw.hex.data(), raw.hex.size(), key)) {
+            throw CryptoError("Invalid key: expected 64 hex digits");
+        }
+    } else if (!raw.file.empty()) {
+        readRawKeyFile(raw.file, key);
+    } else if (raw.fd >= 0) {
+        readRawKey(raw.fd, "descriptor " + std::to_string(raw.fd), key);
+    } else {
+        generateKeyFromPassword(password, key);
     }
-    file.write((char*)data.data(), data.size());
 }
 /**
- * @brief Шифрование данных с использованием AES-256 CBC и записью IV в начало файла.
+ * @brief Выполняет операцию через агент ключей, если он запущен.
  * 
- * @param[in] plaintext Вектор байтов, содержащий исходные данные (plaintext).
- * @param[in] key Массив байтов, содержащий ключ для шифрования.
- * @param[in] iv Массив байтов, содержащий вектор инициализации (IV).
- * @return std::vector<unsigned char> Вектор байтов, содержащий зашифрованные данные с добавленным в начало IV.
+ * @param[in] socketPath Путь к сокету агента.
+ * @param[in] op Шифрование или расшифрование.
+ * @param[in] inputFile Имя входного файла.
+ * @param[in] outputFile Имя выходного файла.
+ * @param[in] password Пароль.
+ * @param[in] options Параметры обработки; используется только вывод хода выполнения.
+ * @param[in] group Группа, выполняющая fsync и переименование результата.
+ * @return bool true, если операция выполнена агентом; false, если агент недоступен.
  * 
- * Функция шифрует данные с использованием AES-256 в режиме CBC, добавляет IV в начало зашифрованного текста
- * и возвращает результат.
+ * Клиент сам открывает файлы и передаёт агенту только дескрипторы, поэтому агент
+ * работает с правами и путями вызывающего процесса. Агент пишет во временный
+ * файл, который клиент переименовывает после успешного ответа. Ход выполнения
+ * оценивается по размеру этого файла.
  */
-std::vector<unsigned char> encryptDataWithIV(const std::vector<unsigned char> &plaintext, unsigned char *key, unsigned char *iv) {
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    if (!ctx) handleErrors();
-
-    if (1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr, key, iv)) {
-        handleErrors();
+bool processWithAgent(const std::string &socketPath, CryptoOp op, const std::string &inputFile,
+                      const std::string &outputFile, const std::string &password, const LocalOptions &options,
+                      DurabilityGroup &group) {
+    ScopedFd in(openInputFile(inputFile));
+    AtomicOutputFile out(outputFile, group);
+    int outFd = out.fd();
+    ProgressReporter progress(options.progress, expectedOutputSize(op, in.get()), options.progressInterval, [outFd] {
+        struct stat st;
+        return fstat(outFd, &st) == 0 ? (uint64_t)st.st_size : 0;
+    });
+    if (!agentProcess(socketPath, op, password, in.get(), outFd)) {
+        return false;
     }
-
-    std::vector<unsigned char> ciphertext(plaintext.size() + AES_BLOCK_SIZE);
-    int len;
-    int ciphertext_len = 0;
-
-    if (1 != EVP_EncryptUpdate(ctx, ciphertext.data(), &len, plaintext.data(), plaintext.size())) {
-        handleErrors();
+    progress.finish();
+    out.commit();
+    return true;
+}
+/**
+ * @brief Шифрует файл в тома или собирает его из томов (volume.h).
+ *
+ * Тома обрабатываются параллельно, поэтому из обработчиков конвейера
+ * остаётся только потокобезопасный подсчёт хода выполнения.
+ */
+static void processVolumes(CryptoOp op, const std::string &inputFile, const std::string &outputFile,
+                           const unsigned char *key, const LocalOptions &options, DurabilityGroup &group) {
+    if (options.digest != DIGEST_NONE) throw CryptoError("Checksums are not supported for volumes");
+    VolumeOptions volumeOptions;
+    volumeOptions.volumeSize = options.volumeSize;
+    volumeOptions.workers = options.pipeline.workers;
+    volumeOptions.perFileKey = options.perFileKey;
+    volumeOptions.pipeline = options.pipeline;
+    if (op == OP_ENCRYPT) {
+        struct stat st;
+        uint64_t total = stat(inputFile.c_str(), &st) == 0 ? (uint64_t)st.st_size : 0;
+        ProgressReporter progress(options.progress, total, options.progressInterval);
+        volumeOptions.pipeline.onOutput = [&progress](const unsigned char *, size_t len) { progress.add(len); };
+        encryptVolumes(inputFile, outputFile, key, volumeOptions, group);
+        progress.finish();
+        return;
     }
-    ciphertext_len = len;
-
-    if (1 != EVP_EncryptFinal_ex(ctx, ciphertext.data() + len, &len)) {
-        handleErrors();
+    VolumeManifest manifest = readVolumeManifest(inputFile);
+    AtomicOutputFile out(outputFile, group);
+    out.preallocate(manifest.size);
+    ProgressReporter progress(options.progress, manifest.size, options.progressInterval);
+    volumeOptions.pipeline.onOutput = [&progress](const unsigned char *, size_t len) { progress.add(len); };
+    decryptVolumes(manifest, out.fd(), key, volumeOptions);
+    progress.finish();
+    out.commit();
+}
+/**
+ * @brief Шифрует файл полосами по нескольким каталогам или собирает его из полос (stripe.h).
+ *
+ * @param[in] inputFile При шифровании — исходный файл, при расшифровании —
+ *            имя полосы в каждом каталоге.
+ * @param[in] outputFile При шифровании — имя полосы, при расшифровании — результат.
+ */
+static void processStriped(CryptoOp op, const std::string &inputFile, const std::string &outputFile,
+                           const unsigned char *key, const LocalOptions &options, DurabilityGroup &group) {
+    if (options.digest != DIGEST_NONE) throw CryptoError("Checksums are not supported for striped files");
+    StripeOptions stripeOptions;
+    stripeOptions.dirs = options.stripeDirs;
+    stripeOptions.unitSize = options.stripeUnit;
+    stripeOptions.perFileKey = options.perFileKey;
+    stripeOptions.pipeline = options.pipeline;
+    struct stat st;
+    uint64_t total = op == OP_ENCRYPT && stat(inputFile.c_str(), &st) == 0 ? (uint64_t)st.st_size : 0;
+    ProgressReporter progress(options.progress, total, options.progressInterval);
+    stripeOptions.pipeline.onOutput = [&progress](const unsigned char *, size_t len) { progress.add(len); };
+    if (op == OP_ENCRYPT) {
+        encryptStriped(inputFile, outputFile, key, stripeOptions, group);
+    } else {
+        AtomicOutputFile out(outputFile, group);
+        decryptStriped(inputFile, out.fd(), key, stripeOptions);
+        out.commit();
     }
-    ciphertext_len += len;
-
-    ciphertext.resize(ciphertext_len);
-
-    EVP_CIPHER_CTX_free(ctx);
-
-    // Добавляем IV в начало шифрованных данных
-    std::vector<unsigned char> result(AES_BLOCK_SIZE + ciphertext.size());
-    std::copy(iv, iv + AES_BLOCK_SIZE, result.begin());
-    std::copy(ciphertext.begin(), ciphertext.end(), result.begin() + AES_BLOCK_SIZE);
-
-    return result;
+    progress.finish();
 }
 /**
- * @brief Расшифрование данных с использованием AES-256 CBC и извлечением IV из начала файла.
+ * @brief Шифрует или расшифровывает файл в текущем процессе.
  * 
- * @param[in] ciphertext Вектор байтов, содержащий зашифрованные данные с IV в начале.
- * @param[in] key Массив байтов, содержащий ключ для расшифрования.
- * @return std::vector<unsigned char> Вектор байтов, содержащий расшифрованные данные (plaintext).
+ * @param[in] op Шифрование или расшифрование.
+ * @param[in] inputFile Имя входного файла.
+ * @param[in] outputFile Имя выходного файла.
+ * @param[in] key Ключ AES-256 (главный, если options.perFileKey; при шифровании
+ *                для options.recipients не используется).
+ * @param[in] options Параметры обработки.
+ * @param[in] group Группа, выполняющая fsync и переименование результата.
  * 
- * Функция извлекает IV из первых AES_BLOCK_SIZE байт зашифрованного текста, а затем использует его для 
- * расшифрования оставшейся части данных.
+ * Данные проходят через конвейер порциями из заблокированного пула, размер
+ * которого ограничен бюджетом памяти, поэтому ни открытый текст, ни шифртекст
+ * целиком в памяти не держатся. Результат пишется во временный файл и заменяет
+ * итоговый только после успешного завершения. При расшифровании ключ
+ * сверяется с контрольным значением в заголовке файла ещё до создания
+ * результата, поэтому неверный пароль отклоняется сразу.
+ * 
+ * Контрольные суммы SHA-256 считаются в том же проходе: входные данные —
+ * потоком чтения, результат — потоком записи, пока данные ещё в кэше.
+ * Они записываются в файл формата sha256sum рядом с результатом.
  */
-std::vector<unsigned char> decryptDataWithIV(const std::vector<unsigned char> &ciphertext, unsigned char *key) {
-    unsigned char iv[AES_BLOCK_SIZE];
-    std::copy(ciphertext.begin(), ciphertext.begin() + AES_BLOCK_SIZE, iv);
-    
-    std::cout << "Extracted IV: ";
-    for (int i = 0; i < AES_BLOCK_SIZE; i++) {
-        std::cout << std::hex << (int)iv[i] << " ";
+void processLocally(CryptoOp op, const std::string &inputFile, const std::string &outputFile, const unsigned char *key,
+                    const LocalOptions &options, DurabilityGroup &group) {
+    if (!options.stripeDirs.empty()) {
+        processStriped(op, inputFile, outputFile, key, options, group);
+        return;
     }
-    std::cout << std::dec << std::endl;  // Возврат к десятичному
-
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    if (!ctx) handleErrors();
-
-    if (1 != EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr, key, iv)) {
-        handleErrors();
+    if ((op == OP_ENCRYPT && options.volumeSize) || (op == OP_DECRYPT && isVolumeManifest(inputFile))) {
+        processVolumes(op, inputFile, outputFile, key, options, group);
+        return;
+    }
+    ScopedFd in(openInputFile(inputFile));
+    FileHeader header;
+    SecureBuffer fileKey = keyPool().acquire();
+    if (op == OP_DECRYPT) readFileHeader(in.get(), key, &header, fileKey.data());
+    AtomicOutputFile out(outputFile, group);
+    size_t headerSize = !options.recipients.empty() ? FILE_HEADER_SLOTS_SIZE
+                        : options.perFileKey        ? FILE_HEADER_HKDF_SIZE
+                                                    : FILE_HEADER_SIZE;
+    uint64_t expected = expectedOutputSize(op, in.get(), headerSize);
+    // Карта нужна до записи заголовка: по ней считается размер результата
+    SparseMap sparseMap;
+    bool sparse = op == OP_ENCRYPT ? options.sparse : (header.flags() & FILE_HEADER_FLAG_SPARSE) != 0;
+    if (sparse && op == OP_ENCRYPT) {
+        sparseMap = findExtents(in.get());
+        expected = headerSize + sparseCipherSize(sparseMap);
     }
+    if (options.xtsSector && op == OP_ENCRYPT) expected = XTS_DATA_OFFSET + (expected - headerSize - AES_BLOCK_SIZE);
+    // Место под разреженный результат не выделяется: на месте дыр оно было бы лишним
+    if (!sparse) out.preallocate(expected);
+    ProgressReporter progress(options.progress, expected, options.progressInterval);
 
-    std::vector<unsigned char> plaintext(ciphertext.size() - AES_BLOCK_SIZE);
-    int len;
-    int plaintext_len = 0;
+    // Открытый текст — вход при шифровании и результат при расшифровании
+    StreamDigest plainDigest, cipherDigest;
+    StreamDigest &inputDigest = op == OP_ENCRYPT ? plainDigest : cipherDigest;
+    StreamDigest &outputDigest = op == OP_ENCRYPT ? cipherDigest : plainDigest;
+    int inputTarget = op == OP_ENCRYPT ? DIGEST_PLAIN : DIGEST_CIPHER;
+    int outputTarget = op == OP_ENCRYPT ? DIGEST_CIPHER : DIGEST_PLAIN;
+    bool hashInput = (options.digest & inputTarget) != 0;
+    bool hashOutput = (options.digest & outputTarget) != 0;
 
-    if (1 != EVP_DecryptUpdate(ctx, plaintext.data(), &len, ciphertext.data() + AES_BLOCK_SIZE, ciphertext.size() - AES_BLOCK_SIZE)) {
-        handleErrors();
+    PipelineOptions pipelineOptions = options.pipeline;
+    if (hashInput) {
+        inputDigest.update(header.bytes, header.size);
+        pipelineOptions.onInput = [&inputDigest](const unsigned char *data, size_t len) { inputDigest.update(data, len); };
     }
-    plaintext_len = len;
+    pipelineOptions.onOutput = [&out, &outputDigest, hashOutput, &progress](const unsigned char *data, size_t len) {
+        if (hashOutput) outputDigest.update(data, len);
+        progress.add(len);
+        out.wrote();
+    };
+    CryptoBackend backend = options.backend;
 
-    if (1 != EVP_DecryptFinal_ex(ctx, plaintext.data() + len, &len)) {
-        handleErrors();
-    }
-    plaintext_len += len;
+    unsigned char iv[AES_BLOCK_SIZE];
+    if (op == OP_ENCRYPT) {
+        // Генерация случайного IV
+        if (!RAND_bytes(iv, AES_BLOCK_SIZE)) {
+            handleErrors();
+        }
+        LOG(LOG_LEVEL_DEBUG, "Generated IV: " << hexBytes(iv, AES_BLOCK_SIZE));
 
-    plaintext.resize(plaintext_len);
+        // Заголовок с контрольным значением ключа, затем IV и шифртекст
+        unsigned char layout = sparse ? FILE_HEADER_FLAG_SPARSE : options.xtsSector ? FILE_HEADER_FLAG_XTS : 0;
+        std::vector<unsigned char> layoutInfo;
+        if (options.xtsSector) layoutInfo = xtsLayoutInfo(options.xtsSector, headerSize);
+        if (!options.recipients.empty()) {
+            writeFileHeader(out.fd(), options.recipients, iv, pipelineOptions, fileKey.data(), layout);
+        } else {
+            writeFileHeader(out.fd(), key, iv, pipelineOptions, options.perFileKey, fileKey.data(), layout,
+                            layoutInfo.data(), layoutInfo.size());
+        }
+        if (options.xtsSector) {
+            encryptXts(in.get(), out.fd(), fileKey.data(), iv, options.xtsSector, pipelineOptions);
+        } else if (sparse) {
+            encryptSparse(in.get(), out.fd(), fileKey.data(), iv, sparseMap, pipelineOptions);
+        } else if (!(backend == BACKEND_KERNEL && kernelEncryptFile(in.get(), out.fd(), fileKey.data(), iv, pipelineOptions))) {
+            encryptPipeline(in.get(), out.fd(), fileKey.data(), iv, pipelineOptions);
+        }
+    } else {
+        if (header.size) {
+            LOG(LOG_LEVEL_DEBUG, "File header version " << (int)header.bytes[4] << ", key check passed");
+        } else {
+            LOG(LOG_LEVEL_DEBUG, "Legacy file without header: the key is checked only by padding");
+        }
 
-    EVP_CIPHER_CTX_free(ctx);
+        // Расшифрование данных с использованием IV из файла
+        if (header.flags() & FILE_HEADER_FLAG_STRIPED) {
+            throw CryptoError(inputFile + " is one stripe of a striped file; decrypt it with --stripe");
+        } else if (header.flags() & FILE_HEADER_FLAG_XTS) {
+            decryptXts(in.get(), out.fd(), fileKey.data(), header, pipelineOptions);
+        } else if (header.flags() & FILE_HEADER_FLAG_SEGMENTED) {
+            decryptSegments(in.get(), out.fd(), fileKey.data(), pipelineOptions, header.prefix);
+        } else if (sparse) {
+            decryptSparse(in.get(), out.fd(), fileKey.data(), pipelineOptions, header.prefix);
+        } else if (!(backend == BACKEND_KERNEL && header.prefix.empty() &&
+              kernelDecryptFile(in.get(), out.fd(), fileKey.data(), pipelineOptions))) {
+            decryptPipeline(in.get(), out.fd(), fileKey.data(), pipelineOptions, header.prefix);
+        }
+    }
+    progress.finish();
+    out.commit();
 
-    return plaintext;
-}
-/**
- * @brief Выводит сообщение об использовании программы.
- * 
- * @param[in] program Имя программы (argv[0]).
- * 
- * Функция выводит инструкции по использованию программы, включая доступные опции.
- */
-void printUsage(const char *program) {
-    std::cout << "Usage: " << program << " [-e | -d] -i <inputfile> -o <outputfile> -p <password>" << std::endl;
+    if (options.digest != DIGEST_NONE) {
+        std::string lines;
+        if (hashInput) lines += digestLine(inputDigest.hex(), inputFile);
+        if (hashOutput) lines += digestLine(outputDigest.hex(), outputFile);
+        AtomicOutputFile sidecar(options.digestFile.empty() ? outputFile + ".sha256" : options.digestFile, group);
+        writeAll(sidecar.fd(), (const unsigned char *)lines.data(), lines.size());
+        sidecar.commit();
+    }
 }
 /**
  * @brief Точка входа в программу.
  * 
  * Основная функция программы, которая обрабатывает аргументы командной строки,
- * генерирует ключ на основе пароля, читает данные из файла, выполняет шифрование
- * или расшифрование и сохраняет результат в файл.
+ * генерирует ключ на основе пароля, потоком читает данные из файла, выполняет шифрование
+ * или расшифрование и сохраняет результат в файл. Если задан сокет агента ключей
+ * и агент отвечает, операция передаётся ему и PBKDF2 не выполняется.
  * 
  * @param argc Количество аргументов командной строки.
  * @param argv Массив аргументов командной строки.
  * @return int Возвращает 0 при успешном выполнении программы, иначе 1.
  */
 int main(int argc, char *argv[]) {
+    initCrypto();
+    enum { OPT_AGENT = 256, OPT_AGENT_SOCKET, OPT_TTL, OPT_FOREGROUND, OPT_SERVE, OPT_WATCH, OPT_FOLLOW, OPT_SEGMENT_SIZE, OPT_FLUSH_INTERVAL, OPT_WORKERS, OPT_QUEUE_DEPTH, OPT_BATCH, OPT_HUGEPAGES, OPT_MAX_MEMORY,
+           OPT_FSYNC, OPT_FSYNC_BATCH, OPT_WRITE_BEHIND, OPT_CACHE, OPT_BACKEND,
+           OPT_DIGEST, OPT_DIGEST_FILE, OPT_NUMA, OPT_SPARSE, OPT_VOLUME_SIZE, OPT_STRIPE, OPT_STRIPE_UNIT, OPT_XTS, OPT_SECTOR_SIZE, OPT_PATCH, OPT_PATCH_OFFSET,
+           OPT_PROGRESS, OPT_PROGRESS_INTERVAL,
+           OPT_KEY_FD, OPT_RECIPIENT, OPT_ADD_RECIPIENT, OPT_REMOVE_RECIPIENT, OPT_RATE, OPT_IOPS, OPT_THROTTLE_CONTROL, OPT_MAX_WORKERS, OPT_NICE, OPT_IOPRIO };
+    static const option longOptions[] = {
+        {"agent", no_argument, nullptr, OPT_AGENT},
+        {"agent-socket", required_argument, nullptr, OPT_AGENT_SOCKET},
+        {"ttl", required_argument, nullptr, OPT_TTL},
+        {"foreground", no_argument, nullptr, OPT_FOREGROUND},
+        {"serve", required_argument, nullptr, OPT_SERVE},
+        {"watch", required_argument, nullptr, OPT_WATCH},
+        {"follow", no_argument, nullptr, OPT_FOLLOW},
+        {"segment-size", required_argument, nullptr, OPT_SEGMENT_SIZE},
+        {"flush-interval", required_argument, nullptr, OPT_FLUSH_INTERVAL},
+        {"workers", required_argument, nullptr, OPT_WORKERS},
+        {"queue-depth", required_argument, nullptr, OPT_QUEUE_DEPTH},
+        {"batch", required_argument, nullptr, OPT_BATCH},
+        {"hugepages", no_argument, nullptr, OPT_HUGEPAGES},
+        {"max-memory", required_argument, nullptr, OPT_MAX_MEMORY},
+        {"fsync", required_argument, nullptr, OPT_FSYNC},
+        {"fsync-batch", required_argument, nullptr, OPT_FSYNC_BATCH},
+        {"write-behind", required_argument, nullptr, OPT_WRITE_BEHIND},
+        {"cache", required_argument, nullptr, OPT_CACHE},
+        {"backend", required_argument, nullptr, OPT_BACKEND},
+        {"digest", required_argument, nullptr, OPT_DIGEST},
+        {"digest-file", required_argument, nullptr, OPT_DIGEST_FILE},
+        {"numa", no_argument, nullptr, OPT_NUMA},
+        {"sparse", no_argument, nullptr, OPT_SPARSE},
+        {"volume-size", required_argument, nullptr, OPT_VOLUME_SIZE},
+        {"stripe", required_argument, nullptr, OPT_STRIPE},
+        {"stripe-unit", required_argument, nullptr, OPT_STRIPE_UNIT},
+        {"xts", no_argument, nullptr, OPT_XTS},
+        {"sector-size", required_argument, nullptr, OPT_SECTOR_SIZE},
+        {"patch", required_argument, nullptr, OPT_PATCH},
+        {"patch-offset", required_argument, nullptr, OPT_PATCH_OFFSET},
+        {"progress", optional_argument, nullptr, OPT_PROGRESS},
+        {"progress-interval", required_argument, nullptr, OPT_PROGRESS_INTERVAL},
+        {"key-fd", required_argument, nullptr, OPT_KEY_FD},
+        {"recipient", required_argument, nullptr, OPT_RECIPIENT},
+        {"add-recipient", required_argument, nullptr, OPT_ADD_RECIPIENT},
+        {"remove-recipient", required_argument, nullptr, OPT_REMOVE_RECIPIENT},
+        {"rate", required_argument, nullptr, OPT_RATE},
+        {"iops", required_argument, nullptr, OPT_IOPS},
+        {"throttle-control", required_argument, nullptr, OPT_THROTTLE_CONTROL},
+        {"max-workers", required_argument, nullptr, OPT_MAX_WORKERS},
+        {"nice", required_argument, nullptr, OPT_NICE},
+        {"ioprio", required_argument, nullptr, OPT_IOPRIO},
+        {nullptr, 0, nullptr, 0}
+    };
+
     int opt;
     std::string inputFile, outputFile, password;
-    bool encrypt = false, decrypt = false;
+    RawKeySource rawKey;
+    std::vector<std::string> recipientSpecs;
+    std::string addRecipient, removeRecipient;
+    bool encrypt = false, decrypt = false, agentMode = false;
+    AgentOptions agentOptions;
+    ServeOptions serveOptions;
+    WatchOptions watchOptions;
+    FollowOptions followOptions;
+    bool follow = false;
+    std::string patchImage;
+    size_t patchOffset = 0;
+    LocalOptions localOptions;
+    PipelineOptions &pipelineOptions = localOptions.pipeline;
+    size_t maxMemory = 0;
+    OutputOptions outputOptions;
+    CryptoBackend &backend = localOptions.backend;
+    std::string throttleControl;
+    int maxWorkers = 0;
+    bool renice = false;
+    int nice = 0;
+    IoPriorityClass ioClass = IOPRIO_DEFAULT;
+    int ioLevel = 0;
+    const char *agentEnv = getenv(AGENT_SOCKET_ENV);
+    if (agentEnv) agentOptions.socketPath = agentEnv;
 
     // Разбор аргументов командной строки
-    while ((opt = getopt(argc, argv, "edi:o:p:")) != -1) {
+    int verbosity = LOG_LEVEL_WARN;
+    while ((opt = getopt_long(argc, argv, "edi:o:p:k:K:v", longOptions, nullptr)) != -1) {
         switch (opt) {
             case 'e':
                 encrypt = true;
@@ -201,51 +474,447 @@ int main(int argc, char *argv[]) {
             case 'p':
                 password = optarg;
                 break;
+            case 'k':
+                rawKey.hex = optarg;
+                // Не оставлять ключ в argv, видимом через /proc
+                OPENSSL_cleanse(optarg, strlen(optarg));
+                break;
+            case 'K':
+                rawKey.file = optarg;
+                break;
+            case OPT_KEY_FD: {
+                char *end;
+                long fd = strtol(optarg, &end, 10);
+                if (*end != '\0' || end == optarg || fd < 0) {
+                    printUsage(argv[0]);
+                    return 1;
+                }
+                rawKey.fd = (int)fd;
+                break;
+            }
+            case OPT_RECIPIENT:
+            case OPT_ADD_RECIPIENT:
+            case OPT_REMOVE_RECIPIENT:
+                if (opt == OPT_RECIPIENT) recipientSpecs.push_back(optarg);
+                if (opt == OPT_ADD_RECIPIENT) addRecipient = optarg;
+                if (opt == OPT_REMOVE_RECIPIENT) removeRecipient = optarg;
+                OPENSSL_cleanse(optarg, strlen(optarg));
+                break;
+            case 'v':
+                if (verbosity < LOG_LEVEL_DEBUG) verbosity++;
+                setLogLevel((LogLevel)verbosity);
+                break;
+            case OPT_AGENT:
+                agentMode = true;
+                break;
+            case OPT_AGENT_SOCKET:
+                agentOptions.socketPath = optarg;
+                break;
+            case OPT_TTL:
+                agentOptions.ttlSeconds = atoi(optarg);
+                break;
+            case OPT_FOREGROUND:
+                agentOptions.foreground = true;
+                break;
+            case OPT_SERVE:
+                serveOptions.endpoint = optarg;
+                break;
+            case OPT_WATCH:
+                watchOptions.spoolDir = optarg;
+                break;
+            case OPT_FOLLOW:
+                follow = true;
+                break;
+            case OPT_SEGMENT_SIZE:
+                if (!parseSize(optarg, &followOptions.segmentSize) || followOptions.segmentSize == 0 ||
+                    followOptions.segmentSize > FOLLOW_MAX_SEGMENT - AES_BLOCK_SIZE) {
+                    std::cerr << "Invalid size: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_FLUSH_INTERVAL:
+                followOptions.interval = atof(optarg);
+                if (followOptions.interval <= 0) followOptions.interval = FOLLOW_DEFAULT_INTERVAL;
+                break;
+            case OPT_WORKERS:
+                serveOptions.workers = atoi(optarg);
+                pipelineOptions.workers = serveOptions.workers;
+                break;
+            case OPT_QUEUE_DEPTH:
+                serveOptions.queueDepth = strtoul(optarg, nullptr, 10);
+                break;
+            case OPT_BATCH:
+                serveOptions.batchSize = strtoul(optarg, nullptr, 10);
+                break;
+            case OPT_HUGEPAGES:
+                configureSecurePools(true);
+                break;
+            case OPT_MAX_MEMORY:
+                if (!parseSize(optarg, &maxMemory) || maxMemory == 0) {
+                    std::cerr << "Invalid size: " << optarg << std::endl;
+                    return 1;
+                }
+                memoryBudget().setLimit(maxMemory);
+                break;
+            case OPT_FSYNC:
+                if (strcmp(optarg, "none") == 0) {
+                    outputOptions.fsync = FSYNC_NONE;
+                } else if (strcmp(optarg, "batch") == 0) {
+                    outputOptions.fsync = FSYNC_BATCH;
+                } else if (strcmp(optarg, "always") == 0) {
+                    outputOptions.fsync = FSYNC_ALWAYS;
+                } else {
+                    printUsage(argv[0]);
+                    return 1;
+                }
+                break;
+            case OPT_FSYNC_BATCH:
+                outputOptions.batchFiles = strtoul(optarg, nullptr, 10);
+                if (outputOptions.batchFiles == 0) outputOptions.batchFiles = 1;
+                break;
+            case OPT_CACHE:
+                if (strcmp(optarg, "normal") == 0) {
+                    pipelineOptions.cache = CACHE_NORMAL;
+                } else if (strcmp(optarg, "dontneed") == 0) {
+                    pipelineOptions.cache = CACHE_DONTNEED;
+                } else if (strcmp(optarg, "direct") == 0) {
+                    pipelineOptions.cache = CACHE_DIRECT;
+                } else {
+                    printUsage(argv[0]);
+                    return 1;
+                }
+                break;
+            case OPT_BACKEND:
+                if (strcmp(optarg, "evp") == 0) {
+                    backend = BACKEND_EVP;
+                } else if (strcmp(optarg, "kernel") == 0) {
+                    backend = BACKEND_KERNEL;
+                    if (!kernelCipherAvailable()) {
+                        LOG(LOG_LEVEL_WARN, "AF_ALG " KERNEL_CIPHER_NAME " is not available, using OpenSSL");
+                    }
+                } else {
+                    printUsage(argv[0]);
+                    return 1;
+                }
+                break;
+            case OPT_DIGEST:
+                if (strcmp(optarg, "plain") == 0) {
+                    localOptions.digest = DIGEST_PLAIN;
+                } else if (strcmp(optarg, "cipher") == 0) {
+                    localOptions.digest = DIGEST_CIPHER;
+                } else if (strcmp(optarg, "both") == 0) {
+                    localOptions.digest = DIGEST_BOTH;
+                } else {
+                    printUsage(argv[0]);
+                    return 1;
+                }
+                break;
+            case OPT_DIGEST_FILE:
+                localOptions.digestFile = optarg;
+                if (localOptions.digest == DIGEST_NONE) localOptions.digest = DIGEST_BOTH;
+                break;
+            case OPT_PROGRESS:
+                if (!optarg) {
+                    localOptions.progress = PROGRESS_AUTO;
+                } else if (strcmp(optarg, "bar") == 0) {
+                    localOptions.progress = PROGRESS_BAR;
+                } else if (strcmp(optarg, "lines") == 0) {
+                    localOptions.progress = PROGRESS_LINES;
+                } else {
+                    printUsage(argv[0]);
+                    return 1;
+                }
+                break;
+            case OPT_PROGRESS_INTERVAL:
+                localOptions.progressInterval = atof(optarg);
+                if (localOptions.progressInterval <= 0) localOptions.progressInterval = PROGRESS_DEFAULT_INTERVAL;
+                break;
+            case OPT_NUMA:
+                pipelineOptions.numa = true;
+                break;
+            case OPT_SPARSE:
+                localOptions.sparse = true;
+                break;
+            case OPT_STRIPE: {
+                std::string list = optarg;
+                localOptions.stripeDirs.clear();
+                for (size_t start = 0; start <= list.size();) {
+                    size_t comma = list.find(',', start);
+                    if (comma == std::string::npos) comma = list.size();
+                    if (comma > start) localOptions.stripeDirs.push_back(list.substr(start, comma - start));
+                    start = comma + 1;
+                }
+                if (localOptions.stripeDirs.empty() || localOptions.stripeDirs.size() > STRIPE_MAX_COUNT) {
+                    std::cerr << "Invalid stripe directories: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            }
+            case OPT_STRIPE_UNIT:
+                if (!parseSize(optarg, &localOptions.stripeUnit) || localOptions.stripeUnit < STRIPE_MIN_UNIT ||
+                    localOptions.stripeUnit > STRIPE_MAX_UNIT || localOptions.stripeUnit % AES_BLOCK_SIZE != 0) {
+                    std::cerr << "Invalid stripe unit: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_XTS:
+                if (!localOptions.xtsSector) localOptions.xtsSector = XTS_DEFAULT_SECTOR;
+                break;
+            case OPT_SECTOR_SIZE:
+                if (!parseSize(optarg, &localOptions.xtsSector) || localOptions.xtsSector < XTS_MIN_SECTOR ||
+                    localOptions.xtsSector > XTS_MAX_SECTOR || (localOptions.xtsSector & (localOptions.xtsSector - 1))) {
+                    std::cerr << "Invalid sector size: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_PATCH:
+                patchImage = optarg;
+                break;
+            case OPT_PATCH_OFFSET:
+                if (!parseSize(optarg, &patchOffset)) {
+                    std::cerr << "Invalid offset: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_VOLUME_SIZE:
+                if (!parseSize(optarg, &localOptions.volumeSize) || localOptions.volumeSize < VOLUME_MIN_SIZE) {
+                    std::cerr << "Invalid volume size: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_RATE:
+            case OPT_IOPS: {
+                std::string reply = throttleCommand(ioThrottle(), std::string(opt == OPT_RATE ? "rate " : "iops ") + optarg);
+                if (reply.compare(0, 6, "error:") == 0) {
+                    std::cerr << "Invalid limit: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            }
+            case OPT_THROTTLE_CONTROL:
+                throttleControl = optarg;
+                break;
+            case OPT_MAX_WORKERS:
+                maxWorkers = atoi(optarg);
+                if (maxWorkers <= 0) {
+                    printUsage(argv[0]);
+                    return 1;
+                }
+                break;
+            case OPT_NICE:
+                renice = true;
+                nice = atoi(optarg);
+                break;
+            case OPT_IOPRIO:
+                if (!parseIoPriority(optarg, &ioClass, &ioLevel)) {
+                    printUsage(argv[0]);
+                    return 1;
+                }
+                break;
+            case OPT_WRITE_BEHIND:
+                if (!parseSize(optarg, &outputOptions.writeBehind)) {
+                    std::cerr << "Invalid size: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
             default:
                 printUsage(argv[0]);
                 return 1;
         }
     }
 
-    if ((encrypt && decrypt) || (!encrypt && !decrypt) || inputFile.empty() || outputFile.empty() || password.empty()) {
-        printUsage(argv[0]);
+    // Приоритеты задаются до запуска потоков, которые их наследуют
+    try {
+        if (renice) setNice(nice);
+        setIoPriority(ioClass, ioLevel);
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
         return 1;
     }
+    if (maxWorkers > 0) {
+        int automatic = std::max(1, (int)std::thread::hardware_concurrency());
+        if (pipelineOptions.workers <= 0) pipelineOptions.workers = automatic;
+        if (serveOptions.workers <= 0) serveOptions.workers = automatic;
+        pipelineOptions.workers = std::min(pipelineOptions.workers, maxWorkers);
+        serveOptions.workers = std::min(serveOptions.workers, maxWorkers);
+    }
 
-    unsigned char key[AES_KEY_LENGTH];
-    unsigned char iv[AES_BLOCK_SIZE];
+    if (agentMode) {
+        if (agentOptions.socketPath.empty() || agentOptions.ttlSeconds <= 0) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        try {
+            return runAgent(agentOptions);
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
 
-    // Генерация ключа из пароля
-    generateKeyFromPassword(password, key);
+    if (!serveOptions.endpoint.empty()) {
+        if (!password.empty() + rawKey.count() != 1 || serveOptions.queueDepth == 0 || serveOptions.batchSize == 0) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        try {
+            // Ключ вычисляется один раз на всё время работы сервиса
+            SecureBuffer key = keyPool().acquire();
+            loadKey(password, rawKey, key.data());
+            return runServer(serveOptions, key.data());
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
 
-    // Чтение данных из файла
-    std::vector<unsigned char> fileData = readFile(inputFile);
+    if (!watchOptions.spoolDir.empty()) {
+        if (decrypt || outputFile.empty() || !password.empty() + rawKey.count() != 1 || !recipientSpecs.empty() ||
+            serveOptions.batchSize == 0) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        watchOptions.outputDir = outputFile;
+        watchOptions.workers = serveOptions.workers;
+        watchOptions.batchSize = serveOptions.batchSize;
+        watchOptions.output = outputOptions;
+        watchOptions.pipeline = pipelineOptions;
+        try {
+            // Как и у сервиса, ключ вычисляется один раз при запуске
+            SecureBuffer key = keyPool().acquire();
+            loadKey(password, rawKey, key.data());
+            return runWatch(watchOptions, key.data(), rawKey.count() != 0);
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
 
-    std::vector<unsigned char> resultData;
+    if (follow) {
+        if (!encrypt || decrypt || inputFile.empty() || outputFile.empty() || !password.empty() + rawKey.count() != 1 ||
+            !recipientSpecs.empty()) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        try {
+            SecureBuffer key = keyPool().acquire();
+            loadKey(password, rawKey, key.data());
+            return runFollow(inputFile, outputFile, key.data(), rawKey.count() != 0, followOptions);
+        } catch (const std::exception &e) {
+            logFlush();
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
 
-    if (encrypt) {
-        // Генерация случайного IV
-        if (!RAND_bytes(iv, AES_BLOCK_SIZE)) {
-            handleErrors();
+    int keySources = !password.empty() + rawKey.count();
+    if (!addRecipient.empty() || !removeRecipient.empty()) {
+        if (encrypt || decrypt || inputFile.empty() || keySources != 1 || (!addRecipient.empty() && !removeRecipient.empty())) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        try {
+            SecureBuffer key = keyPool().acquire();
+            loadKey(password, rawKey, key.data());
+            Recipient recipient;
+            parseRecipient(addRecipient.empty() ? removeRecipient : addRecipient, &recipient);
+            if (!addRecipient.empty()) {
+                addFileRecipient(inputFile, key.data(), recipient);
+            } else {
+                removeFileRecipient(inputFile, key.data(), recipient.key.data());
+            }
+        } catch (const std::exception &e) {
+            logFlush();
+            std::cerr << e.what() << std::endl;
+            return 1;
         }
+        LOG(LOG_LEVEL_INFO, "Recipient " << (addRecipient.empty() ? "removed" : "added"));
+        return 0;
+    }
 
-        std::cout << "Generated IV: ";
-        for (int i = 0; i < AES_BLOCK_SIZE; i++) {
-            std::cout << std::hex << (int)iv[i] << " ";
+    if (!patchImage.empty()) {
+        if (encrypt || decrypt || inputFile.empty() || keySources != 1) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        try {
+            SecureBuffer key = keyPool().acquire();
+            loadKey(password, rawKey, key.data());
+            ScopedFd data(openInputFile(inputFile));
+            uint64_t patched = patchXtsImage(patchImage, key.data(), patchOffset, data.get());
+            LOG(LOG_LEVEL_INFO, "Patched " << patched << " bytes at offset " << patchOffset);
+        } catch (const std::exception &e) {
+            logFlush();
+            std::cerr << e.what() << std::endl;
+            return 1;
         }
-        std::cout << std::dec << std::endl;  // Возврат к десятичному
+        return 0;
+    }
 
-        // Шифрование данных с записью IV
-        resultData = encryptDataWithIV(fileData, key, iv);
-    } else if (decrypt) {
-        // Расшифрование данных с использованием IV из файла
-        resultData = decryptDataWithIV(fileData, key);
+    // Со слотами получателей заданный ключ необязателен: он лишь ещё один получатель
+    bool slotted = encrypt && !recipientSpecs.empty();
+    if ((encrypt && decrypt) || (!encrypt && !decrypt) || inputFile.empty() || outputFile.empty() ||
+        !(keySources == 1 || (slotted && keySources == 0)) || (decrypt && !recipientSpecs.empty()) ||
+        (decrypt && (localOptions.sparse || localOptions.volumeSize || localOptions.xtsSector)) ||
+        (localOptions.xtsSector && (slotted || localOptions.sparse || localOptions.volumeSize ||
+                                    !localOptions.stripeDirs.empty())) ||
+        (localOptions.volumeSize && (slotted || localOptions.sparse || localOptions.digest != DIGEST_NONE)) ||
+        (!localOptions.stripeDirs.empty() && (slotted || localOptions.sparse || localOptions.volumeSize ||
+                                              localOptions.digest != DIGEST_NONE))) {
+        printUsage(argv[0]);
+        return 1;
     }
 
-    // Запись результата в файл
-    writeFile(outputFile, resultData);
+    try {
+        DurabilityGroup group(outputOptions);
+        std::unique_ptr<ThrottleControl> control;
+        if (!throttleControl.empty()) control.reset(new ThrottleControl(throttleControl));
+        // Агент не видит данных, поэтому контрольные суммы считаются только локально;
+        // лимиты скорости действуют только на этот процесс
+        // Агент знает только пароль: с готовым ключом работа идёт локально;
+        // разреженный вход агент шифровал бы целиком, а тома и полосы он не знает
+        bool throttled = control || ioThrottle().limited();
+        bool volumes = localOptions.volumeSize || !localOptions.stripeDirs.empty() ||
+                       (decrypt && isVolumeManifest(inputFile));
+        if (!agentOptions.socketPath.empty() && localOptions.digest == DIGEST_NONE && !throttled && rawKey.count() == 0 &&
+            !slotted && !localOptions.sparse && !localOptions.xtsSector && !volumes &&
+            processWithAgent(agentOptions.socketPath, encrypt ? OP_ENCRYPT : OP_DECRYPT, inputFile, outputFile, password,
+                             localOptions, group)) {
+            group.flush();
+            LOG(LOG_LEVEL_INFO, "Operation " << (encrypt ? "encryption" : "decryption") << " completed successfully!");
+            return 0;
+        }
+
+        // Ключ из пароля или заданный готовым, в заблокированный буфер;
+        // готовый ключ — главный, каждый файл шифруется выведенным из него
+        SecureBuffer key = keyPool().acquire();
+        if (slotted) {
+            if (keySources) {
+                Recipient self;
+                self.kind = rawKey.count() ? RECIPIENT_RAW_KEY : RECIPIENT_PASSWORD;
+                self.key = keyPool().acquire();
+                loadKey(password, rawKey, self.key.data());
+                localOptions.recipients.push_back(std::move(self));
+            }
+            for (size_t i = 0; i < recipientSpecs.size(); i++) {
+                Recipient recipient;
+                parseRecipient(recipientSpecs[i], &recipient);
+                localOptions.recipients.push_back(std::move(recipient));
+            }
+        } else {
+            loadKey(password, rawKey, key.data());
+            localOptions.perFileKey = rawKey.count() != 0;
+        }
+
+        processLocally(encrypt ? OP_ENCRYPT : OP_DECRYPT, inputFile, outputFile, key.data(), localOptions, group);
+        group.flush();
+    } catch (const std::exception &e) {
+        logFlush();
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
 
-    std::cout << "Operation " << (encrypt ? "encryption" : "decryption") << " completed successfully!" << std::endl;
+    LOG(LOG_LEVEL_INFO, "Operation " << (encrypt ? "encryption" : "decryption") << " completed successfully!");
 
     return 0;
 }
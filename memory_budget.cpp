@@ -0,0 +1,72 @@
+#include "memory_budget.h"
+#include "crypto.h"
+
+#include <sstream>
+
+/**
+ * @brief Устанавливает лимит; вызывается до начала обработки.
+ */
+void MemoryBudget::setLimit(size_t limit) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    limit_ = limit;
+    freed_.notify_all();
+}
+/**
+ * @brief Резервирует память, дожидаясь её освобождения другими операциями.
+ *
+ * @param[in] bytes Размер резервирования.
+ *
+ * Выбрасывает CryptoError, если запрос больше всего лимита и не может быть
+ * удовлетворён никогда.
+ */
+void MemoryBudget::acquire(size_t bytes) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (bytes > limit_) {
+        std::ostringstream message;
+        message << "Memory budget exceeded: " << bytes << " bytes requested, limit is " << limit_;
+        throw CryptoError(message.str());
+    }
+    while (used_ + bytes > limit_) freed_.wait(lock);
+    used_ += bytes;
+    if (used_ > peak_) peak_ = used_;
+}
+/**
+ * @brief Резервирует память без ожидания.
+ *
+ * @return bool false, если свободной памяти в бюджете недостаточно.
+ */
+bool MemoryBudget::tryAcquire(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (bytes > limit_ || used_ + bytes > limit_) return false;
+    used_ += bytes;
+    if (used_ > peak_) peak_ = used_;
+    return true;
+}
+
+void MemoryBudget::release(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    used_ -= bytes < used_ ? bytes : used_;
+    freed_.notify_all();
+}
+
+size_t MemoryBudget::limit() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return limit_;
+}
+
+size_t MemoryBudget::available() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return limit_ - used_;
+}
+
+size_t MemoryBudget::peak() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return peak_;
+}
+/**
+ * @brief Бюджет памяти процесса (по умолчанию без ограничения).
+ */
+MemoryBudget &memoryBudget() {
+    static MemoryBudget budget;
+    return budget;
+}
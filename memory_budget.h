@@ -0,0 +1,40 @@
+#ifndef FILE_CRYPTO_MEMORY_BUDGET_H
+#define FILE_CRYPTO_MEMORY_BUDGET_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+/**
+ * @brief Общий лимит памяти под буферы данных.
+ *
+ * Все буферы, через которые проходят данные (чтение, шифрование, запись),
+ * выделяются из SecurePool, а пулы получают память только после резервирования
+ * в бюджете. Если бюджет исчерпан параллельными операциями, acquire() ждёт
+ * освобождения; запрос, превышающий весь лимит, отклоняется сразу.
+ */
+class MemoryBudget {
+public:
+    MemoryBudget() : limit_((size_t)-1), used_(0), peak_(0) {}
+
+    void setLimit(size_t limit);
+    void acquire(size_t bytes);
+    bool tryAcquire(size_t bytes);
+    void release(size_t bytes);
+
+    size_t limit();
+    size_t available();
+    size_t peak();
+    bool limited() { return limit() != (size_t)-1; }
+
+private:
+    size_t limit_;
+    size_t used_;
+    size_t peak_;
+    std::mutex mutex_;
+    std::condition_variable freed_;
+};
+
+MemoryBudget &memoryBudget();
+
+#endif // FILE_CRYPTO_MEMORY_BUDGET_H
@@ -0,0 +1,220 @@
+#include "multibuffer.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MULTIBUFFER_AESNI 1
+#include <wmmintrin.h>
+#include <emmintrin.h>
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+#endif
+
+#ifdef MULTIBUFFER_AESNI
+/**
+ * @brief Шаг расширения ключа AES-256 для чётных раундовых ключей.
+ */
+AESNI_TARGET static inline __m128i expandEven(__m128i key, __m128i assist) {
+    assist = _mm_shuffle_epi32(assist, 0xff);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+/**
+ * @brief Шаг расширения ключа AES-256 для нечётных раундовых ключей.
+ */
+AESNI_TARGET static inline __m128i expandOdd(__m128i key, __m128i prev) {
+    __m128i assist = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev, 0), 0xaa);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+#define EXPAND_PAIR(i, rcon)                                                             \
+    rk[i] = expandEven(rk[i - 2], _mm_aeskeygenassist_si128(rk[i - 1], rcon));           \
+    if (i + 1 < 15) rk[i + 1] = expandOdd(rk[i - 1], rk[i]);
+
+AESNI_TARGET static void expandKey(const unsigned char *key, __m128i *rk) {
+    rk[0] = _mm_loadu_si128((const __m128i *)key);
+    rk[1] = _mm_loadu_si128((const __m128i *)(key + AES_BLOCK_SIZE));
+    EXPAND_PAIR(2, 0x01)
+    EXPAND_PAIR(4, 0x02)
+    EXPAND_PAIR(6, 0x04)
+    EXPAND_PAIR(8, 0x08)
+    EXPAND_PAIR(10, 0x10)
+    EXPAND_PAIR(12, 0x20)
+    rk[14] = expandEven(rk[12], _mm_aeskeygenassist_si128(rk[13], 0x40));
+}
+
+/**
+ * @brief Дорожка: текущее сообщение и положение в нём.
+ */
+struct CbcLane {
+    const unsigned char *in;  ///< следующий блок открытого текста
+    unsigned char *out;       ///< куда писать следующий блок шифртекста
+    size_t blocks;            ///< блоков осталось в текущем источнике
+    bool final;               ///< источник — последний блок с дополнением
+    __m128i state;            ///< предыдущий блок шифртекста (сначала IV)
+    unsigned char last[AES_BLOCK_SIZE];  ///< остаток сообщения и дополнение PKCS7
+};
+/**
+ * @brief Шифрует blocks блоков на каждой из N дорожек вперемешку.
+ *
+ * N известно при компиляции, поэтому внутренний цикл по дорожкам
+ * разворачивается и состояния всех дорожек остаются в регистрах.
+ */
+template <int N>
+AESNI_TARGET static void encryptLanes(CbcLane *lanes, size_t blocks, const __m128i *rk) {
+    __m128i state[N];
+    for (int l = 0; l < N; l++) state[l] = lanes[l].state;
+    for (size_t b = 0; b < blocks; b++) {
+        for (int l = 0; l < N; l++) {
+            __m128i plain = _mm_loadu_si128((const __m128i *)(lanes[l].in + b * AES_BLOCK_SIZE));
+            state[l] = _mm_xor_si128(_mm_xor_si128(state[l], plain), rk[0]);
+        }
+        for (int r = 1; r < 14; r++) {
+            for (int l = 0; l < N; l++) state[l] = _mm_aesenc_si128(state[l], rk[r]);
+        }
+        for (int l = 0; l < N; l++) {
+            state[l] = _mm_aesenclast_si128(state[l], rk[14]);
+            _mm_storeu_si128((__m128i *)(lanes[l].out + b * AES_BLOCK_SIZE), state[l]);
+        }
+    }
+    for (int l = 0; l < N; l++) {
+        lanes[l].state = state[l];
+        lanes[l].in += blocks * AES_BLOCK_SIZE;
+        lanes[l].out += blocks * AES_BLOCK_SIZE;
+        lanes[l].blocks -= blocks;
+    }
+}
+
+AESNI_TARGET static void encryptLanes(CbcLane *lanes, int count, size_t blocks, const __m128i *rk) {
+    switch (count) {
+        case 1: encryptLanes<1>(lanes, blocks, rk); break;
+        case 2: encryptLanes<2>(lanes, blocks, rk); break;
+        case 3: encryptLanes<3>(lanes, blocks, rk); break;
+        case 4: encryptLanes<4>(lanes, blocks, rk); break;
+        case 5: encryptLanes<5>(lanes, blocks, rk); break;
+        case 6: encryptLanes<6>(lanes, blocks, rk); break;
+        case 7: encryptLanes<7>(lanes, blocks, rk); break;
+        default: encryptLanes<8>(lanes, blocks, rk); break;
+    }
+}
+/**
+ * @brief Ставит сообщение на дорожку.
+ */
+AESNI_TARGET static void loadLane(CbcLane &lane, const CbcJob &job) {
+    size_t full = job.len / AES_BLOCK_SIZE;
+    size_t tail = job.len - full * AES_BLOCK_SIZE;
+    lane.in = job.data;
+    lane.out = job.out + AES_BLOCK_SIZE;
+    lane.blocks = full;
+    lane.final = false;
+    lane.state = _mm_loadu_si128((const __m128i *)job.out);
+    if (tail) memcpy(lane.last, job.data + full * AES_BLOCK_SIZE, tail);
+    memset(lane.last + tail, AES_BLOCK_SIZE - tail, AES_BLOCK_SIZE - tail);
+}
+/**
+ * @brief Планировщик дорожек.
+ *
+ * Каждый шаг шифрует столько блоков, сколько осталось у самой короткой из
+ * активных дорожек; затем дорожки с исчерпанными данными переходят к блоку
+ * с дополнением, а завершившие сообщение получают следующее по размеру.
+ */
+AESNI_TARGET static void encryptScheduled(const std::vector<const CbcJob *> &order, const __m128i *rk) {
+    CbcLane lanes[MULTIBUFFER_LANES];
+    size_t next = 0;
+    int active = 0;
+    while (active < MULTIBUFFER_LANES && next < order.size()) loadLane(lanes[active++], *order[next++]);
+
+    while (active > 0) {
+        size_t step = lanes[0].blocks;
+        for (int l = 1; l < active; l++) step = std::min(step, lanes[l].blocks);
+        if (step > 0) encryptLanes(lanes, active, step, rk);
+
+        for (int l = 0; l < active;) {
+            CbcLane &lane = lanes[l];
+            if (lane.blocks > 0) {
+                l++;
+            } else if (!lane.final) {
+                lane.in = lane.last;
+                lane.blocks = 1;
+                lane.final = true;
+                l++;
+            } else {
+                OPENSSL_cleanse(lane.last, sizeof(lane.last));
+                if (next < order.size()) {
+                    loadLane(lane, *order[next++]);
+                    l++;
+                } else {
+                    // Последняя дорожка переезжает на место освободившейся; если
+                    // она уже шифрует блок с дополнением, in указывает в её last
+                    CbcLane &moved = lanes[--active];
+                    if (&moved != &lane) {
+                        lane = moved;
+                        if (lane.final) lane.in = lane.last + (moved.in - moved.last);
+                        OPENSSL_cleanse(moved.last, sizeof(moved.last));
+                    }
+                }
+            }
+        }
+    }
+}
+#endif
+
+MultiBufferCipher::MultiBufferCipher(const unsigned char *key) : accelerated_(false), ctx_(EVP_CIPHER_CTX_new()) {
+    if (!ctx_ || 1 != EVP_EncryptInit_ex(ctx_, aes256Cbc(), nullptr, key, nullptr)) {
+        EVP_CIPHER_CTX_free(ctx_);
+        handleErrors();
+    }
+#ifdef MULTIBUFFER_AESNI
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("aes")) {
+        expandKey(key, (__m128i *)roundKeys_);
+        accelerated_ = true;
+    }
+#endif
+}
+
+MultiBufferCipher::~MultiBufferCipher() {
+    OPENSSL_cleanse(roundKeys_, sizeof(roundKeys_));
+    EVP_CIPHER_CTX_free(ctx_);
+}
+/**
+ * @brief Шифрует пакет сообщений.
+ *
+ * @param[in,out] jobs Сообщения; результат пишется в их буферы out.
+ * @param[in] count Число сообщений.
+ */
+void MultiBufferCipher::encrypt(CbcJob *jobs, size_t count) {
+    if (!accelerated_ || count < 2) {
+        encryptFallback(jobs, count);
+        return;
+    }
+#ifdef MULTIBUFFER_AESNI
+    // Группировка по размеру: соседние дорожки заканчивают почти одновременно
+    std::vector<const CbcJob *> order(count);
+    for (size_t i = 0; i < count; i++) order[i] = &jobs[i];
+    std::stable_sort(order.begin(), order.end(), [](const CbcJob *a, const CbcJob *b) { return a->len < b->len; });
+    encryptScheduled(order, (const __m128i *)roundKeys_);
+#endif
+}
+/**
+ * @brief Шифрование по одному сообщению через OpenSSL.
+ */
+void MultiBufferCipher::encryptFallback(CbcJob *jobs, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        int outLen, finalLen;
+        unsigned char *out = jobs[i].out;
+        if (1 != EVP_EncryptInit_ex(ctx_, nullptr, nullptr, nullptr, out) ||
+            1 != EVP_EncryptUpdate(ctx_, out + AES_BLOCK_SIZE, &outLen, jobs[i].data, jobs[i].len) ||
+            1 != EVP_EncryptFinal_ex(ctx_, out + AES_BLOCK_SIZE + outLen, &finalLen)) {
+            handleErrors();
+        }
+    }
+}
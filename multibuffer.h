@@ -0,0 +1,55 @@
+#ifndef FILE_CRYPTO_MULTIBUFFER_H
+#define FILE_CRYPTO_MULTIBUFFER_H
+
+#include "crypto.h"
+
+#include <cstddef>
+
+#define MULTIBUFFER_LANES 8  // независимых потоков CBC в одном проходе
+
+/**
+ * @brief Одно сообщение для пакетного шифрования.
+ *
+ * Результат имеет формат encryptDataWithIV(): IV, затем шифртекст с
+ * дополнением PKCS7. Первые AES_BLOCK_SIZE байт out должны уже содержать IV;
+ * размер out — MultiBufferCipher::encryptedSize(len).
+ */
+struct CbcJob {
+    const unsigned char *data;
+    size_t len;
+    unsigned char *out;
+};
+
+/**
+ * @brief Шифрование AES-256 CBC многих независимых сообщений одновременно.
+ *
+ * Шифрование CBC одного сообщения последовательно: каждый блок ждёт
+ * результата предыдущего, и конвейер AES-NI простаивает. Здесь до
+ * MULTIBUFFER_LANES сообщений с разными IV шифруются вперемешку: на каждом
+ * раунде одна инструкция AESENC выполняется для всех дорожек подряд, и
+ * задержка одной дорожки скрывается работой остальных. Сообщения
+ * сортируются по размеру, а освободившаяся дорожка сразу получает следующее
+ * сообщение, поэтому дорожки почти всё время заняты. Без AES-NI сообщения
+ * шифруются по одному через OpenSSL.
+ */
+class MultiBufferCipher {
+public:
+    explicit MultiBufferCipher(const unsigned char *key);
+    ~MultiBufferCipher();
+
+    static size_t encryptedSize(size_t len) { return AES_BLOCK_SIZE + (len / AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE; }
+    void encrypt(CbcJob *jobs, size_t count);
+    bool accelerated() const { return accelerated_; }
+
+private:
+    void encryptFallback(CbcJob *jobs, size_t count);
+
+    alignas(16) unsigned char roundKeys_[15 * AES_BLOCK_SIZE];  ///< расписание ключа AES-256
+    bool accelerated_;
+    EVP_CIPHER_CTX *ctx_;
+
+    MultiBufferCipher(const MultiBufferCipher &);
+    MultiBufferCipher &operator=(const MultiBufferCipher &);
+};
+
+#endif // FILE_CRYPTO_MULTIBUFFER_H
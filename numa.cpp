@@ -0,0 +1,158 @@
+#include "numa.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#define NUMA_SYSFS "/sys/devices/system/node"
+
+/**
+ * @brief Разбирает список процессоров вида «0-3,8,10-11».
+ */
+static std::vector<int> parseCpuList(const std::string &text) {
+    std::vector<int> cpus;
+    std::stringstream stream(text);
+    std::string range;
+    while (std::getline(stream, range, ',')) {
+        if (range.empty() || range[0] == '\n') continue;
+        int first = 0, last = 0;
+        if (sscanf(range.c_str(), "%d-%d", &first, &last) == 2) {
+            for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+        } else if (sscanf(range.c_str(), "%d", &first) == 1) {
+            cpus.push_back(first);
+        }
+    }
+    return cpus;
+}
+
+static std::string readLine(const std::string &path) {
+    std::ifstream file(path.c_str());
+    std::string line;
+    std::getline(file, line);
+    return line;
+}
+
+static NumaTopology loadTopology() {
+    NumaTopology topology;
+    DIR *dir = opendir(NUMA_SYSFS);
+    if (dir) {
+        std::vector<int> ids;
+        while (dirent *entry = readdir(dir)) {
+            int id;
+            if (sscanf(entry->d_name, "node%d", &id) == 1) ids.push_back(id);
+        }
+        closedir(dir);
+        std::sort(ids.begin(), ids.end());
+        for (size_t i = 0; i < ids.size(); i++) {
+            std::vector<int> cpus = parseCpuList(readLine(NUMA_SYSFS "/node" + std::to_string(ids[i]) + "/cpulist"));
+            if (cpus.empty()) continue;  // узел только с памятью
+            topology.nodes.push_back(ids[i]);
+            topology.cpus.push_back(cpus);
+        }
+    }
+    if (topology.nodes.empty()) {
+        std::vector<int> cpus;
+        long count = sysconf(_SC_NPROCESSORS_ONLN);
+        for (long cpu = 0; cpu < count; cpu++) cpus.push_back(cpu);
+        topology.nodes.push_back(0);
+        topology.cpus.push_back(cpus);
+    }
+    return topology;
+}
+
+size_t NumaTopology::index(int node) const {
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i] == node) return i;
+    }
+    return 0;
+}
+/**
+ * @brief Топология машины; разбирается один раз.
+ */
+const NumaTopology &numaTopology() {
+    static const NumaTopology topology = loadTopology();
+    return topology;
+}
+/**
+ * @brief Распределяет потоки по узлам пропорционально числу процессоров.
+ *
+ * @param[in] threads Число потоков.
+ * @return std::vector<int> Узел для каждого потока; соседние потоки — на одном узле.
+ */
+std::vector<int> spreadOverNodes(int threads) {
+    const NumaTopology &topology = numaTopology();
+    std::vector<int> order;
+    for (size_t n = 0; n < topology.nodes.size(); n++) {
+        order.insert(order.end(), topology.cpus[n].size(), topology.nodes[n]);
+    }
+    std::vector<int> result(threads > 0 ? threads : 0);
+    for (int i = 0; i < threads; i++) {
+        result[i] = order[(size_t)i * order.size() / threads];
+    }
+    return result;
+}
+/**
+ * @brief Узел NUMA контроллера, на котором лежит файл.
+ *
+ * По номеру устройства файла находит его каталог в /sys/dev/block и
+ * поднимается к родительским устройствам (раздел → диск → контроллер PCI),
+ * пока не встретит numa_node.
+ *
+ * @return int Номер узла или -1, если узнать не удалось.
+ */
+int storageNode(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return -1;
+    char link[64];
+    snprintf(link, sizeof(link), "/sys/dev/block/%u:%u", major(st.st_dev), minor(st.st_dev));
+    char resolved[PATH_MAX];
+    if (!realpath(link, resolved)) return -1;
+
+    std::string path = resolved;
+    while (path.size() > strlen("/sys/devices")) {
+        std::string value = readLine(path + "/device/numa_node");
+        if (value.empty()) value = readLine(path + "/numa_node");
+        if (!value.empty()) {
+            int node = atoi(value.c_str());
+            if (node >= 0) return node;
+        }
+        path = path.substr(0, path.rfind('/'));
+    }
+    return -1;
+}
+/**
+ * @brief Привязывает текущий поток к процессорам узла.
+ */
+bool pinToNode(int node) {
+    const NumaTopology &topology = numaTopology();
+    const std::vector<int> &cpus = topology.cpus[topology.index(node)];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus.size(); i++) CPU_SET(cpus[i], &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+/**
+ * @brief Переносит страницы диапазона памяти на узел.
+ *
+ * Страницы пула уже отображены и закреплены, поэтому используется
+ * mbind() с MPOL_MF_MOVE. Диапазон должен быть выровнен по странице;
+ * при неудаче (например, для больших страниц) память остаётся где была.
+ */
+bool placeOnNode(void *addr, size_t len, int node) {
+    if (node < 0 || node >= (int)(sizeof(unsigned long) * CHAR_BIT)) return false;
+    unsigned long mask = 1ul << node;
+    return syscall(SYS_mbind, addr, len, MPOL_BIND, &mask, sizeof(mask) * CHAR_BIT + 1, MPOL_MF_MOVE) == 0;
+}
@@ -0,0 +1,26 @@
+#ifndef FILE_CRYPTO_NUMA_H
+#define FILE_CRYPTO_NUMA_H
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * @brief Топология NUMA из /sys/devices/system/node.
+ *
+ * Разбирается без libnuma. Если sysfs недоступен, считается, что есть один
+ * узел со всеми процессорами.
+ */
+struct NumaTopology {
+    std::vector<int> nodes;               ///< номера узлов с процессорами
+    std::vector<std::vector<int> > cpus;  ///< процессоры каждого узла
+
+    size_t index(int node) const;
+};
+
+const NumaTopology &numaTopology();
+std::vector<int> spreadOverNodes(int threads);
+int storageNode(int fd);
+bool pinToNode(int node);
+bool placeOnNode(void *addr, size_t len, int node);
+
+#endif // FILE_CRYPTO_NUMA_H
@@ -0,0 +1,214 @@
+#include "output_file.h"
+#include "crypto.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @brief Каталог, в котором находится путь.
+ */
+static std::string directoryOf(const std::string &path) {
+    size_t slash = path.rfind('/');
+    if (slash == std::string::npos) return ".";
+    if (slash == 0) return "/";
+    return path.substr(0, slash);
+}
+/**
+ * @brief fsync() каталога, чтобы закрепить на диске переименование.
+ */
+static void syncDirectory(const std::string &dir) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        throw CryptoError("Cannot open directory " + dir + ": " + strerror(errno));
+    }
+    int rc = fsync(fd);
+    int err = errno;
+    close(fd);
+    if (rc != 0 && err != EINVAL) {
+        throw CryptoError("Cannot sync directory " + dir + ": " + strerror(err));
+    }
+}
+
+DurabilityGroup::~DurabilityGroup() {
+    if (hold_) {
+        discard();
+        return;
+    }
+    try {
+        flush();
+    } catch (const std::exception &) {
+        // ошибка уже не может быть сообщена; временные файлы удалены в flush()
+    }
+}
+/**
+ * @brief Принимает записанный временный файл.
+ *
+ * @param[in] fd Дескриптор временного файла; группа становится его владельцем.
+ * @param[in] tempPath Имя временного файла.
+ * @param[in] finalPath Итоговое имя.
+ */
+void DurabilityGroup::add(int fd, const std::string &tempPath, const std::string &finalPath) {
+    Pending item;
+    item.fd = fd;
+    item.tempPath = tempPath;
+    item.finalPath = finalPath;
+    pending_.push_back(item);
+    if (!hold_ && (options_.fsync != FSYNC_BATCH || pending_.size() >= options_.batchFiles)) {
+        flush();
+    }
+}
+/**
+ * @brief Синхронизирует и переименовывает все ожидающие файлы.
+ *
+ * Порядок важен: сначала fsync() данных всех файлов, затем переименования,
+ * затем по одному fsync() на каждый затронутый каталог.
+ */
+void DurabilityGroup::flush() {
+    std::vector<Pending> items;
+    items.swap(pending_);
+    std::string error;
+    std::set<std::string> dirs;
+
+    for (size_t i = 0; i < items.size(); i++) {
+        if (options_.fsync != FSYNC_NONE && error.empty() && fdatasync(items[i].fd) != 0) {
+            error = "Cannot sync " + items[i].finalPath + ": " + strerror(errno);
+        }
+        if (close(items[i].fd) != 0 && error.empty()) {
+            error = "Cannot write " + items[i].finalPath + ": " + strerror(errno);
+        }
+    }
+    for (size_t i = 0; i < items.size(); i++) {
+        if (!error.empty()) {
+            unlink(items[i].tempPath.c_str());
+            continue;
+        }
+        if (rename(items[i].tempPath.c_str(), items[i].finalPath.c_str()) != 0) {
+            error = "Cannot rename to " + items[i].finalPath + ": " + strerror(errno);
+            unlink(items[i].tempPath.c_str());
+            continue;
+        }
+        dirs.insert(directoryOf(items[i].finalPath));
+    }
+    if (options_.fsync != FSYNC_NONE) {
+        for (std::set<std::string>::iterator it = dirs.begin(); it != dirs.end(); ++it) {
+            syncDirectory(*it);
+        }
+    }
+    if (!error.empty()) throw CryptoError(error);
+}
+/**
+ * @brief Удаляет ожидающие файлы, не трогая итоговых.
+ */
+void DurabilityGroup::discard() {
+    for (size_t i = 0; i < pending_.size(); i++) {
+        close(pending_[i].fd);
+        unlink(pending_[i].tempPath.c_str());
+    }
+    pending_.clear();
+}
+/**
+ * @brief Создаёт временный файл рядом с итоговым.
+ *
+ * @param[in] path Итоговое имя файла.
+ * @param[in] group Группа, которая выполнит fsync и переименование.
+ *
+ * Если путь указывает не на обычный файл (например, /dev/stdout или FIFO),
+ * запись идёт прямо в него без атомарной замены.
+ */
+AtomicOutputFile::AtomicOutputFile(const std::string &path, DurabilityGroup &group)
+    : path_(path), group_(group), fd_(-1), direct_(false), started_(0), waited_(0) {
+    struct stat st;
+    bool exists = stat(path.c_str(), &st) == 0;
+    if (exists && !S_ISREG(st.st_mode)) {
+        direct_ = true;
+        fd_ = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd_ < 0) throw CryptoError("Cannot open file: " + path);
+        return;
+    }
+
+    std::string dir = directoryOf(path);
+    std::string name = path.substr(path.rfind('/') == std::string::npos ? 0 : path.rfind('/') + 1);
+    std::vector<char> temp(dir.size() + name.size() + 16);
+    snprintf(temp.data(), temp.size(), "%s/.%s.XXXXXX", dir.c_str(), name.c_str());
+    fd_ = mkostemp(temp.data(), O_CLOEXEC);
+    if (fd_ < 0) {
+        throw CryptoError("Cannot open file: " + path);
+    }
+    tempPath_ = temp.data();
+
+    // Права как у заменяемого файла или как у нового файла с учётом umask
+    mode_t mode;
+    if (exists) {
+        mode = st.st_mode & 07777;
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        mode = 0666 & ~mask;
+    }
+    fchmod(fd_, mode);
+}
+
+AtomicOutputFile::~AtomicOutputFile() {
+    if (fd_ >= 0) {
+        close(fd_);
+        if (!direct_) unlink(tempPath_.c_str());
+    }
+}
+/**
+ * @brief Заранее выделяет место под ожидаемый размер результата.
+ *
+ * Непрерывное выделение уменьшает фрагментацию и ошибка нехватки места
+ * обнаруживается до записи. Неподдерживаемый fallocate() не является ошибкой.
+ */
+void AtomicOutputFile::preallocate(uint64_t size) {
+    if (direct_ || size == 0) return;
+    if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, size) != 0 && errno == ENOSPC) {
+        throw CryptoError("No space left for " + path_);
+    }
+}
+/**
+ * @brief Сообщает о записанных данных; запускает фоновую запись на диск.
+ *
+ * Каждые writeBehind байт для нового участка запускается запись
+ * (SYNC_FILE_RANGE_WRITE), а завершения предыдущего участка дожидаемся.
+ * Так объём «грязных» страниц остаётся ограниченным, а fsync в commit()
+ * почти ничего не дописывает.
+ */
+void AtomicOutputFile::wrote() {
+    size_t step = group_.options().writeBehind;
+    if (direct_ || step == 0 || group_.options().fsync == FSYNC_NONE) return;
+    off_t pos = lseek(fd_, 0, SEEK_CUR);
+    if (pos < 0 || (uint64_t)pos - started_ < step) return;
+
+    sync_file_range(fd_, started_, pos - started_, SYNC_FILE_RANGE_WRITE);
+    if (started_ > waited_) {
+        sync_file_range(fd_, waited_, started_ - waited_,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        waited_ = started_;
+    }
+    started_ = pos;
+}
+/**
+ * @brief Завершает запись и передаёт файл группе для fsync и переименования.
+ */
+void AtomicOutputFile::commit() {
+    int fd = fd_;
+    fd_ = -1;
+    if (direct_) {
+        if (close(fd) != 0) throw CryptoError("Cannot write file: " + path_);
+        return;
+    }
+    // Отрезаем выделенное заранее место за концом данных
+    off_t end = lseek(fd, 0, SEEK_CUR);
+    if (end >= 0 && ftruncate(fd, end) != 0) {
+        close(fd);
+        unlink(tempPath_.c_str());
+        throw CryptoError("Cannot write file: " + path_);
+    }
+    group_.add(fd, tempPath_, path_);
+}
@@ -0,0 +1,101 @@
+#ifndef FILE_CRYPTO_OUTPUT_FILE_H
+#define FILE_CRYPTO_OUTPUT_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define OUTPUT_DEFAULT_WRITE_BEHIND (8u << 20)  // байт между запусками фоновой записи на диск
+#define OUTPUT_DEFAULT_FSYNC_BATCH 64           // файлов в одной группе fsync
+
+/**
+ * @brief Когда сбрасывать результат на диск.
+ */
+enum FsyncPolicy {
+    FSYNC_NONE,    ///< только атомарное переименование (защита от сбоя процесса)
+    FSYNC_BATCH,   ///< fsync группами файлов, один fsync каталога на группу
+    FSYNC_ALWAYS   ///< fsync файла и каталога для каждого результата
+};
+
+/**
+ * @brief Параметры записи результата.
+ */
+struct OutputOptions {
+    FsyncPolicy fsync;
+    size_t batchFiles;   ///< размер группы для FSYNC_BATCH
+    size_t writeBehind;  ///< шаг sync_file_range(); 0 — не использовать
+
+    OutputOptions() : fsync(FSYNC_NONE), batchFiles(OUTPUT_DEFAULT_FSYNC_BATCH), writeBehind(OUTPUT_DEFAULT_WRITE_BEHIND) {}
+};
+
+/**
+ * @brief Группа готовых результатов, ожидающих fsync и переименования.
+ *
+ * При FSYNC_BATCH файлы не переименовываются в итоговые имена, пока не
+ * выполнен fsync всей группы, поэтому после сбоя питания под итоговым
+ * именем оказывается либо старый файл, либо полностью записанный новый.
+ * Каталоги синхронизируются один раз на группу.
+ *
+ * Удерживающая группа (hold) переименовывает файлы только по явному
+ * flush(); разрушенная без него — удаляет их временные файлы. Так набор
+ * файлов (тома, полосы) заменяет прежний только целиком.
+ */
+class DurabilityGroup {
+public:
+    explicit DurabilityGroup(const OutputOptions &options, bool hold = false) : options_(options), hold_(hold) {}
+    ~DurabilityGroup();
+
+    void add(int fd, const std::string &tempPath, const std::string &finalPath);
+    void flush();
+    void discard();
+    const OutputOptions &options() const { return options_; }
+
+private:
+    struct Pending {
+        int fd;
+        std::string tempPath;
+        std::string finalPath;
+    };
+
+    OutputOptions options_;
+    bool hold_;
+    std::vector<Pending> pending_;
+
+    DurabilityGroup(const DurabilityGroup &);
+    DurabilityGroup &operator=(const DurabilityGroup &);
+};
+
+/**
+ * @brief Выходной файл, появляющийся под итоговым именем только целиком.
+ *
+ * Данные пишутся во временный файл в том же каталоге, место под него
+ * заранее выделяется fallocate(), а по мере записи sync_file_range()
+ * запускает фоновую запись, чтобы итоговый fsync был коротким. commit()
+ * передаёт файл группе; без commit() временный файл удаляется, и прежнее
+ * содержимое итогового файла не затрагивается.
+ */
+class AtomicOutputFile {
+public:
+    AtomicOutputFile(const std::string &path, DurabilityGroup &group);
+    ~AtomicOutputFile();
+
+    int fd() const { return fd_; }
+    void preallocate(uint64_t size);
+    void wrote();
+    void commit();
+
+private:
+    std::string path_;
+    std::string tempPath_;
+    DurabilityGroup &group_;
+    int fd_;
+    bool direct_;       ///< не обычный файл: пишем напрямую, без переименования
+    uint64_t started_;  ///< до этого смещения фоновая запись уже запущена
+    uint64_t waited_;   ///< до этого смещения запись уже завершена
+
+    AtomicOutputFile(const AtomicOutputFile &);
+    AtomicOutputFile &operator=(const AtomicOutputFile &);
+};
+
+#endif // FILE_CRYPTO_OUTPUT_FILE_H
@@ -0,0 +1,685 @@
+#include "pipeline.h"
+#include "blocking_queue.h"
+#include "fileio.h"
+#include "log.h"
+#include "memory_budget.h"
+#include "numa.h"
+#include "secure_pool.h"
+#include "throttle.h"
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/**
+ * @brief Порция данных, проходящая через конвейер.
+ *
+ * Шифрование выполняется на месте, поэтому одна порция занимает один буфер
+ * с запасом в два блока под дополнение.
+ */
+struct PipelineChunk {
+    SecureBuffer buf;
+    size_t len;                          ///< байт данных в buf
+    uint64_t seq;                        ///< порядковый номер
+    int owner;                           ///< поток шифрования, которому принадлежит буфер
+    bool last;                           ///< последняя порция потока
+    unsigned char iv[AES_BLOCK_SIZE];    ///< для расшифрования: предыдущий блок шифртекста
+};
+
+typedef std::unique_ptr<PipelineChunk> ChunkPtr;
+
+/**
+ * @brief Выбирает число потоков и размер порции под бюджет памяти.
+ *
+ * @param[in] op Шифрование или расшифрование.
+ * @param[in] options Пожелания пользователя.
+ * @param[in] inputSize Размер входных данных, если известен; 0 — неизвестен.
+ * @return PipelineLayout Конфигурация, укладывающаяся в свободную часть бюджета.
+ *
+ * В обращении находится 2 * workers + 3 порции: две у читателя (порция и
+ * упреждающее чтение для поиска конца потока), по две на поток шифрования
+ * (в работе и в очереди) и одна у писателя; в режиме CACHE_DIRECT ещё одна
+ * служит писателю буфером выравнивания. При нехватке памяти сначала
+ * сокращается число потоков до сохранения порции не меньше
+ * PIPELINE_PREFERRED_CHUNK, затем уменьшается сама порция. Шифрование CBC
+ * последовательно по своей природе и всегда идёт в одном потоке.
+ *
+ * Для небольшого входа известного размера порция сокращается до размера
+ * данных, а потоков берётся не больше, чем будет порций: иначе закрепление
+ * в памяти мегабайтных буферов и запуск лишних потоков стоят дороже
+ * самой обработки.
+ */
+PipelineLayout planPipeline(CryptoOp op, const PipelineOptions &options, uint64_t inputSize) {
+    int wanted = options.workers > 0 ? options.workers : (int)std::thread::hardware_concurrency();
+    if (wanted <= 0) wanted = 1;
+    if (op == OP_ENCRYPT) wanted = 1;
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t fitted = 0;
+    if (inputSize > 0) {
+        uint64_t wantedChunk = options.chunkSize ? options.chunkSize : PIPELINE_DEFAULT_CHUNK;
+        uint64_t chunks = (inputSize + wantedChunk - 1) / wantedChunk;
+        if (chunks < (uint64_t)wanted) wanted = (int)chunks;
+        if (inputSize < wantedChunk) fitted = (size_t)((inputSize + page - 1) / page * page);
+    }
+    size_t available = memoryBudget().available();
+    // Пул ключей берёт из бюджета одну страницу; оставляем её свободной
+    available = available > page ? available - page : 0;
+
+    PipelineLayout layout;
+    for (int workers = wanted; workers >= 1; workers--) {
+        size_t buffers = 2 * workers + 3 + (options.cache == CACHE_DIRECT ? 1 : 0);
+        size_t chunk = fitted ? fitted : options.chunkSize ? options.chunkSize : PIPELINE_DEFAULT_CHUNK;
+        size_t perBuffer = available / buffers;
+        if (perBuffer < chunk + page && !options.chunkSize) {
+            chunk = perBuffer > page ? (perBuffer - page) / page * page : 0;
+        }
+        chunk = (chunk + page - 1) / page * page;
+        if (chunk == 0) chunk = page;
+
+        layout.workers = workers;
+        layout.chunkSize = chunk;
+        layout.buffers = buffers;
+        SecurePool probe(chunk + 2 * AES_BLOCK_SIZE, secureHugePages());
+        layout.footprint = probe.slabSizeFor(buffers);
+        bool fits = layout.footprint <= available;
+        if (fits && (chunk >= PIPELINE_PREFERRED_CHUNK || workers == 1)) break;
+    }
+
+    if (layout.chunkSize < PIPELINE_MIN_CHUNK || layout.footprint > memoryBudget().limit()) {
+        std::ostringstream message;
+        message << "Memory budget of " << memoryBudget().limit() << " bytes is too small for the pipeline";
+        throw CryptoError(message.str());
+    }
+    return layout;
+}
+
+/**
+ * @brief Конвейер «чтение → шифрование → запись».
+ *
+ * Читатель заполняет свободные порции и раздаёт их потокам шифрования по
+ * кругу (порция seq достаётся потоку seq % workers), писатель забирает
+ * результаты в том же порядке из выходных очередей потоков, поэтому
+ * переупорядочивать порции не нужно. Каждый буфер закреплён за одним
+ * потоком шифрования, и свободные буферы возвращаются читателю через очередь
+ * этого потока: их конечное число и задаёт предел памяти.
+ *
+ * С параметром numa потоки шифрования распределяются по узлам NUMA и
+ * привязываются к ним, буферы каждого потока переносятся на его узел, а
+ * читатель и писатель работают на узле контроллера своего файла, поэтому
+ * данные порции не переходят между сокетами при шифровании.
+ *
+ * В режиме CACHE_DIRECT файлы читаются и пишутся с O_DIRECT: буферы пула
+ * выровнены по странице, порция кратна странице, а результат собирается
+ * в отдельном выровненном буфере, из которого пишутся только целые
+ * страницы; неполный хвост дописывается уже без O_DIRECT. В режиме
+ * CACHE_DONTNEED прочитанные и записанные на диск страницы вытесняются
+ * из кэша через posix_fadvise().
+ */
+class CipherPipeline {
+public:
+    CipherPipeline(CryptoOp op, const PipelineLayout &layout, const PipelineOptions &options, const unsigned char *key)
+        : op_(op), layout_(layout), options_(options), key_(key), pool_(layout.chunkSize + 2 * AES_BLOCK_SIZE, secureHugePages()),
+          align_(sysconf(_SC_PAGESIZE)), inDirect_(false), outDirect_(false),
+          inDontneed_(false), outDontneed_(false), inOffset_(0), outOffset_(0), outStarted_(0), outDropped_(0),
+          skip_(0), staged_(0), prefix_(nullptr), prefixLen_(0), extent_(0), extentLeft_(0), extentPos_(0),
+          plainOffset_(0), positional_(false) {
+        if (options.numa && numaTopology().nodes.size() > 1) workerNode_ = spreadOverNodes(layout.workers);
+        LOG(LOG_LEVEL_DEBUG, "Pipeline: workers=" << layout.workers << " chunk=" << layout.chunkSize
+                                 << " buffers=" << layout.buffers << " numa_nodes=" << workerNode_.size());
+        pool_.reserve(layout.buffers);
+        for (int i = 0; i < layout.workers; i++) {
+            free_.push_back(std::unique_ptr<BlockingQueue<ChunkPtr> >(new BlockingQueue<ChunkPtr>(layout.buffers)));
+            input_.push_back(std::unique_ptr<BlockingQueue<ChunkPtr> >(new BlockingQueue<ChunkPtr>(2)));
+            output_.push_back(std::unique_ptr<BlockingQueue<ChunkPtr> >(new BlockingQueue<ChunkPtr>()));
+        }
+        // Буфер выравнивания писателя остаётся в пуле и в обращение не попадает
+        for (size_t i = 0; i < (size_t)(2 * layout.workers + 3); i++) {
+            ChunkPtr chunk(new PipelineChunk);
+            chunk->buf = pool_.acquire();
+            chunk->len = 0;
+            chunk->seq = 0;
+            chunk->owner = i % layout.workers;
+            chunk->last = false;
+            if (!workerNode_.empty()) placeOnNode(chunk->buf.data(), pool_.bufferSize(), workerNode_[chunk->owner]);
+            free_[chunk->owner]->push(std::move(chunk));
+        }
+    }
+
+    void run(int inFd, int outFd, const unsigned char *iv);
+    /// читатель сначала отдаёт эти байты, затем продолжает чтение из дескриптора
+    void setPrefix(const unsigned char *data, size_t len) {
+        prefix_ = data;
+        prefixLen_ = len;
+    }
+
+private:
+    void setupInput(int inFd);
+    void setupOutput(int outFd);
+    size_t readChunk(int inFd, unsigned char *buf);
+    bool fill(int inFd, PipelineChunk &chunk);
+    void writeOut(int outFd, const unsigned char *buf, size_t len);
+    bool nextExtent(int fd);
+    void emit(int outFd, const unsigned char *data, size_t len);
+    void flushStage(int outFd, bool final);
+    void dropWritten(int outFd, bool final);
+    void reader(int inFd, const unsigned char *iv);
+    void worker(int index, const unsigned char *iv);
+    void writer(int outFd, const unsigned char *iv);
+    void dispatch(ChunkPtr &chunk, unsigned char *prevBlock);
+    void fail(const std::string &message);
+
+    CryptoOp op_;
+    PipelineLayout layout_;
+    const PipelineOptions &options_;
+    const unsigned char *key_;
+    SecurePool pool_;
+    std::vector<std::unique_ptr<BlockingQueue<ChunkPtr> > > free_;
+    std::vector<std::unique_ptr<BlockingQueue<ChunkPtr> > > input_;
+    std::vector<std::unique_ptr<BlockingQueue<ChunkPtr> > > output_;
+    std::mutex errorMutex_;
+    std::string error_;
+    std::vector<int> workerNode_;  ///< узел NUMA каждого потока; пусто — без привязки
+
+    size_t align_;          ///< выравнивание для O_DIRECT
+    bool inDirect_;         ///< вход читается с O_DIRECT
+    bool outDirect_;        ///< результат пишется с O_DIRECT
+    bool inDontneed_;       ///< прочитанные страницы входа вытесняются
+    bool outDontneed_;      ///< записанные страницы результата вытесняются
+    uint64_t inOffset_;     ///< смещение чтения во входном файле
+    uint64_t outOffset_;    ///< смещение записи в файле результата
+    uint64_t outStarted_;   ///< до этого смещения запись на диск запущена
+    uint64_t outDropped_;   ///< до этого смещения страницы вытеснены
+    size_t skip_;           ///< байт в начале первого выровненного чтения, уже прочитанных ранее
+    SecureBuffer stage_;    ///< буфер выравнивания результата для O_DIRECT
+    size_t staged_;         ///< байт в stage_
+    const unsigned char *prefix_;  ///< данные, уже прочитанные из канала до запуска
+    size_t prefixLen_;             ///< байт в prefix_, ещё не отданных читателю
+    size_t extent_;                ///< следующий участок options_.extents
+    uint64_t extentLeft_;          ///< байт, оставшихся в текущем участке
+    uint64_t extentPos_;           ///< смещение следующего чтения или записи в текущем участке
+    uint64_t plainOffset_;         ///< смещение в открытом тексте за последним участком
+    bool positional_;              ///< участки читаются pread() и пишутся pwrite()
+};
+/**
+ * @brief Запоминает первую ошибку и останавливает все стадии.
+ */
+void CipherPipeline::fail(const std::string &message) {
+    {
+        std::lock_guard<std::mutex> lock(errorMutex_);
+        if (error_.empty()) error_ = message;
+    }
+    for (size_t i = 0; i < input_.size(); i++) {
+        free_[i]->close();
+        input_[i]->close();
+        output_[i]->close();
+    }
+}
+/**
+ * @brief Передаёт порцию потоку шифрования.
+ *
+ * Для расшифрования в порцию записывается IV — последний блок шифртекста
+ * предыдущей порции, поэтому порции расшифровываются независимо.
+ */
+void CipherPipeline::dispatch(ChunkPtr &chunk, unsigned char *prevBlock) {
+    if (options_.onInput && chunk->len > 0) options_.onInput(chunk->buf.data(), chunk->len);
+    if (op_ == OP_DECRYPT) {
+        memcpy(chunk->iv, prevBlock, AES_BLOCK_SIZE);
+        if (chunk->len >= AES_BLOCK_SIZE) {
+            memcpy(prevBlock, chunk->buf.data() + chunk->len - AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+        }
+    }
+    input_[chunk->seq % input_.size()]->push(std::move(chunk));
+}
+
+/**
+ * @brief Настраивает работу входа со страничным кэшем.
+ *
+ * Для O_DIRECT позиция чтения сдвигается назад до границы страницы, а уже
+ * прочитанные байты (IV при расшифровании) отбрасываются из первой порции.
+ * Если O_DIRECT недоступен, вход работает в режиме CACHE_DONTNEED. При
+ * чтении по участкам позиция скачет, и режим кэша не меняется.
+ */
+void CipherPipeline::setupInput(int inFd) {
+    if (options_.cache == CACHE_NORMAL || (options_.extents && op_ == OP_ENCRYPT)) return;
+    off_t pos = lseek(inFd, 0, SEEK_CUR);
+    if (pos < 0) return;  // канал: кэша нет
+    inOffset_ = pos;
+    if (options_.cache == CACHE_DIRECT && setDirectIo(inFd, true)) {
+        off_t aligned = pos / align_ * align_;
+        if (lseek(inFd, aligned, SEEK_SET) == aligned) {
+            inDirect_ = true;
+            inOffset_ = aligned;
+            skip_ = pos - aligned;
+            return;
+        }
+        setDirectIo(inFd, false);
+        lseek(inFd, pos, SEEK_SET);
+    }
+    inDontneed_ = true;
+    posix_fadvise(inFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+/**
+ * @brief Настраивает работу результата со страничным кэшем.
+ */
+void CipherPipeline::setupOutput(int outFd) {
+    if (options_.cache == CACHE_NORMAL || (options_.extents && op_ == OP_DECRYPT)) return;
+    off_t pos = lseek(outFd, 0, SEEK_CUR);
+    if (pos < 0) return;
+    outOffset_ = outStarted_ = outDropped_ = pos;
+    if (options_.cache == CACHE_DIRECT && pos % align_ == 0 && setDirectIo(outFd, true)) {
+        outDirect_ = true;
+        stage_ = pool_.acquire();
+        return;
+    }
+    outDontneed_ = true;
+}
+/**
+ * @brief Переходит к следующему участку открытого текста.
+ *
+ * @param[in] fd Вход при шифровании или результат при расшифровании.
+ * @return bool false, если участков больше нет.
+ *
+ * Файл читается и пишется по смещениям участков через pread() и pwrite(),
+ * не трогая позицию дескриптора: так несколько конвейеров могут
+ * одновременно работать с одним дескриптором. Если результат — канал,
+ * пропуск заполняется нулями.
+ */
+bool CipherPipeline::nextExtent(int fd) {
+    if (extent_ == options_.extents->size()) return false;
+    const FileExtent &extent = (*options_.extents)[extent_++];
+    positional_ = lseek(fd, 0, SEEK_CUR) >= 0;
+    if (!positional_) {
+        if (errno != ESPIPE || op_ != OP_DECRYPT || extent.offset < plainOffset_) {
+            throw CryptoError(std::string("Seek failed: ") + strerror(errno));
+        }
+        static const unsigned char zeros[4096] = {0};
+        for (uint64_t gap = extent.offset - plainOffset_; gap > 0;) {
+            size_t n = gap < sizeof(zeros) ? gap : sizeof(zeros);
+            writeAll(fd, zeros, n);
+            gap -= n;
+        }
+    }
+    extentLeft_ = extent.length;
+    extentPos_ = extent.offset;
+    plainOffset_ = extent.offset + extent.length;
+    return true;
+}
+/**
+ * @brief Читает до полной порции.
+ *
+ * Короткое чтение O_DIRECT оставляет позицию невыровненной, и следующий
+ * read() вернёт EINVAL; тогда O_DIRECT снимается и чтение продолжается
+ * через кэш с вытеснением страниц.
+ */
+size_t CipherPipeline::readChunk(int inFd, unsigned char *buf) {
+    size_t done = 0;
+    if (prefixLen_ > 0) {
+        done = prefixLen_ < layout_.chunkSize ? prefixLen_ : layout_.chunkSize;
+        memcpy(buf, prefix_, done);
+        prefix_ += done;
+        prefixLen_ -= done;
+    }
+    const bool extents = options_.extents != nullptr && op_ == OP_ENCRYPT;
+    while (done < layout_.chunkSize) {
+        size_t want = layout_.chunkSize - done;
+        if (extents) {
+            if (extentLeft_ == 0) {
+                if (!nextExtent(inFd)) break;
+                continue;
+            }
+            if (want > extentLeft_) want = extentLeft_;
+        }
+        ssize_t n = extents && positional_ ? pread(inFd, buf + done, want, extentPos_) : read(inFd, buf + done, want);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL && inDirect_) {
+                setDirectIo(inFd, false);
+                inDirect_ = false;
+                inDontneed_ = true;
+                continue;
+            }
+            throw CryptoError(std::string("Read failed: ") + strerror(errno));
+        }
+        if (n == 0) {
+            if (extents) throw CryptoError("Input shrank while being read");
+            break;
+        }
+        done += n;
+        if (extents) {
+            extentLeft_ -= n;
+            extentPos_ += n;
+        }
+    }
+    return done;
+}
+/**
+ * @brief Заполняет порцию данными входа.
+ *
+ * @return bool true, если прочитана полная порция (поток, возможно, не закончился).
+ */
+bool CipherPipeline::fill(int inFd, PipelineChunk &chunk) {
+    unsigned char *data = chunk.buf.data();
+    size_t n = readChunk(inFd, data);
+    ioThrottle().account(n, 1);
+    bool full = n == layout_.chunkSize;
+    if (inDontneed_ && n > 0) {
+        posix_fadvise(inFd, inOffset_, n, POSIX_FADV_DONTNEED);
+    }
+    inOffset_ += n;
+    if (skip_) {
+        size_t skip = skip_ < n ? skip_ : n;
+        memmove(data, data + skip, n - skip);
+        n -= skip;
+        skip_ -= skip;
+    }
+    chunk.len = n;
+    return full;
+}
+
+void CipherPipeline::reader(int inFd, const unsigned char *iv) {
+    try {
+        if (!workerNode_.empty()) {
+            int node = storageNode(inFd);
+            if (node >= 0) pinToNode(node);
+        }
+        unsigned char prevBlock[AES_BLOCK_SIZE];
+        if (iv) memcpy(prevBlock, iv, AES_BLOCK_SIZE);
+
+        uint64_t seq = 0;
+        ChunkPtr current;
+        if (!free_[0]->pop(current)) return;
+        bool full = fill(inFd, *current);
+        for (;;) {
+            current->seq = seq++;
+            current->last = !full;
+            if (current->last) {
+                dispatch(current, prevBlock);
+                return;
+            }
+            // Упреждающее чтение: только так можно узнать, что порция последняя
+            ChunkPtr next;
+            if (!free_[seq % free_.size()]->pop(next)) return;
+            full = fill(inFd, *next);
+            if (next->len == 0) {
+                current->last = true;
+                dispatch(current, prevBlock);
+                free_[next->owner]->push(std::move(next));
+                return;
+            }
+            dispatch(current, prevBlock);
+            current = std::move(next);
+        }
+    } catch (const std::exception &e) {
+        fail(e.what());
+    }
+}
+/**
+ * @brief Поток шифрования.
+ *
+ * @param[in] index Номер потока; он обрабатывает порции с seq % workers == index.
+ * @param[in] iv IV потока при шифровании.
+ *
+ * Шифрование ведёт один поток с непрерывным контекстом CBC. При
+ * расшифровании контекст переинициализируется IV каждой порции, а
+ * дополнение проверяется только в последней.
+ */
+void CipherPipeline::worker(int index, const unsigned char *iv) {
+    if (!workerNode_.empty()) pinToNode(workerNode_[index]);
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    try {
+        if (!ctx) handleErrors();
+        int rc = op_ == OP_ENCRYPT ? EVP_EncryptInit_ex(ctx, aes256Cbc(), nullptr, key_, iv)
+                                   : EVP_DecryptInit_ex(ctx, aes256Cbc(), nullptr, key_, nullptr);
+        if (rc != 1) handleErrors();
+
+        ChunkPtr chunk;
+        while (input_[index]->pop(chunk)) {
+            unsigned char *data = chunk->buf.data();
+            int len = 0, finalLen = 0;
+            if (op_ == OP_ENCRYPT) {
+                if (1 != EVP_EncryptUpdate(ctx, data, &len, data, chunk->len)) handleErrors();
+                if (chunk->last && 1 != EVP_EncryptFinal_ex(ctx, data + len, &finalLen)) handleErrors();
+            } else {
+                if (1 != EVP_DecryptInit_ex(ctx, nullptr, nullptr, nullptr, chunk->iv)) handleErrors();
+                EVP_CIPHER_CTX_set_padding(ctx, chunk->last ? 1 : 0);
+                if (1 != EVP_DecryptUpdate(ctx, data, &len, data, chunk->len)) handleErrors();
+                if (chunk->last && 1 != EVP_DecryptFinal_ex(ctx, data + len, &finalLen)) handleErrors();
+            }
+            chunk->len = len + finalLen;
+            if (!output_[index]->push(std::move(chunk))) break;
+        }
+    } catch (const std::exception &e) {
+        fail(e.what());
+    }
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+/**
+ * @brief Записывает данные; при отказе O_DIRECT продолжает запись через кэш.
+ */
+void CipherPipeline::writeOut(int outFd, const unsigned char *buf, size_t len) {
+    const bool extents = options_.extents != nullptr && op_ == OP_DECRYPT;
+    while (len > 0) {
+        size_t want = len;
+        if (extents) {
+            if (extentLeft_ == 0) {
+                if (!nextExtent(outFd)) throw CryptoError("Decrypted data does not match the extent map");
+                continue;
+            }
+            if (want > extentLeft_) want = extentLeft_;
+        }
+        ssize_t n = extents && positional_ ? pwrite(outFd, buf, want, extentPos_) : write(outFd, buf, want);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL && outDirect_) {
+                setDirectIo(outFd, false);
+                outDirect_ = false;
+                outDontneed_ = true;
+                continue;
+            }
+            throw CryptoError(std::string("Write failed: ") + strerror(errno));
+        }
+        buf += n;
+        len -= n;
+        outOffset_ += n;
+        if (extents) {
+            extentLeft_ -= n;
+            extentPos_ += n;
+        }
+    }
+}
+/**
+ * @brief Передаёт очередную часть результата на запись.
+ *
+ * С O_DIRECT данные копируются в буфер выравнивания, иначе пишутся сразу.
+ */
+void CipherPipeline::emit(int outFd, const unsigned char *data, size_t len) {
+    ioThrottle().account(0, 1);
+    if (!stage_.data()) {
+        writeOut(outFd, data, len);
+        dropWritten(outFd, false);
+        return;
+    }
+    while (len > 0) {
+        size_t n = stage_.size() - staged_;
+        if (n > len) n = len;
+        memcpy(stage_.data() + staged_, data, n);
+        staged_ += n;
+        data += n;
+        len -= n;
+        if (staged_ >= layout_.chunkSize) flushStage(outFd, false);
+    }
+}
+/**
+ * @brief Пишет накопленные целые страницы из буфера выравнивания.
+ *
+ * @param[in] final Конец потока: неполный хвост пишется без O_DIRECT.
+ */
+void CipherPipeline::flushStage(int outFd, bool final) {
+    size_t aligned = staged_ / align_ * align_;
+    writeOut(outFd, stage_.data(), aligned);
+    staged_ -= aligned;
+    memmove(stage_.data(), stage_.data() + aligned, staged_);
+    if (final && staged_ > 0) {
+        if (outDirect_) {
+            setDirectIo(outFd, false);
+            outDirect_ = false;
+        }
+        writeOut(outFd, stage_.data(), staged_);
+        staged_ = 0;
+    }
+}
+/**
+ * @brief Вытесняет из кэша уже записанные на диск страницы результата.
+ *
+ * Грязные страницы posix_fadvise() не вытесняет, поэтому для только что
+ * записанного участка запускается запись на диск, а для предыдущего
+ * дожидаемся её завершения и вытесняем его. В конце потока ждём всё.
+ */
+void CipherPipeline::dropWritten(int outFd, bool final) {
+    if (!outDontneed_) return;
+    if (outOffset_ > outStarted_) {
+        sync_file_range(outFd, outStarted_, outOffset_ - outStarted_, SYNC_FILE_RANGE_WRITE);
+    }
+    uint64_t until = final ? outOffset_ : outStarted_;
+    if (until > outDropped_) {
+        sync_file_range(outFd, outDropped_, until - outDropped_,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(outFd, outDropped_, until - outDropped_, POSIX_FADV_DONTNEED);
+        outDropped_ = until;
+    }
+    outStarted_ = outOffset_;
+}
+/**
+ * @brief Писатель: при шифровании сначала IV, затем порции по порядку.
+ */
+void CipherPipeline::writer(int outFd, const unsigned char *iv) {
+    try {
+        if (op_ == OP_ENCRYPT) {
+            emit(outFd, iv, AES_BLOCK_SIZE);
+            if (options_.onOutput) options_.onOutput(iv, AES_BLOCK_SIZE);
+        }
+        for (uint64_t seq = 0;; seq++) {
+            ChunkPtr chunk;
+            if (!output_[seq % output_.size()]->pop(chunk)) return;
+            emit(outFd, chunk->buf.data(), chunk->len);
+            if (options_.onOutput) options_.onOutput(chunk->buf.data(), chunk->len);
+            bool last = chunk->last;
+            free_[chunk->owner]->push(std::move(chunk));
+            if (last) {
+                if (stage_.data()) flushStage(outFd, true);
+                dropWritten(outFd, true);
+                return;
+            }
+        }
+    } catch (const std::exception &e) {
+        fail(e.what());
+    }
+}
+/**
+ * @brief Запускает стадии и дожидается их завершения.
+ *
+ * Писателем служит вызывающий поток. Первая ошибка любой стадии
+ * выбрасывается как CryptoError после остановки всех потоков.
+ */
+void CipherPipeline::run(int inFd, int outFd, const unsigned char *iv) {
+    setupInput(inFd);
+    setupOutput(outFd);
+    std::vector<std::thread> threads;
+    threads.push_back(std::thread(&CipherPipeline::reader, this, inFd, iv));
+    for (int i = 0; i < layout_.workers; i++) {
+        threads.push_back(std::thread(&CipherPipeline::worker, this, i, iv));
+    }
+
+    // Писатель — вызывающий поток: привязка к узлу только на время записи
+    cpu_set_t savedAffinity;
+    bool pinned = false;
+    if (!workerNode_.empty()) {
+        int node = storageNode(outFd);
+        pinned = node >= 0 && pthread_getaffinity_np(pthread_self(), sizeof(savedAffinity), &savedAffinity) == 0 &&
+                 pinToNode(node);
+    }
+    writer(outFd, iv);
+    if (pinned) pthread_setaffinity_np(pthread_self(), sizeof(savedAffinity), &savedAffinity);
+
+    fail("");
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+    // Дескрипторы принадлежат вызывающему: возвращаем обычный режим
+    if (inDirect_) setDirectIo(inFd, false);
+    if (outDirect_) setDirectIo(outFd, false);
+    if (!error_.empty()) throw CryptoError(error_);
+}
+/**
+ * @brief Непрочитанный остаток обычного файла, не меньше 1; 0 — неизвестен.
+ */
+static uint64_t remainingInput(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos < 0) return 0;
+    return pos < st.st_size ? st.st_size - pos : 1;
+}
+/**
+ * @brief Шифрует поток: IV, затем шифртекст AES-256 CBC.
+ *
+ * @param[in] inFd Дескриптор с исходными данными.
+ * @param[in] outFd Дескриптор для результата.
+ * @param[in] key Ключ AES-256.
+ * @param[in] iv Вектор инициализации; если nullptr, генерируется случайный.
+ * @param[in] options Параметры конвейера.
+ *
+ * Формат результата совпадает с encryptDataWithIV().
+ */
+void encryptPipeline(int inFd, int outFd, const unsigned char *key, const unsigned char *iv, const PipelineOptions &options) {
+    unsigned char randomIv[AES_BLOCK_SIZE];
+    if (!iv) {
+        if (!RAND_bytes(randomIv, AES_BLOCK_SIZE)) {
+            handleErrors();
+        }
+        iv = randomIv;
+    }
+    CipherPipeline pipeline(OP_ENCRYPT, planPipeline(OP_ENCRYPT, options, remainingInput(inFd)), options, key);
+    pipeline.run(inFd, outFd, iv);
+}
+/**
+ * @brief Расшифровывает поток, начинающийся с IV.
+ *
+ * @param[in] inFd Дескриптор с зашифрованными данными.
+ * @param[in] outFd Дескриптор для результата.
+ * @param[in] key Ключ AES-256.
+ * @param[in] options Параметры конвейера.
+ */
+void decryptPipeline(int inFd, int outFd, const unsigned char *key, const PipelineOptions &options) {
+    decryptPipeline(inFd, outFd, key, options, std::vector<unsigned char>());
+}
+/**
+ * @brief Расшифровывает поток, начало которого уже прочитано из канала.
+ *
+ * @param[in] prefix Начало потока (IV и, возможно, шифртекст), за которым
+ *            следуют данные inFd.
+ */
+void decryptPipeline(int inFd, int outFd, const unsigned char *key, const PipelineOptions &options,
+                     const std::vector<unsigned char> &prefix) {
+    unsigned char iv[AES_BLOCK_SIZE];
+    size_t fromPrefix = prefix.size() < AES_BLOCK_SIZE ? prefix.size() : AES_BLOCK_SIZE;
+    if (fromPrefix) memcpy(iv, prefix.data(), fromPrefix);
+    if (readFull(inFd, iv + fromPrefix, AES_BLOCK_SIZE - fromPrefix) != AES_BLOCK_SIZE - fromPrefix) {
+        throw CryptoError("Input is too short to contain an IV");
+    }
+    if (options.onInput) options.onInput(iv, AES_BLOCK_SIZE);
+    CipherPipeline pipeline(OP_DECRYPT, planPipeline(OP_DECRYPT, options, remainingInput(inFd)), options, key);
+    pipeline.setPrefix(prefix.data() + fromPrefix, prefix.size() - fromPrefix);
+    pipeline.run(inFd, outFd, iv);
+}
@@ -0,0 +1,67 @@
+#ifndef FILE_CRYPTO_PIPELINE_H
+#define FILE_CRYPTO_PIPELINE_H
+
+#include "crypto.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#define PIPELINE_DEFAULT_CHUNK (1u << 20)    // порция по умолчанию без ограничения памяти
+#define PIPELINE_PREFERRED_CHUNK (64u << 10) // меньше этого сначала сокращается число потоков
+#define PIPELINE_MIN_CHUNK 4096              // минимальная порция при жёстком лимите
+
+/**
+ * @brief Как конвейер обращается со страничным кэшем.
+ */
+enum CacheMode {
+    CACHE_NORMAL,    ///< обычный ввод-вывод через кэш
+    CACHE_DONTNEED,  ///< через кэш, но обработанные страницы сразу вытесняются
+    CACHE_DIRECT     ///< O_DIRECT в обход кэша; где не поддерживается — как CACHE_DONTNEED
+};
+
+/**
+ * @brief Участок файла с данными.
+ */
+struct FileExtent {
+    uint64_t offset;  ///< начало участка
+    uint64_t length;  ///< длина участка
+};
+
+/**
+ * @brief Параметры конвейера шифрования.
+ */
+struct PipelineOptions {
+    int workers;       ///< потоков расшифрования; 0 — по числу ядер
+    size_t chunkSize;  ///< размер порции; 0 — выбрать по бюджету памяти
+    CacheMode cache;   ///< режим работы со страничным кэшем
+    bool numa;         ///< привязывать потоки и буферы к узлам NUMA
+    /// участки открытого текста: при шифровании читаются только они, при
+    /// расшифровании результат раскладывается по ним; nullptr — файл целиком
+    const std::vector<FileExtent> *extents;
+    /// вызывается читателем для каждой порции входных данных по порядку, до шифрования
+    std::function<void(const unsigned char *data, size_t len)> onInput;
+    /// вызывается писателем после записи каждой части результата, включая IV
+    std::function<void(const unsigned char *data, size_t len)> onOutput;
+
+    PipelineOptions() : workers(0), chunkSize(0), cache(CACHE_NORMAL), numa(false), extents(nullptr) {}
+};
+
+/**
+ * @brief Выбранная конфигурация конвейера.
+ */
+struct PipelineLayout {
+    int workers;         ///< потоков шифрования
+    size_t chunkSize;    ///< байт данных в порции
+    size_t buffers;      ///< порций в обращении одновременно
+    size_t footprint;    ///< резерв в бюджете памяти, байт
+};
+
+PipelineLayout planPipeline(CryptoOp op, const PipelineOptions &options, uint64_t inputSize = 0);
+void encryptPipeline(int inFd, int outFd, const unsigned char *key, const unsigned char *iv, const PipelineOptions &options);
+void decryptPipeline(int inFd, int outFd, const unsigned char *key, const PipelineOptions &options);
+void decryptPipeline(int inFd, int outFd, const unsigned char *key, const PipelineOptions &options,
+                     const std::vector<unsigned char> &prefix);
+
+#endif // FILE_CRYPTO_PIPELINE_H
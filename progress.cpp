@@ -0,0 +1,115 @@
+#include "progress.h"
+
+#include <cstdio>
+#include <unistd.h>
+
+#define PROGRESS_BAR_WIDTH 30
+
+/**
+ * @brief Размер в удобных единицах: «512 B», «1.5 MiB».
+ */
+static std::string formatBytes(double bytes) {
+    static const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        unit++;
+    }
+    char text[32];
+    snprintf(text, sizeof(text), unit ? "%.1f %s" : "%.0f %s", bytes, units[unit]);
+    return text;
+}
+/**
+ * @brief Длительность в виде ч:мм:сс.
+ */
+static std::string formatDuration(double seconds) {
+    long total = (long)(seconds + 0.5);
+    char text[32];
+    snprintf(text, sizeof(text), "%ld:%02ld:%02ld", total / 3600, total / 60 % 60, total % 60);
+    return text;
+}
+
+ProgressReporter::ProgressReporter(ProgressMode mode, uint64_t total, double interval, std::function<uint64_t()> sampler)
+    : mode_(mode), total_(total), interval_(interval), sampler_(sampler), done_(0), start_(Clock::now()), stop_(false),
+      drawn_(false), finished_(false) {
+    if (mode_ == PROGRESS_AUTO) mode_ = isatty(STDERR_FILENO) ? PROGRESS_BAR : PROGRESS_LINES;
+    if (mode_ != PROGRESS_OFF) thread_ = std::thread(&ProgressReporter::run, this);
+}
+
+ProgressReporter::~ProgressReporter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    if (thread_.joinable()) thread_.join();
+    // Прерванная полоса: переводим строку, чтобы сообщение об ошибке не слилось с ней
+    if (mode_ == PROGRESS_BAR && drawn_ && !finished_) fputc('\n', stderr);
+}
+/**
+ * @brief Печатает итоговую строку и останавливает поток вывода.
+ *
+ * Вызывается только при успешном завершении; при ошибке отчёт просто
+ * прекращается без строки о 100%.
+ */
+void ProgressReporter::finish() {
+    if (mode_ == PROGRESS_OFF) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stop_) return;
+        stop_ = true;
+    }
+    wake_.notify_all();
+    thread_.join();
+    // Размер результата расшифрования известен лишь с точностью до дополнения
+    total_ = current();
+    report(true);
+    finished_ = true;
+}
+
+uint64_t ProgressReporter::current() const {
+    return sampler_ ? sampler_() : done_.load(std::memory_order_relaxed);
+}
+
+void ProgressReporter::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!wake_.wait_for(lock, interval_, [this] { return stop_; })) {
+        lock.unlock();
+        report(false);
+        lock.lock();
+    }
+}
+/**
+ * @brief Печатает текущее состояние: объём, скорость и оставшееся время.
+ *
+ * Скорость считается как средняя с начала работы: она устойчивее мгновенной,
+ * а для длинных равномерных операций почти не отличается от неё.
+ */
+void ProgressReporter::report(bool final) {
+    uint64_t done = current();
+    double elapsed = std::chrono::duration<double>(Clock::now() - start_).count();
+    double rate = elapsed > 0 ? done / elapsed : 0;
+    double percent = total_ ? 100.0 * done / total_ : 0;
+    if (percent > 100) percent = 100;
+    bool eta = total_ && rate > 0 && done < total_;
+    double remaining = eta ? (total_ - done) / rate : 0;
+
+    if (mode_ == PROGRESS_LINES) {
+        fprintf(stderr, "progress bytes=%llu total=%llu percent=%.1f rate=%.0f elapsed=%.1f eta=%.0f%s\n",
+                (unsigned long long)done, (unsigned long long)total_, percent, rate, elapsed, remaining,
+                final ? " done=1" : "");
+        return;
+    }
+    std::string bar;
+    if (total_) {
+        int filled = (int)(percent / 100 * PROGRESS_BAR_WIDTH);
+        bar = "[" + std::string(filled, '#') + std::string(PROGRESS_BAR_WIDTH - filled, ' ') + "] ";
+    }
+    char line[256];
+    snprintf(line, sizeof(line), "%s%5.1f%%  %s/%s  %s/s  %s %s", bar.c_str(), percent, formatBytes(done).c_str(),
+             total_ ? formatBytes(total_).c_str() : "?", formatBytes(rate).c_str(), final ? "elapsed" : "ETA",
+             final ? formatDuration(elapsed).c_str() : eta ? formatDuration(remaining).c_str() : "--:--");
+    // \033[K стирает остаток прежней, более длинной строки
+    fprintf(stderr, "\r%s\033[K%s", line, final ? "\n" : "");
+    drawn_ = true;
+}
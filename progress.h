@@ -0,0 +1,67 @@
+#ifndef FILE_CRYPTO_PROGRESS_H
+#define FILE_CRYPTO_PROGRESS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#define PROGRESS_DEFAULT_INTERVAL 1.0  // секунд между обновлениями
+
+/**
+ * @brief Вид вывода хода выполнения.
+ */
+enum ProgressMode {
+    PROGRESS_OFF,
+    PROGRESS_AUTO,   ///< полоса, если stderr — терминал, иначе строки
+    PROGRESS_BAR,    ///< обновляемая строка с полосой
+    PROGRESS_LINES   ///< отдельные строки key=value для журналов и сценариев
+};
+
+/**
+ * @brief Отчёт о ходе выполнения в stderr.
+ *
+ * Стадии обработки только увеличивают атомарный счётчик (add() на каждую
+ * порцию — одна операция без блокировок), а вывод делает отдельный поток раз
+ * в interval секунд, поэтому накладные расходы не зависят от размера порции.
+ * Если задан sampler, счётчик не используется, а текущее значение
+ * запрашивается у него (например, размер файла, который пишет агент).
+ */
+class ProgressReporter {
+public:
+    ProgressReporter(ProgressMode mode, uint64_t total, double interval = PROGRESS_DEFAULT_INTERVAL,
+                     std::function<uint64_t()> sampler = std::function<uint64_t()>());
+    ~ProgressReporter();
+
+    void add(uint64_t bytes) { done_.fetch_add(bytes, std::memory_order_relaxed); }
+    void finish();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    void run();
+    void report(bool final);
+    uint64_t current() const;
+
+    ProgressMode mode_;
+    uint64_t total_;
+    std::chrono::duration<double> interval_;
+    std::function<uint64_t()> sampler_;
+    std::atomic<uint64_t> done_;
+    Clock::time_point start_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool stop_;
+    bool drawn_;     ///< полоса уже выведена (меняется только потоком вывода до join)
+    bool finished_;  ///< напечатана итоговая строка
+    std::thread thread_;
+
+    ProgressReporter(const ProgressReporter &);
+    ProgressReporter &operator=(const ProgressReporter &);
+};
+
+#endif // FILE_CRYPTO_PROGRESS_H
@@ -0,0 +1,168 @@
+#include "secure_pool.h"
+#include "crypto.h"
+#include "log.h"
+#include "memory_budget.h"
+
+#include <openssl/crypto.h>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static bool useHugePages = false;
+
+SecureBuffer &SecureBuffer::operator=(SecureBuffer &&other) {
+    if (this != &other) {
+        reset();
+        pool_ = other.pool_;
+        data_ = other.data_;
+        other.pool_ = nullptr;
+        other.data_ = nullptr;
+    }
+    return *this;
+}
+
+size_t SecureBuffer::size() const {
+    return pool_ ? pool_->bufferSize() : 0;
+}
+
+void SecureBuffer::reset() {
+    if (pool_ && data_) pool_->release(data_);
+    pool_ = nullptr;
+    data_ = nullptr;
+}
+/**
+ * @brief Создаёт пул буферов.
+ *
+ * @param[in] bufferSize Размер одного буфера; буферы от страницы и больше
+ * выравниваются по границе страницы, меньшие — по 64 байта.
+ * @param[in] hugePages Пытаться размещать слабы в больших страницах.
+ */
+SecurePool::SecurePool(size_t bufferSize, bool hugePages) : hugePages_(hugePages) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t align = bufferSize >= page ? page : 64;
+    bufferSize_ = (bufferSize + align - 1) / align * align;
+    // Бюджет создаётся раньше пула и потому разрушается позже: статические
+    // пулы (keyPool(), blockCache()) возвращают в него память при выходе
+    memoryBudget();
+}
+
+SecurePool::~SecurePool() {
+    for (size_t i = 0; i < slabs_.size(); i++) {
+        OPENSSL_cleanse(slabs_[i].first, slabs_[i].second);
+        munlock(slabs_[i].first, slabs_[i].second);
+        munmap(slabs_[i].first, slabs_[i].second);
+        memoryBudget().release(slabs_[i].second);
+    }
+}
+/**
+ * @brief Размер слаба для заданного числа буферов.
+ */
+size_t SecurePool::slabSizeFor(size_t count) const {
+    size_t bytes = bufferSize_ * count;
+    size_t align = hugePages_ ? SECURE_SLAB_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+    return (bytes + align - 1) / align * align;
+}
+/**
+ * @brief Заранее выделяет ровно count буферов одним слабом.
+ *
+ * @param[in] count Число буферов.
+ *
+ * Память резервируется в бюджете с ожиданием, поэтому параллельные операции
+ * при нехватке лимита выполняются по очереди, а не завершаются ошибкой.
+ */
+void SecurePool::reserve(size_t count) {
+    size_t slabSize = slabSizeFor(count);
+    memoryBudget().acquire(slabSize);
+    std::lock_guard<std::mutex> lock(mutex_);
+    addSlab(slabSize);
+}
+/**
+ * @brief Добавляет в пул новый слаб при исчерпании свободных буферов.
+ */
+void SecurePool::grow() {
+    size_t slabSize = slabSizeFor(bufferSize_ >= SECURE_SLAB_SIZE ? 1 : 16);
+    if (hugePages_ && slabSize < SECURE_SLAB_SIZE) slabSize = SECURE_SLAB_SIZE;
+    if (!memoryBudget().tryAcquire(slabSize)) {
+        throw CryptoError("Memory budget exceeded");
+    }
+    addSlab(slabSize);
+}
+/**
+ * @brief Отображает слаб и делит его на буферы.
+ *
+ * Сначала пробуются явные большие страницы (MAP_HUGETLB), затем обычное
+ * отображение с подсказкой MADV_HUGEPAGE. Ошибка mlock() не фатальна: при
+ * малом RLIMIT_MEMLOCK выводится одно предупреждение. Память уже учтена в бюджете.
+ */
+void SecurePool::addSlab(size_t slabSize) {
+    void *mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (hugePages_) {
+        mem = mmap(nullptr, slabSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    }
+#endif
+    if (mem == MAP_FAILED) {
+        mem = mmap(nullptr, slabSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (mem == MAP_FAILED) {
+            memoryBudget().release(slabSize);
+            throw CryptoError(std::string("Cannot allocate secure buffers: ") + strerror(errno));
+        }
+#ifdef MADV_HUGEPAGE
+        if (hugePages_) madvise(mem, slabSize, MADV_HUGEPAGE);
+#endif
+    }
+    if (mlock(mem, slabSize) != 0) {
+        static bool warned = false;
+        if (!warned) {
+            warned = true;
+            LOG(LOG_LEVEL_WARN, "cannot lock buffers in memory: " << strerror(errno));
+        }
+    }
+#ifdef MADV_DONTDUMP
+    madvise(mem, slabSize, MADV_DONTDUMP);
+#endif
+    slabs_.push_back(std::make_pair(mem, slabSize));
+
+    unsigned char *base = static_cast<unsigned char *>(mem);
+    for (size_t off = 0; off + bufferSize_ <= slabSize; off += bufferSize_) {
+        free_.push_back(base + off);
+    }
+}
+/**
+ * @brief Берёт свободный буфер, при необходимости расширяя пул.
+ */
+SecureBuffer SecurePool::acquire() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_.empty()) grow();
+    unsigned char *data = free_.back();
+    free_.pop_back();
+    return SecureBuffer(this, data);
+}
+/**
+ * @brief Затирает буфер и возвращает его в пул.
+ */
+void SecurePool::release(unsigned char *data) {
+    OPENSSL_cleanse(data, bufferSize_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.push_back(data);
+}
+/**
+ * @brief Включает большие страницы для пулов; вызывается до первого использования.
+ */
+void configureSecurePools(bool hugePages) {
+    useHugePages = hugePages;
+}
+/**
+ * @brief Включены ли большие страницы для пулов буферов данных.
+ */
+bool secureHugePages() {
+    return useHugePages;
+}
+/**
+ * @brief Пул буферов для ключей.
+ */
+SecurePool &keyPool() {
+    static SecurePool pool(SECURE_KEY_BUFFER_SIZE, false);
+    return pool;
+}
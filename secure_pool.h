@@ -0,0 +1,80 @@
+#ifndef FILE_CRYPTO_SECURE_POOL_H
+#define FILE_CRYPTO_SECURE_POOL_H
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#define SECURE_SLAB_SIZE (2u << 20)   // размер слаба; совпадает с размером большой страницы x86-64
+#define SECURE_KEY_BUFFER_SIZE 64     // буфер для ключевого материала (до двух ключей AES-256)
+
+class SecurePool;
+
+/**
+ * @brief Буфер из SecurePool, возвращаемый в пул при разрушении.
+ *
+ * Перемещаемый, но не копируемый. Перед возвратом в пул содержимое затирается.
+ */
+class SecureBuffer {
+public:
+    SecureBuffer() : pool_(nullptr), data_(nullptr) {}
+    SecureBuffer(SecurePool *pool, unsigned char *data) : pool_(pool), data_(data) {}
+    SecureBuffer(SecureBuffer &&other) : pool_(other.pool_), data_(other.data_) {
+        other.pool_ = nullptr;
+        other.data_ = nullptr;
+    }
+    SecureBuffer &operator=(SecureBuffer &&other);
+    ~SecureBuffer() { reset(); }
+
+    unsigned char *data() const { return data_; }
+    size_t size() const;
+    void reset();
+
+private:
+    SecurePool *pool_;
+    unsigned char *data_;
+
+    SecureBuffer(const SecureBuffer &);
+    SecureBuffer &operator=(const SecureBuffer &);
+};
+
+/**
+ * @brief Пул буферов фиксированного размера в заблокированной памяти.
+ *
+ * Память выделяется слабами через mmap(): страницы сразу отображаются
+ * (MAP_POPULATE), закрепляются mlock() и исключаются из дампов, а при
+ * наличии — берутся из больших страниц. Освобождённые буферы затираются и
+ * возвращаются в список свободных, поэтому при обработке многих порций и
+ * файлов подряд повторных выделений памяти не происходит. Каждый слаб
+ * учитывается в общем бюджете памяти (memoryBudget()).
+ */
+class SecurePool {
+public:
+    SecurePool(size_t bufferSize, bool hugePages);
+    ~SecurePool();
+
+    void reserve(size_t count);
+    SecureBuffer acquire();
+    void release(unsigned char *data);
+    size_t bufferSize() const { return bufferSize_; }
+    size_t slabSizeFor(size_t count) const;
+
+private:
+    void grow();
+    void addSlab(size_t slabSize);
+
+    size_t bufferSize_;
+    bool hugePages_;
+    std::mutex mutex_;
+    std::vector<unsigned char *> free_;
+    std::vector<std::pair<void *, size_t> > slabs_;
+
+    SecurePool(const SecurePool &);
+    SecurePool &operator=(const SecurePool &);
+};
+
+void configureSecurePools(bool hugePages);
+bool secureHugePages();
+SecurePool &keyPool();
+
+#endif // FILE_CRYPTO_SECURE_POOL_H
@@ -0,0 +1,671 @@
+#include "server.h"
+#include "crypto.h"
+#include "histogram.h"
+#include "log.h"
+#include "multibuffer.h"
+
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SERVE_READ_CHUNK (64 * 1024)
+#define SERVE_MAX_PENDING_OUTPUT (8u << 20)  // неотправленных байт на соединение до паузы чтения
+#define SERVE_MAX_EVENTS 64
+
+typedef std::chrono::steady_clock ServeClock;
+
+/**
+ * @brief Запрос, переданный рабочему потоку, и его результат.
+ */
+struct ServeJob {
+    uint64_t conn;
+    uint32_t id;
+    uint8_t op;
+    uint8_t status;
+    std::vector<unsigned char> payload;
+    ServeClock::time_point received;
+};
+
+typedef std::unique_ptr<ServeJob> ServeJobPtr;
+
+/**
+ * @brief Ограниченная очередь запросов.
+ *
+ * tryPush() никогда не блокирует цикл событий: при заполненной очереди запрос
+ * остаётся в буфере соединения, а чтение из сокета приостанавливается.
+ * Рабочие потоки забирают запросы пакетами, чтобы блокировка бралась один раз
+ * на несколько мелких запросов.
+ */
+class JobQueue {
+public:
+    explicit JobQueue(size_t capacity) : capacity_(capacity), closed_(false) {}
+
+    bool tryPush(ServeJobPtr &job) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (jobs_.size() >= capacity_) return false;
+        jobs_.push_back(std::move(job));
+        ready_.notify_one();
+        return true;
+    }
+
+    bool popBatch(std::vector<ServeJobPtr> &batch, size_t maxCount) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (jobs_.empty() && !closed_) ready_.wait(lock);
+        if (jobs_.empty()) return false;
+        while (!jobs_.empty() && batch.size() < maxCount) {
+            batch.push_back(std::move(jobs_.front()));
+            jobs_.pop_front();
+        }
+        return true;
+    }
+
+    void pushAll(std::vector<ServeJobPtr> &batch) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < batch.size(); i++) jobs_.push_back(std::move(batch[i]));
+        batch.clear();
+    }
+
+    void takeAll(std::deque<ServeJobPtr> &out) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        out.swap(jobs_);
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return jobs_.size();
+    }
+
+    size_t capacity() const { return capacity_; }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        ready_.notify_all();
+    }
+
+private:
+    size_t capacity_;
+    bool closed_;
+    std::deque<ServeJobPtr> jobs_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+};
+
+/**
+ * @brief Состояние клиентского соединения в цикле событий.
+ */
+struct ServeConn {
+    uint64_t id;                      ///< ключ соединения в epoll
+    int fd;
+    std::vector<unsigned char> in;    ///< принятые, ещё не разобранные байты
+    size_t inOffset;                  ///< начало неразобранной части in
+    std::deque<std::vector<unsigned char> > out;
+    size_t outOffset;                 ///< отправленная часть out.front()
+    size_t outBytes;                  ///< всего неотправленных байт
+    uint32_t events;                  ///< текущая маска epoll
+    bool stalled;                     ///< ждёт места в очереди запросов
+    bool eof;                         ///< клиент закрыл свою сторону
+    size_t inFlight;                  ///< запросов у рабочих потоков
+
+    ServeConn() : id(0), fd(-1), inOffset(0), outOffset(0), outBytes(0), events(0), stalled(false), eof(false), inFlight(0) {}
+};
+
+static int serveWakeFd = -1;
+static volatile sig_atomic_t serveStop = 0;
+static volatile sig_atomic_t serveDump = 0;
+
+static void serveSignalHandler(int sig) {
+    if (sig == SIGUSR1) {
+        serveDump = 1;
+    } else {
+        serveStop = 1;
+    }
+    uint64_t one = 1;
+    if (serveWakeFd >= 0 && write(serveWakeFd, &one, sizeof(one)) < 0) {
+        // очередь eventfd переполнена — цикл и так проснётся
+    }
+}
+/**
+ * @brief Открывает адрес сервиса для прослушивания или подключения.
+ *
+ * @param[in] endpoint unix:/path, /path или tcp:host:port.
+ * @param[in] listening true — создать слушающий сокет, false — подключиться.
+ * @return int Дескриптор сокета.
+ *
+ * TCP-адреса допускаются только на loopback-интерфейсе: протокол не содержит
+ * аутентификации, а ключ хранится в процессе сервиса.
+ */
+int openEndpoint(const std::string &endpoint, bool listening) {
+    std::string spec = endpoint;
+    if (spec.compare(0, 5, "unix:") == 0) spec = spec.substr(5);
+
+    if (spec.compare(0, 4, "tcp:") != 0) {
+        sockaddr_un addr;
+        if (spec.empty() || spec.size() >= sizeof(addr.sun_path)) {
+            throw CryptoError("Invalid socket path: " + endpoint);
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, spec.c_str(), spec.size() + 1);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) throw CryptoError(std::string("Cannot create socket: ") + strerror(errno));
+        int rc;
+        if (listening) {
+            unlink(spec.c_str());
+            mode_t oldMask = umask(0077);
+            rc = bind(fd, (sockaddr *)&addr, sizeof(addr));
+            umask(oldMask);
+            if (rc == 0) rc = listen(fd, SOMAXCONN);
+        } else {
+            rc = connect(fd, (sockaddr *)&addr, sizeof(addr));
+        }
+        if (rc != 0) {
+            int err = errno;
+            close(fd);
+            throw CryptoError("Cannot open " + endpoint + ": " + strerror(err));
+        }
+        return fd;
+    }
+
+    std::string hostPort = spec.substr(4);
+    size_t colon = hostPort.rfind(':');
+    if (colon == std::string::npos) throw CryptoError("Invalid TCP endpoint: " + endpoint);
+    std::string host = hostPort.substr(0, colon);
+    std::string port = hostPort.substr(colon + 1);
+    if (host.size() > 2 && host[0] == '[' && host[host.size() - 1] == ']') host = host.substr(1, host.size() - 2);
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    addrinfo *result = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0 || !result) {
+        throw CryptoError("Cannot resolve " + endpoint);
+    }
+
+    int fd = -1;
+    std::string error = "no usable address";
+    for (addrinfo *ai = result; ai; ai = ai->ai_next) {
+        bool loopback = false;
+        if (ai->ai_family == AF_INET) {
+            loopback = (ntohl(((sockaddr_in *)ai->ai_addr)->sin_addr.s_addr) >> 24) == 127;
+        } else if (ai->ai_family == AF_INET6) {
+            loopback = IN6_IS_ADDR_LOOPBACK(&((sockaddr_in6 *)ai->ai_addr)->sin6_addr);
+        }
+        if (!loopback) {
+            error = "only loopback addresses are allowed";
+            continue;
+        }
+        fd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) continue;
+        int one = 1;
+        int rc;
+        if (listening) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            rc = bind(fd, ai->ai_addr, ai->ai_addrlen);
+            if (rc == 0) rc = listen(fd, SOMAXCONN);
+        } else {
+            rc = connect(fd, ai->ai_addr, ai->ai_addrlen);
+            if (rc == 0) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        if (rc == 0) break;
+        error = strerror(errno);
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    if (fd < 0) throw CryptoError("Cannot open " + endpoint + ": " + error);
+    return fd;
+}
+/**
+ * @brief Сервис шифрования: цикл событий epoll и пул рабочих потоков.
+ */
+class Server {
+public:
+    Server(const ServeOptions &options, const unsigned char *key)
+        : options_(options), key_(key), queue_(options.queueDepth), completions_((size_t)-1),
+          epollFd_(-1), wakeFd_(-1), listenFd_(-1), nextConn_(1), requests_(0), bytesIn_(0), bytesOut_(0),
+          errors_(0), stalls_(0) {}
+
+    int run();
+
+private:
+    void worker();
+    void acceptClients();
+    void readClient(uint64_t id, ServeConn &conn);
+    void parseFrames(uint64_t id, ServeConn &conn);
+    void writeClient(ServeConn &conn);
+    void queueResponse(ServeConn &conn, uint32_t id, uint8_t op, uint8_t status, const unsigned char *data, size_t len);
+    void drainCompletions();
+    void resumeStalled();
+    void updateEvents(ServeConn &conn);
+    void closeClient(uint64_t id);
+    std::string statsText();
+
+    ServeOptions options_;
+    const unsigned char *key_;
+    JobQueue queue_;
+    JobQueue completions_;
+    int epollFd_;
+    int wakeFd_;
+    int listenFd_;
+    uint64_t nextConn_;
+    std::map<uint64_t, ServeConn> conns_;
+    LatencyHistogram latency_;
+    uint64_t requests_;
+    uint64_t bytesIn_;
+    uint64_t bytesOut_;
+    uint64_t errors_;
+    uint64_t stalls_;
+};
+/**
+ * @brief Шифрует запросы пакета одним многопоточным (multi-buffer) проходом.
+ *
+ * IV для всех запросов берутся одним вызовом RAND_bytes().
+ */
+static void encryptBatch(MultiBufferCipher &cipher, std::vector<ServeJob *> &jobs) {
+    if (jobs.empty()) return;
+    std::vector<unsigned char> ivs(jobs.size() * AES_BLOCK_SIZE);
+    std::vector<std::vector<unsigned char> > results(jobs.size());
+    std::vector<CbcJob> cbc(jobs.size());
+    try {
+        if (!RAND_bytes(ivs.data(), ivs.size())) {
+            handleErrors();
+        }
+        for (size_t i = 0; i < jobs.size(); i++) {
+            results[i].resize(MultiBufferCipher::encryptedSize(jobs[i]->payload.size()));
+            memcpy(results[i].data(), &ivs[i * AES_BLOCK_SIZE], AES_BLOCK_SIZE);
+            cbc[i].data = jobs[i]->payload.data();
+            cbc[i].len = jobs[i]->payload.size();
+            cbc[i].out = results[i].data();
+        }
+        cipher.encrypt(cbc.data(), cbc.size());
+    } catch (const std::exception &e) {
+        std::string message = e.what();
+        for (size_t i = 0; i < jobs.size(); i++) {
+            OPENSSL_cleanse(jobs[i]->payload.data(), jobs[i]->payload.size());
+            jobs[i]->payload.assign(message.begin(), message.end());
+            jobs[i]->status = 1;
+        }
+        return;
+    }
+    for (size_t i = 0; i < jobs.size(); i++) {
+        OPENSSL_cleanse(jobs[i]->payload.data(), jobs[i]->payload.size());
+        jobs[i]->payload.swap(results[i]);
+        jobs[i]->status = 0;
+    }
+}
+/**
+ * @brief Рабочий поток: пакетами забирает запросы и шифрует их.
+ *
+ * Каждый поток держит собственные BufferCipher и MultiBufferCipher, поэтому
+ * расписание ключа не пересчитывается для каждого запроса. Запросы на
+ * шифрование из пакета шифруются вместе, вперемешку по нескольким дорожкам
+ * AES-NI; расшифрование CBC и так параллельно внутри одного запроса.
+ */
+void Server::worker() {
+    BufferCipher cipher(key_);
+    MultiBufferCipher multi(key_);
+    std::vector<ServeJobPtr> batch;
+    std::vector<ServeJob *> encrypts;
+    batch.reserve(options_.batchSize);
+    while (queue_.popBatch(batch, options_.batchSize)) {
+        encrypts.clear();
+        for (size_t i = 0; i < batch.size(); i++) {
+            ServeJob &job = *batch[i];
+            if (job.op == SERVE_ENCRYPT) {
+                encrypts.push_back(&job);
+                continue;
+            }
+            try {
+                std::vector<unsigned char> result = cipher.decrypt(job.payload.data(), job.payload.size());
+                OPENSSL_cleanse(job.payload.data(), job.payload.size());
+                job.payload.swap(result);
+                job.status = 0;
+            } catch (const std::exception &e) {
+                std::string message = e.what();
+                job.payload.assign(message.begin(), message.end());
+                job.status = 1;
+            }
+        }
+        encryptBatch(multi, encrypts);
+        completions_.pushAll(batch);
+        uint64_t one = 1;
+        if (write(wakeFd_, &one, sizeof(one)) < 0) {
+            // счётчик eventfd уже ненулевой
+        }
+    }
+}
+
+void Server::updateEvents(ServeConn &conn) {
+    uint32_t events = 0;
+    if (!conn.stalled && !conn.eof && conn.outBytes < SERVE_MAX_PENDING_OUTPUT) events |= EPOLLIN;
+    if (conn.outBytes > 0) events |= EPOLLOUT;
+    if (events != conn.events) {
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.u64 = conn.id;
+        epoll_ctl(epollFd_, EPOLL_CTL_MOD, conn.fd, &ev);
+        conn.events = events;
+    }
+}
+
+void Server::acceptClients() {
+    for (;;) {
+        int fd = accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        uint64_t id = nextConn_++;
+        ServeConn &conn = conns_[id];
+        conn.id = id;
+        conn.fd = fd;
+        conn.events = EPOLLIN;
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = id;
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+void Server::closeClient(uint64_t id) {
+    std::map<uint64_t, ServeConn>::iterator it = conns_.find(id);
+    if (it == conns_.end()) return;
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, it->second.fd, nullptr);
+    close(it->second.fd);
+    conns_.erase(it);
+}
+
+void Server::queueResponse(ServeConn &conn, uint32_t id, uint8_t op, uint8_t status, const unsigned char *data, size_t len) {
+    ServeFrameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SERVE_MAGIC;
+    header.id = id;
+    header.op = op;
+    header.status = status;
+    header.length = len;
+    std::vector<unsigned char> frame(sizeof(header) + len);
+    memcpy(frame.data(), &header, sizeof(header));
+    if (len) memcpy(frame.data() + sizeof(header), data, len);
+    conn.outBytes += frame.size();
+    conn.out.push_back(std::vector<unsigned char>());
+    conn.out.back().swap(frame);
+}
+/**
+ * @brief Выделяет из входного буфера соединения полные кадры.
+ *
+ * Запросы статистики обслуживаются сразу в цикле событий, остальные
+ * передаются в очередь. Если очередь заполнена, разбор останавливается и
+ * соединение помечается как ожидающее: байты остаются в буфере, а новые из
+ * сокета не читаются до освобождения места.
+ */
+void Server::parseFrames(uint64_t id, ServeConn &conn) {
+    conn.stalled = false;
+    for (;;) {
+        size_t available = conn.in.size() - conn.inOffset;
+        if (available < sizeof(ServeFrameHeader)) break;
+        ServeFrameHeader header;
+        memcpy(&header, conn.in.data() + conn.inOffset, sizeof(header));
+        if (header.magic != SERVE_MAGIC || header.length > options_.maxFrame ||
+            (header.op != SERVE_ENCRYPT && header.op != SERVE_DECRYPT && header.op != SERVE_STATS)) {
+            LOG(LOG_LEVEL_WARN, "closing connection " << id << ": malformed frame");
+            closeClient(id);
+            return;
+        }
+        if (available < sizeof(header) + header.length) break;
+
+        const unsigned char *payload = conn.in.data() + conn.inOffset + sizeof(header);
+        if (header.op == SERVE_STATS) {
+            std::string text = statsText();
+            queueResponse(conn, header.id, header.op, 0, (const unsigned char *)text.data(), text.size());
+        } else {
+            ServeJobPtr job(new ServeJob);
+            job->conn = id;
+            job->id = header.id;
+            job->op = header.op;
+            job->status = 0;
+            job->payload.assign(payload, payload + header.length);
+            job->received = ServeClock::now();
+            if (!queue_.tryPush(job)) {
+                OPENSSL_cleanse(job->payload.data(), job->payload.size());
+                conn.stalled = true;
+                stalls_++;
+                break;
+            }
+            conn.inFlight++;
+            bytesIn_ += header.length;
+        }
+        conn.inOffset += sizeof(header) + header.length;
+    }
+
+    // Сдвигаем неразобранный остаток в начало буфера
+    if (conn.inOffset > 0 && (conn.inOffset == conn.in.size() || conn.inOffset > SERVE_READ_CHUNK)) {
+        OPENSSL_cleanse(conn.in.data(), conn.inOffset);
+        conn.in.erase(conn.in.begin(), conn.in.begin() + conn.inOffset);
+        conn.inOffset = 0;
+    }
+    updateEvents(conn);
+}
+
+void Server::readClient(uint64_t id, ServeConn &conn) {
+    size_t old = conn.in.size();
+    conn.in.resize(old + SERVE_READ_CHUNK);
+    ssize_t n = read(conn.fd, conn.in.data() + old, SERVE_READ_CHUNK);
+    if (n <= 0) {
+        conn.in.resize(old);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        conn.eof = true;
+        if (conn.inFlight == 0 && conn.outBytes == 0) {
+            closeClient(id);
+        } else {
+            updateEvents(conn);
+        }
+        return;
+    }
+    conn.in.resize(old + n);
+    parseFrames(id, conn);
+}
+
+void Server::writeClient(ServeConn &conn) {
+    while (!conn.out.empty()) {
+        std::vector<unsigned char> &front = conn.out.front();
+        ssize_t n = send(conn.fd, front.data() + conn.outOffset, front.size() - conn.outOffset, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) break;
+            conn.out.clear();
+            conn.outBytes = 0;
+            conn.eof = true;
+            break;
+        }
+        conn.outOffset += n;
+        conn.outBytes -= n;
+        if (conn.outOffset == front.size()) {
+            OPENSSL_cleanse(front.data(), front.size());
+            conn.out.pop_front();
+            conn.outOffset = 0;
+        }
+    }
+}
+/**
+ * @brief Переносит готовые результаты рабочих потоков в очереди отправки.
+ */
+void Server::drainCompletions() {
+    std::deque<ServeJobPtr> done;
+    completions_.takeAll(done);
+    ServeClock::time_point now = ServeClock::now();
+    for (size_t i = 0; i < done.size(); i++) {
+        ServeJob &job = *done[i];
+        latency_.record(std::chrono::duration_cast<std::chrono::microseconds>(now - job.received).count());
+        requests_++;
+        if (job.status != 0) errors_++;
+
+        std::map<uint64_t, ServeConn>::iterator it = conns_.find(job.conn);
+        if (it == conns_.end()) continue;
+        ServeConn &conn = it->second;
+        conn.inFlight--;
+        bytesOut_ += job.payload.size();
+        queueResponse(conn, job.id, job.op, job.status, job.payload.data(), job.payload.size());
+        OPENSSL_cleanse(job.payload.data(), job.payload.size());
+        writeClient(conn);
+        if (conn.eof && conn.inFlight == 0 && conn.outBytes == 0) {
+            closeClient(job.conn);
+        } else {
+            updateEvents(conn);
+        }
+    }
+}
+/**
+ * @brief Возобновляет разбор соединений, ожидавших места в очереди.
+ */
+void Server::resumeStalled() {
+    if (queue_.size() >= queue_.capacity()) return;
+    std::vector<uint64_t> stalled;
+    for (std::map<uint64_t, ServeConn>::iterator it = conns_.begin(); it != conns_.end(); ++it) {
+        if (it->second.stalled) stalled.push_back(it->first);
+    }
+    for (size_t i = 0; i < stalled.size(); i++) {
+        std::map<uint64_t, ServeConn>::iterator it = conns_.find(stalled[i]);
+        if (it != conns_.end()) parseFrames(it->first, it->second);
+    }
+}
+
+std::string Server::statsText() {
+    std::ostringstream out;
+    out << "requests=" << requests_ << " errors=" << errors_ << " bytes_in=" << bytesIn_ << " bytes_out=" << bytesOut_
+        << " queue=" << queue_.size() << "/" << queue_.capacity() << " backpressure_stalls=" << stalls_
+        << " connections=" << conns_.size() << "\nlatency " << latency_.format() << "\n";
+    return out.str();
+}
+/**
+ * @brief Цикл событий сервиса.
+ *
+ * Один поток принимает соединения, читает и разбирает кадры, отправляет ответы;
+ * шифрование выполняют рабочие потоки. Готовые результаты возвращаются через
+ * очередь завершений и eventfd.
+ */
+int Server::run() {
+    listenFd_ = openEndpoint(options_.endpoint, true);
+    fcntl(listenFd_, F_SETFL, fcntl(listenFd_, F_GETFL) | O_NONBLOCK);
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epollFd_ < 0 || wakeFd_ < 0) {
+        throw CryptoError(std::string("Cannot create event loop: ") + strerror(errno));
+    }
+
+    // Идентификаторы 0 и 1 зарезервированы за eventfd и слушающим сокетом
+    nextConn_ = 2;
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    epoll_ctl(epollFd_, EPOLL_CTL_ADD, wakeFd_, &ev);
+    ev.data.u64 = 1;
+    epoll_ctl(epollFd_, EPOLL_CTL_ADD, listenFd_, &ev);
+
+    serveWakeFd = wakeFd_;
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, serveSignalHandler);
+    signal(SIGTERM, serveSignalHandler);
+    signal(SIGUSR1, serveSignalHandler);
+
+    int workers = options_.workers > 0 ? options_.workers : (int)std::thread::hardware_concurrency();
+    if (workers <= 0) workers = 1;
+    std::vector<std::thread> pool;
+    for (int i = 0; i < workers; i++) pool.push_back(std::thread(&Server::worker, this));
+
+    std::cout << "Serving on " << options_.endpoint << " with " << workers << " workers" << std::endl;
+
+    epoll_event events[SERVE_MAX_EVENTS];
+    while (!serveStop) {
+        int n = epoll_wait(epollFd_, events, SERVE_MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR) break;
+        for (int i = 0; i < n; i++) {
+            uint64_t id = events[i].data.u64;
+            if (id == 0) {
+                uint64_t counter;
+                while (read(wakeFd_, &counter, sizeof(counter)) > 0) {}
+                drainCompletions();
+                continue;
+            }
+            if (id == 1) {
+                acceptClients();
+                continue;
+            }
+            std::map<uint64_t, ServeConn>::iterator it = conns_.find(id);
+            if (it == conns_.end()) continue;
+            if (events[i].events & EPOLLOUT) writeClient(it->second);
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                readClient(id, it->second);
+                it = conns_.find(id);
+                if (it == conns_.end()) continue;
+            }
+            ServeConn &conn = it->second;
+            if (conn.eof && conn.inFlight == 0 && conn.outBytes == 0) {
+                closeClient(id);
+            } else {
+                updateEvents(conn);
+            }
+        }
+        resumeStalled();
+        if (serveDump) {
+            serveDump = 0;
+            std::cerr << statsText();
+        }
+    }
+
+    queue_.close();
+    for (size_t i = 0; i < pool.size(); i++) pool[i].join();
+    std::cerr << statsText();
+
+    std::vector<uint64_t> ids;
+    for (std::map<uint64_t, ServeConn>::iterator it = conns_.begin(); it != conns_.end(); ++it) ids.push_back(it->first);
+    for (size_t i = 0; i < ids.size(); i++) closeClient(ids[i]);
+    serveWakeFd = -1;
+    close(wakeFd_);
+    close(epollFd_);
+    close(listenFd_);
+    if (options_.endpoint.compare(0, 4, "tcp:") != 0) {
+        std::string path = options_.endpoint.compare(0, 5, "unix:") == 0 ? options_.endpoint.substr(5) : options_.endpoint;
+        unlink(path.c_str());
+    }
+    return 0;
+}
+/**
+ * @brief Запускает сервис шифрования.
+ *
+ * @param[in] options Параметры сервиса.
+ * @param[in] key Ключ AES-256, производный от пароля.
+ * @return int Код завершения процесса.
+ */
+int runServer(const ServeOptions &options, const unsigned char *key) {
+    Server server(options, key);
+    return server.run();
+}
@@ -0,0 +1,55 @@
+#ifndef FILE_CRYPTO_SERVER_H
+#define FILE_CRYPTO_SERVER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#define SERVE_MAGIC 0x46435356u           // "FCSV"
+#define SERVE_DEFAULT_QUEUE_DEPTH 1024    // запросов в очереди до включения обратного давления
+#define SERVE_DEFAULT_BATCH 32            // запросов, забираемых рабочим потоком за раз
+#define SERVE_DEFAULT_MAX_FRAME (16u << 20)
+
+/**
+ * @brief Код операции в кадре сервиса.
+ */
+enum ServeOp {
+    SERVE_ENCRYPT = 1,  ///< зашифровать полезную нагрузку
+    SERVE_DECRYPT = 2,  ///< расшифровать полезную нагрузку
+    SERVE_STATS = 3     ///< вернуть текстовую статистику сервиса
+};
+
+/**
+ * @brief Заголовок кадра запроса и ответа.
+ *
+ * Поля передаются в порядке байтов узла: сервис доступен только через Unix-сокет
+ * или loopback. В ответе id совпадает с id запроса, status равен 0 при успехе,
+ * а полезная нагрузка содержит результат или текст ошибки.
+ */
+struct ServeFrameHeader {
+    uint32_t magic;
+    uint32_t id;
+    uint8_t op;
+    uint8_t status;
+    uint16_t reserved;
+    uint32_t length;
+};
+
+/**
+ * @brief Параметры режима сервиса.
+ */
+struct ServeOptions {
+    std::string endpoint;  ///< unix:/path или tcp:127.0.0.1:port
+    int workers;           ///< число рабочих потоков шифрования
+    size_t queueDepth;     ///< ёмкость очереди запросов
+    size_t batchSize;      ///< максимальный размер пакета для рабочего потока
+    size_t maxFrame;       ///< максимальная длина полезной нагрузки
+
+    ServeOptions() : workers(0), queueDepth(SERVE_DEFAULT_QUEUE_DEPTH), batchSize(SERVE_DEFAULT_BATCH),
+                     maxFrame(SERVE_DEFAULT_MAX_FRAME) {}
+};
+
+int openEndpoint(const std::string &endpoint, bool listening);
+int runServer(const ServeOptions &options, const unsigned char *key);
+
+#endif // FILE_CRYPTO_SERVER_H
@@ -0,0 +1,293 @@
+#include "sparse.h"
+#include "crypto.h"
+#include "fileio.h"
+#include "log.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SPARSE_MAP_HEADER 16  // размер и число участков
+#define SPARSE_MAP_ENTRY 16   // смещение и длина участка
+
+static void putLe64(unsigned char *p, uint64_t value) {
+    for (int i = 0; i < 8; i++) p[i] = (value >> (8 * i)) & 0xff;
+}
+
+static uint64_t getLe64(const unsigned char *p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) value = value << 8 | p[i];
+    return value;
+}
+/**
+ * @brief Шифрует или расшифровывает карту одним вызовом EVP.
+ */
+static std::vector<unsigned char> cipherMap(bool encrypt, const unsigned char *key, const unsigned char *iv,
+                                            const std::vector<unsigned char> &in) {
+    std::vector<unsigned char> out(in.size() + AES_BLOCK_SIZE);
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int len = 0, finalLen = 0;
+    bool ok = ctx && EVP_CipherInit_ex(ctx, aes256Cbc(), nullptr, key, iv, encrypt ? 1 : 0) == 1 &&
+              EVP_CipherUpdate(ctx, out.data(), &len, in.data(), in.size()) == 1 &&
+              EVP_CipherFinal_ex(ctx, out.data() + len, &finalLen) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    if (!ok) handleErrors();
+    out.resize(len + finalLen);
+    return out;
+}
+
+/**
+ * @brief Передаёт обработчику данные участков вместе с нулями дыр между ними.
+ *
+ * Обработчики onInput и onOutput видят открытый текст таким, каким он
+ * лежит в файле, поэтому контрольная сумма совпадает с суммой исходного
+ * разреженного файла.
+ */
+class HoleFiller {
+public:
+    typedef std::function<void(const unsigned char *data, size_t len)> Callback;
+
+    HoleFiller(const SparseMap &map, const Callback &callback)
+        : map_(map), callback_(callback), extent_(0), left_(0), offset_(0) {}
+
+    void feed(const unsigned char *data, size_t len) {
+        while (len > 0) {
+            if (left_ == 0) {
+                if (extent_ == map_.extents.size()) throw CryptoError("Decrypted data does not match the extent map");
+                const FileExtent &extent = map_.extents[extent_++];
+                zeros(extent.offset - offset_);
+                left_ = extent.length;
+                offset_ = extent.offset + extent.length;
+            }
+            size_t n = len < left_ ? len : left_;
+            callback_(data, n);
+            data += n;
+            len -= n;
+            left_ -= n;
+        }
+    }
+    void finish() {
+        zeros(map_.size - offset_);
+        offset_ = map_.size;
+    }
+
+private:
+    void zeros(uint64_t count) {
+        static const unsigned char block[65536] = {0};
+        for (; count > 0;) {
+            size_t n = count < sizeof(block) ? count : sizeof(block);
+            callback_(block, n);
+            count -= n;
+        }
+    }
+
+    const SparseMap &map_;
+    Callback callback_;
+    size_t extent_;     ///< следующий участок
+    uint64_t left_;     ///< байт, оставшихся в текущем участке
+    uint64_t offset_;   ///< смещение за последним начатым участком
+
+    HoleFiller(const HoleFiller &);
+    HoleFiller &operator=(const HoleFiller &);
+};
+
+uint64_t SparseMap::dataBytes() const {
+    uint64_t total = 0;
+    for (size_t i = 0; i < extents.size(); i++) total += extents[i].length;
+    return total;
+}
+/**
+ * @brief Находит участки с данными через SEEK_DATA и SEEK_HOLE.
+ *
+ * @param[in] fd Обычный файл; позиция после вызова — начало файла.
+ * @return SparseMap Карта файла. Если файловая система не сообщает о
+ *         дырах, весь файл — один участок.
+ */
+SparseMap findExtents(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) throw CryptoError("Sparse mode needs a regular input file");
+    SparseMap map;
+    map.size = st.st_size;
+    off_t pos = 0;
+    while ((uint64_t)pos < map.size) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) break;  // дальше только дыра
+            throw CryptoError(std::string("SEEK_DATA failed: ") + strerror(errno));
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) hole = map.size;
+        if (map.extents.size() == SPARSE_MAX_EXTENTS) throw CryptoError("Too many extents for sparse mode");
+        FileExtent extent = {(uint64_t)data, (uint64_t)(hole - data)};
+        map.extents.push_back(extent);
+        pos = hole;
+    }
+    lseek(fd, 0, SEEK_SET);
+    LOG(LOG_LEVEL_DEBUG, "Sparse map: " << map.extents.size() << " extents, " << map.dataBytes() << " of " << map.size
+                                        << " bytes are data");
+    return map;
+}
+/**
+ * @brief Размер зашифрованного потока после заголовка для карты map.
+ */
+uint64_t sparseCipherSize(const SparseMap &map) {
+    uint64_t mapPlain = SPARSE_MAP_HEADER + SPARSE_MAP_ENTRY * map.extents.size();
+    uint64_t mapCipher = (mapPlain / AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE;
+    return AES_BLOCK_SIZE + 4 + mapCipher + AES_BLOCK_SIZE + (map.dataBytes() / AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE;
+}
+/**
+ * @brief Шифрует только участки с данными.
+ *
+ * @param[in] inFd Исходный файл.
+ * @param[in] outFd Результат, позиция — сразу после заголовка.
+ * @param[in] key Ключ файла.
+ * @param[in] iv IV файла из заголовка; им шифруется карта.
+ * @param[in] map Карта из findExtents().
+ * @param[in] options Параметры конвейера для данных.
+ */
+void encryptSparse(int inFd, int outFd, const unsigned char *key, const unsigned char *iv, const SparseMap &map,
+                   const PipelineOptions &options) {
+    std::vector<unsigned char> plain(SPARSE_MAP_HEADER + SPARSE_MAP_ENTRY * map.extents.size());
+    putLe64(&plain[0], map.size);
+    putLe64(&plain[8], map.extents.size());
+    for (size_t i = 0; i < map.extents.size(); i++) {
+        putLe64(&plain[SPARSE_MAP_HEADER + SPARSE_MAP_ENTRY * i], map.extents[i].offset);
+        putLe64(&plain[SPARSE_MAP_HEADER + SPARSE_MAP_ENTRY * i + 8], map.extents[i].length);
+    }
+    std::vector<unsigned char> cipher = cipherMap(true, key, iv, plain);
+    OPENSSL_cleanse(plain.data(), plain.size());
+
+    unsigned char length[4];
+    for (int i = 0; i < 4; i++) length[i] = (cipher.size() >> (8 * i)) & 0xff;
+    writeAll(outFd, iv, AES_BLOCK_SIZE);
+    writeAll(outFd, length, sizeof(length));
+    writeAll(outFd, cipher.data(), cipher.size());
+    if (options.onOutput) {
+        options.onOutput(iv, AES_BLOCK_SIZE);
+        options.onOutput(length, sizeof(length));
+        options.onOutput(cipher.data(), cipher.size());
+    }
+
+    unsigned char dataIv[AES_BLOCK_SIZE];
+    if (!RAND_bytes(dataIv, AES_BLOCK_SIZE)) handleErrors();
+    PipelineOptions dataOptions = options;
+    dataOptions.extents = &map.extents;
+    HoleFiller filler(map, options.onInput);
+    if (options.onInput) {
+        dataOptions.onInput = [&filler](const unsigned char *data, size_t len) { filler.feed(data, len); };
+    }
+    encryptPipeline(inFd, outFd, key, dataIv, dataOptions);
+    if (options.onInput) filler.finish();
+}
+/**
+ * @brief Читает и проверяет карту разреженного файла.
+ */
+static SparseMap readSparseMap(int inFd, const unsigned char *key, const PipelineOptions &options,
+                               const std::vector<unsigned char> &prefix) {
+    if (prefix.size() > AES_BLOCK_SIZE) throw CryptoError("Corrupt sparse file");
+    unsigned char iv[AES_BLOCK_SIZE], length[4];
+    memcpy(iv, prefix.data(), prefix.size());
+    size_t rest = AES_BLOCK_SIZE - prefix.size();
+    if (readFull(inFd, iv + prefix.size(), rest) != rest || readFull(inFd, length, sizeof(length)) != sizeof(length)) {
+        throw CryptoError("Truncated sparse map");
+    }
+    uint64_t mapLen = length[0] | length[1] << 8 | length[2] << 16 | (uint64_t)length[3] << 24;
+    if (mapLen == 0 || mapLen % AES_BLOCK_SIZE != 0 ||
+        mapLen > SPARSE_MAP_HEADER + (uint64_t)SPARSE_MAP_ENTRY * SPARSE_MAX_EXTENTS + AES_BLOCK_SIZE) {
+        throw CryptoError("Corrupt sparse map");
+    }
+    std::vector<unsigned char> cipher(mapLen);
+    if (readFull(inFd, cipher.data(), mapLen) != mapLen) throw CryptoError("Truncated sparse map");
+    if (options.onInput) {
+        options.onInput(iv, AES_BLOCK_SIZE);
+        options.onInput(length, sizeof(length));
+        options.onInput(cipher.data(), cipher.size());
+    }
+
+    std::vector<unsigned char> plain = cipherMap(false, key, iv, cipher);
+    SparseMap map;
+    uint64_t count = plain.size() >= SPARSE_MAP_HEADER ? getLe64(&plain[8]) : 0;
+    if (plain.size() < SPARSE_MAP_HEADER || count > SPARSE_MAX_EXTENTS ||
+        plain.size() != SPARSE_MAP_HEADER + SPARSE_MAP_ENTRY * count) {
+        throw CryptoError("Corrupt sparse map");
+    }
+    map.size = getLe64(&plain[0]);
+    uint64_t end = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        FileExtent extent = {getLe64(&plain[SPARSE_MAP_HEADER + SPARSE_MAP_ENTRY * i]),
+                             getLe64(&plain[SPARSE_MAP_HEADER + SPARSE_MAP_ENTRY * i + 8])};
+        if (extent.offset < end || extent.length > map.size || extent.offset > map.size - extent.length) {
+            throw CryptoError("Corrupt sparse map");
+        }
+        end = extent.offset + extent.length;
+        map.extents.push_back(extent);
+    }
+    OPENSSL_cleanse(plain.data(), plain.size());
+    return map;
+}
+/**
+ * @brief Дописывает нули до logical: результат — канал, дыры в нём невозможны.
+ */
+static void writeZeros(int fd, uint64_t count) {
+    static const unsigned char zeros[4096] = {0};
+    while (count > 0) {
+        size_t n = count < sizeof(zeros) ? count : sizeof(zeros);
+        writeAll(fd, zeros, n);
+        count -= n;
+    }
+}
+/**
+ * @brief Расшифровывает разреженный файл, восстанавливая дыры.
+ *
+ * @param[in] inFd Дескриптор, указывающий на IV (после readFileHeader()).
+ * @param[in] outFd Результат.
+ * @param[in] key Ключ файла.
+ * @param[in] options Параметры конвейера для данных.
+ * @param[in] prefix Уже прочитанное из канала начало потока.
+ *
+ * Данные пишутся только в участки карты. Промежутки между ними
+ * освобождаются fallocate(FALLOC_FL_PUNCH_HOLE): место под результат
+ * могло быть выделено заранее. Если результат — канал, вместо дыр
+ * пишутся нули.
+ */
+void decryptSparse(int inFd, int outFd, const unsigned char *key, const PipelineOptions &options,
+                   const std::vector<unsigned char> &prefix) {
+    SparseMap map = readSparseMap(inFd, key, options, prefix);
+    uint64_t written = 0;
+    PipelineOptions dataOptions = options;
+    dataOptions.extents = &map.extents;
+    HoleFiller filler(map, options.onOutput);
+    dataOptions.onOutput = [&options, &filler, &written](const unsigned char *data, size_t len) {
+        written += len;
+        if (options.onOutput) filler.feed(data, len);
+    };
+    decryptPipeline(inFd, outFd, key, dataOptions);
+    if (written != map.dataBytes()) throw CryptoError("Decrypted data does not match the extent map");
+    if (options.onOutput) filler.finish();
+
+    uint64_t end = map.extents.empty() ? 0 : map.extents.back().offset + map.extents.back().length;
+    if (lseek(outFd, 0, SEEK_CUR) < 0) {
+        writeZeros(outFd, map.size - end);
+        return;
+    }
+    // Позиция — на логическом конце: по ней результат обрезается при фиксации
+    if (ftruncate(outFd, map.size) != 0 || lseek(outFd, map.size, SEEK_SET) < 0) {
+        throw CryptoError(std::string("Cannot resize output: ") + strerror(errno));
+    }
+    uint64_t pos = 0;
+    for (size_t i = 0; i <= map.extents.size(); i++) {
+        uint64_t next = i < map.extents.size() ? map.extents[i].offset : map.size;
+        if (next > pos && fallocate(outFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, next - pos) != 0 &&
+            errno != EOPNOTSUPP) {
+            throw CryptoError(std::string("Cannot punch a hole: ") + strerror(errno));
+        }
+        if (i < map.extents.size()) pos = map.extents[i].offset + map.extents[i].length;
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef FILE_CRYPTO_SPARSE_H
+#define FILE_CRYPTO_SPARSE_H
+
+#include "pipeline.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#define SPARSE_MAX_EXTENTS (1u << 24)  // наибольшее число участков в карте
+
+/**
+ * @brief Карта разреженного файла: логический размер и участки с данными.
+ *
+ * Формат зашифрованного файла с флагом FILE_HEADER_FLAG_SPARSE после IV:
+ *   0  длина зашифрованной карты m (uint32, little-endian)
+ *   4  карта, зашифрованная AES-256 CBC с IV файла, m байт
+ *   затем IV и шифртекст данных всех участков подряд, как у обычного файла.
+ * Карта в открытом виде (целые — uint64, little-endian): логический
+ * размер, число участков и для каждого участка смещение и длина.
+ */
+struct SparseMap {
+    uint64_t size;                    ///< логический размер файла
+    std::vector<FileExtent> extents;  ///< участки с данными по возрастанию смещения
+
+    SparseMap() : size(0) {}
+    uint64_t dataBytes() const;
+};
+
+SparseMap findExtents(int fd);
+uint64_t sparseCipherSize(const SparseMap &map);
+void encryptSparse(int inFd, int outFd, const unsigned char *key, const unsigned char *iv, const SparseMap &map,
+                   const PipelineOptions &options);
+void decryptSparse(int inFd, int outFd, const unsigned char *key, const PipelineOptions &options,
+                   const std::vector<unsigned char> &prefix);
+
+#endif // FILE_CRYPTO_SPARSE_H
@@ -0,0 +1,147 @@
+#include "crypto.h"
+#include "fileio.h"
+
+#include <openssl/rand.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <getopt.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define STARTUP_BENCH_PASSWORD "startup-bench"
+
+extern char **environ;
+
+typedef std::chrono::steady_clock BenchClock;
+
+/**
+ * @brief Параметры измерения.
+ */
+struct StartupOptions {
+    std::string dir;                 ///< каталог для временных файлов
+    size_t size;                     ///< размер исходного файла
+    int runs;                        ///< запусков каждой операции
+    std::vector<std::string> extra;  ///< дополнительные аргументы каждого запуска
+};
+/**
+ * @brief Запускает программу и ждёт её завершения.
+ *
+ * @return double Время от exec до завершения в миллисекундах.
+ */
+static double runProgram(const std::vector<std::string> &args) {
+    std::vector<char *> argv;
+    for (size_t i = 0; i < args.size(); i++) argv.push_back(const_cast<char *>(args[i].c_str()));
+    argv.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    BenchClock::time_point start = BenchClock::now();
+    pid_t pid;
+    int rc = posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) throw CryptoError("Cannot start " + args[0] + ": " + strerror(rc));
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) throw CryptoError(std::string("waitpid failed: ") + strerror(errno));
+    }
+    double ms = std::chrono::duration<double, std::milli>(BenchClock::now() - start).count();
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) throw CryptoError(args[0] + " failed");
+    return ms;
+}
+/**
+ * @brief Печатает распределение времени запусков одной операции.
+ */
+static void report(const std::string &program, const char *op, std::vector<double> times) {
+    std::sort(times.begin(), times.end());
+    double sum = 0;
+    for (size_t i = 0; i < times.size(); i++) sum += times[i];
+    std::cout << program << ": " << op << " min=" << times.front() << " median=" << times[times.size() / 2]
+              << " p90=" << times[times.size() * 9 / 10] << " mean=" << sum / times.size() << " ms" << std::endl;
+}
+/**
+ * @brief Измеряет шифрование и расшифрование одного файла программой.
+ */
+static void measure(const StartupOptions &options, const std::string &program, const std::string &plain) {
+    std::string cipher = plain + ".enc", check = plain + ".dec";
+    const char *ops[] = {"encrypt", "decrypt"};
+    for (int o = 0; o < 2; o++) {
+        std::vector<std::string> args;
+        args.push_back(program);
+        args.push_back(o == 0 ? "-e" : "-d");
+        args.push_back("-i");
+        args.push_back(o == 0 ? plain : cipher);
+        args.push_back("-o");
+        args.push_back(o == 0 ? cipher : check);
+        args.push_back("-p");
+        args.push_back(STARTUP_BENCH_PASSWORD);
+        args.insert(args.end(), options.extra.begin(), options.extra.end());
+
+        runProgram(args);  // прогрев страничного кэша для исполняемого файла и библиотек
+        std::vector<double> times;
+        for (int i = 0; i < options.runs; i++) times.push_back(runProgram(args));
+        report(program, ops[o], times);
+    }
+    if (readFile(plain) != readFile(check)) throw CryptoError(program + ": round trip mismatch");
+    unlink(cipher.c_str());
+    unlink(check.c_str());
+}
+
+static void printUsage(const char *program) {
+    std::cout << "Usage: " << program << " [-n runs] [-s size] [-d dir] [-x arg]... <file_crypto>..." << std::endl;
+}
+/**
+ * @brief Время от exec до выхода для маленьких файлов.
+ *
+ * Для каждой указанной программы (например, динамической и статической
+ * сборки file_crypto) много раз шифрует и расшифровывает файл размером
+ * size байт и печатает минимум, медиану, 90-й процентиль и среднее в
+ * миллисекундах. Аргументы -x добавляются к каждому запуску.
+ */
+int main(int argc, char *argv[]) {
+    StartupOptions options;
+    options.dir = "/tmp";
+    options.size = 16;
+    options.runs = 50;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:d:x:")) != -1) {
+        switch (opt) {
+            case 'n': options.runs = atoi(optarg); break;
+            case 's': options.size = strtoul(optarg, nullptr, 10); break;
+            case 'd': options.dir = optarg; break;
+            case 'x': options.extra.push_back(optarg); break;
+            default:
+                printUsage(argv[0]);
+                return 1;
+        }
+    }
+    if (options.runs <= 0 || optind >= argc) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    std::string plain = options.dir + "/file_crypto_startup." + std::to_string(getpid());
+    try {
+        std::vector<unsigned char> data(options.size);
+        RAND_bytes(data.data(), data.size());
+        writeFile(plain, data);
+        for (int i = optind; i < argc; i++) measure(options, argv[i], plain);
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        unlink(plain.c_str());
+        return 1;
+    }
+    unlink(plain.c_str());
+    return 0;
+}
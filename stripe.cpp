@@ -0,0 +1,284 @@
+#include "stripe.h"
+#include "crypto.h"
+#include "file_header.h"
+#include "fileio.h"
+#include "log.h"
+#include "memory_budget.h"
+#include "secure_pool.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STRIPE_SET_ID_SIZE 16  // идентификатор набора полос
+
+typedef std::unique_ptr<EVP_CIPHER_CTX, void (*)(EVP_CIPHER_CTX *)> CipherCtxPtr;
+
+/**
+ * @brief Карта полос из заголовка.
+ */
+struct StripeInfo {
+    unsigned char setId[STRIPE_SET_ID_SIZE];
+    uint64_t size;      ///< размер открытого текста
+    uint32_t unitSize;  ///< открытого текста в единице
+    unsigned index;     ///< номер полосы
+    unsigned count;     ///< число полос
+};
+
+static void encodeStripeInfo(const StripeInfo &info, unsigned char *out) {
+    memset(out, 0, FILE_STRIPE_INFO_SIZE);
+    memcpy(out, info.setId, STRIPE_SET_ID_SIZE);
+    for (int i = 0; i < 8; i++) out[16 + i] = (info.size >> (8 * i)) & 0xff;
+    for (int i = 0; i < 4; i++) out[24 + i] = (info.unitSize >> (8 * i)) & 0xff;
+    out[28] = info.index;
+    out[29] = info.count;
+}
+
+static void decodeStripeInfo(const unsigned char *in, StripeInfo *info) {
+    memcpy(info->setId, in, STRIPE_SET_ID_SIZE);
+    info->size = 0;
+    for (int i = 7; i >= 0; i--) info->size = info->size << 8 | in[16 + i];
+    info->unitSize = 0;
+    for (int i = 3; i >= 0; i--) info->unitSize = info->unitSize << 8 | in[24 + i];
+    info->index = in[28];
+    info->count = in[29];
+}
+/**
+ * @brief Шифртекст единицы с IV для открытого текста длины len.
+ */
+static size_t unitCipherSize(size_t len) {
+    return AES_BLOCK_SIZE + (len / AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE;
+}
+/**
+ * @brief Путь к полосе index набора name.
+ */
+static std::string stripePath(const StripeOptions &options, size_t index, const std::string &name) {
+    return options.dirs[index] + "/" + name;
+}
+/**
+ * @brief Резервирует буферы единиц для потоков полос в пределах бюджета.
+ *
+ * @return size_t Число потоков: по потоку на полосу, а если их буферы не
+ *         помещаются в свободную часть бюджета — меньше, но не меньше одного.
+ */
+static size_t reserveStripeBuffers(SecurePool &pool, size_t count) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t available = memoryBudget().available();
+    // Страница остаётся пулу ключей, как в planPipeline()
+    available = available > page ? available - page : 0;
+    size_t workers = count;
+    while (workers > 1 && pool.slabSizeFor(workers) > available) workers--;
+    if (workers < count) {
+        LOG(LOG_LEVEL_DEBUG, "Memory budget allows " << workers << " of " << count << " stripes at a time");
+    }
+    pool.reserve(workers);
+    return workers;
+}
+/**
+ * @brief Выполняет task(i) для каждой полосы в workers потоках.
+ *
+ * Каждую полосу целиком обрабатывает один поток; если потоков меньше, чем
+ * полос, освободившийся поток берёт следующую. Первая ошибка поднимает
+ * stop, по которому остальные полосы прекращают работу, и пробрасывается
+ * после завершения всех потоков.
+ */
+static void forEachStripe(size_t count, size_t workers,
+                          const std::function<void(size_t, const std::atomic<bool> &)> &task) {
+    std::atomic<bool> stop(false);
+    std::atomic<size_t> next(0);
+    std::mutex mutex;
+    std::string error;
+    auto run = [&]() {
+        for (size_t index = next.fetch_add(1); index < count && !stop; index = next.fetch_add(1)) {
+            try {
+                task(index, stop);
+            } catch (const std::exception &e) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (error.empty()) error = e.what();
+                stop = true;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers; i++) threads.push_back(std::thread(run));
+    run();
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+    if (!error.empty()) throw CryptoError(error);
+}
+/**
+ * @brief Шифрует файл полосами в несколько каталогов.
+ *
+ * @param[in] inputFile Исходный файл; нужен обычный файл, полосы читают
+ *            его параллельно по смещениям.
+ * @param[in] name Имя полосы в каждом каталоге.
+ * @param[in] key Ключ AES-256 (главный при options.perFileKey).
+ * @param[in] options Каталоги и размер единицы.
+ * @param[in] group Группа результата; её параметры fsync действуют и на полосы.
+ *
+ * Каждую полосу пишет свой поток: чтение, шифрование и запись одного
+ * устройства не ждут остальных, и пропускная способность растёт с числом
+ * устройств. Если буферы всех потоков не помещаются в бюджет памяти,
+ * потоков меньше и полосы обрабатываются по очереди.
+ */
+void encryptStriped(const std::string &inputFile, const std::string &name, const unsigned char *key,
+                    const StripeOptions &options, DurabilityGroup &group) {
+    ScopedFd in(openInputFile(inputFile));
+    struct stat st;
+    if (fstat(in.get(), &st) != 0 || !S_ISREG(st.st_mode)) throw CryptoError("Striping needs a regular input file");
+    size_t count = options.dirs.size();
+    if (count == 0 || count > STRIPE_MAX_COUNT) {
+        throw CryptoError("Striping needs from 1 to " + std::to_string(STRIPE_MAX_COUNT) + " directories");
+    }
+    if (options.unitSize < STRIPE_MIN_UNIT || options.unitSize > STRIPE_MAX_UNIT ||
+        options.unitSize % AES_BLOCK_SIZE != 0) {
+        throw CryptoError("Invalid stripe unit size");
+    }
+    StripeInfo info;
+    if (!RAND_bytes(info.setId, STRIPE_SET_ID_SIZE)) handleErrors();
+    info.size = st.st_size;
+    info.unitSize = options.unitSize;
+    info.count = count;
+    uint64_t units = (info.size + options.unitSize - 1) / options.unitSize;
+    LOG(LOG_LEVEL_DEBUG, "Striping " << info.size << " bytes as " << units << " units over " << count << " directories");
+
+    SecurePool pool(options.unitSize + 2 * AES_BLOCK_SIZE, secureHugePages());
+    size_t workers = reserveStripeBuffers(pool, count);
+    // Полосы заменяют прежние только все вместе, после успеха каждой
+    DurabilityGroup set(group.options(), true);
+    std::mutex groupMutex;
+    forEachStripe(count, workers, [&](size_t index, const std::atomic<bool> &stop) {
+        StripeInfo stripe = info;
+        stripe.index = index;
+        unsigned char layoutInfo[FILE_STRIPE_INFO_SIZE];
+        encodeStripeInfo(stripe, layoutInfo);
+
+        AtomicOutputFile out(stripePath(options, index, name), set);
+        uint64_t stripeUnits = units > index ? (units - index + count - 1) / count : 0;
+        out.preallocate(FILE_HEADER_HKDF_SIZE + FILE_STRIPE_INFO_SIZE + AES_BLOCK_SIZE +
+                        stripeUnits * unitCipherSize(options.unitSize));
+        unsigned char iv[AES_BLOCK_SIZE];
+        if (!RAND_bytes(iv, AES_BLOCK_SIZE)) handleErrors();
+        SecureBuffer fileKey = keyPool().acquire();
+        writeFileHeader(out.fd(), key, iv, options.pipeline, options.perFileKey, fileKey.data(),
+                        FILE_HEADER_FLAG_STRIPED, layoutInfo, sizeof(layoutInfo));
+        writeAll(out.fd(), iv, AES_BLOCK_SIZE);
+        if (options.pipeline.onOutput) options.pipeline.onOutput(iv, AES_BLOCK_SIZE);
+
+        // Буфер: IV единицы, затем открытый текст, шифруемый на месте
+        SecureBuffer buf = pool.acquire();
+        unsigned char *unitIv = buf.data(), *data = buf.data() + AES_BLOCK_SIZE;
+        CipherCtxPtr ctx(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
+        if (!ctx) handleErrors();
+        for (uint64_t unit = index; unit < units && !stop; unit += count) {
+            uint64_t offset = unit * options.unitSize;
+            size_t len = info.size - offset < options.unitSize ? (size_t)(info.size - offset) : options.unitSize;
+            if (preadFull(in.get(), data, len, offset) != len) throw CryptoError("Input shrank while being read");
+            if (!RAND_bytes(unitIv, AES_BLOCK_SIZE)) handleErrors();
+            int outLen = 0, finalLen = 0;
+            if (EVP_EncryptInit_ex(ctx.get(), aes256Cbc(), nullptr, fileKey.data(), unitIv) != 1 ||
+                EVP_EncryptUpdate(ctx.get(), data, &outLen, data, (int)len) != 1 ||
+                EVP_EncryptFinal_ex(ctx.get(), data + outLen, &finalLen) != 1) {
+                handleErrors();
+            }
+            size_t total = AES_BLOCK_SIZE + outLen + finalLen;
+            writeAll(out.fd(), buf.data(), total);
+            if (options.pipeline.onOutput) options.pipeline.onOutput(buf.data(), total);
+            out.wrote();
+        }
+        if (stop) return;
+        std::lock_guard<std::mutex> lock(groupMutex);
+        out.commit();
+    });
+    set.flush();
+}
+/**
+ * @brief Собирает файл из полос, расшифровывая их параллельно.
+ *
+ * @param[in] name Имя полосы в каждом каталоге.
+ * @param[in] outFd Результат — обычный файл.
+ * @param[in] key Ключ AES-256 (главный для полос с ключом файла).
+ * @param[in] options Каталоги в том же порядке, что и при шифровании.
+ *
+ * Сначала проверяются заголовки всех полос: ключ, общий идентификатор
+ * набора и номера полос. Затем каждую полосу читает свой поток и пишет
+ * единицы pwrite() по их смещениям. После завершения позиция результата
+ * — на его конце.
+ */
+void decryptStriped(const std::string &name, int outFd, const unsigned char *key, const StripeOptions &options) {
+    if (lseek(outFd, 0, SEEK_CUR) < 0) throw CryptoError("Striped files can only be decrypted into a regular file");
+    size_t count = options.dirs.size();
+    std::unique_ptr<ScopedFd[]> fds(new ScopedFd[count]);
+    std::unique_ptr<SecureBuffer[]> fileKeys(new SecureBuffer[count]);
+    StripeInfo info;
+    for (size_t i = 0; i < count; i++) {
+        std::string path = stripePath(options, i, name);
+        fds[i].reset(openInputFile(path));
+        fileKeys[i] = keyPool().acquire();
+        FileHeader header;
+        try {
+            readFileHeader(fds[i].get(), key, &header, fileKeys[i].data());
+        } catch (const CryptoError &e) {
+            throw CryptoError(path + ": " + e.what());
+        }
+        if (!(header.flags() & FILE_HEADER_FLAG_STRIPED) || !header.prefix.empty()) {
+            throw CryptoError(path + " is not a stripe");
+        }
+        StripeInfo stripe;
+        decodeStripeInfo(header.bytes + header.size - FILE_STRIPE_INFO_SIZE, &stripe);
+        if (i == 0) info = stripe;
+        if (stripe.count != count || stripe.index != i) {
+            throw CryptoError(path + " is stripe " + std::to_string(stripe.index + 1) + " of " +
+                              std::to_string(stripe.count) + "; list the directories in the order used to encrypt");
+        }
+        if (CRYPTO_memcmp(stripe.setId, info.setId, STRIPE_SET_ID_SIZE) != 0 || stripe.size != info.size ||
+            stripe.unitSize != info.unitSize || stripe.unitSize < STRIPE_MIN_UNIT || stripe.unitSize > STRIPE_MAX_UNIT ||
+            stripe.unitSize % AES_BLOCK_SIZE != 0) {
+            throw CryptoError(path + " belongs to a different striped file");
+        }
+        // IV файла нужен только для проверки ключа
+        unsigned char iv[AES_BLOCK_SIZE];
+        if (readFull(fds[i].get(), iv, AES_BLOCK_SIZE) != AES_BLOCK_SIZE) throw CryptoError("Truncated stripe " + path);
+    }
+    if (fallocate(outFd, FALLOC_FL_KEEP_SIZE, 0, info.size) != 0 && errno == ENOSPC) {
+        throw CryptoError("No space left for the output");
+    }
+    uint64_t units = (info.size + info.unitSize - 1) / info.unitSize;
+
+    SecurePool pool(info.unitSize + 2 * AES_BLOCK_SIZE, secureHugePages());
+    size_t workers = reserveStripeBuffers(pool, count);
+    forEachStripe(count, workers, [&](size_t index, const std::atomic<bool> &stop) {
+        std::string path = stripePath(options, index, name);
+        SecureBuffer buf = pool.acquire();
+        unsigned char *unitIv = buf.data(), *data = buf.data() + AES_BLOCK_SIZE;
+        CipherCtxPtr ctx(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
+        if (!ctx) handleErrors();
+        for (uint64_t unit = index; unit < units && !stop; unit += count) {
+            uint64_t offset = unit * info.unitSize;
+            size_t len = info.size - offset < info.unitSize ? (size_t)(info.size - offset) : info.unitSize;
+            size_t cipherLen = unitCipherSize(len);
+            if (readFull(fds[index].get(), buf.data(), cipherLen) != cipherLen) throw CryptoError("Truncated stripe " + path);
+            int outLen = 0, finalLen = 0;
+            bool ok = EVP_DecryptInit_ex(ctx.get(), aes256Cbc(), nullptr, fileKeys[index].data(), unitIv) == 1 &&
+                      EVP_DecryptUpdate(ctx.get(), data, &outLen, data, (int)(cipherLen - AES_BLOCK_SIZE)) == 1 &&
+                      EVP_DecryptFinal_ex(ctx.get(), data + outLen, &finalLen) == 1;
+            if (!ok || (size_t)(outLen + finalLen) != len) throw CryptoError("Corrupt stripe " + path);
+            pwriteAll(outFd, data, len, offset);
+            if (options.pipeline.onOutput) options.pipeline.onOutput(data, len);
+        }
+        unsigned char extra;
+        if (!stop && readFull(fds[index].get(), &extra, 1) != 0) throw CryptoError("Trailing data in stripe " + path);
+    });
+    if (ftruncate(outFd, info.size) != 0 || lseek(outFd, info.size, SEEK_SET) < 0) {
+        throw CryptoError(std::string("Cannot resize output: ") + strerror(errno));
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef FILE_CRYPTO_STRIPE_H
+#define FILE_CRYPTO_STRIPE_H
+
+#include "output_file.h"
+#include "pipeline.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#define STRIPE_DEFAULT_UNIT (1u << 20)  // открытого текста в единице чередования
+#define STRIPE_MIN_UNIT 4096            // наименьшая единица чередования
+#define STRIPE_MAX_UNIT (64u << 20)     // наибольшая единица чередования
+#define STRIPE_MAX_COUNT 255            // наибольшее число полос
+
+/**
+ * @brief Параметры записи с чередованием по нескольким каталогам.
+ *
+ * Открытый текст делится на единицы по unitSize байт; единица u попадает
+ * в полосу u % N — файл с одним и тем же именем в каталоге dirs[u % N].
+ * Полоса — заголовок с флагом FILE_HEADER_FLAG_STRIPED, IV файла (нужен
+ * только для контрольного значения ключа), затем её единицы по порядку,
+ * каждая — свой IV и шифртекст AES-256 CBC с дополнением. Единицы
+ * независимы, поэтому каждая полоса шифруется, пишется, читается и
+ * расшифровывается своим потоком.
+ *
+ * Карта полос в конце заголовка (целые — little-endian):
+ *   0  идентификатор набора (16 случайных байт, общий для всех полос)
+ *   16 размер открытого текста (uint64)
+ *   24 размер единицы (uint32)
+ *   28 номер полосы (байт)
+ *   29 число полос (байт)
+ *   30 резерв (нули)
+ */
+struct StripeOptions {
+    std::vector<std::string> dirs;  ///< каталоги полос, по одному на устройство
+    size_t unitSize;                ///< открытого текста в единице, кратен AES_BLOCK_SIZE
+    bool perFileKey;                ///< ключ каждой полосы выводится HKDF из главного
+    PipelineOptions pipeline;       ///< используется onOutput; вызывается из нескольких потоков
+
+    StripeOptions() : unitSize(STRIPE_DEFAULT_UNIT), perFileKey(false) {}
+};
+
+void encryptStriped(const std::string &inputFile, const std::string &name, const unsigned char *key,
+                    const StripeOptions &options, DurabilityGroup &group);
+void decryptStriped(const std::string &name, int outFd, const unsigned char *key, const StripeOptions &options);
+
+#endif // FILE_CRYPTO_STRIPE_H
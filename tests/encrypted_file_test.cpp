@@ -0,0 +1,177 @@
+#include "crypto.h"
+#include "encrypted_file.h"
+#include "file_header.h"
+#include "fileio.h"
+#include "memory_budget.h"
+
+#include <openssl/rand.h>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Образ: несколько полных порций кэша и короткая последняя (не кратная сектору)
+#define TEST_IMAGE_SIZE (3 * BLOCK_CACHE_CHUNK + 5000)
+
+static const unsigned char TEST_KEY[AES_KEY_LENGTH] = {9, 8, 7, 6, 5, 4, 3, 2, 1};
+static int failures = 0;
+
+#define CHECK(condition)                                                                   \
+    do {                                                                                   \
+        if (!(condition)) {                                                                \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+            failures++;                                                                    \
+        }                                                                                  \
+    } while (0)
+
+/**
+ * @brief Шифрует plain в образ XTS по пути path.
+ */
+static void writeImage(const std::string &path, const std::vector<unsigned char> &plain) {
+    std::string plainPath = path + ".plain";
+    writeFile(plainPath, plain);
+    ScopedFd in(openInputFile(plainPath));
+    ScopedFd out(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+    unsigned char iv[AES_BLOCK_SIZE];
+    RAND_bytes(iv, AES_BLOCK_SIZE);
+    unsigned char fileKey[AES_KEY_LENGTH];
+    std::vector<unsigned char> info = xtsLayoutInfo(XTS_DEFAULT_SECTOR, FILE_HEADER_SIZE);
+    writeFileHeader(out.get(), TEST_KEY, iv, PipelineOptions(), false, fileKey, FILE_HEADER_FLAG_XTS, info.data(),
+                    info.size());
+    encryptXts(in.get(), out.get(), fileKey, iv, XTS_DEFAULT_SECTOR, PipelineOptions());
+    unlink(plainPath.c_str());
+}
+/**
+ * @brief Читает len байт со смещения offset и сравнивает с образцом.
+ */
+static bool readMatches(EncryptedFile &file, const std::vector<unsigned char> &plain, uint64_t offset, size_t len) {
+    std::vector<unsigned char> buf(len + 1);
+    size_t n = file.pread(buf.data(), len, offset);
+    return n == len && memcmp(buf.data(), plain.data() + offset, len) == 0;
+}
+
+static void testReads(EncryptedFile &file, const std::vector<unsigned char> &plain) {
+    CHECK(file.size() == plain.size());
+    // Через границу порций, целиком несколько порций, затем те же данные из кэша
+    CHECK(readMatches(file, plain, BLOCK_CACHE_CHUNK - 100, 200));
+    CHECK(readMatches(file, plain, 10, 2 * BLOCK_CACHE_CHUNK + 300));
+    CHECK(readMatches(file, plain, BLOCK_CACHE_CHUNK - 100, 200));
+    // Короткая последняя порция
+    CHECK(readMatches(file, plain, 3 * BLOCK_CACHE_CHUNK, 5000));
+    CHECK(readMatches(file, plain, plain.size() - 17, 17));
+    // Последовательное чтение с упреждением
+    for (uint64_t offset = 0; offset < plain.size(); offset += 4096) {
+        size_t len = plain.size() - offset < 4096 ? (size_t)(plain.size() - offset) : 4096;
+        CHECK(readMatches(file, plain, offset, len));
+    }
+    // За концом файла чтение укорачивается или ничего не возвращает
+    unsigned char buf[64];
+    CHECK(file.pread(buf, sizeof(buf), plain.size() - 10) == 10);
+    CHECK(memcmp(buf, plain.data() + plain.size() - 10, 10) == 0);
+    CHECK(file.pread(buf, sizeof(buf), plain.size()) == 0);
+    CHECK(file.pread(buf, sizeof(buf), plain.size() + 12345) == 0);
+}
+
+static void testWrites(const std::string &path, std::vector<unsigned char> &plain) {
+    EncryptedFile writer(path, TEST_KEY, true);
+    EncryptedFile reader(path, TEST_KEY, false);
+    // Обе порции уже в кэше до записи
+    CHECK(readMatches(writer, plain, 0, 2 * BLOCK_CACHE_CHUNK));
+    CHECK(readMatches(reader, plain, 0, 2 * BLOCK_CACHE_CHUNK));
+
+    std::vector<unsigned char> patch(3000);
+    RAND_bytes(patch.data(), patch.size());
+    uint64_t offset = BLOCK_CACHE_CHUNK - 1000;
+    writer.pwrite(patch.data(), patch.size(), offset);
+    memcpy(plain.data() + offset, patch.data(), patch.size());
+    CHECK(readMatches(writer, plain, 0, 2 * BLOCK_CACHE_CHUNK));
+    CHECK(readMatches(reader, plain, 0, 2 * BLOCK_CACHE_CHUNK));
+
+    // Запись в короткую последнюю порцию до самого конца
+    RAND_bytes(patch.data(), 100);
+    writer.pwrite(patch.data(), 100, plain.size() - 100);
+    memcpy(plain.data() + plain.size() - 100, patch.data(), 100);
+    CHECK(readMatches(reader, plain, plain.size() - 300, 300));
+
+    // Файл не растёт: запись за конец отклоняется
+    bool rejected = false;
+    try {
+        writer.pwrite(patch.data(), 10, plain.size() - 5);
+    } catch (const CryptoError &) {
+        rejected = true;
+    }
+    CHECK(rejected);
+    writer.sync();
+
+    // Тот же файл с другим кэшем открыть нельзя
+    BlockCache other(BLOCK_CACHE_CHUNK * BLOCK_CACHE_SHARDS);
+    rejected = false;
+    try {
+        EncryptedFile third(path, TEST_KEY, false, other);
+    } catch (const CryptoError &) {
+        rejected = true;
+    }
+    CHECK(rejected);
+}
+/**
+ * @brief Кэш при бюджете памяти меньше его объёма: промахи вытесняют
+ *        порции, а не завершаются ошибкой.
+ */
+static void testBudget(const std::string &path) {
+    std::vector<unsigned char> plain(40 * BLOCK_CACHE_CHUNK);
+    RAND_bytes(plain.data(), plain.size());
+    writeImage(path, plain);
+    size_t used = memoryBudget().limit() - memoryBudget().available();
+    memoryBudget().setLimit(used + 3 * (BLOCK_CACHE_CHUNK * BLOCK_CACHE_SHARDS) / 2);
+    {
+        BlockCache cache(BLOCK_CACHE_DEFAULT_SIZE);
+        CHECK(cache.capacity() < BLOCK_CACHE_DEFAULT_SIZE);
+        EncryptedFile file(path, TEST_KEY, false, cache);
+        for (int pass = 0; pass < 2; pass++) {
+            for (uint64_t offset = 0; offset < plain.size(); offset += 3 * BLOCK_CACHE_CHUNK / 2) {
+                size_t len = plain.size() - offset < 5000 ? (size_t)(plain.size() - offset) : 5000;
+                CHECK(readMatches(file, plain, offset, len));
+            }
+        }
+    }
+    memoryBudget().setLimit((size_t)-1);
+}
+/**
+ * @brief Проверки EncryptedFile: чтение через границы порций и за концом
+ *        файла, запись и её видимость через другое открытие, работа кэша
+ *        в пределах бюджета памяти.
+ */
+int main() {
+    initCrypto();
+    char dir[] = "/tmp/file_crypto_test.XXXXXX";
+    if (!mkdtemp(dir)) {
+        std::cerr << "Cannot create a temporary directory" << std::endl;
+        return 1;
+    }
+    std::string path = std::string(dir) + "/image.xts";
+    std::vector<unsigned char> plain(TEST_IMAGE_SIZE);
+    RAND_bytes(plain.data(), plain.size());
+    try {
+        writeImage(path, plain);
+        {
+            EncryptedFile file(path, TEST_KEY, false);
+            testReads(file, plain);
+        }
+        testWrites(path, plain);
+        // После закрытия всех открытий данные читаются с диска заново
+        EncryptedFile file(path, TEST_KEY, false);
+        testReads(file, plain);
+        testBudget(std::string(dir) + "/budget.xts");
+    } catch (const std::exception &e) {
+        std::cerr << "Unexpected error: " << e.what() << std::endl;
+        failures++;
+    }
+    unlink(path.c_str());
+    unlink((std::string(dir) + "/budget.xts").c_str());
+    rmdir(dir);
+    if (failures) std::cerr << failures << " check(s) failed" << std::endl;
+    return failures ? 1 : 0;
+}
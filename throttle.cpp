@@ -0,0 +1,224 @@
+#include "throttle.h"
+#include "crypto.h"
+#include "fileio.h"
+#include "server.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define IOPRIO_WHO_PROCESS 1       // ioprio_set(): which = поток или процесс
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_LEVELS 8            // уровни 0 (высший) .. 7 внутри класса
+#define IOPRIO_DEFAULT_LEVEL 4
+#define THROTTLE_CONTROL_LINE 256  // наибольшая длина команды
+
+/**
+ * @brief Начисляет единицы за прошедшее время; вызывается под mutex_.
+ */
+void TokenBucket::refill(std::chrono::steady_clock::time_point now) {
+    if (rate_ > 0) {
+        tokens_ += std::chrono::duration<double>(now - last_).count() * rate_;
+        tokens_ = std::min(tokens_, rate_ * THROTTLE_BURST_SECONDS);
+    }
+    last_ = now;
+}
+/**
+ * @brief Меняет лимит; ждущие в take() потоки подхватывают его сразу.
+ *
+ * @param[in] rate Единиц в секунду; 0 снимает ограничение и прощает долг.
+ */
+void TokenBucket::setRate(double rate) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    refill(std::chrono::steady_clock::now());
+    rate_ = rate > 0 ? rate : 0;
+    if (rate_ == 0) tokens_ = 0;
+    tokens_ = std::min(tokens_, rate_ * THROTTLE_BURST_SECONDS);
+    limited_.store(rate_ > 0, std::memory_order_relaxed);
+}
+
+double TokenBucket::rate() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return rate_;
+}
+/**
+ * @brief Списывает amount единиц и ждёт, пока скорость не вернётся в лимит.
+ */
+void TokenBucket::take(double amount) {
+    if (!limited_.load(std::memory_order_relaxed)) return;
+    std::unique_lock<std::mutex> lock(mutex_);
+    refill(std::chrono::steady_clock::now());
+    tokens_ -= amount;
+    while (tokens_ < 0 && rate_ > 0) {
+        double wait = std::min(-tokens_ / rate_, THROTTLE_MAX_SLEEP);
+        lock.unlock();
+        std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+        lock.lock();
+        refill(std::chrono::steady_clock::now());
+    }
+}
+/**
+ * @brief Учитывает обработанные данные, задерживая вызывающий поток при превышении лимитов.
+ *
+ * @param[in] bytes Байт входных данных.
+ * @param[in] ops Операций ввода-вывода.
+ */
+void IoThrottle::account(uint64_t bytes, unsigned ops) {
+    if (bytes) bytes_.take((double)bytes);
+    if (ops) ops_.take(ops);
+}
+
+IoThrottle &ioThrottle() {
+    static IoThrottle throttle;
+    return throttle;
+}
+/**
+ * @brief Выполняет команду управления лимитами.
+ *
+ * @param[in] throttle Изменяемые лимиты.
+ * @param[in] line Команда без перевода строки.
+ * @return std::string Ответ с переводом строки.
+ */
+std::string throttleCommand(IoThrottle &throttle, const std::string &line) {
+    std::istringstream input(line);
+    std::string command, value;
+    input >> command >> value;
+    if (command == "rate" || command == "iops") {
+        // Допускается запись вида 50M/s
+        if (value.size() > 2 && value.compare(value.size() - 2, 2, "/s") == 0) value.resize(value.size() - 2);
+        size_t number;
+        if (value.empty() || !parseSize(value.c_str(), &number)) return "error: invalid value '" + value + "'\n";
+        if (command == "rate") {
+            throttle.setByteRate((double)number);
+        } else {
+            throttle.setIops((double)number);
+        }
+    } else if (command != "show") {
+        return "error: unknown command '" + command + "' (use rate, iops or show)\n";
+    }
+    std::ostringstream reply;
+    reply << "rate=" << (uint64_t)throttle.byteRate() << " iops=" << (uint64_t)throttle.iops() << "\n";
+    return reply.str();
+}
+
+ThrottleControl::ThrottleControl(const std::string &path) : path_(path), listenFd_(-1), stopFd_(-1) {
+    listenFd_ = openEndpoint("unix:" + path, true);
+    stopFd_ = eventfd(0, EFD_CLOEXEC);
+    if (stopFd_ < 0) {
+        close(listenFd_);
+        throw CryptoError(std::string("Cannot create eventfd: ") + strerror(errno));
+    }
+    thread_ = std::thread(&ThrottleControl::serve, this);
+}
+
+ThrottleControl::~ThrottleControl() {
+    uint64_t one = 1;
+    if (write(stopFd_, &one, sizeof(one)) < 0) {
+        // eventfd не переполняется одной записью
+    }
+    thread_.join();
+    close(stopFd_);
+    close(listenFd_);
+    unlink(path_.c_str());
+}
+
+void ThrottleControl::serve() {
+    for (;;) {
+        pollfd fds[2] = {{listenFd_, POLLIN, 0}, {stopFd_, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (fds[1].revents) return;
+        int fd = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) continue;
+        handle(fd);
+        close(fd);
+    }
+}
+/**
+ * @brief Обслуживает одно соединение до его закрытия или остановки.
+ */
+void ThrottleControl::handle(int fd) {
+    std::string pending;
+    for (;;) {
+        pollfd fds[2] = {{fd, POLLIN, 0}, {stopFd_, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (fds[1].revents) return;
+        char buf[THROTTLE_CONTROL_LINE];
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            // Последняя команда может прийти без перевода строки
+            if (!pending.empty()) {
+                std::string reply = throttleCommand(ioThrottle(), pending);
+                send(fd, reply.data(), reply.size(), MSG_NOSIGNAL);
+            }
+            return;
+        }
+        pending.append(buf, n);
+        size_t end;
+        while ((end = pending.find('\n')) != std::string::npos) {
+            std::string reply = throttleCommand(ioThrottle(), pending.substr(0, end));
+            pending.erase(0, end + 1);
+            if (send(fd, reply.data(), reply.size(), MSG_NOSIGNAL) < 0) return;
+        }
+        if (pending.size() > THROTTLE_CONTROL_LINE) return;
+    }
+}
+/**
+ * @brief Разбирает приоритет ввода-вывода: idle, be[:уровень] или rt[:уровень].
+ */
+bool parseIoPriority(const char *text, IoPriorityClass *cls, int *level) {
+    std::string spec = text;
+    std::string name = spec.substr(0, spec.find(':'));
+    *level = IOPRIO_DEFAULT_LEVEL;
+    if (name == "idle") {
+        *cls = IOPRIO_IDLE;
+        *level = 0;
+        return name == spec;
+    }
+    if (name == "be") {
+        *cls = IOPRIO_BEST_EFFORT;
+    } else if (name == "rt") {
+        *cls = IOPRIO_REALTIME;
+    } else {
+        return false;
+    }
+    if (name == spec) return true;
+    char *end;
+    long value = strtol(spec.c_str() + name.size() + 1, &end, 10);
+    if (*end != '\0' || end == spec.c_str() + name.size() + 1 || value < 0 || value >= IOPRIO_LEVELS) return false;
+    *level = (int)value;
+    return true;
+}
+/**
+ * @brief Задаёт приоритет ввода-вывода вызывающему потоку.
+ *
+ * Вызывается до запуска рабочих потоков: они наследуют приоритет.
+ */
+void setIoPriority(IoPriorityClass cls, int level) {
+    if (cls == IOPRIO_DEFAULT) return;
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ((int)cls << IOPRIO_CLASS_SHIFT) | level) != 0) {
+        throw CryptoError(std::string("Cannot set I/O priority: ") + strerror(errno));
+    }
+}
+/**
+ * @brief Задаёт значение nice вызывающему потоку (наследуется новыми потоками).
+ */
+void setNice(int nice) {
+    if (setpriority(PRIO_PROCESS, 0, nice) != 0) {
+        throw CryptoError(std::string("Cannot set nice value: ") + strerror(errno));
+    }
+}
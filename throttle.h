@@ -0,0 +1,112 @@
+#ifndef FILE_CRYPTO_THROTTLE_H
+#define FILE_CRYPTO_THROTTLE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#define THROTTLE_BURST_SECONDS 0.1   // запас, накапливаемый за время простоя
+#define THROTTLE_MAX_SLEEP 0.05      // секунд сна за раз: новые лимиты действуют сразу
+
+/**
+ * @brief Класс планирования ввода-вывода (ioprio_set(2)).
+ */
+enum IoPriorityClass {
+    IOPRIO_DEFAULT = 0,  ///< не менять
+    IOPRIO_REALTIME = 1,
+    IOPRIO_BEST_EFFORT = 2,
+    IOPRIO_IDLE = 3
+};
+
+/**
+ * @brief Маркерная корзина: не больше rate единиц в секунду.
+ *
+ * take() списывает единицы сразу, даже в долг, и ждёт, пока долг не будет
+ * погашен пополнением. Поэтому порция любого размера проходит, а средняя
+ * скорость всё равно равна лимиту. Ожидание идёт короткими отрезками и
+ * каждый раз пересчитывается, так что изменение лимита во время работы
+ * действует уже на ждущие потоки. Нулевой лимит — без ограничения.
+ */
+class TokenBucket {
+public:
+    TokenBucket() : rate_(0), limited_(false), tokens_(0), last_(std::chrono::steady_clock::now()) {}
+
+    void setRate(double rate);
+    double rate();
+    void take(double amount);
+
+private:
+    void refill(std::chrono::steady_clock::time_point now);
+
+    double rate_;
+    std::atomic<bool> limited_;  ///< быстрая проверка без блокировки
+    double tokens_;
+    std::chrono::steady_clock::time_point last_;
+    std::mutex mutex_;
+
+    TokenBucket(const TokenBucket &);
+    TokenBucket &operator=(const TokenBucket &);
+};
+
+/**
+ * @brief Общие лимиты скорости ввода-вывода процесса.
+ *
+ * Байты считаются по прочитанным входным данным, операции — по вызовам
+ * чтения и записи порций. Лимиты можно менять во время работы.
+ */
+class IoThrottle {
+public:
+    IoThrottle() {}
+
+    void setByteRate(double bytesPerSecond) { bytes_.setRate(bytesPerSecond); }
+    void setIops(double opsPerSecond) { ops_.setRate(opsPerSecond); }
+    double byteRate() { return bytes_.rate(); }
+    double iops() { return ops_.rate(); }
+    bool limited() { return byteRate() > 0 || iops() > 0; }
+    void account(uint64_t bytes, unsigned ops);
+
+private:
+    TokenBucket bytes_;
+    TokenBucket ops_;
+
+    IoThrottle(const IoThrottle &);
+    IoThrottle &operator=(const IoThrottle &);
+};
+
+IoThrottle &ioThrottle();
+
+/**
+ * @brief Сокет управления лимитами во время работы.
+ *
+ * Принимает на Unix-сокете текстовые команды по одной в строке:
+ * "rate <size>" (байт в секунду, 0 — без лимита), "iops <n>" и "show".
+ * На каждую команду отвечает строкой с текущими лимитами или ошибкой.
+ * Соединения обслуживаются по одному фоновым потоком.
+ */
+class ThrottleControl {
+public:
+    explicit ThrottleControl(const std::string &path);
+    ~ThrottleControl();
+
+private:
+    void serve();
+    void handle(int fd);
+
+    std::string path_;
+    int listenFd_;
+    int stopFd_;  ///< eventfd для остановки потока
+    std::thread thread_;
+
+    ThrottleControl(const ThrottleControl &);
+    ThrottleControl &operator=(const ThrottleControl &);
+};
+
+std::string throttleCommand(IoThrottle &throttle, const std::string &line);
+bool parseIoPriority(const char *text, IoPriorityClass *cls, int *level);
+void setIoPriority(IoPriorityClass cls, int level);
+void setNice(int nice);
+
+#endif // FILE_CRYPTO_THROTTLE_H
@@ -0,0 +1,264 @@
+#include "volume.h"
+#include "crypto.h"
+#include "file_header.h"
+#include "fileio.h"
+#include "log.h"
+#include "secure_pool.h"
+
+#include <openssl/rand.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @brief Каталог файла вместе с завершающей косой чертой; пусто — текущий.
+ */
+static std::string directoryOf(const std::string &path) {
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+}
+/**
+ * @brief Имя тома index (с нуля) для описи manifestFile.
+ */
+static std::string volumePath(const std::string &manifestFile, size_t index) {
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%03zu", index + 1);
+    return manifestFile + suffix;
+}
+/**
+ * @brief Выполняет task(i) для каждого тома в нескольких потоках.
+ *
+ * Потоки разбирают тома по очереди; первая ошибка останавливает раздачу
+ * и пробрасывается после завершения уже начатых томов.
+ */
+static void forEachVolume(size_t count, int workers, const std::function<void(size_t)> &task) {
+    if (workers <= 0) workers = (int)std::thread::hardware_concurrency();
+    if (workers <= 0) workers = 1;
+    if ((size_t)workers > count) workers = (int)count;
+
+    std::atomic<size_t> next(0);
+    std::mutex mutex;
+    std::string error;
+    auto run = [&]() {
+        for (;;) {
+            size_t index = next.fetch_add(1);
+            if (index >= count) return;
+            try {
+                task(index);
+            } catch (const std::exception &e) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (error.empty()) error = e.what();
+                next = count;
+                return;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < workers; i++) threads.push_back(std::thread(run));
+    run();
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+    if (!error.empty()) throw CryptoError(error);
+}
+/**
+ * @brief Проверяет, что файл — опись томов, по первой строке.
+ */
+bool isVolumeManifest(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    ScopedFd guard(fd);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    const size_t magicLen = sizeof(VOLUME_MANIFEST_MAGIC) - 1;
+    unsigned char line[sizeof(VOLUME_MANIFEST_MAGIC)];
+    return readFull(fd, line, sizeof(line)) == sizeof(line) && memcmp(line, VOLUME_MANIFEST_MAGIC, magicLen) == 0 &&
+           line[magicLen] == '\n';
+}
+/**
+ * @brief Читает опись томов и проверяет, что тома покрывают файл без пропусков.
+ *
+ * @param[in] path Путь к описи.
+ * @return VolumeManifest Тома с путями относительно текущего каталога.
+ */
+VolumeManifest readVolumeManifest(const std::string &path) {
+    ScopedFd in(openInputFile(path));
+    std::string text;
+    unsigned char buf[4096];
+    for (;;) {
+        size_t n = readFull(in.get(), buf, sizeof(buf));
+        text.append((const char *)buf, n);
+        if (text.size() > VOLUME_MANIFEST_MAX) throw CryptoError("Volume manifest is too large: " + path);
+        if (n < sizeof(buf)) break;
+    }
+
+    std::istringstream lines(text);
+    std::string line;
+    if (!std::getline(lines, line) || line != VOLUME_MANIFEST_MAGIC) throw CryptoError("Not a volume manifest: " + path);
+    VolumeManifest manifest;
+    bool sized = false;
+    std::string directory = directoryOf(path);
+    while (std::getline(lines, line)) {
+        if (line.empty()) continue;
+        std::istringstream fields(line);
+        std::string keyword;
+        fields >> keyword;
+        if (keyword == "size" && !sized && (fields >> manifest.size)) {
+            sized = true;
+            continue;
+        }
+        VolumeEntry volume;
+        std::string name;
+        if (keyword != "volume" || !(fields >> volume.offset >> volume.length) || !std::getline(fields >> std::ws, name) ||
+            name.empty()) {
+            throw CryptoError("Corrupt volume manifest: " + path);
+        }
+        volume.path = name[0] == '/' ? name : directory + name;
+        manifest.volumes.push_back(volume);
+    }
+    uint64_t end = 0;
+    for (size_t i = 0; i < manifest.volumes.size(); i++) {
+        const VolumeEntry &volume = manifest.volumes[i];
+        if (volume.offset != end || volume.length > manifest.size - end) {
+            throw CryptoError("Corrupt volume manifest: " + path);
+        }
+        end += volume.length;
+    }
+    if (!sized || manifest.volumes.empty() || end != manifest.size) throw CryptoError("Corrupt volume manifest: " + path);
+    return manifest;
+}
+/**
+ * @brief Шифрует файл в набор томов и опись.
+ *
+ * @param[in] inputFile Исходный файл; нужен обычный файл, тома читают его
+ *            параллельно по смещениям.
+ * @param[in] manifestFile Путь к описи; тома — рядом с ней.
+ * @param[in] key Ключ AES-256 (главный при options.perFileKey).
+ * @param[in] options Параметры разбиения.
+ * @param[in] group Группа результата; её параметры fsync действуют и на тома.
+ *
+ * Открытый текст тома кратен блоку, поэтому шифртекст длиннее ровно на
+ * блок дополнения и том не превышает options.volumeSize. Опись
+ * записывается последней: без неё неполный набор томов не принимается за
+ * готовый. Тома и опись заменяют прежний набор только вместе, после
+ * успеха всех томов: при ошибке прежние файлы остаются как были.
+ */
+void encryptVolumes(const std::string &inputFile, const std::string &manifestFile, const unsigned char *key,
+                    const VolumeOptions &options, DurabilityGroup &group) {
+    ScopedFd in(openInputFile(inputFile));
+    struct stat st;
+    if (fstat(in.get(), &st) != 0 || !S_ISREG(st.st_mode)) throw CryptoError("Volumes need a regular input file");
+    if (options.volumeSize < VOLUME_MIN_SIZE) {
+        throw CryptoError("Volume size must be at least " + std::to_string(VOLUME_MIN_SIZE) + " bytes");
+    }
+    size_t headerSize = options.perFileKey ? FILE_HEADER_HKDF_SIZE : FILE_HEADER_SIZE;
+    // Заголовок, IV, открытый текст и полный блок дополнения
+    uint64_t capacity = (options.volumeSize - headerSize - 2 * AES_BLOCK_SIZE) / AES_BLOCK_SIZE * AES_BLOCK_SIZE;
+    uint64_t size = st.st_size;
+    size_t count = size == 0 ? 1 : (size_t)((size + capacity - 1) / capacity);
+
+    std::vector<VolumeEntry> volumes(count);
+    for (size_t i = 0; i < count; i++) {
+        volumes[i].offset = i * capacity;
+        volumes[i].length = size - volumes[i].offset < capacity ? size - volumes[i].offset : capacity;
+        volumes[i].path = volumePath(manifestFile, i);
+    }
+    LOG(LOG_LEVEL_DEBUG, "Splitting " << size << " bytes into " << count << " volumes of up to " << capacity
+                                      << " bytes of plaintext");
+
+    DurabilityGroup set(group.options(), true);
+    std::mutex groupMutex;
+    forEachVolume(count, options.workers, [&](size_t index) {
+        const VolumeEntry &volume = volumes[index];
+        std::vector<FileExtent> extents;
+        if (volume.length) {
+            FileExtent extent = {volume.offset, volume.length};
+            extents.push_back(extent);
+        }
+        PipelineOptions pipeline = options.pipeline;
+        pipeline.extents = &extents;
+
+        AtomicOutputFile out(volume.path, set);
+        out.preallocate(headerSize + 2 * AES_BLOCK_SIZE + volume.length);
+        unsigned char iv[AES_BLOCK_SIZE];
+        if (!RAND_bytes(iv, AES_BLOCK_SIZE)) handleErrors();
+        SecureBuffer fileKey = keyPool().acquire();
+        writeFileHeader(out.fd(), key, iv, pipeline, options.perFileKey, fileKey.data());
+        encryptPipeline(in.get(), out.fd(), fileKey.data(), iv, pipeline);
+        std::lock_guard<std::mutex> lock(groupMutex);
+        out.commit();
+    });
+
+    std::ostringstream text;
+    text << VOLUME_MANIFEST_MAGIC << "\n" << "size " << size << "\n";
+    for (size_t i = 0; i < count; i++) {
+        std::string name = volumes[i].path.substr(directoryOf(volumes[i].path).size());
+        text << "volume " << volumes[i].offset << " " << volumes[i].length << " " << name << "\n";
+    }
+    std::string manifest = text.str();
+    AtomicOutputFile out(manifestFile, set);
+    writeAll(out.fd(), (const unsigned char *)manifest.data(), manifest.size());
+    out.commit();
+    set.flush();
+}
+/**
+ * @brief Расшифровывает тома параллельно в один результат.
+ *
+ * @param[in] manifest Опись из readVolumeManifest().
+ * @param[in] outFd Результат — обычный файл; место под него лучше выделить заранее.
+ * @param[in] key Ключ AES-256 (главный для томов с ключом файла).
+ * @param[in] options Число томов в работе и параметры конвейера.
+ *
+ * Каждый том пишется pwrite() по своему смещению, поэтому тома
+ * обрабатываются в любом порядке через общий дескриптор. После
+ * завершения позиция результата — на его конце.
+ */
+void decryptVolumes(const VolumeManifest &manifest, int outFd, const unsigned char *key, const VolumeOptions &options) {
+    if (lseek(outFd, 0, SEEK_CUR) < 0) throw CryptoError("Volumes can only be decrypted into a regular file");
+    forEachVolume(manifest.volumes.size(), options.workers, [&](size_t index) {
+        const VolumeEntry &volume = manifest.volumes[index];
+        ScopedFd in(openInputFile(volume.path));
+        FileHeader header;
+        SecureBuffer fileKey = keyPool().acquire();
+        try {
+            readFileHeader(in.get(), key, &header, fileKey.data());
+        } catch (const CryptoError &e) {
+            throw CryptoError(volume.path + ": " + e.what());
+        }
+        const unsigned char layouts =
+            FILE_HEADER_FLAG_SEGMENTED | FILE_HEADER_FLAG_SPARSE | FILE_HEADER_FLAG_STRIPED | FILE_HEADER_FLAG_XTS;
+        if (header.flags() & layouts) {
+            throw CryptoError("Unexpected data layout in volume " + volume.path);
+        }
+
+        std::vector<FileExtent> extents;
+        if (volume.length) {
+            FileExtent extent = {volume.offset, volume.length};
+            extents.push_back(extent);
+        }
+        uint64_t written = 0;
+        PipelineOptions pipeline = options.pipeline;
+        pipeline.extents = &extents;
+        // Параллельность даёт число томов: каждому тому — один поток шифра
+        pipeline.workers = 1;
+        pipeline.onOutput = [&options, &written](const unsigned char *data, size_t len) {
+            written += len;
+            if (options.pipeline.onOutput) options.pipeline.onOutput(data, len);
+        };
+        try {
+            decryptPipeline(in.get(), outFd, fileKey.data(), pipeline, header.prefix);
+        } catch (const CryptoError &e) {
+            throw CryptoError(volume.path + ": " + e.what());
+        }
+        if (written != volume.length) throw CryptoError("Volume " + volume.path + " does not match the manifest");
+    });
+    if (ftruncate(outFd, manifest.size) != 0 || lseek(outFd, manifest.size, SEEK_SET) < 0) {
+        throw CryptoError(std::string("Cannot resize output: ") + strerror(errno));
+    }
+}
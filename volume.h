@@ -0,0 +1,61 @@
+#ifndef FILE_CRYPTO_VOLUME_H
+#define FILE_CRYPTO_VOLUME_H
+
+#include "output_file.h"
+#include "pipeline.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define VOLUME_MIN_SIZE (64u << 10)              // наименьший размер тома
+#define VOLUME_MANIFEST_MAGIC "file_crypto volumes 1"  // первая строка описи
+#define VOLUME_MANIFEST_MAX (16u << 20)          // наибольший размер описи
+
+/**
+ * @brief Параметры разбиения на тома.
+ *
+ * Результат <имя> — опись, тома — <имя>.001, <имя>.002 и т. д. Каждый том
+ * — обычный зашифрованный файл со своим заголовком и IV, который
+ * расшифровывается и сам по себе. Опись — текст:
+ *   file_crypto volumes 1
+ *   size <размер открытого текста>
+ *   volume <смещение> <длина> <имя тома относительно каталога описи>
+ * Строки volume идут по возрастанию смещения и покрывают весь файл.
+ */
+struct VolumeOptions {
+    uint64_t volumeSize;       ///< наибольший размер тома вместе с заголовком
+    int workers;               ///< томов в работе одновременно; 0 — по числу ядер
+    bool perFileKey;           ///< ключ каждого тома выводится HKDF из главного
+    PipelineOptions pipeline;  ///< onOutput вызывается из нескольких потоков
+
+    VolumeOptions() : volumeSize(0), workers(0), perFileKey(false) {}
+};
+
+/**
+ * @brief Том из описи.
+ */
+struct VolumeEntry {
+    uint64_t offset;   ///< смещение открытого текста тома в исходном файле
+    uint64_t length;   ///< длина открытого текста тома
+    std::string path;  ///< путь к тому
+};
+
+/**
+ * @brief Прочитанная опись томов.
+ */
+struct VolumeManifest {
+    uint64_t size;                     ///< размер открытого текста
+    std::vector<VolumeEntry> volumes;  ///< тома по возрастанию смещения
+
+    VolumeManifest() : size(0) {}
+};
+
+bool isVolumeManifest(const std::string &path);
+VolumeManifest readVolumeManifest(const std::string &path);
+void encryptVolumes(const std::string &inputFile, const std::string &manifestFile, const unsigned char *key,
+                    const VolumeOptions &options, DurabilityGroup &group);
+void decryptVolumes(const VolumeManifest &manifest, int outFd, const unsigned char *key, const VolumeOptions &options);
+
+#endif // FILE_CRYPTO_VOLUME_H
@@ -0,0 +1,423 @@
+#include "watch.h"
+#include "blocking_queue.h"
+#include "crypto.h"
+#include "file_header.h"
+#include "fileio.h"
+#include "log.h"
+#include "memory_budget.h"
+#include "multibuffer.h"
+#include "secure_pool.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int watchWakeFd = -1;
+static volatile sig_atomic_t watchStop = 0;
+
+static void watchSignalHandler(int) {
+    watchStop = 1;
+    uint64_t one = 1;
+    if (watchWakeFd >= 0 && write(watchWakeFd, &one, sizeof(one)) < 0) {
+        // очередь eventfd переполнена — цикл и так проснётся
+    }
+}
+
+typedef std::unique_ptr<EVP_CIPHER_CTX, void (*)(EVP_CIPHER_CTX *)> CipherCtxPtr;
+typedef std::chrono::steady_clock WatchClock;
+
+// Место мелкого файла в буфере потока: открытый текст, затем IV и шифртекст.
+// MULTIBUFFER_LANES мест помещаются в буфер для файлов до WATCH_INLINE_MAX
+// Буфер рабочего потока: целиком файл до WATCH_INLINE_MAX и его шифртекст
+#define WATCH_BUFFER_SIZE (2 * WATCH_INLINE_MAX + 3 * AES_BLOCK_SIZE)
+#define WATCH_SLOT_SIZE (WATCH_MULTIBUFFER_MAX + AES_BLOCK_SIZE + (WATCH_MULTIBUFFER_MAX / AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE)
+
+/**
+ * @brief Исходный файл, принятый рабочим потоком.
+ */
+struct SpoolFile {
+    std::string name;  ///< имя в каталоге очереди
+    struct stat st;    ///< состояние на момент открытия
+    bool encrypted;    ///< результат записан; исходник можно удалить
+};
+
+/**
+ * @brief Мелкие файлы пакета, ожидающие общего прохода MultiBufferCipher.
+ *
+ * Заголовки уже записаны, открытый текст лежит в местах буфера потока.
+ * Пачка шифруется, когда заняты все дорожки или пакет кончился.
+ */
+struct SmallFiles {
+    std::unique_ptr<MultiBufferCipher> cipher;  ///< нет, если у каждого файла свой ключ
+    std::vector<CbcJob> jobs;
+    std::vector<SpoolFile *> files;
+    std::vector<std::unique_ptr<AtomicOutputFile> > outputs;
+};
+
+/**
+ * @brief Шифрует файлы, появляющиеся в каталоге очереди.
+ *
+ * Цикл событий читает inotify и ставит имена в очередь, рабочие потоки
+ * забирают их пакетами. Ключ вычислен заранее, у каждого потока свой
+ * контекст шифра, поэтому на файл приходятся только чтение, шифрование и
+ * запись. Исходник удаляется, когда результат всего пакета сброшен на диск
+ * и переименован в итоговое имя.
+ */
+class SpoolWatcher {
+public:
+    SpoolWatcher(const WatchOptions &options, const unsigned char *key, bool perFileKey)
+        : options_(options), key_(key), perFileKey_(perFileKey), pool_(WATCH_BUFFER_SIZE, secureHugePages()),
+          inotifyFd_(-1), wakeFd_(-1), encrypted_(0), failed_(0) {}
+
+    int run();
+
+private:
+    void enqueue(const std::string &name);
+    void scan();
+    void readEvents();
+    void worker();
+    void encryptFile(SpoolFile &file, EVP_CIPHER_CTX *ctx, unsigned char *buf, DurabilityGroup &group,
+                     SmallFiles &small);
+    void encryptSmall(unsigned char *buf, SmallFiles &small);
+    void finish(std::vector<SpoolFile> &batch);
+
+    const WatchOptions &options_;
+    const unsigned char *key_;
+    bool perFileKey_;
+    SecurePool pool_;  ///< по буферу WATCH_BUFFER_SIZE на рабочий поток, резервируется в run()
+    int inotifyFd_;
+    int wakeFd_;
+    BlockingQueue<std::string> queue_;
+    std::mutex mutex_;
+    std::set<std::string> pending_;  ///< в очереди или у рабочего потока
+    std::atomic<uint64_t> encrypted_;
+    std::atomic<uint64_t> failed_;
+
+    SpoolWatcher(const SpoolWatcher &);
+    SpoolWatcher &operator=(const SpoolWatcher &);
+};
+/**
+ * @brief Ставит файл в очередь, если он ещё не ожидает обработки.
+ *
+ * Имена, начинающиеся с точки, пропускаются: так принято называть файлы,
+ * которые ещё пишутся и потом переименовываются в итоговое имя.
+ */
+void SpoolWatcher::enqueue(const std::string &name) {
+    if (name.empty() || name[0] == '.') return;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!pending_.insert(name).second) return;
+    }
+    std::string item = name;
+    queue_.push(std::move(item));
+}
+/**
+ * @brief Ставит в очередь все файлы каталога.
+ *
+ * Выполняется при запуске — для файлов, появившихся, пока программа не
+ * работала, — и при переполнении очереди событий inotify.
+ */
+void SpoolWatcher::scan() {
+    DIR *dir = opendir(options_.spoolDir.c_str());
+    if (!dir) throw CryptoError("Cannot open " + options_.spoolDir + ": " + strerror(errno));
+    while (dirent *entry = readdir(dir)) {
+        if (entry->d_type == DT_REG || entry->d_type == DT_UNKNOWN) enqueue(entry->d_name);
+    }
+    closedir(dir);
+}
+/**
+ * @brief Разбирает накопившиеся события inotify.
+ */
+void SpoolWatcher::readEvents() {
+    alignas(inotify_event) char buf[4096];
+    for (;;) {
+        ssize_t n = read(inotifyFd_, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        for (char *p = buf; p < buf + n;) {
+            inotify_event *event = (inotify_event *)p;
+            if (event->mask & IN_Q_OVERFLOW) {
+                LOG(LOG_LEVEL_WARN, "inotify queue overflowed, rescanning " << options_.spoolDir);
+                scan();
+            } else if (event->len && !(event->mask & IN_ISDIR)) {
+                enqueue(event->name);
+            }
+            p += sizeof(inotify_event) + event->len;
+        }
+    }
+}
+/**
+ * @brief Шифрует один файл очереди в выходной каталог.
+ *
+ * Небольшие файлы читаются целиком и шифруются контекстом потока без
+ * запуска конвейера; большие проходят через encryptPipeline(). Мелкие
+ * файлы при общем ключе откладываются в small и шифруются пачкой.
+ */
+void SpoolWatcher::encryptFile(SpoolFile &file, EVP_CIPHER_CTX *ctx, unsigned char *buf,
+                               DurabilityGroup &group, SmallFiles &small) {
+    std::string path = options_.spoolDir + "/" + file.name;
+    int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        // Уже обработан по более раннему событию
+        if (errno == ENOENT) return;
+        throw CryptoError("Cannot open " + path + ": " + strerror(errno));
+    }
+    ScopedFd in(fd);
+    if (fstat(fd, &file.st) != 0 || !S_ISREG(file.st.st_mode)) return;
+
+    std::unique_ptr<AtomicOutputFile> output(
+        new AtomicOutputFile(options_.outputDir + "/" + file.name + options_.suffix, group));
+    AtomicOutputFile &out = *output;
+    unsigned char iv[AES_BLOCK_SIZE];
+    if (!RAND_bytes(iv, AES_BLOCK_SIZE)) handleErrors();
+    SecureBuffer fileKey = keyPool().acquire();
+    writeFileHeader(out.fd(), key_, iv, PipelineOptions(), perFileKey_, fileKey.data());
+
+    size_t size = (size_t)file.st.st_size;
+    if (small.cipher && size <= WATCH_MULTIBUFFER_MAX) {
+        unsigned char *plain = buf + small.jobs.size() * WATCH_SLOT_SIZE;
+        CbcJob job;
+        job.data = plain;
+        job.len = readFull(fd, plain, size);
+        job.out = plain + WATCH_MULTIBUFFER_MAX;
+        memcpy(job.out, iv, AES_BLOCK_SIZE);
+        small.jobs.push_back(job);
+        small.files.push_back(&file);
+        small.outputs.push_back(std::move(output));
+        if (small.jobs.size() == MULTIBUFFER_LANES) encryptSmall(buf, small);
+        return;
+    }
+    if (size <= WATCH_INLINE_MAX) {
+        // Буфер занят отложенными мелкими файлами: сначала шифруются они
+        encryptSmall(buf, small);
+        // Открытый текст в начале буфера, IV и шифртекст — за ним
+        unsigned char *plain = buf;
+        unsigned char *cipher = buf + WATCH_INLINE_MAX + AES_BLOCK_SIZE;
+        size = readFull(fd, plain, size);
+        memcpy(cipher, iv, AES_BLOCK_SIZE);
+        int len = 0, finalLen = 0;
+        bool ok = EVP_EncryptInit_ex(ctx, aes256Cbc(), nullptr, fileKey.data(), iv) == 1 &&
+                  EVP_EncryptUpdate(ctx, cipher + AES_BLOCK_SIZE, &len, plain, (int)size) == 1 &&
+                  EVP_EncryptFinal_ex(ctx, cipher + AES_BLOCK_SIZE + len, &finalLen) == 1;
+        OPENSSL_cleanse(plain, size);
+        if (!ok) handleErrors();
+        writeAll(out.fd(), cipher, AES_BLOCK_SIZE + len + finalLen);
+    } else {
+        encryptPipeline(fd, out.fd(), fileKey.data(), iv, options_.pipeline);
+    }
+    out.commit();
+    file.encrypted = true;
+}
+/**
+ * @brief Шифрует отложенные мелкие файлы одним проходом MultiBufferCipher.
+ *
+ * Ошибка записи одного результата не мешает остальным; открытый текст
+ * затирается в любом случае.
+ */
+void SpoolWatcher::encryptSmall(unsigned char *buf, SmallFiles &small) {
+    if (small.jobs.empty()) return;
+    try {
+        small.cipher->encrypt(small.jobs.data(), small.jobs.size());
+        for (size_t i = 0; i < small.jobs.size(); i++) {
+            try {
+                writeAll(small.outputs[i]->fd(), small.jobs[i].out, MultiBufferCipher::encryptedSize(small.jobs[i].len));
+                small.outputs[i]->commit();
+                small.files[i]->encrypted = true;
+            } catch (const std::exception &e) {
+                LOG(LOG_LEVEL_ERROR, small.files[i]->name << ": " << e.what());
+                failed_++;
+            }
+        }
+    } catch (const std::exception &e) {
+        LOG(LOG_LEVEL_ERROR, e.what());
+        failed_ += small.jobs.size();
+    }
+    OPENSSL_cleanse(buf, small.jobs.size() * WATCH_SLOT_SIZE);
+    small.jobs.clear();
+    small.files.clear();
+    small.outputs.clear();
+}
+/**
+ * @brief Удаляет исходники пакета, результаты которого уже на диске.
+ *
+ * Если за время шифрования под тем же именем появился другой файл
+ * (изменились inode, размер или время изменения), он не удаляется, а
+ * снова ставится в очередь.
+ */
+void SpoolWatcher::finish(std::vector<SpoolFile> &batch) {
+    std::vector<std::string> again;
+    for (size_t i = 0; i < batch.size(); i++) {
+        const SpoolFile &file = batch[i];
+        if (!file.encrypted) continue;
+        std::string path = options_.spoolDir + "/" + file.name;
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0) continue;
+        if (st.st_ino == file.st.st_ino && st.st_dev == file.st.st_dev && st.st_size == file.st.st_size && st.st_mtim.tv_sec == file.st.st_mtim.tv_sec &&
+            st.st_mtim.tv_nsec == file.st.st_mtim.tv_nsec) {
+            unlink(path.c_str());
+        } else {
+            again.push_back(file.name);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < batch.size(); i++) pending_.erase(batch[i].name);
+    }
+    for (size_t i = 0; i < again.size(); i++) enqueue(again[i]);
+}
+/**
+ * @brief Рабочий поток: забирает файлы пакетами и шифрует их.
+ *
+ * На пакет приходится одна группа сброса на диск (DurabilityGroup), поэтому
+ * всплеск мелких файлов обходится несколькими fsync каталога, а не
+ * двумя fsync на файл.
+ */
+void SpoolWatcher::worker() {
+    CipherCtxPtr ctx(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
+    if (!ctx) handleErrors();
+    // Буфер зарезервирован в run() для каждого потока, поэтому acquire() не ждёт бюджета
+    SecureBuffer buf = pool_.acquire();
+    std::vector<std::string> names;
+    std::vector<SpoolFile> batch;
+    // С общим ключом мелкие файлы пакета шифруются по несколько сразу
+    SmallFiles small;
+    if (!perFileKey_) small.cipher.reset(new MultiBufferCipher(key_));
+    while (queue_.popBatch(names, options_.batchSize)) {
+        WatchClock::time_point start = WatchClock::now();
+        DurabilityGroup group(options_.output);
+        batch.resize(names.size());
+        for (size_t i = 0; i < names.size(); i++) {
+            batch[i].name = names[i];
+            batch[i].encrypted = false;
+            try {
+                encryptFile(batch[i], ctx.get(), buf.data(), group, small);
+            } catch (const std::exception &e) {
+                LOG(LOG_LEVEL_ERROR, names[i] << ": " << e.what());
+                failed_++;
+            }
+        }
+        encryptSmall(buf.data(), small);
+        try {
+            group.flush();
+        } catch (const std::exception &e) {
+            LOG(LOG_LEVEL_ERROR, e.what());
+            for (size_t i = 0; i < batch.size(); i++) batch[i].encrypted = false;
+            failed_ += batch.size();
+        }
+        finish(batch);
+        size_t done = 0;
+        for (size_t i = 0; i < batch.size(); i++) done += batch[i].encrypted;
+        encrypted_ += done;
+        double ms = std::chrono::duration<double, std::milli>(WatchClock::now() - start).count();
+        LOG(LOG_LEVEL_DEBUG, "Encrypted " << done << " of " << batch.size() << " files in " << ms << " ms");
+        names.clear();
+    }
+}
+/**
+ * @brief Цикл событий: до SIGINT или SIGTERM.
+ */
+int SpoolWatcher::run() {
+    char spool[PATH_MAX], output[PATH_MAX];
+    if (!realpath(options_.spoolDir.c_str(), spool)) {
+        throw CryptoError("Cannot open " + options_.spoolDir + ": " + strerror(errno));
+    }
+    if (!realpath(options_.outputDir.c_str(), output)) {
+        throw CryptoError("Cannot open " + options_.outputDir + ": " + strerror(errno));
+    }
+    if (strcmp(spool, output) == 0) throw CryptoError("The output directory must differ from the spool directory");
+
+    inotifyFd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inotifyFd_ < 0 || wakeFd_ < 0) throw CryptoError(std::string("Cannot create event loop: ") + strerror(errno));
+    ScopedFd inotifyGuard(inotifyFd_), wakeGuard(wakeFd_);
+    // Файл готов, когда писатель закрыл его или переместил в каталог целиком
+    if (inotify_add_watch(inotifyFd_, spool, IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+        throw CryptoError("Cannot watch " + options_.spoolDir + ": " + strerror(errno));
+    }
+
+    watchWakeFd = wakeFd_;
+    signal(SIGINT, watchSignalHandler);
+    signal(SIGTERM, watchSignalHandler);
+
+    int workers = options_.workers > 0 ? options_.workers : (int)std::thread::hardware_concurrency();
+    if (workers <= 0) workers = 1;
+    // Буферы потоков закреплены и входят в бюджет памяти; если их не
+    // хватает на всех, потоков меньше (страница остаётся пулу ключей)
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t available = memoryBudget().available();
+    available = available > page ? available - page : 0;
+    int requested = workers;
+    while (workers > 1 && pool_.slabSizeFor(workers) > available) workers--;
+    if (workers < requested) {
+        LOG(LOG_LEVEL_DEBUG, "Memory budget allows " << workers << " of " << requested << " watch workers");
+    }
+    pool_.reserve(workers);
+    std::vector<std::thread> pool;
+    for (int i = 0; i < workers; i++) pool.push_back(std::thread(&SpoolWatcher::worker, this));
+
+    std::cout << "Watching " << options_.spoolDir << " with " << workers << " workers" << std::endl;
+    int status = 0;
+    try {
+        // Наблюдение уже включено, поэтому файлы не теряются между обходом и событиями
+        scan();
+        pollfd fds[2];
+        fds[0].fd = inotifyFd_;
+        fds[0].events = POLLIN;
+        fds[1].fd = wakeFd_;
+        fds[1].events = POLLIN;
+        while (!watchStop) {
+            int n = poll(fds, 2, -1);
+            if (n < 0 && errno != EINTR) break;
+            if (n > 0 && (fds[0].revents & POLLIN)) readEvents();
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        status = 1;
+    }
+
+    queue_.close();
+    for (size_t i = 0; i < pool.size(); i++) pool[i].join();
+    watchWakeFd = -1;
+    std::cerr << "Encrypted " << encrypted_.load() << " files, " << failed_.load() << " failed" << std::endl;
+    return status;
+}
+/**
+ * @brief Шифрует файлы, появляющиеся в каталоге очереди, пока не получен сигнал.
+ *
+ * @param[in] options Параметры наблюдения.
+ * @param[in] key Ключ AES-256 (главный, если perFileKey).
+ * @param[in] perFileKey Шифровать каждый файл ключом, выведенным HKDF.
+ * @return int Код завершения процесса.
+ *
+ * Результат появляется в выходном каталоге под именем исходника с
+ * суффиксом только целиком. Исходник удаляется после успешного шифрования;
+ * при ошибке он остаётся в очереди и обрабатывается при следующем запуске.
+ */
+int runWatch(const WatchOptions &options, const unsigned char *key, bool perFileKey) {
+    WatchOptions effective = options;
+    // Исходник удаляется, поэтому результат должен быть на диске раньше
+    if (effective.output.fsync == FSYNC_NONE) effective.output.fsync = FSYNC_BATCH;
+    if (effective.output.batchFiles < effective.batchSize) effective.output.batchFiles = effective.batchSize;
+    SpoolWatcher watcher(effective, key, perFileKey);
+    return watcher.run();
+}
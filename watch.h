@@ -0,0 +1,32 @@
+#ifndef FILE_CRYPTO_WATCH_H
+#define FILE_CRYPTO_WATCH_H
+
+#include "output_file.h"
+#include "pipeline.h"
+
+#include <cstddef>
+#include <string>
+
+#define WATCH_DEFAULT_SUFFIX ".enc"     // добавляется к имени результата
+#define WATCH_DEFAULT_BATCH 32          // файлов, забираемых рабочим потоком за раз
+#define WATCH_INLINE_MAX (1u << 20)     // файлы не больше этого шифруются целиком в рабочем потоке
+#define WATCH_MULTIBUFFER_MAX (64u << 10)  // файлы не больше этого шифруются пачками MultiBufferCipher
+
+/**
+ * @brief Параметры режима наблюдения за каталогом.
+ */
+struct WatchOptions {
+    std::string spoolDir;      ///< каталог, в который кладутся исходные файлы
+    std::string outputDir;     ///< каталог результатов; не совпадает со spoolDir
+    std::string suffix;        ///< суффикс имени результата
+    int workers;               ///< рабочих потоков; 0 — по числу ядер
+    size_t batchSize;          ///< файлов в пакете рабочего потока
+    OutputOptions output;      ///< запись результата
+    PipelineOptions pipeline;  ///< конвейер для файлов больше WATCH_INLINE_MAX
+
+    WatchOptions() : suffix(WATCH_DEFAULT_SUFFIX), workers(0), batchSize(WATCH_DEFAULT_BATCH) {}
+};
+
+int runWatch(const WatchOptions &options, const unsigned char *key, bool perFileKey);
+
+#endif // FILE_CRYPTO_WATCH_H
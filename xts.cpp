@@ -0,0 +1,343 @@
+#include "xts.h"
+#include "crypto.h"
+#include "keys.h"
+#include "log.h"
+#include "memory_budget.h"
+
+#include <openssl/crypto.h>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @brief Твик сектора: номер сектора, 128 бит little-endian.
+ */
+static void sectorTweak(uint64_t sector, unsigned char *tweak) {
+    memset(tweak, 0, AES_BLOCK_SIZE);
+    for (int i = 0; i < 8; i++) tweak[i] = (sector >> (8 * i)) & 0xff;
+}
+
+static bool validSectorSize(size_t size) {
+    return size >= XTS_MIN_SECTOR && size <= XTS_MAX_SECTOR && (size & (size - 1)) == 0;
+}
+/**
+ * @brief Размер сектора из заголовка образа.
+ */
+static size_t headerSectorSize(const FileHeader &header) {
+    if (!(header.flags() & FILE_HEADER_FLAG_XTS)) throw CryptoError("Not an XTS image");
+    const unsigned char *info = header.bytes + header.size - FILE_XTS_INFO_SIZE;
+    size_t size = info[0] | info[1] << 8 | info[2] << 16 | (size_t)info[3] << 24;
+    if (!validSectorSize(size)) throw CryptoError("Corrupt XTS image header");
+    return size;
+}
+/**
+ * @brief Контекст XTS-AES-256 с ключом, выведенным из ключа файла и IV.
+ */
+static EVP_CIPHER_CTX *newXtsContext(const unsigned char *fileKey, const unsigned char *iv, bool encrypt) {
+    unsigned char xtsKey[XTS_KEY_LENGTH];
+    deriveXtsKey(fileKey, iv, xtsKey);
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    bool ok = ctx && EVP_CipherInit_ex(ctx, EVP_aes_256_xts(), nullptr, xtsKey, nullptr, encrypt ? 1 : 0) == 1;
+    OPENSSL_cleanse(xtsKey, sizeof(xtsKey));
+    if (!ok) {
+        EVP_CIPHER_CTX_free(ctx);
+        handleErrors();
+    }
+    return ctx;
+}
+/**
+ * @brief Шифрует или расшифровывает один сектор (ключ уже в контексте).
+ */
+static void xtsSector(EVP_CIPHER_CTX *ctx, uint64_t sector, const unsigned char *in, unsigned char *out, size_t len) {
+    unsigned char tweak[AES_BLOCK_SIZE];
+    sectorTweak(sector, tweak);
+    int outLen = 0;
+    if (EVP_CipherInit_ex(ctx, nullptr, nullptr, nullptr, tweak, -1) != 1 ||
+        EVP_CipherUpdate(ctx, out, &outLen, in, (int)len) != 1 || (size_t)outLen != len) {
+        handleErrors();
+    }
+}
+/**
+ * @brief Размер пакета шифрования образа целиком в пределах бюджета памяти.
+ *
+ * XTS_BATCH, а если его слаб не помещается в свободную часть бюджета —
+ * меньше, но кратно сектору (не меньше одного сектора: иначе резервирование
+ * сообщит о нехватке бюджета). Страница остаётся пулу ключей, как в
+ * planPipeline().
+ */
+static size_t xtsBatchSize(size_t sectorSize) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t available = memoryBudget().available();
+    available = available > page ? available - page : 0;
+    size_t batch = XTS_BATCH / sectorSize * sectorSize;
+    while (batch > sectorSize && SecurePool(batch, secureHugePages()).slabSizeFor(1) > available) {
+        batch = (batch / 2) / sectorSize * sectorSize;
+    }
+    return batch < sectorSize ? sectorSize : batch;
+}
+/**
+ * @brief Данные устройства для writeFileHeader(): нули и параметры образа.
+ *
+ * @param[in] sectorSize Размер сектора.
+ * @param[in] headerBase Длина заголовка без данных устройства.
+ * @return std::vector<unsigned char> Столько байт, чтобы заголовок с IV
+ *         занял XTS_DATA_OFFSET.
+ */
+std::vector<unsigned char> xtsLayoutInfo(size_t sectorSize, size_t headerBase) {
+    std::vector<unsigned char> info(XTS_DATA_OFFSET - AES_BLOCK_SIZE - headerBase, 0);
+    unsigned char *params = info.data() + info.size() - FILE_XTS_INFO_SIZE;
+    for (int i = 0; i < 4; i++) params[i] = (sectorSize >> (8 * i)) & 0xff;
+    return info;
+}
+/**
+ * @brief Шифрует файл целиком в образ XTS.
+ *
+ * @param[in] inFd Исходный файл или канал.
+ * @param[in] outFd Результат, позиция — сразу после заголовка.
+ * @param[in] fileKey Ключ файла.
+ * @param[in] iv IV файла из заголовка.
+ * @param[in] sectorSize Размер сектора.
+ * @param[in] options Используются onInput и onOutput.
+ */
+void encryptXts(int inFd, int outFd, const unsigned char *fileKey, const unsigned char *iv, size_t sectorSize,
+                const PipelineOptions &options) {
+    if (!validSectorSize(sectorSize)) throw CryptoError("Invalid XTS sector size");
+    writeAll(outFd, iv, AES_BLOCK_SIZE);
+    if (options.onOutput) options.onOutput(iv, AES_BLOCK_SIZE);
+
+    std::unique_ptr<EVP_CIPHER_CTX, void (*)(EVP_CIPHER_CTX *)> ctx(newXtsContext(fileKey, iv, true),
+                                                                    EVP_CIPHER_CTX_free);
+    size_t batch = xtsBatchSize(sectorSize);
+    SecurePool pool(batch, secureHugePages());
+    pool.reserve(1);
+    SecureBuffer buf = pool.acquire();
+    uint64_t sector = 0;
+    for (;;) {
+        size_t n = readFull(inFd, buf.data(), batch);
+        if (n == 0) break;
+        if (n % sectorSize != 0 && n % sectorSize < AES_BLOCK_SIZE) {
+            throw CryptoError("The last sector of an XTS image must be at least 16 bytes");
+        }
+        if (options.onInput) options.onInput(buf.data(), n);
+        for (size_t done = 0; done < n; done += sectorSize, sector++) {
+            size_t len = n - done < sectorSize ? n - done : sectorSize;
+            xtsSector(ctx.get(), sector, buf.data() + done, buf.data() + done, len);
+        }
+        writeAll(outFd, buf.data(), n);
+        if (options.onOutput) options.onOutput(buf.data(), n);
+        if (n < batch) break;
+    }
+}
+/**
+ * @brief Расшифровывает образ XTS целиком.
+ *
+ * @param[in] inFd Дескриптор после readFileHeader(): позиция на IV, или
+ *            канал, из которого IV уже прочитан в header.prefix.
+ * @param[in] outFd Результат.
+ * @param[in] fileKey Ключ файла.
+ * @param[in] header Заголовок образа.
+ * @param[in] options Используются onInput и onOutput.
+ */
+void decryptXts(int inFd, int outFd, const unsigned char *fileKey, const FileHeader &header,
+                const PipelineOptions &options) {
+    size_t sectorSize = headerSectorSize(header);
+    unsigned char iv[AES_BLOCK_SIZE];
+    size_t fromPrefix = header.prefix.size() < AES_BLOCK_SIZE ? header.prefix.size() : AES_BLOCK_SIZE;
+    if (fromPrefix) memcpy(iv, header.prefix.data(), fromPrefix);
+    if (readFull(inFd, iv + fromPrefix, AES_BLOCK_SIZE - fromPrefix) != AES_BLOCK_SIZE - fromPrefix) {
+        throw CryptoError("Input is too short to contain an IV");
+    }
+    if (options.onInput) options.onInput(iv, AES_BLOCK_SIZE);
+
+    std::unique_ptr<EVP_CIPHER_CTX, void (*)(EVP_CIPHER_CTX *)> ctx(newXtsContext(fileKey, iv, false),
+                                                                    EVP_CIPHER_CTX_free);
+    size_t batch = xtsBatchSize(sectorSize);
+    SecurePool pool(batch, secureHugePages());
+    pool.reserve(1);
+    SecureBuffer buf = pool.acquire();
+    uint64_t sector = 0;
+    for (;;) {
+        size_t n = readFull(inFd, buf.data(), batch);
+        if (n == 0) break;
+        if (n % sectorSize != 0 && n % sectorSize < AES_BLOCK_SIZE) throw CryptoError("Truncated XTS image");
+        if (options.onInput) options.onInput(buf.data(), n);
+        for (size_t done = 0; done < n; done += sectorSize, sector++) {
+            size_t len = n - done < sectorSize ? n - done : sectorSize;
+            xtsSector(ctx.get(), sector, buf.data() + done, buf.data() + done, len);
+        }
+        writeAll(outFd, buf.data(), n);
+        if (options.onOutput) options.onOutput(buf.data(), n);
+        if (n < batch) break;
+    }
+}
+/**
+ * @brief Открывает образ XTS для чтения и записи отдельных секторов.
+ *
+ * @param[in] path Путь к образу.
+ * @param[in] key Ключ AES-256 (главный для образа с ключом файла).
+ * @param[in] writable Открыть для записи.
+ *
+ * Ключ проверяется по заголовку; неверный отклоняется до чтения данных.
+ */
+XtsImage::XtsImage(const std::string &path, const unsigned char *key, bool writable)
+    : path_(path), sectorSize_(0), dataOffset_(0), size_(0), enc_(nullptr, EVP_CIPHER_CTX_free),
+      dec_(nullptr, EVP_CIPHER_CTX_free) {
+    int fd = open(path.c_str(), (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd < 0) throw CryptoError("Cannot open " + path + ": " + strerror(errno));
+    fd_.reset(fd);
+    FileHeader header;
+    SecureBuffer fileKey = keyPool().acquire();
+    readFileHeader(fd, key, &header, fileKey.data());
+    if (!(header.flags() & FILE_HEADER_FLAG_XTS)) throw CryptoError(path + " is not an XTS image");
+    sectorSize_ = headerSectorSize(header);
+
+    unsigned char iv[AES_BLOCK_SIZE];
+    if (preadFull(fd, iv, AES_BLOCK_SIZE, header.size) != AES_BLOCK_SIZE) throw CryptoError("Truncated XTS image");
+    dataOffset_ = header.size + AES_BLOCK_SIZE;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < dataOffset_) throw CryptoError("Truncated XTS image");
+    size_ = st.st_size - dataOffset_;
+    if (size_ % sectorSize_ != 0 && size_ % sectorSize_ < AES_BLOCK_SIZE) throw CryptoError("Truncated XTS image");
+
+    enc_.reset(newXtsContext(fileKey.data(), iv, true));
+    dec_.reset(newXtsContext(fileKey.data(), iv, false));
+    pool_.reset(new SecurePool(sectorSize_, false));
+    pool_->reserve(1);
+    sector_ = pool_->acquire();
+}
+/**
+ * @brief Длина сектора: последний может быть короче.
+ */
+size_t XtsImage::sectorLength(uint64_t sector) const {
+    uint64_t start = sector * sectorSize_;
+    return size_ - start < sectorSize_ ? (size_t)(size_ - start) : sectorSize_;
+}
+/**
+ * @brief Читает открытый текст образа со смещения offset.
+ *
+ * @return size_t Прочитано байт; меньше len только у конца образа.
+ *
+ * Целые сектора расшифровываются прямо в buf, крайние — через буфер сектора.
+ */
+size_t XtsImage::pread(unsigned char *buf, size_t len, uint64_t offset) {
+    if (offset >= size_) return 0;
+    if (len > size_ - offset) len = (size_t)(size_ - offset);
+    size_t done = 0;
+    while (done < len) {
+        uint64_t pos = offset + done;
+        uint64_t sector = pos / sectorSize_;
+        size_t inSector = (size_t)(pos % sectorSize_);
+        size_t sectorLen = sectorLength(sector);
+        size_t n = sectorLen - inSector < len - done ? sectorLen - inSector : len - done;
+        unsigned char *target = inSector == 0 && n == sectorLen ? buf + done : sector_.data();
+        if (preadFull(fd_.get(), target, sectorLen, dataOffset_ + sector * sectorSize_) != sectorLen) {
+            throw CryptoError("Truncated XTS image");
+        }
+        xtsSector(dec_.get(), sector, target, target, sectorLen);
+        if (target != buf + done) memcpy(buf + done, sector_.data() + inSector, n);
+        done += n;
+    }
+    return len;
+}
+/**
+ * @brief Переписывает открытый текст образа со смещения offset.
+ *
+ * Запись не может выходить за конец образа. Целые сектора шифруются и
+ * пишутся сразу, у частично затронутых сначала читается и
+ * расшифровывается прежнее содержимое. Остальные сектора не трогаются.
+ */
+void XtsImage::pwrite(const unsigned char *buf, size_t len, uint64_t offset) {
+    if (offset > size_ || len > size_ - offset) throw CryptoError("Write beyond the end of " + path_);
+    size_t done = 0;
+    while (done < len) {
+        uint64_t pos = offset + done;
+        uint64_t sector = pos / sectorSize_;
+        size_t inSector = (size_t)(pos % sectorSize_);
+        size_t sectorLen = sectorLength(sector);
+        size_t n = sectorLen - inSector < len - done ? sectorLen - inSector : len - done;
+        uint64_t at = dataOffset_ + sector * sectorSize_;
+        if (n < sectorLen) {
+            if (preadFull(fd_.get(), sector_.data(), sectorLen, at) != sectorLen) throw CryptoError("Truncated XTS image");
+            xtsSector(dec_.get(), sector, sector_.data(), sector_.data(), sectorLen);
+        }
+        memcpy(sector_.data() + inSector, buf + done, n);
+        xtsSector(enc_.get(), sector, sector_.data(), sector_.data(), sectorLen);
+        pwriteAll(fd_.get(), sector_.data(), sectorLen, at);
+        done += n;
+    }
+}
+/**
+ * @brief Сбрасывает записанные сектора на диск.
+ */
+void XtsImage::sync() {
+    if (fdatasync(fd_.get()) != 0) throw CryptoError("Cannot sync " + path_ + ": " + strerror(errno));
+}
+/**
+ * @brief Переписывает участок образа данными из dataFd.
+ *
+ * @param[in] path Образ XTS.
+ * @param[in] key Ключ AES-256.
+ * @param[in] offset Смещение участка в открытом тексте образа.
+ * @param[in] dataFd Новые данные до конца файла или канала.
+ * @return uint64_t Записано байт.
+ *
+ * Запись на месте не откатить, поэтому длина данных проверяется до
+ * первой записи: у обычного файла — по fstat(), канал сначала читается
+ * целиком в буферы пула. Такой канал ограничен местом в образе и
+ * бюджетом памяти: данные, не помещающиеся в бюджет, нужно передать файлом.
+ */
+uint64_t patchXtsImage(const std::string &path, const unsigned char *key, uint64_t offset, int dataFd) {
+    XtsImage image(path, key, true);
+    uint64_t room = offset < image.size() ? image.size() - offset : 0;
+    size_t batch = xtsBatchSize(image.sectorSize());
+    SecurePool pool(batch, secureHugePages());
+    std::vector<SecureBuffer> spooled;
+    uint64_t spooledBytes = 0;
+    struct stat st;
+    bool regular = fstat(dataFd, &st) == 0 && S_ISREG(st.st_mode);
+    if (regular) {
+        off_t pos = lseek(dataFd, 0, SEEK_CUR);
+        uint64_t remaining = pos >= 0 && pos < st.st_size ? st.st_size - pos : 0;
+        if (offset > image.size() || remaining > room) throw CryptoError("Write beyond the end of " + path);
+    } else {
+        for (;;) {
+            // Резервирование не должно ждать: освободить память некому
+            if (pool.slabSizeFor(1) > memoryBudget().available()) {
+                throw CryptoError("Piped patch data does not fit in the memory budget; pass it as a file");
+            }
+            pool.reserve(1);
+            SecureBuffer buf = pool.acquire();
+            size_t n = readFull(dataFd, buf.data(), batch);
+            spooledBytes += n;
+            if (offset > image.size() || spooledBytes > room) throw CryptoError("Write beyond the end of " + path);
+            if (n) spooled.push_back(std::move(buf));
+            if (n < batch) break;
+        }
+    }
+
+    uint64_t total = 0;
+    if (!regular) {
+        for (size_t i = 0; i < spooled.size(); i++) {
+            size_t n = spooledBytes - total < batch ? (size_t)(spooledBytes - total) : batch;
+            image.pwrite(spooled[i].data(), n, offset + total);
+            total += n;
+        }
+    } else {
+        pool.reserve(1);
+        SecureBuffer buf = pool.acquire();
+        for (;;) {
+            size_t n = readFull(dataFd, buf.data(), batch);
+            if (n == 0) break;
+            // Файл мог вырасти после проверки: лишнее не пишется
+            if (n > room - total) throw CryptoError("Patch data changed while patching " + path);
+            image.pwrite(buf.data(), n, offset + total);
+            total += n;
+            if (n < batch) break;
+        }
+    }
+    image.sync();
+    LOG(LOG_LEVEL_DEBUG, "Patched " << total << " bytes of " << path << " at offset " << offset);
+    return total;
+}
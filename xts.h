@@ -0,0 +1,75 @@
+#ifndef FILE_CRYPTO_XTS_H
+#define FILE_CRYPTO_XTS_H
+
+#include "file_header.h"
+#include "fileio.h"
+#include "pipeline.h"
+#include "secure_pool.h"
+
+#include <openssl/evp.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define XTS_DEFAULT_SECTOR 4096      // размер сектора по умолчанию
+#define XTS_MIN_SECTOR 512           // наименьший сектор
+#define XTS_MAX_SECTOR (64u << 10)   // наибольший сектор
+#define XTS_DATA_OFFSET 4096         // начало секторов: заголовок с IV дополнен до страницы
+#define XTS_BATCH (1u << 20)         // наибольший пакет данных за одно чтение; меньше при малом бюджете памяти
+
+/**
+ * @brief Образ, зашифрованный по секторам XTS-AES-256, с произвольным доступом.
+ *
+ * Формат: заголовок с флагом FILE_HEADER_FLAG_XTS, дополненный нулями так,
+ * что вместе с IV файла он занимает XTS_DATA_OFFSET байт, затем сектора.
+ * Параметры в конце заголовка: размер сектора (uint32, little-endian) и
+ * резерв. Пара ключей XTS выводится deriveXtsKey() из ключа файла и IV,
+ * твик сектора — его номер (128 бит, little-endian, как в IEEE 1619).
+ *
+ * Шифртекст сектора той же длины, что и открытый текст, без дополнения,
+ * поэтому любой сектор читается и переписывается за O(1), не трогая
+ * соседних. Последний сектор может быть короче, но не короче
+ * AES_BLOCK_SIZE (XTS с кражей шифртекста). Как и CBC в остальных
+ * режимах, XTS не защищает целостность: порча или откат сектора к
+ * прежней версии не обнаруживаются.
+ */
+class XtsImage {
+public:
+    XtsImage(const std::string &path, const unsigned char *key, bool writable);
+
+    uint64_t size() const { return size_; }
+    size_t sectorSize() const { return sectorSize_; }
+    int fd() const { return fd_.get(); }
+    size_t pread(unsigned char *buf, size_t len, uint64_t offset);
+    void pwrite(const unsigned char *buf, size_t len, uint64_t offset);
+    void sync();
+
+private:
+    typedef std::unique_ptr<EVP_CIPHER_CTX, void (*)(EVP_CIPHER_CTX *)> CipherCtxPtr;
+
+    size_t sectorLength(uint64_t sector) const;
+
+    std::string path_;
+    ScopedFd fd_;
+    size_t sectorSize_;
+    uint64_t dataOffset_;  ///< смещение первого сектора в файле
+    uint64_t size_;        ///< размер открытого текста образа
+    CipherCtxPtr enc_;
+    CipherCtxPtr dec_;
+    std::unique_ptr<SecurePool> pool_;
+    SecureBuffer sector_;  ///< сектор при частичном чтении и записи
+
+    XtsImage(const XtsImage &);
+    XtsImage &operator=(const XtsImage &);
+};
+
+std::vector<unsigned char> xtsLayoutInfo(size_t sectorSize, size_t headerBase);
+void encryptXts(int inFd, int outFd, const unsigned char *fileKey, const unsigned char *iv, size_t sectorSize,
+                const PipelineOptions &options);
+void decryptXts(int inFd, int outFd, const unsigned char *fileKey, const FileHeader &header,
+                const PipelineOptions &options);
+uint64_t patchXtsImage(const std::string &path, const unsigned char *key, uint64_t offset, int dataFd);
+
+#endif // FILE_CRYPTO_XTS_H